@@ -0,0 +1,64 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Admission control for the accept loop: a session limit, a memory budget for
+ * the sessions' receive and write-behind buffers and a bounded queue of
+ * requests waiting for capacity. Requests that cannot be queued or wait too
+ * long are shed with a "busy, retry after N ms" error.
+ */
+
+typedef struct {
+  size_t max_sessions;
+  uint64_t memory_budget;  /* bytes, 0 for no budget */
+  uint64_t session_memory; /* bytes each session's buffers may take */
+  size_t queue_length;
+  uint64_t queue_timeout_ms;
+} admission_config_t;
+
+typedef struct {
+  void *packet;
+  size_t size;
+  struct sockaddr_in6 source;
+  struct sockaddr_in6 destination;
+  size_t socket;       /* the caller's index of the socket it came in on */
+  uint64_t arrival_ns; /* set when queued */
+} admission_request_t;
+
+typedef enum {
+  ADMISSION_QUEUED,
+  ADMISSION_DUPLICATE, /* a retransmission of a queued request */
+  ADMISSION_FULL,
+} admission_enqueue_result_t;
+
+typedef struct admission admission_t;
+
+admission_t *admission_new(const admission_config_t *config);
+void admission_free(admission_t *admission);
+/* takes the new limits and timeout, the queue keeps its length */
+void admission_reconfigure(admission_t *admission,
+                           const admission_config_t *config);
+
+bool admission_can_admit(const admission_t *admission);
+void admission_session_begin(admission_t *admission);
+void admission_session_end(admission_t *admission);
+
+/* queues a copy of request */
+admission_enqueue_result_t admission_enqueue(admission_t *admission,
+                                             const admission_request_t *request);
+/* pops the oldest request, the caller frees out->packet */
+bool admission_dequeue(admission_t *admission, admission_request_t *out);
+/* pops the oldest request if it waited longer than the queue timeout */
+bool admission_expire(admission_t *admission, admission_request_t *out);
+/* milliseconds until the oldest queued request expires, -1 if none */
+int admission_next_timeout_ms(const admission_t *admission);
+
+/* counts a shed request, returns the back-off to suggest in ms */
+unsigned admission_reject(admission_t *admission);
+
+void admission_dump(const admission_t *admission, FILE *out);
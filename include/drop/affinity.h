@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Placement of the daemon's sessions next to the NIC queue their packets
+ * arrive on.
+ *
+ * The daemon listens with one SO_REUSEPORT socket per CPU of the map, a
+ * classic BPF program picks the socket of the CPU that received the request.
+ * The session for it is pinned to that CPU, where the rest of its flow
+ * arrives too, and allocates its buffers after pinning so that they come
+ * from the CPU's NUMA node.
+ *
+ * The counters live in a shared mapping, sessions report whether their
+ * packets really arrived on their CPU.
+ */
+
+#define AFFINITY_MAX_CPUS 1024
+
+typedef struct affinity affinity_t;
+
+/* creates the map from a CPU list such as "0-3,8", NULL with errno EINVAL if
+ * the list is invalid or names a CPU we may not run on */
+affinity_t *affinity_new(const char *list);
+void affinity_free(affinity_t *affinity);
+size_t affinity_size(const affinity_t *affinity);
+
+/* steers requests by receiving CPU within the reuseport group of socket, whose
+ * members are the map's CPUs in order */
+int affinity_steer(int socket, const affinity_t *affinity);
+/* counts a request received on the socket at index */
+void affinity_request(affinity_t *affinity, size_t index);
+
+/* pins the calling session process to the CPU at index */
+int affinity_pin(const affinity_t *affinity, size_t index);
+/* counts the finished session, checking the CPU its connected socket last
+ * received on */
+void affinity_session_end(affinity_t *affinity, size_t index, int socket);
+
+void affinity_dump(const affinity_t *affinity, FILE *out);
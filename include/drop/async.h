@@ -0,0 +1,64 @@
+#pragma once
+
+#include <drop/tftp.h>
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Uploads from memory for programs that embed libdrop.
+ *
+ * An upload reads from a buffer, an iovec list or a pull callback and runs
+ * on a thread of its own, the TFTP engine blocks. Starting one returns right
+ * away. Once it ends its completion is queued and the set's file descriptor
+ * becomes readable, async_dispatch then runs the completion callbacks on the
+ * calling thread. One thread can so drive hundreds of uploads from a poll
+ * loop without forking the drop binary. Nothing is global, sets are
+ * independent of each other and async_start may be called from any thread.
+ */
+
+typedef struct async async_t;
+typedef struct async_upload async_upload_t;
+
+/* fills buffer with up to size bytes of the file. Returns the number of
+ * bytes, 0 at its end or -1 with errno to fail the upload. Called on the
+ * upload's thread */
+typedef ssize_t (*async_pull_cb_t)(void *buffer, size_t size, void *userdata);
+/* the upload ended, on the thread calling async_dispatch. upload is freed
+ * once it returns */
+typedef void (*async_done_cb_t)(async_upload_t *upload,
+                                const tftp_result_t *result, void *userdata);
+
+typedef struct {
+  struct sockaddr_in6 server; /* IPv4 servers as mapped addresses */
+  const char *filename;
+  /* the data, from the first of these that is set. Memory is read in place
+   * and has to stay until the upload is done */
+  const void *data;
+  size_t size;
+  const struct iovec *iov;
+  size_t iov_count;
+  async_pull_cb_t pull;
+  /* options to ask for, blksize 0 for what fits the path MTU */
+  tftp_params_t request;
+  async_done_cb_t on_done;
+  void *userdata; /* for pull and on_done */
+} async_request_t;
+
+/* NULL with errno on failure */
+async_t *async_new(void);
+/* waits for the running uploads, their callbacks are not called */
+void async_free(async_t *async);
+
+/* readable while completions are queued, for poll or epoll */
+int async_fd(const async_t *async);
+/* starts an upload, NULL with errno on failure. request is copied, the
+ * memory it points to for the data has to stay until the upload is done */
+async_upload_t *async_start(async_t *async, const async_request_t *request);
+/* fails the upload with ECANCELED at its next block, until its on_done ran */
+void async_cancel(async_upload_t *upload);
+/* runs the callbacks of the uploads that ended, without blocking. Returns
+ * how many */
+size_t async_dispatch(async_t *async);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Batches: many small files as one upload.
+ *
+ * The files travel as a ustar archive, so the request, the session and its
+ * process are paid for once instead of per file. The sender builds the
+ * archive as it is read, the receiver unpacks it as it is written, neither
+ * keeps a copy. Members are regular files, named by their paths without
+ * leading slashes. Directories in an archive from elsewhere are created,
+ * other entries are skipped. Names that are absolute or go up with ".." are
+ * refused, what they would write lies outside the directory unpacked to.
+ */
+
+typedef struct batch batch_t;
+
+/* the archive of the count files at paths, read from batch_stream. NULL with
+ * errno on failure */
+batch_t *batch_pack(char *const *paths, size_t count);
+/* reads the archive, fails with errno when a file cannot be read or changed
+ * size since its header was sent. Seeking to 0 starts over */
+FILE *batch_stream(batch_t *batch);
+/* the file that last failed the stream, NULL for none */
+const char *batch_failed(const batch_t *batch, int *error);
+/* closes the stream and frees batch */
+void batch_free(batch_t *batch);
+
+/* a stream that unpacks the archive written to it into directory. Members
+ * are complete once closing it succeeded, it fails with EBADMSG for an
+ * archive cut short, the member that was being written is then removed.
+ * NULL with errno on failure */
+FILE *batch_unpack(const char *directory);
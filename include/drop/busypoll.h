@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Spin-then-block waiting for lock-step round trips.
+ *
+ * Instead of sleeping in select right away, a wait polls the socket for up to
+ * spin_us first, so a reply that is already on its way is picked up without an
+ * interrupt and a scheduler wakeup. With SO_BUSY_POLL the polling reaches down
+ * to the NIC queue on drivers that support it. The share of wall time spent
+ * spinning is held to the budget, past it waits block as before.
+ */
+
+typedef struct {
+  uint32_t spin_us; /* longest spin per wait, 0 for off */
+  uint8_t budget;   /* percent of wall time that may go to spinning */
+} busypoll_config_t;
+
+typedef struct {
+  busypoll_config_t config;
+  uint64_t start_ns;
+  uint64_t spun_ns;
+  uint64_t waits; /* spun on */
+  uint64_t hits;  /* ended by a packet while spinning */
+} busypoll_t;
+
+#define BUSYPOLL_DEFAULT_BUDGET 50
+
+void busypoll_init(busypoll_t *busypoll, const busypoll_config_t *config);
+/* asks the kernel to busy poll the device queue for socket as well, drivers
+ * without NAPI ignore it. -1 with errno if the kernel refused, EPERM beyond
+ * net.core.busy_read without CAP_NET_ADMIN */
+int busypoll_setup(int socket, const busypoll_config_t *config);
+/* spins until socket is readable, the deadline or the spin limit, whichever
+ * comes first. Returns 1 if a packet is waiting, 0 if not and -1 with errno
+ * for an error the socket reported, as tftp's on_wait hook does */
+int busypoll_wait(busypoll_t *busypoll, int socket, uint64_t deadline_ns);
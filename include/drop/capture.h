@@ -0,0 +1,60 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Captures of the datagrams dropd receives, for drop-replay.
+ *
+ * A capture is a header and then a record per datagram: when it arrived,
+ * from whom, whether at a listening socket or at a session's, and the
+ * datagram as it was. Records are in host byte order, a capture is read on
+ * the kind of machine it was taken on.
+ *
+ * The accept loop and the sessions it forks append to the same file through
+ * O_APPEND, each write whole records, so records of different processes
+ * interleave but are never torn and readers order them by time. A session
+ * buffers its records and writes them once the buffer is full and when it
+ * ends, the accept loop writes every request as it arrives so a fork does
+ * not inherit any.
+ */
+
+typedef enum {
+  CAPTURE_REQUEST, /* at a listening socket, opens a session */
+  CAPTURE_SESSION, /* at a session's socket */
+} capture_kind_t;
+
+typedef struct {
+  uint64_t time_ns; /* CLOCK_MONOTONIC, when it was received */
+  struct sockaddr_in6 peer;
+  capture_kind_t kind;
+  const uint8_t *data;
+  size_t size;
+} capture_record_t;
+
+typedef struct capture capture_t;
+
+/* appends to the capture at path, created if there is none. NULL with
+ * errno on failure */
+capture_t *capture_open(const char *path);
+/* writes out what is buffered */
+void capture_close(capture_t *capture);
+
+void capture_add(capture_t *capture, capture_kind_t kind,
+                 const struct sockaddr_in6 *peer, const void *data,
+                 size_t size);
+/* -1 with errno when records were lost */
+int capture_flush(capture_t *capture);
+
+/* a capture read whole */
+typedef struct {
+  capture_record_t *records; /* in the order they were received */
+  size_t count;
+  uint8_t *contents; /* the file, what records point into */
+} capture_trace_t;
+
+/* false with errno, EINVAL when path is no capture */
+bool capture_read(const char *path, capture_trace_t *trace);
+void capture_trace_free(capture_trace_t *trace);
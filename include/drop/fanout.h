@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * One input shared by the uploads of a file to several hosts.
+ *
+ * A regular file is mapped once and every upload reads the mapping at its
+ * own position. Anything else, a pipe or stdin, is read once into a ring the
+ * uploads read from at their own pace: the fastest is at most the ring's size
+ * ahead of the slowest and waits there. An upload that starts over finds the
+ * start in the ring only while nobody has gone further.
+ *
+ * The ring is filled by a thread of its own, in reads as large as the room
+ * the slowest upload left, so a producer that stalls and a network that
+ * stalls do not add up: the uploads go at the slower of the two. A single
+ * upload from a pipe goes through the ring for that alone.
+ *
+ * The readers are threads of one process, closing a stream lets the others
+ * past its position.
+ */
+
+#define FANOUT_DEFAULT_BUFFER (8 * 1024 * 1024)
+
+typedef struct fanout fanout_t;
+
+/* shares input between readers streams, ring_size bounds the buffer a stream
+ * needs. NULL with errno on failure */
+fanout_t *fanout_new(FILE *input, size_t readers, size_t ring_size);
+/* after all streams are closed */
+void fanout_free(fanout_t *fanout);
+
+/* the stream of the reader at index, read-only and seekable within what the
+ * input still holds */
+FILE *fanout_open(fanout_t *fanout, size_t reader);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Whole files in memory for downloads, shared by the sessions serving them.
+ *
+ * The first time a file is asked for, the accept loop stats it and maps
+ * shared memory the size of it, and forks the sessions for it with that
+ * mapped. The session forked first reads the file into it, those forked
+ * while it does wait for it, so when a rack boots from the same kernel at
+ * once the file is read from disk once, outside the accept loop, and every
+ * session sends from the same pages. A session whose loader failed or died
+ * reads the file itself. A session keeps its mapping until it ends, the
+ * memory goes with the last one. Evicting an entry, the least recently used
+ * first once the budget is reached, only keeps new sessions from getting
+ * it.
+ *
+ * Entries are snapshots. inotify reports a change to a cached file, its
+ * entry is then dropped and the next request loads the new contents while
+ * running downloads finish with the old. Files that cannot be watched are
+ * not cached, nor are empty ones or those larger than the budget. Those
+ * are remembered for a second by device, inode, size and modification
+ * time, so a storm of requests for one does not stat it each time.
+ */
+
+typedef struct filecache filecache_t;
+/* how far an entry's loading got, in memory shared with its sessions */
+typedef struct filecache_shared filecache_shared_t;
+
+typedef struct {
+  const void *data; /* once filecache_ready returned true */
+  size_t size;
+  filecache_shared_t *shared;
+  bool fill; /* the session forked with it is the one to load it */
+} filecache_file_t;
+
+/* holds up to budget bytes of files. NULL with errno on failure */
+filecache_t *filecache_new(uint64_t budget);
+/* unmaps the entries, sessions keep what they were forked with */
+void filecache_free(filecache_t *cache);
+
+/* the entry of path, mapped but not loaded yet on a miss. false with errno
+ * when it is not cached, EFBIG for a file over the budget */
+bool filecache_get(filecache_t *cache, const char *path,
+                   filecache_file_t *out);
+/* the session file is loaded by, after forking it. -1 when the fork failed,
+ * the entry is loaded again for the next session then */
+void filecache_loading(const filecache_file_t *file, pid_t pid);
+
+/* in a session: loads the file from path, the same file the accept loop
+ * found, when it is the one to, or waits for the one that is. false with
+ * errno when the contents are not there, the session reads path itself */
+bool filecache_ready(const filecache_file_t *file, const char *path);
+
+/* readable once cached files changed, for poll */
+int filecache_fd(const filecache_t *cache);
+/* drops the entries of files that changed, without blocking */
+void filecache_dispatch(filecache_t *cache);
+
+void filecache_dump(const filecache_t *cache, FILE *out);
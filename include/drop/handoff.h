@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Getting the listening sockets without binding them: from systemd socket
+ * activation or from a running dropd that hands them over to its successor.
+ *
+ * The handoff goes over a Unix stream socket. The running daemon listens on
+ * a control path, the new one connects and receives the listening sockets as
+ * SCM_RIGHTS ancillary data.
+ */
+
+#define HANDOFF_MAX_FDS 1024
+
+/* stores up to max sockets passed by socket activation (LISTEN_PID,
+ * LISTEN_FDS) in fds and returns their number. Unsets the variables so
+ * children do not see them */
+size_t handoff_activated(int *fds, size_t max);
+
+/* creates the control socket at path, replacing a stale one */
+int handoff_listen(const char *path);
+/* accepts a successor on control and hands it the count fds, -1 with errno
+ * on failure */
+int handoff_send(int control, const int *fds, size_t count);
+/* connects to the daemon at path and takes its listening sockets over, up to
+ * max into fds. Returns their number, -1 with errno on failure */
+int handoff_receive(const char *path, int *fds, size_t max);
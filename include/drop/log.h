@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Structured logging that stays off the transfer path.
+ *
+ * A message is an event name and typed fields, copied as they are into a
+ * ring the calling thread owns: no formatting, no lock and no system call
+ * where it is logged. A drain thread formats what the rings hold as
+ * key=value lines or JSON objects and writes them in batches. A full ring
+ * drops the message and counts it, the drain reports the count, so a
+ * thread never waits for the log. Messages of one thread keep their order,
+ * those of different threads are ordered by their time field only.
+ *
+ * A forked child starts a drain of its own with its first message, what
+ * the parent had not written yet is left to the parent. The rings are
+ * written out when the process exits through exit(3).
+ */
+
+typedef enum {
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG,
+} log_level_t;
+
+typedef enum {
+  LOG_FORMAT_TEXT, /* key=value, values quoted where they need it */
+  LOG_FORMAT_JSON, /* an object per line */
+} log_format_t;
+
+typedef enum {
+  LOG_FIELD_U64,
+  LOG_FIELD_I64,
+  LOG_FIELD_STR,
+} log_field_type_t;
+
+typedef struct {
+  const char *key; /* a literal, kept by reference */
+  log_field_type_t type;
+  union {
+    uint64_t u64;
+    int64_t i64;
+    const char *str; /* copied, cut to what the message has room for */
+  } value;
+} log_field_t;
+
+#define LOG_U64(k, v)                                                          \
+  ((log_field_t){.key = (k), .type = LOG_FIELD_U64, .value.u64 = (v)})
+#define LOG_I64(k, v)                                                          \
+  ((log_field_t){.key = (k), .type = LOG_FIELD_I64, .value.i64 = (v)})
+#define LOG_STR(k, v)                                                          \
+  ((log_field_t){.key = (k), .type = LOG_FIELD_STR, .value.str = (v)})
+
+/* messages above it are not logged, ERROR until log_start */
+extern log_level_t log_threshold;
+
+/* writes the messages up to level to fd from a drain thread. false with
+ * errno when it could not be started */
+bool log_start(int fd, log_level_t level, log_format_t format);
+/* writes out what is queued and stops the drain */
+void log_stop(void);
+
+/* queues a message, event being a literal. Before log_start it is written
+ * to stderr right away */
+void log_emit(log_level_t level, const char *event, const log_field_t *fields,
+              size_t count);
+
+/* the fields are only evaluated for a message that is logged */
+#define LOG(level, event, ...)                                                 \
+  do {                                                                         \
+    if ((level) <= log_threshold) {                                            \
+      const log_field_t log_fields_[] = {__VA_ARGS__};                         \
+      log_emit((level), (event), log_fields_,                                  \
+               sizeof(log_fields_) / sizeof(log_fields_[0]));                  \
+    }                                                                          \
+  } while (0)
+
+/* up to burst messages per interval, for what a session may repeat at its
+ * packet rate */
+typedef struct {
+  uint64_t interval_ns;
+  uint32_t burst;
+  uint32_t left;       /* in the current interval */
+  uint64_t start_ns;   /* of the current interval */
+  uint64_t suppressed; /* since the last message let through */
+} log_limit_t;
+
+void log_limit_init(log_limit_t *limit, uint32_t burst, uint64_t interval_ns);
+/* whether the next message goes out, with how many were held back before
+ * it */
+bool log_limit_pass(log_limit_t *limit, uint64_t *suppressed);
+
+/* LOG through limit, the message gets a suppressed field */
+#define LOG_LIMITED(limit, level, event, ...)                                  \
+  do {                                                                         \
+    uint64_t log_suppressed_ = 0;                                              \
+    if ((level) <= log_threshold &&                                            \
+        log_limit_pass((limit), &log_suppressed_)) {                           \
+      const log_field_t log_fields_[] = {                                      \
+          __VA_ARGS__, LOG_U64("suppressed", log_suppressed_)};                \
+      log_emit((level), (event), log_fields_,                                  \
+               sizeof(log_fields_) / sizeof(log_fields_[0]));                  \
+    }                                                                          \
+  } while (0)
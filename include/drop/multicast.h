@@ -0,0 +1,72 @@
+#pragma once
+
+#include <drop/tftp.h>
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Reliable multicast push of one file to many daemons.
+ *
+ * The sender announces the upload to the group on the daemons' port, every
+ * daemon that joined the group answers from a session socket of its own. The
+ * sender then multicasts each block once, to the group on its own port, paced
+ * by its on_send hook. Receivers report what they miss with NAKs of block
+ * ranges over unicast, at most one every few milliseconds. A block is repaired
+ * once however many receivers miss it, and not again until a NAK sent after
+ * the repair could have arrived. Once all blocks went out the sender repeats
+ * an END so that receivers that lost the tail find out, and finishes once
+ * every receiver reported DONE. Its bandwidth does not grow with the number
+ * of receivers, only with the losses.
+ *
+ * The packets have opcodes of their own and 32-bit block numbers, a large
+ * image would wrap TFTP's 16 bits:
+ *
+ *   ANNOUNCE | 0x4d01 | session | blksize (2) | size (8) | filename | 0 |
+ *   JOIN     | 0x4d02 | session |
+ *   DATA     | 0x4d03 | session | block (4) | data |
+ *   NAK      | 0x4d04 | session | first (4) | last (4) | ... |
+ *   END      | 0x4d05 | session | blocks (4) |
+ *   DONE     | 0x4d06 | session |
+ *
+ * with a 4 byte session id. A receiver that cannot take the file answers with
+ * a TFTP ERROR packet.
+ */
+
+/* the DATA header, blocks are that much smaller than unicast ones */
+#define MULTICAST_HEADER_SIZE 10
+#define MULTICAST_MAX_RECEIVERS 4096
+
+typedef struct {
+  uint16_t blksize;    /* 0 for the largest that fits the interface MTU */
+  size_t receivers;    /* to wait for, 0 for whoever joins in time */
+} multicast_params_t;
+
+typedef struct {
+  int error; /* ETIMEDOUT when receivers did not join or finish in time, EPROTO
+                when one refused */
+  size_t joined;
+  size_t completed;
+  size_t refused;    /* answered the announce with an ERROR */
+  uint64_t bytes;    /* the file's size */
+  uint64_t repaired; /* blocks sent again */
+  uint64_t naks;     /* received */
+} multicast_result_t;
+
+/* pushes file, which has to be seekable, to the daemons in group. socket is
+ * unbound, group carries the daemons' port and the interface as scope */
+multicast_result_t multicast_send(int socket, const struct sockaddr_in6 *group,
+                                  const char *filename, FILE *file,
+                                  const multicast_params_t *params,
+                                  const tftp_hooks_t *hooks);
+
+/* takes part in the upload the ANNOUNCE in packet is for. socket is the
+ * session's unicast socket, connected to the sender, group the address the
+ * daemon joined with its port and interface. The file is opened and closed
+ * through the hooks as a unicast upload's is */
+tftp_result_t multicast_receive(int socket, const struct sockaddr_in6 *group,
+                                const void *packet, size_t size,
+                                const tftp_limits_t *limits,
+                                const tftp_hooks_t *hooks);
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 typedef struct {
   char host[NI_MAXHOST];
@@ -17,3 +19,7 @@ typedef struct {
 void options_from_config(const char *filename,
                          void (*parse)(int, char *const *, options_t *),
                          options_t *out);
+
+/* parses a byte count or rate such as "512", "64k" or "1.5M" (powers of
+ * 1024), false for anything else and for values that do not fit 64 bits */
+bool options_parse_size(const char *string, uint64_t *out);
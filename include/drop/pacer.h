@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Packet pacing by departure time (GCRA). Every reservation is scheduled one
+ * packet's worth of time after the previous one, so the rate holds down to
+ * single packets instead of bursting and sleeping. Lock-free, a pacer in a
+ * shared mapping paces several processes together.
+ *
+ * Times are CLOCK_MONOTONIC nanoseconds, the clock SO_TXTIME is set up with.
+ */
+
+typedef struct {
+  uint64_t rate; /* bytes per second, 0 for unlimited */
+  _Atomic uint64_t tat_ns;
+} pacer_t;
+
+void pacer_init(pacer_t *pacer, uint64_t rate);
+/* reserves bytes, returns when they may leave, 0 for unlimited pacers */
+uint64_t pacer_reserve(pacer_t *pacer, size_t bytes);
+
+uint64_t pacer_now_ns(void);
+void pacer_sleep_until(uint64_t departure_ns);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Path MTU discovery for picking the TFTP block size.
+ *
+ * Sockets are set to never fragment, so the kernel tracks the path MTU from
+ * ICMP "packet too big" and fails sends that exceed it with EMSGSIZE. The
+ * block size is what fits the MTU after the IP, UDP and TFTP headers.
+ *
+ * The cache remembers block sizes per destination below what the kernel
+ * reports, for paths that drop big packets without telling. It lives in a
+ * shared mapping so the upload processes learn from each other.
+ */
+
+typedef struct pmtu_cache pmtu_cache_t;
+
+pmtu_cache_t *pmtu_cache_new(size_t entries);
+void pmtu_cache_free(pmtu_cache_t *cache);
+
+/* sets don't-fragment on a socket, before connect */
+int pmtu_setup(int socket);
+/* the block size for the connected socket's path, at least 512 */
+uint16_t pmtu_blksize(pmtu_cache_t *cache, int socket);
+/* remembers that blocks above blksize do not make it to the socket's peer */
+void pmtu_cache_lower(pmtu_cache_t *cache, int socket, uint16_t blksize);
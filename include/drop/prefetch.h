@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Opens, stats and reads a list of files ahead of their use.
+ *
+ * Up to depth files past the one being used are in flight at once through
+ * io_uring: each is opened, then stated and its first bytes read into a
+ * registered buffer, so a consumer going through many small files finds
+ * each one ready instead of waiting on its metadata, which on a network
+ * filesystem is most of the cost. Files come back in list order. Without
+ * io_uring, as under seccomp filters that refuse it, the same is done
+ * synchronously as the files are asked for.
+ */
+
+typedef struct prefetch prefetch_t;
+
+typedef struct {
+  int fd;             /* the caller closes it, read on from data_size */
+  struct stat status; /* mode, size, owner and mtime */
+  const uint8_t *data; /* the first bytes, until the next prefetch_next */
+  size_t data_size;
+} prefetch_file_t;
+
+/* reads ahead up to depth of the count files at paths, the first
+ * buffer_size bytes of each. NULL with errno on failure */
+prefetch_t *prefetch_new(char *const *paths, size_t count, size_t depth,
+                         size_t buffer_size);
+/* closes the files read ahead and not taken */
+void prefetch_free(prefetch_t *prefetch);
+
+/* the next file of the list, waiting for it. false with errno when it could
+ * not be opened, stated or read */
+bool prefetch_next(prefetch_t *prefetch, prefetch_file_t *out);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* an address prefix, IPv4 prefixes are kept as v4-mapped IPv6 prefixes */
+typedef struct {
+  struct in6_addr address;
+  uint8_t length;
+} prefix_t;
+
+/* parses "2001:db8::/32", "10.0.0.0/8" or a bare address */
+bool prefix_parse(const char *string, prefix_t *out);
+/* truncates address to its first length bits */
+prefix_t prefix_of(const struct in6_addr *address, uint8_t length);
+bool prefix_contains(const prefix_t *prefix, const struct in6_addr *address);
+void prefix_format(const prefix_t *prefix, char *buffer, size_t size);
+
+/* longest-prefix match from prefixes to non-negative values, a binary trie
+ * kept in one array */
+typedef struct prefix_table prefix_table_t;
+
+prefix_table_t *prefix_table_new(void);
+void prefix_table_free(prefix_table_t *table);
+/* a prefix inserted again takes the new value, false when out of memory */
+bool prefix_table_insert(prefix_table_t *table, const prefix_t *prefix,
+                         int value);
+/* the value of the longest prefix containing address, -1 for none */
+int prefix_table_lookup(const prefix_table_t *table,
+                        const struct in6_addr *address);
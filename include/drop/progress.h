@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Progress of a run of many uploads, as one line.
+ *
+ * Every upload has a slot in memory shared with the processes forked after
+ * the slots were made. An upload adds the bytes acknowledged to its slot
+ * with a relaxed atomic, so reporting costs no system call per block, and
+ * the threads sending one file to several hosts share its slot. The process
+ * that made the slots reads them at its own pace and renders the files
+ * done, the bytes, the throughput and the time left, at most once an
+ * interval. On a terminal the line is redrawn in place, elsewhere a line is
+ * added each time.
+ */
+
+typedef struct progress progress_t;
+
+/* slots for count uploads, rendered to out. NULL with errno on failure */
+progress_t *progress_new(size_t count, FILE *out, uint64_t interval_ns);
+void progress_free(progress_t *progress);
+
+/* adds size to the bytes the upload at index moves, uploads nothing was
+ * expected of have no time left to show */
+void progress_expect(progress_t *progress, size_t index, uint64_t size);
+/* adds bytes acknowledged, negative ones for an upload starting over */
+void progress_add(progress_t *progress, size_t index, int64_t bytes);
+/* the upload at index is over, from the process that made the slots */
+void progress_finish(progress_t *progress, size_t index, bool ok);
+
+/* draws the line unless it was drawn less than an interval ago */
+void progress_render(progress_t *progress, uint64_t now_ns);
+/* when the next render is due, for a poll timeout */
+uint64_t progress_next_ns(const progress_t *progress);
+/* takes a line drawn in place away for other output */
+void progress_clear(progress_t *progress);
+/* draws the line a last time and ends it */
+void progress_done(progress_t *progress, uint64_t now_ns);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <drop/tftp.h>
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Chain replication: an upload goes on to the next hop while it is still
+ * being received.
+ *
+ * What the session writes is teed into the local file and a socket pair a
+ * thread uploads to the next hop from, with the same TFTP engine. Storing and
+ * forwarding overlap. Once the pair's buffer is full the session's writes,
+ * and with them its ACKs, wait for the next hop, so the upstream is never
+ * more than that buffer ahead of it.
+ *
+ * With local commit the upstream's final ACK means the file is stored here,
+ * the session then waits for the next hop in the background. With downstream
+ * commit the final ACK waits for the next hop's and an upload it failed fails
+ * upstream as well, so a client of a chain of such daemons learns that every
+ * hop has the file. A failed or cut short upstream upload is aborted at the
+ * next hop rather than ended early.
+ */
+
+#define RELAY_BUFFER (1024 * 1024)
+
+typedef enum {
+  RELAY_COMMIT_LOCAL,
+  RELAY_COMMIT_DOWNSTREAM,
+} relay_commit_t;
+
+typedef struct relay relay_t;
+
+/* creates filename and starts uploading it under the same name to next_hop,
+ * NULL with errno on failure */
+relay_t *relay_open(const char *filename, const struct sockaddr_in6 *next_hop,
+                    relay_commit_t commit);
+/* the stream the upload is written to */
+FILE *relay_stream(relay_t *relay);
+/* closes the stream, complete when the whole file was written. -1 with errno
+ * when the local file or, with downstream commit, the next hop failed */
+int relay_close(relay_t *relay, bool complete);
+/* after relay_close, waits for the next hop and frees relay */
+tftp_result_t relay_finish(relay_t *relay);
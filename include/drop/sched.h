@@ -0,0 +1,65 @@
+#pragma once
+
+#include <drop/prefix.h>
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Weighted fair sharing of the daemon's ingest bandwidth.
+ *
+ * Sessions are grouped into classes by client subnet. Every class with an
+ * active session gets a share of the global rate proportional to its weight,
+ * capped by the per-client rate, with the leftover of capped classes handed to
+ * the others (water-filling). Sessions pace themselves by delaying ACKs until
+ * their class' virtual clock allows the received bytes.
+ *
+ * The state lives in a shared mapping so forked session processes and the
+ * accept loop see the same clocks and counters.
+ */
+
+typedef struct {
+  prefix_t prefix;
+  uint32_t weight;
+} sched_weight_t;
+
+typedef struct {
+  uint64_t rate;        /* global cap in bytes/s, 0 for none */
+  uint64_t client_rate; /* cap per client subnet in bytes/s, 0 for none */
+  uint8_t subnet_v4;    /* prefix length grouping IPv4 clients */
+  uint8_t subnet_v6;    /* prefix length grouping IPv6 clients */
+  const sched_weight_t *weights;
+  size_t weight_count;
+} sched_config_t;
+
+typedef struct sched sched_t;
+
+#define SCHED_DEFAULT_SUBNET_V4 24
+#define SCHED_DEFAULT_SUBNET_V6 64
+
+/* sessions up to this size are tracked in the small upload latency histogram */
+#define SCHED_SMALL_UPLOAD (64 * 1024)
+
+sched_t *sched_new(const sched_config_t *config, size_t max_sessions);
+void sched_free(sched_t *sched);
+/* takes new rates and weights, running sessions are paced by them from their
+ * next acquire on. The subnet lengths stay as they are */
+void sched_reconfigure(sched_t *sched, const sched_config_t *config);
+
+/* called by the accept loop, returns a session slot or -1 when full */
+int sched_session_begin(sched_t *sched, const struct in6_addr *client);
+void sched_session_attach(sched_t *sched, int slot, pid_t pid);
+void sched_session_end(sched_t *sched, int slot);
+/* called by a session once its transfer is over, before it lingers for
+ * retransmissions, so that neither counts toward latency or bandwidth */
+void sched_session_complete(sched_t *sched, int slot);
+/* releases the slot of a reaped session process, false if pid is unknown */
+bool sched_session_reap(sched_t *sched, pid_t pid);
+
+/* called by a session before acknowledging bytes, sleeps until allowed */
+void sched_acquire(sched_t *sched, int slot, size_t bytes);
+
+void sched_dump(sched_t *sched, FILE *out);
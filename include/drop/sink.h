@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Streaming sinks: uploads handed to a consumer process instead of a file.
+ *
+ * A Unix stream socket gets a connection per upload, so a persistent
+ * consumer can take several at once. The upload arrives as chunks, each a
+ * 4 byte length in network byte order followed by that many bytes: the
+ * filename first, then the data in pieces of up to the session's write
+ * buffer, then an empty chunk once it is complete. A connection that closes
+ * without the empty chunk is an upload that failed. The consumer closes its
+ * end once it has taken the file, the final ACK waits for that.
+ *
+ * A FIFO gets the raw data, uploads to FIFOs in one directory take turns and
+ * each opens it anew, so a consumer that reopens it on end of file reads one
+ * upload at a time. The consumer cannot tell a failed upload from a complete
+ * one, use a socket for that. Writes to a FIFO whose consumer went away raise
+ * SIGPIPE, callers ignore it and get EPIPE.
+ *
+ * Either way a consumer that does not keep up blocks the session's writes
+ * and so its ACKs, the upload slows down to what the consumer takes.
+ */
+
+typedef struct sink sink_t;
+
+/* connects to the consumer at path, a Unix stream socket or a FIFO, for
+ * filename. NULL with errno on failure, ENXIO when a FIFO has no reader */
+sink_t *sink_open(const char *path, const char *filename);
+/* the stream the upload is written to */
+FILE *sink_stream(sink_t *sink);
+/* closes the stream, complete when the whole file was written, and frees
+ * sink. -1 with errno when the consumer failed */
+int sink_close(sink_t *sink, bool complete);
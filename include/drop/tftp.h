@@ -1,20 +1,145 @@
 #pragma once
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 
 #define TFTP_BLOCK_SIZE 512
+/* the blksize option's range, RFC 2348 */
+#define TFTP_MIN_BLOCK_SIZE 8
+#define TFTP_MAX_BLOCK_SIZE 65464
+/* stdio buffer the receiver writes through */
+#define TFTP_WRITE_BUFFER_SIZE (64 * 1024)
 
 typedef uint16_t tftp_block_t;
 
+typedef enum tftp_error_code : uint16_t {
+  TFTP_ERROR_NOT_DEFINED = 0,
+  TFTP_ERROR_NOT_FOUND = 1,
+  TFTP_ERROR_ACCESS_VIOLATION = 2,
+  TFTP_ERROR_DISK_FULL = 3,
+  TFTP_ERROR_ILLEGAL_OPERATION = 4,
+  TFTP_ERROR_UNKNOWN_TID = 5,
+  TFTP_ERROR_ALREADY_EXISTS = 6,
+  TFTP_ERROR_NO_SUCH_USER = 7,
+  TFTP_ERROR_OPTION_REFUSED = 8, /* RFC 2347 */
+} tftp_error_code_t;
+
 typedef struct {
-  uint8_t buffer[TFTP_BLOCK_SIZE + 4];
+  uint8_t buffer[TFTP_MAX_BLOCK_SIZE + 4];
 } tftp_buffer_t;
 
 typedef void (*tftp_block_cb_t)(tftp_block_t block, void *useredata);
+/* called with the bytes acknowledged so far, once per ACK that moved them.
+ * An upload that starts over reports from 0 again */
+typedef void (*tftp_progress_cb_t)(uint64_t bytes, void *userdata);
+/* called with the payload size of a DATA packet before it is acknowledged,
+ * blocking in it delays the ACK and so paces the sender */
+typedef void (*tftp_data_cb_t)(size_t bytes, void *userdata);
+/* called with the payload size before a DATA packet is sent, blocking in it
+ * delays the packet. Returns the CLOCK_MONOTONIC departure time to pass to a
+ * socket with SO_TXTIME enabled, 0 to send right away */
+typedef uint64_t (*tftp_send_cb_t)(size_t bytes, void *userdata);
+typedef void (*tftp_done_cb_t)(void *userdata);
+/* called with every datagram the socket receives, before it is parsed */
+typedef void (*tftp_packet_cb_t)(const void *packet, size_t size,
+                                 void *userdata);
+/* called before blocking for a packet until the CLOCK_MONOTONIC deadline, it
+ * may spin on socket instead. Returns 1 once a packet is waiting, 0 to leave
+ * the wait to select and -1 with errno for an error the socket reported */
+typedef int (*tftp_wait_cb_t)(int socket, uint64_t deadline_ns,
+                              void *userdata);
+/* called with the requested filename for the stream an upload is written
+ * to or a download read from, NULL with errno to refuse it */
+typedef FILE *(*tftp_open_cb_t)(const char *filename, void *userdata);
+/* closes what on_open returned, complete once the final block is written or
+ * acknowledged. An upload's final ACK waits for it, non-zero with errno
+ * fails the upload instead */
+typedef int (*tftp_close_cb_t)(FILE *file, bool complete, void *userdata);
+
+typedef struct {
+  /* sender: blocks as they are acknowledged, receiver: blocks as they are
+   * written, both start with block 0 once the request is answered */
+  tftp_block_cb_t on_block;
+  tftp_data_cb_t on_data;         /* receiver only */
+  tftp_send_cb_t on_send;         /* sender only */
+  tftp_progress_cb_t on_progress; /* sender only */
+  tftp_done_cb_t on_request;      /* sender only, the WRQ went out */
+  /* receiver only, the final block is acknowledged. The session lingers for
+   * retransmissions a while longer */
+  tftp_done_cb_t on_complete;
+  tftp_wait_cb_t on_wait;
+  /* the server's file, without them it is opened with fopen */
+  tftp_open_cb_t on_open;
+  tftp_close_cb_t on_close;
+  tftp_packet_cb_t on_receive;
+  void *userdata;
+} tftp_hooks_t;
+
+/*
+ * Transfer parameters negotiated with RFC 2347 options, 0 for not negotiated.
+ *
+ * Without options transfers are lock-step, every DATA packet is acknowledged
+ * before the next is sent. With a window the sender keeps windowsize blocks in
+ * flight and the receiver acknowledges every ackevery blocks, at the end of a
+ * window, on the final block and at the latest ackdelay after the first block
+ * it has not acknowledged. Gaps are answered right away with a repeated ACK
+ * the sender resends from.
+ */
+typedef struct {
+  uint16_t blksize;     /* RFC 2348, defaults to 512 */
+  uint16_t windowsize;  /* RFC 7440 */
+  uint16_t ackevery;    /* defaults to windowsize */
+  uint16_t ackdelay_ms; /* defaults to 50 */
+  uint8_t timeout;      /* RFC 2349, retransmission timeout in seconds */
+  uint8_t probe;        /* the receiver discards the data, for measuring */
+  /* the data is an archive the receiver unpacks into the directory named
+   * by the request, see batch.h */
+  uint8_t batch;
+} tftp_params_t;
+
+typedef struct {
+  int error;               /* 0 on success, errno style code otherwise */
+  tftp_error_code_t code;  /* when error is EPROTO, as sent by the peer */
+  unsigned retry_after_ms; /* when error is EBUSY */
+  bool started;            /* the request was accepted, file was read from */
+  uint64_t bytes;          /* acknowledged by the receiver */
+  uint64_t resent;         /* DATA packets sent again */
+  uint64_t rtt_ns;         /* shortest from a block to its ACK, 0 for none */
+} tftp_result_t;
+
+/* request holds the options to ask for, NULL for none. error is ETIMEDOUT
+ * when the WRQ or the data went unanswered, EBUSY when the server shed the
+ * request, EMSGSIZE when a block exceeded the path MTU and EPROTONOSUPPORT
+ * when a probe or a batch was not taken as one. started tells whether
+ * anything was read from file */
+tftp_result_t tftp_send_wrq(int socket, const char *filename, FILE *file,
+                            const tftp_params_t *request,
+                            const tftp_hooks_t *hooks);
+/* what a receiver lets senders negotiate */
+typedef struct {
+  tftp_params_t max;   /* a zero field refuses the option */
+  uint8_t min_timeout; /* shorter timeouts are refused */
+} tftp_limits_t;
+
+/* limits caps what a client may negotiate, NULL refuses all options */
+tftp_result_t tftp_handle_wrq(int socket, tftp_buffer_t *buffer,
+                              size_t buffer_size, const tftp_limits_t *limits,
+                              const tftp_hooks_t *hooks);
+
+/* the filename of a read request, NULL for any other packet. It points
+ * into buffer */
+const char *tftp_read_request_filename(tftp_buffer_t *buffer,
+                                       size_t buffer_size);
+/* serves a read request, sending the file as tftp_send_wrq does. limits caps
+ * what the client may negotiate, NULL refuses all options */
+tftp_result_t tftp_handle_rrq(int socket, tftp_buffer_t *buffer,
+                              size_t buffer_size, const tftp_limits_t *limits,
+                              const tftp_hooks_t *hooks);
 
-void tftp_send_wrq(int socket, const char *filename, FILE *file,
-                   tftp_block_cb_t on_block, void *userdata);
-void tftp_handle_wrq(int socket, tftp_buffer_t *buffer, size_t buffer_size,
-                     tftp_block_cb_t on_block, void *userdata);
+/* formats an ERROR packet, returns its size */
+size_t tftp_format_error(tftp_buffer_t *buffer, tftp_error_code_t code,
+                         const char *message);
+/* formats the ERROR packet an overloaded server answers a request with */
+size_t tftp_format_busy(tftp_buffer_t *buffer, unsigned retry_after_ms);
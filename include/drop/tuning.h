@@ -0,0 +1,42 @@
+#pragma once
+
+#include <drop/tftp.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Transfer settings per destination, derived from a short probe upload the
+ * server discards, so later uploads start out tuned to the path instead of
+ * at the defaults.
+ *
+ * They are cached in $XDG_CONFIG_HOME/drop/tuning next to drop.conf, one line
+ * per destination:
+ *
+ *   <host> <port> <probed at> <blksize> <window> <ack every> <timeout> <rate>
+ */
+
+typedef struct {
+  uint16_t blksize; /* the probe ran with */
+  uint64_t rtt_ns;  /* shortest from a block to its ACK */
+  uint64_t rate;    /* bytes per second acknowledged */
+  uint64_t packets; /* DATA packets sent */
+  uint64_t resent;  /* of which retransmissions */
+} tuning_measurement_t;
+
+typedef struct {
+  time_t probed_at;
+  tftp_params_t params; /* blksize, windowsize, ackevery and timeout */
+  uint64_t rate;        /* bytes per second to pace at, 0 for unpaced */
+} tuning_t;
+
+tuning_t tuning_derive(const tuning_measurement_t *measurement);
+
+/* looks up the destination, entries probed more than max_age seconds ago do
+ * not count */
+bool tuning_load(const char *host, const char *port, time_t max_age,
+                 tuning_t *out);
+/* adds or replaces the destination's entry, returns -1 with errno set if the
+ * cache could not be written */
+int tuning_store(const char *host, const char *port, const tuning_t *tuning);
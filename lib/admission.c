@@ -0,0 +1,234 @@
+#include <drop/admission.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NS_PER_MS 1000000ull
+#define ADMISSION_MIN_RETRY_MS 50
+#define ADMISSION_MAX_RETRY_MS 30000
+#define ADMISSION_DEFAULT_RETRY_MS 1000
+
+struct admission {
+  admission_config_t config;
+  size_t sessions;
+
+  /* ring of waiting requests */
+  admission_request_t *queue;
+  size_t head;
+  size_t count;
+
+  /* how fast sessions complete, to size the suggested back-off */
+  uint64_t last_completion_ns;
+  double completion_interval_ns;
+
+  uint64_t admitted;
+  uint64_t queued;
+  uint64_t rejected;
+  size_t peak_queue;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec now = {0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+admission_t *admission_new(const admission_config_t *config) {
+  assert(config);
+  assert(config->max_sessions > 0);
+
+  admission_t *admission = calloc(1, sizeof(admission_t));
+  if (!admission)
+    return NULL;
+
+  admission->config = *config;
+  if (config->queue_length) {
+    admission->queue =
+        calloc(config->queue_length, sizeof(admission_request_t));
+    if (!admission->queue) {
+      free(admission);
+      return NULL;
+    }
+  }
+
+  return admission;
+}
+
+void admission_free(admission_t *admission) {
+  if (!admission)
+    return;
+
+  admission_request_t request;
+  while (admission_dequeue(admission, &request))
+    free(request.packet);
+
+  free(admission->queue);
+  free(admission);
+}
+
+void admission_reconfigure(admission_t *admission,
+                           const admission_config_t *config) {
+  assert(admission);
+  assert(config);
+  assert(config->max_sessions > 0);
+
+  const size_t queue_length = admission->config.queue_length;
+  admission->config = *config;
+  admission->config.queue_length = queue_length;
+}
+
+bool admission_can_admit(const admission_t *admission) {
+  assert(admission);
+
+  if (admission->sessions >= admission->config.max_sessions)
+    return false;
+
+  if (admission->config.memory_budget &&
+      (admission->sessions + 1) * admission->config.session_memory >
+          admission->config.memory_budget)
+    return false;
+
+  return true;
+}
+
+void admission_session_begin(admission_t *admission) {
+  assert(admission);
+  ++admission->sessions;
+  ++admission->admitted;
+}
+
+void admission_session_end(admission_t *admission) {
+  assert(admission);
+  assert(admission->sessions > 0);
+  --admission->sessions;
+
+  const uint64_t now = now_ns();
+  if (admission->last_completion_ns) {
+    const double interval = (double)(now - admission->last_completion_ns);
+    admission->completion_interval_ns =
+        admission->completion_interval_ns
+            ? 0.875 * admission->completion_interval_ns + 0.125 * interval
+            : interval;
+  }
+  admission->last_completion_ns = now;
+}
+
+static bool same_peer(const struct sockaddr_in6 *a,
+                      const struct sockaddr_in6 *b) {
+  return a->sin6_port == b->sin6_port &&
+         memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+}
+
+admission_enqueue_result_t
+admission_enqueue(admission_t *admission, const admission_request_t *request) {
+  assert(admission);
+  assert(request);
+
+  const size_t capacity = admission->config.queue_length;
+  for (size_t n = 0; n < admission->count; ++n) {
+    const admission_request_t *queued =
+        admission->queue + (admission->head + n) % capacity;
+    if (same_peer(&queued->source, &request->source))
+      return ADMISSION_DUPLICATE;
+  }
+
+  if (admission->count == capacity)
+    return ADMISSION_FULL;
+
+  admission_request_t *slot =
+      admission->queue + (admission->head + admission->count) % capacity;
+  *slot = *request;
+  slot->arrival_ns = now_ns();
+  slot->packet = malloc(request->size);
+  if (!slot->packet)
+    return ADMISSION_FULL;
+  memcpy(slot->packet, request->packet, request->size);
+
+  ++admission->count;
+  ++admission->queued;
+  if (admission->count > admission->peak_queue)
+    admission->peak_queue = admission->count;
+
+  return ADMISSION_QUEUED;
+}
+
+bool admission_dequeue(admission_t *admission, admission_request_t *out) {
+  assert(admission);
+  assert(out);
+
+  if (admission->count == 0)
+    return false;
+
+  *out = admission->queue[admission->head];
+  admission->head = (admission->head + 1) % admission->config.queue_length;
+  --admission->count;
+  return true;
+}
+
+bool admission_expire(admission_t *admission, admission_request_t *out) {
+  assert(admission);
+
+  if (admission->count == 0)
+    return false;
+
+  const admission_request_t *oldest = admission->queue + admission->head;
+  if (now_ns() - oldest->arrival_ns <
+      admission->config.queue_timeout_ms * NS_PER_MS)
+    return false;
+
+  return admission_dequeue(admission, out);
+}
+
+int admission_next_timeout_ms(const admission_t *admission) {
+  assert(admission);
+
+  if (admission->count == 0)
+    return -1;
+
+  const admission_request_t *oldest = admission->queue + admission->head;
+  const uint64_t deadline =
+      oldest->arrival_ns + admission->config.queue_timeout_ms * NS_PER_MS;
+  const uint64_t now = now_ns();
+  if (deadline <= now)
+    return 0;
+
+  /* round up so the request has expired once poll returns */
+  return (int)((deadline - now + NS_PER_MS - 1) / NS_PER_MS);
+}
+
+unsigned admission_reject(admission_t *admission) {
+  assert(admission);
+  ++admission->rejected;
+
+  if (!admission->completion_interval_ns)
+    return ADMISSION_DEFAULT_RETRY_MS;
+
+  /* the time it takes for everyone queued ahead to get a slot */
+  const double retry_after_ms = admission->completion_interval_ns *
+                                (double)(admission->count + 1) / NS_PER_MS;
+
+  if (retry_after_ms < ADMISSION_MIN_RETRY_MS)
+    return ADMISSION_MIN_RETRY_MS;
+  if (retry_after_ms > ADMISSION_MAX_RETRY_MS)
+    return ADMISSION_MAX_RETRY_MS;
+  return (unsigned)retry_after_ms;
+}
+
+void admission_dump(const admission_t *admission, FILE *out) {
+  assert(admission);
+  assert(out);
+
+  fprintf(out,
+          "admission: sessions=%zu/%zu memory=%" PRIu64 "/%" PRIu64
+          " queue=%zu/%zu peak=%zu admitted=%" PRIu64 " queued=%" PRIu64
+          " rejected=%" PRIu64 "\n",
+          admission->sessions, admission->config.max_sessions,
+          admission->sessions * admission->config.session_memory,
+          admission->config.memory_budget, admission->count,
+          admission->config.queue_length, admission->peak_queue,
+          admission->admitted, admission->queued, admission->rejected);
+  fflush(out);
+}
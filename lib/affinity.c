@@ -0,0 +1,193 @@
+#include <drop/affinity.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct affinity_entry {
+  int cpu;
+  int node;          /* NUMA node, -1 if unknown */
+  uint64_t requests; /* steered to the CPU's socket */
+  uint64_t sessions; /* finished */
+  uint64_t misses;   /* sessions whose packets arrived on another CPU */
+};
+
+struct affinity {
+  size_t mapping_size;
+  size_t count;
+  struct affinity_entry entry[];
+};
+
+/* the lowest NUMA node sysfs lists for the CPU */
+static int affinity_node(int cpu) {
+  for (int node = 0; node < AFFINITY_MAX_CPUS; ++node) {
+    char path[96] = {0};
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu,
+             node);
+    if (access(path, F_OK) == 0)
+      return node;
+  }
+  return -1;
+}
+
+/* parses the list into cpus, in order of first appearance */
+static bool affinity_parse(const char *list, int *cpus, size_t *count) {
+  cpu_set_t allowed, seen;
+  CPU_ZERO(&allowed);
+  CPU_ZERO(&seen);
+  if (-1 == sched_getaffinity(0, sizeof(allowed), &allowed))
+    return false;
+
+  const char *p = list;
+  for (;;) {
+    char *end = NULL;
+    const long first = strtol(p, &end, 10);
+    if (end == p || first < 0)
+      return false;
+    long last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first)
+        return false;
+    }
+    if (last >= AFFINITY_MAX_CPUS)
+      return false;
+
+    for (long cpu = first; cpu <= last; ++cpu) {
+      if (!CPU_ISSET((int)cpu, &allowed))
+        return false;
+      if (!CPU_ISSET((int)cpu, &seen))
+        cpus[(*count)++] = (int)cpu;
+      CPU_SET((int)cpu, &seen);
+    }
+
+    if (*end == '\0')
+      return *count > 0;
+    if (*end != ',')
+      return false;
+    p = end + 1;
+  }
+}
+
+affinity_t *affinity_new(const char *list) {
+  int cpus[AFFINITY_MAX_CPUS];
+  size_t count = 0;
+  if (!affinity_parse(list, cpus, &count)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  const size_t size =
+      sizeof(affinity_t) + count * sizeof(struct affinity_entry);
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  affinity_t *affinity = mapping;
+  affinity->mapping_size = size;
+  affinity->count = count;
+  for (size_t n = 0; n < count; ++n) {
+    affinity->entry[n] = (struct affinity_entry){
+        .cpu = cpus[n],
+        .node = affinity_node(cpus[n]),
+    };
+  }
+  return affinity;
+}
+
+void affinity_free(affinity_t *affinity) {
+  if (affinity)
+    munmap(affinity, affinity->mapping_size);
+}
+
+size_t affinity_size(const affinity_t *affinity) {
+  return affinity ? affinity->count : 0;
+}
+
+int affinity_steer(int socket, const affinity_t *affinity) {
+  /* a comparison per CPU of the map, CPUs outside it spread by modulo */
+  const size_t length = 2 * affinity->count + 3;
+  struct sock_filter *code = calloc(length, sizeof(struct sock_filter));
+  if (!code)
+    return -1;
+
+  size_t pc = 0;
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                            SKF_AD_OFF + SKF_AD_CPU);
+  for (size_t n = 0; n < affinity->count; ++n) {
+    code[pc++] = (struct sock_filter)BPF_JUMP(
+        BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)affinity->entry[n].cpu, 0, 1);
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (uint32_t)n);
+  }
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+                                            (uint32_t)affinity->count);
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+  assert(pc <= length);
+
+  const struct sock_fprog program = {
+      .len = (unsigned short)pc,
+      .filter = code,
+  };
+  const int result = setsockopt(socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                                &program, sizeof(program));
+  const int error = errno;
+  free(code);
+  errno = error;
+  return result;
+}
+
+void affinity_request(affinity_t *affinity, size_t index) {
+  assert(index < affinity->count);
+  __atomic_fetch_add(&affinity->entry[index].requests, 1, __ATOMIC_RELAXED);
+}
+
+int affinity_pin(const affinity_t *affinity, size_t index) {
+  assert(index < affinity->count);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(affinity->entry[index].cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set);
+}
+
+void affinity_session_end(affinity_t *affinity, size_t index, int socket) {
+  assert(index < affinity->count);
+  struct affinity_entry *entry = affinity->entry + index;
+  __atomic_fetch_add(&entry->sessions, 1, __ATOMIC_RELAXED);
+
+  int cpu = -1;
+  socklen_t size = sizeof(cpu);
+  if (0 == getsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &size) &&
+      cpu != -1 && cpu != entry->cpu)
+    __atomic_fetch_add(&entry->misses, 1, __ATOMIC_RELAXED);
+}
+
+void affinity_dump(const affinity_t *affinity, FILE *out) {
+  if (!affinity)
+    return;
+
+  fprintf(out, "affinity: cpus=%zu\n", affinity->count);
+  for (size_t n = 0; n < affinity->count; ++n) {
+    const struct affinity_entry *entry = affinity->entry + n;
+    char node[16] = "-";
+    if (entry->node != -1)
+      snprintf(node, sizeof(node), "%d", entry->node);
+    fprintf(out,
+            "  cpu %d node=%s requests=%" PRIu64 " sessions=%" PRIu64
+            " received-elsewhere=%" PRIu64 "\n",
+            entry->cpu, node,
+            __atomic_load_n(&entry->requests, __ATOMIC_RELAXED),
+            __atomic_load_n(&entry->sessions, __ATOMIC_RELAXED),
+            __atomic_load_n(&entry->misses, __ATOMIC_RELAXED));
+  }
+}
@@ -0,0 +1,305 @@
+#include <drop/async.h>
+#include <drop/pmtu.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the engine keeps a packet buffer on the stack, not much more */
+#define ASYNC_STACK_SIZE (256 * 1024)
+/* a busy or silent server is asked again, as the client does */
+#define ASYNC_ATTEMPTS 5
+#define ASYNC_RETRY_MS 1000
+
+struct async_upload {
+  async_t *async;
+  async_request_t request;
+  char *filename; /* request.filename's copy */
+  struct iovec data; /* request.data as the only iovec */
+  const struct iovec *iov;
+  size_t iov_count;
+  size_t iov_index; /* where the upload stands */
+  size_t iov_offset;
+  atomic_bool cancelled;
+  pthread_t thread;
+  tftp_result_t result;
+  /* in the running list, then the done list */
+  async_upload_t *prev;
+  async_upload_t *next;
+};
+
+struct async {
+  int fd; /* an eventfd counting completions */
+  pthread_mutex_t lock;
+  pthread_cond_t idle; /* running went empty */
+  async_upload_t *running;
+  async_upload_t *done; /* newest first */
+};
+
+async_t *async_new(void) {
+  async_t *async = calloc(1, sizeof(async_t));
+  if (!async)
+    return NULL;
+  async->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (async->fd == -1) {
+    const int error = errno;
+    free(async);
+    errno = error;
+    return NULL;
+  }
+  pthread_mutex_init(&async->lock, NULL);
+  pthread_cond_init(&async->idle, NULL);
+  return async;
+}
+
+static void async_upload_free(async_upload_t *upload) {
+  pthread_join(upload->thread, NULL);
+  free(upload->filename);
+  free(upload);
+}
+
+void async_free(async_t *async) {
+  if (!async)
+    return;
+
+  pthread_mutex_lock(&async->lock);
+  for (async_upload_t *upload = async->running; upload; upload = upload->next)
+    async_cancel(upload);
+  while (async->running)
+    pthread_cond_wait(&async->idle, &async->lock);
+  async_upload_t *done = async->done;
+  async->done = NULL;
+  pthread_mutex_unlock(&async->lock);
+
+  while (done) {
+    async_upload_t *next = done->next;
+    async_upload_free(done);
+    done = next;
+  }
+  pthread_cond_destroy(&async->idle);
+  pthread_mutex_destroy(&async->lock);
+  close(async->fd);
+  free(async);
+}
+
+int async_fd(const async_t *async) { return async->fd; }
+
+void async_cancel(async_upload_t *upload) {
+  atomic_store(&upload->cancelled, true);
+}
+
+static ssize_t async_read(void *cookie, char *buffer, size_t size) {
+  async_upload_t *upload = cookie;
+  if (atomic_load(&upload->cancelled)) {
+    errno = ECANCELED;
+    return -1;
+  }
+  if (upload->request.pull)
+    return upload->request.pull(buffer, size, upload->request.userdata);
+
+  size_t copied = 0;
+  while (copied < size && upload->iov_index < upload->iov_count) {
+    const struct iovec *iov = upload->iov + upload->iov_index;
+    size_t length = iov->iov_len - upload->iov_offset;
+    if (length > size - copied)
+      length = size - copied;
+    memcpy(buffer + copied, (const char *)iov->iov_base + upload->iov_offset,
+           length);
+    copied += length;
+    upload->iov_offset += length;
+    if (upload->iov_offset == iov->iov_len) {
+      ++upload->iov_index;
+      upload->iov_offset = 0;
+    }
+  }
+  return (ssize_t)copied;
+}
+
+/* memory is read again from the start when the upload starts over */
+static int async_seek(void *cookie, off64_t *offset, int whence) {
+  async_upload_t *upload = cookie;
+  if (*offset != 0 || whence != SEEK_SET) {
+    errno = EINVAL;
+    return -1;
+  }
+  upload->iov_index = 0;
+  upload->iov_offset = 0;
+  return 0;
+}
+
+static void async_backoff(unsigned retry_after_ms) {
+  const unsigned delay_ms = retry_after_ms ? retry_after_ms : ASYNC_RETRY_MS;
+  const struct timespec delay = {
+      .tv_sec = (time_t)(delay_ms / 1000),
+      .tv_nsec = (long)(delay_ms % 1000) * 1000000,
+  };
+  nanosleep(&delay, NULL);
+}
+
+static tftp_result_t async_attempt(async_upload_t *upload, FILE *file) {
+  const int s = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (s == -1)
+    return (tftp_result_t){.error = errno};
+  if (-1 == pmtu_setup(s) ||
+      -1 == connect(s, (const struct sockaddr *)&upload->request.server,
+                    sizeof(upload->request.server))) {
+    const int error = errno;
+    close(s);
+    return (tftp_result_t){.error = error};
+  }
+
+  tftp_params_t request = upload->request.request;
+  if (!request.blksize)
+    request.blksize = pmtu_blksize(NULL, s);
+  const tftp_result_t result =
+      tftp_send_wrq(s, upload->request.filename, file, &request, NULL);
+  close(s);
+  return result;
+}
+
+static tftp_result_t async_upload(async_upload_t *upload) {
+  const cookie_io_functions_t functions = {
+      .read = &async_read,
+      .seek = upload->request.pull ? NULL : &async_seek,
+  };
+  FILE *file = fopencookie(upload, "r", functions);
+  if (!file)
+    return (tftp_result_t){.error = errno};
+  /* blocks are copied out of the caller's memory once */
+  setvbuf(file, NULL, _IONBF, 0);
+
+  tftp_result_t result = {0};
+  for (unsigned attempt = 0; attempt < ASYNC_ATTEMPTS; ++attempt) {
+    result = async_attempt(upload, file);
+    if (result.error != EBUSY && result.error != ETIMEDOUT)
+      break;
+    /* a pull callback cannot start over */
+    if (result.started && fseek(file, 0, SEEK_SET) != 0)
+      break;
+    if (atomic_load(&upload->cancelled)) {
+      result.error = ECANCELED;
+      break;
+    }
+    if (attempt + 1 < ASYNC_ATTEMPTS)
+      async_backoff(result.retry_after_ms);
+  }
+  fclose(file);
+  return result;
+}
+
+static void *async_thread(void *arg) {
+  async_upload_t *upload = arg;
+  upload->result = async_upload(upload);
+
+  async_t *async = upload->async;
+  pthread_mutex_lock(&async->lock);
+  if (upload->prev)
+    upload->prev->next = upload->next;
+  else
+    async->running = upload->next;
+  if (upload->next)
+    upload->next->prev = upload->prev;
+  upload->prev = NULL;
+  upload->next = async->done;
+  async->done = upload;
+  if (!async->running)
+    pthread_cond_broadcast(&async->idle);
+  pthread_mutex_unlock(&async->lock);
+
+  /* the counter is far from overflowing, which is all that fails it */
+  const uint64_t one = 1;
+  while (write(async->fd, &one, sizeof(one)) == -1 && errno == EINTR)
+    ;
+  return NULL;
+}
+
+async_upload_t *async_start(async_t *async, const async_request_t *request) {
+  async_upload_t *upload = calloc(1, sizeof(async_upload_t));
+  if (!upload)
+    return NULL;
+  upload->async = async;
+  upload->request = *request;
+  upload->filename = strdup(request->filename);
+  if (!upload->filename) {
+    free(upload);
+    return NULL;
+  }
+  upload->request.filename = upload->filename;
+  atomic_init(&upload->cancelled, false);
+  if (request->data) {
+    upload->data = (struct iovec){
+        .iov_base = (void *)request->data,
+        .iov_len = request->size,
+    };
+    upload->iov = &upload->data;
+    upload->iov_count = 1;
+  } else {
+    upload->iov = request->iov;
+    upload->iov_count = request->iov_count;
+  }
+
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, ASYNC_STACK_SIZE);
+
+  /* listed before the thread can take itself off */
+  pthread_mutex_lock(&async->lock);
+  const int error =
+      pthread_create(&upload->thread, &attributes, &async_thread, upload);
+  if (error == 0) {
+    upload->next = async->running;
+    if (async->running)
+      async->running->prev = upload;
+    async->running = upload;
+  }
+  pthread_mutex_unlock(&async->lock);
+  pthread_attr_destroy(&attributes);
+
+  if (error) {
+    free(upload->filename);
+    free(upload);
+    errno = error;
+    return NULL;
+  }
+  return upload;
+}
+
+size_t async_dispatch(async_t *async) {
+  uint64_t count = 0;
+  if (read(async->fd, &count, sizeof(count)) != sizeof(count))
+    return 0;
+
+  pthread_mutex_lock(&async->lock);
+  async_upload_t *done = async->done;
+  async->done = NULL;
+  pthread_mutex_unlock(&async->lock);
+
+  /* oldest first */
+  async_upload_t *ordered = NULL;
+  while (done) {
+    async_upload_t *next = done->next;
+    done->next = ordered;
+    ordered = done;
+    done = next;
+  }
+
+  size_t dispatched = 0;
+  while (ordered) {
+    async_upload_t *next = ordered->next;
+    if (ordered->request.on_done)
+      ordered->request.on_done(ordered, &ordered->result,
+                               ordered->request.userdata);
+    async_upload_free(ordered);
+    ordered = next;
+    ++dispatched;
+  }
+  return dispatched;
+}
@@ -0,0 +1,597 @@
+#include <drop/batch.h>
+#include <drop/prefetch.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the stdio buffer in front of the archive as it is built */
+#define BATCH_READ_SIZE (64 * 1024)
+/* files opened and stated ahead of the one being read, and how much of
+ * each is read with it: all of the small ones the batches are for */
+#define BATCH_PREFETCH_DEPTH 32
+#define BATCH_PREFETCH_SIZE (64 * 1024)
+/* two zero records end an archive */
+#define BATCH_TRAILER_SIZE 1024
+/* what 11 octal digits hold */
+#define BATCH_MAX_SIZE 077777777777ull
+/* prefix, slash, name and the terminator */
+#define BATCH_NAME_SIZE (155 + 1 + 100 + 1)
+
+/* POSIX ustar */
+typedef struct {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} batch_header_t;
+
+static_assert(sizeof(batch_header_t) == 512, "a ustar record");
+
+#define BATCH_RECORD_SIZE sizeof(batch_header_t)
+
+struct batch {
+  char *const *paths;
+  size_t count;
+  size_t index;       /* of the next file */
+  const char *member; /* the file being read */
+  int fd;             /* its descriptor, -1 between files */
+  uint64_t left;      /* of its data */
+  const uint8_t *head; /* its first bytes, read ahead */
+  size_t head_left;
+  size_t padding;     /* zeros after it, to a whole record */
+  batch_header_t header;
+  size_t header_left; /* of header still to read */
+  size_t trailer_left;
+  const char *failed; /* the file that failed the last read, kept over a
+                       * seek to report */
+  int error;
+  prefetch_t *prefetch;
+  FILE *stream;
+};
+
+static unsigned batch_checksum(const batch_header_t *header) {
+  const uint8_t *bytes = (const uint8_t *)header;
+  unsigned sum = 0;
+  for (size_t n = 0; n < sizeof(*header); ++n)
+    sum += bytes[n];
+  /* the field itself counts as spaces */
+  for (size_t n = 0; n < sizeof(header->checksum); ++n)
+    sum += (unsigned)' ' - (uint8_t)header->checksum[n];
+  return sum;
+}
+
+/* splits path into name and prefix, false if it does not fit */
+static bool batch_set_name(batch_header_t *header, const char *path) {
+  const size_t length = strlen(path);
+  if (length <= sizeof(header->name)) {
+    memcpy(header->name, path, length);
+    return true;
+  }
+  for (const char *slash = strchr(path, '/'); slash;
+       slash = strchr(slash + 1, '/')) {
+    const size_t prefix = (size_t)(slash - path);
+    const size_t name = length - prefix - 1;
+    if (prefix > sizeof(header->prefix))
+      break;
+    if (name == 0 || name > sizeof(header->name))
+      continue;
+    memcpy(header->prefix, path, prefix);
+    memcpy(header->name, slash + 1, name);
+    return true;
+  }
+  return false;
+}
+
+static bool batch_format_header(batch_header_t *header, const char *path,
+                                const struct stat *status) {
+  /* as tar does, the archive unpacks relative to where it goes */
+  while (*path == '/')
+    ++path;
+  memset(header, 0, sizeof(*header));
+  if (!*path || !batch_set_name(header, path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  snprintf(header->mode, sizeof(header->mode), "%07o",
+           (unsigned)(status->st_mode & 07777));
+  snprintf(header->uid, sizeof(header->uid), "%07o",
+           (unsigned)(status->st_uid & 07777777));
+  snprintf(header->gid, sizeof(header->gid), "%07o",
+           (unsigned)(status->st_gid & 07777777));
+  snprintf(header->size, sizeof(header->size), "%011llo",
+           (unsigned long long)status->st_size);
+  snprintf(header->mtime, sizeof(header->mtime), "%011llo",
+           (unsigned long long)status->st_mtime & BATCH_MAX_SIZE);
+  header->typeflag = '0';
+  memcpy(header->magic, "ustar", sizeof("ustar"));
+  memcpy(header->version, "00", sizeof(header->version));
+
+  snprintf(header->checksum, sizeof(header->checksum), "%06o",
+           batch_checksum(header));
+  header->checksum[7] = ' ';
+  return true;
+}
+
+static ssize_t batch_fail(batch_t *batch) {
+  batch->error = errno;
+  batch->failed = batch->member;
+  if (batch->fd != -1)
+    close(batch->fd);
+  batch->fd = -1;
+  errno = batch->error;
+  return -1;
+}
+
+/* opens the next file and queues its header */
+static bool batch_next(batch_t *batch) {
+  batch->member = batch->paths[batch->index++];
+  prefetch_file_t file;
+  if (!prefetch_next(batch->prefetch, &file))
+    return false;
+  batch->fd = file.fd;
+
+  const struct stat status = file.status;
+  if (!S_ISREG(status.st_mode)) {
+    errno = S_ISDIR(status.st_mode) ? EISDIR : EINVAL;
+    return false;
+  }
+  if ((uint64_t)status.st_size > BATCH_MAX_SIZE) {
+    errno = EFBIG;
+    return false;
+  }
+  if (!batch_format_header(&batch->header, batch->member, &status))
+    return false;
+
+  batch->header_left = BATCH_RECORD_SIZE;
+  batch->left = (uint64_t)status.st_size;
+  batch->head = file.data;
+  batch->head_left =
+      file.data_size < batch->left ? file.data_size : (size_t)batch->left;
+  batch->padding =
+      (BATCH_RECORD_SIZE - batch->left % BATCH_RECORD_SIZE) %
+      BATCH_RECORD_SIZE;
+  return true;
+}
+
+static ssize_t batch_read(void *cookie, char *buffer, size_t size) {
+  batch_t *batch = cookie;
+  size_t copied = 0;
+  while (copied < size) {
+    size_t length = size - copied;
+    if (batch->header_left) {
+      if (length > batch->header_left)
+        length = batch->header_left;
+      memcpy(buffer + copied,
+             (const char *)&batch->header + BATCH_RECORD_SIZE -
+                 batch->header_left,
+             length);
+      batch->header_left -= length;
+    } else if (batch->head_left) {
+      if (length > batch->head_left)
+        length = batch->head_left;
+      memcpy(buffer + copied, batch->head, length);
+      batch->head += length;
+      batch->head_left -= length;
+      batch->left -= length;
+    } else if (batch->left) {
+      if (length > batch->left)
+        length = (size_t)batch->left;
+      const ssize_t got = read(batch->fd, buffer + copied, length);
+      if (got == -1 && errno == EINTR)
+        continue;
+      if (got == 0) /* it shrank since its header went out */
+        errno = EIO;
+      if (got <= 0)
+        return batch_fail(batch);
+      length = (size_t)got;
+      batch->left -= length;
+    } else if (batch->padding) {
+      if (length > batch->padding)
+        length = batch->padding;
+      memset(buffer + copied, 0, length);
+      batch->padding -= length;
+    } else if (batch->fd != -1) {
+      close(batch->fd);
+      batch->fd = -1;
+      continue;
+    } else if (batch->index < batch->count) {
+      if (!batch_next(batch))
+        return batch_fail(batch);
+      continue;
+    } else if (batch->trailer_left) {
+      if (length > batch->trailer_left)
+        length = batch->trailer_left;
+      memset(buffer + copied, 0, length);
+      batch->trailer_left -= length;
+    } else {
+      break;
+    }
+    copied += length;
+  }
+  return (ssize_t)copied;
+}
+
+/* an upload that timed out is sent again from the start */
+static int batch_seek(void *cookie, off64_t *offset, int whence) {
+  batch_t *batch = cookie;
+  if (*offset != 0 || whence != SEEK_SET) {
+    errno = EINVAL;
+    return -1;
+  }
+  prefetch_t *prefetch = prefetch_new(batch->paths, batch->count,
+                                      BATCH_PREFETCH_DEPTH,
+                                      BATCH_PREFETCH_SIZE);
+  if (!prefetch)
+    return -1;
+  prefetch_free(batch->prefetch);
+  batch->prefetch = prefetch;
+  if (batch->fd != -1)
+    close(batch->fd);
+  batch->fd = -1;
+  batch->index = 0;
+  batch->member = NULL;
+  batch->left = batch->padding = batch->header_left = batch->head_left = 0;
+  batch->trailer_left = BATCH_TRAILER_SIZE;
+  return 0;
+}
+
+static int batch_close(void *cookie) {
+  batch_t *batch = cookie;
+  if (batch->fd != -1)
+    close(batch->fd);
+  batch->fd = -1;
+  return 0;
+}
+
+batch_t *batch_pack(char *const *paths, size_t count) {
+  batch_t *batch = calloc(1, sizeof(batch_t));
+  if (!batch)
+    return NULL;
+  batch->paths = paths;
+  batch->count = count;
+  batch->fd = -1;
+  batch->trailer_left = BATCH_TRAILER_SIZE;
+  batch->prefetch = prefetch_new(paths, count, BATCH_PREFETCH_DEPTH,
+                                 BATCH_PREFETCH_SIZE);
+  if (!batch->prefetch) {
+    free(batch);
+    return NULL;
+  }
+
+  const cookie_io_functions_t functions = {
+      .read = &batch_read,
+      .seek = &batch_seek,
+      .close = &batch_close,
+  };
+  batch->stream = fopencookie(batch, "r", functions);
+  if (!batch->stream) {
+    prefetch_free(batch->prefetch);
+    free(batch);
+    return NULL;
+  }
+  setvbuf(batch->stream, NULL, _IOFBF, BATCH_READ_SIZE);
+  return batch;
+}
+
+FILE *batch_stream(batch_t *batch) { return batch->stream; }
+
+const char *batch_failed(const batch_t *batch, int *error) {
+  if (error)
+    *error = batch->error;
+  return batch->failed;
+}
+
+void batch_free(batch_t *batch) {
+  if (!batch)
+    return;
+  fclose(batch->stream);
+  prefetch_free(batch->prefetch);
+  free(batch);
+}
+
+typedef struct {
+  int directory;
+  batch_header_t header;
+  size_t header_size; /* of header received so far */
+  int fd;             /* the member being written, -1 for none */
+  char name[BATCH_NAME_SIZE]; /* its name, removed if it is cut short */
+  int parent;       /* the directory it is in, directory at the top */
+  const char *leaf; /* its last component, in name */
+  uint64_t left;      /* of the entry's data, written or skipped */
+  size_t padding;     /* after it, skipped */
+  bool ended;         /* the zero record came, the rest is ignored */
+  int error;
+} batch_unpacker_t;
+
+static bool batch_octal(const char *field, size_t size, uint64_t *out) {
+  size_t n = 0;
+  while (n < size && field[n] == ' ')
+    ++n;
+  if (n == size || field[n] < '0' || field[n] > '7')
+    return false;
+  uint64_t value = 0;
+  for (; n < size && field[n] >= '0' && field[n] <= '7'; ++n)
+    value = value * 8 + (uint64_t)(field[n] - '0');
+  if (n < size && field[n] != ' ' && field[n] != '\0')
+    return false;
+  *out = value;
+  return true;
+}
+
+/* relative and not going up, so it stays below the directory */
+static bool batch_name_safe(const char *name) {
+  if (!*name || *name == '/')
+    return false;
+  for (const char *part = name; part;) {
+    const char *slash = strchr(part, '/');
+    const size_t length = slash ? (size_t)(slash - part) : strlen(part);
+    if (length == 2 && part[0] == '.' && part[1] == '.')
+      return false;
+    part = slash ? slash + 1 : NULL;
+  }
+  return true;
+}
+
+static bool batch_is_zero(const batch_header_t *header) {
+  const uint8_t *bytes = (const uint8_t *)header;
+  for (size_t n = 0; n < sizeof(*header); ++n)
+    if (bytes[n])
+      return false;
+  return true;
+}
+
+static void batch_close_parent(batch_unpacker_t *unpacker) {
+  if (unpacker->parent != unpacker->directory)
+    close(unpacker->parent);
+  unpacker->parent = unpacker->directory;
+}
+
+static bool batch_end_member(batch_unpacker_t *unpacker) {
+  const int result = close(unpacker->fd);
+  unpacker->fd = -1;
+  if (result == -1)
+    unlinkat(unpacker->parent, unpacker->leaf, 0);
+  batch_close_parent(unpacker);
+  return result == 0;
+}
+
+/* opens the directory the entry goes in, creating what is missing one
+ * component at a time. Links are not followed, so a member cannot be
+ * written outside the directory through one an earlier member made */
+static bool batch_open_parent(batch_unpacker_t *unpacker) {
+  int parent = unpacker->directory;
+  char *part = unpacker->name;
+  for (char *slash = strchr(part, '/'); slash;
+       part = slash + 1, slash = strchr(part, '/')) {
+    if (slash == part || (slash == part + 1 && *part == '.'))
+      continue;
+    *slash = '\0';
+    int next = -1;
+    if (-1 != mkdirat(parent, part, 0777) || errno == EEXIST)
+      next = openat(parent, part,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    const int error = errno;
+    *slash = '/';
+    if (parent != unpacker->directory)
+      close(parent);
+    if (next == -1) {
+      errno = error;
+      return false;
+    }
+    parent = next;
+  }
+  unpacker->parent = parent;
+  unpacker->leaf = part;
+  return true;
+}
+
+/* starts the entry of the header just received */
+static bool batch_unpack_header(batch_unpacker_t *unpacker) {
+  const batch_header_t *header = &unpacker->header;
+  if (batch_is_zero(header)) {
+    unpacker->ended = true;
+    return true;
+  }
+
+  uint64_t checksum = 0;
+  uint64_t size = 0;
+  if (memcmp(header->magic, "ustar", 5) != 0 ||
+      !batch_octal(header->checksum, sizeof(header->checksum), &checksum) ||
+      checksum != batch_checksum(header) ||
+      !batch_octal(header->size, sizeof(header->size), &size)) {
+    errno = EBADMSG;
+    return false;
+  }
+
+  /* GNU keeps long names in entries of their own */
+  if (header->typeflag == 'L' || header->typeflag == 'K') {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  const int prefix = (int)strnlen(header->prefix, sizeof(header->prefix));
+  const int name = (int)strnlen(header->name, sizeof(header->name));
+  snprintf(unpacker->name, sizeof(unpacker->name), "%.*s%s%.*s", prefix,
+           header->prefix, prefix ? "/" : "", name, header->name);
+  if (!batch_name_safe(unpacker->name)) {
+    errno = EPERM;
+    return false;
+  }
+
+  unpacker->left = size;
+  unpacker->padding =
+      (BATCH_RECORD_SIZE - size % BATCH_RECORD_SIZE) % BATCH_RECORD_SIZE;
+
+  switch (header->typeflag) {
+  case '0':
+  case '\0':
+    if (!batch_open_parent(unpacker))
+      return false;
+    if (!*unpacker->leaf || !strcmp(unpacker->leaf, ".")) {
+      batch_close_parent(unpacker);
+      errno = EBADMSG;
+      return false;
+    }
+    unpacker->fd = openat(unpacker->parent, unpacker->leaf,
+                          O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC |
+                              O_NOFOLLOW,
+                          0666);
+    if (unpacker->fd == -1) {
+      const int error = errno;
+      batch_close_parent(unpacker);
+      errno = error;
+      return false;
+    }
+    return size ? true : batch_end_member(unpacker);
+  case '5': {
+    if (!batch_open_parent(unpacker))
+      return false;
+    /* "dir/" was made by the walk already */
+    const bool made = !*unpacker->leaf || !strcmp(unpacker->leaf, ".") ||
+                      -1 != mkdirat(unpacker->parent, unpacker->leaf, 0777) ||
+                      errno == EEXIST;
+    const int error = errno;
+    batch_close_parent(unpacker);
+    errno = error;
+    return made;
+  }
+  default: /* links, devices and extended headers, their data is skipped */
+    return true;
+  }
+}
+
+static ssize_t batch_unpack_fail(batch_unpacker_t *unpacker) {
+  unpacker->error = errno;
+  if (unpacker->fd != -1) {
+    close(unpacker->fd);
+    unpacker->fd = -1;
+    unlinkat(unpacker->parent, unpacker->leaf, 0);
+    batch_close_parent(unpacker);
+  }
+  errno = unpacker->error;
+  return -1;
+}
+
+static bool batch_write_all(int fd, const char *data, size_t size) {
+  while (size) {
+    const ssize_t written = write(fd, data, size);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1)
+      return false;
+    data += written;
+    size -= (size_t)written;
+  }
+  return true;
+}
+
+static ssize_t batch_unpack_write(void *cookie, const char *data,
+                                  size_t size) {
+  batch_unpacker_t *unpacker = cookie;
+  if (unpacker->error) {
+    errno = unpacker->error;
+    return -1;
+  }
+
+  const size_t total = size;
+  while (size && !unpacker->ended) {
+    size_t length = size;
+    if (unpacker->left) {
+      if (length > unpacker->left)
+        length = (size_t)unpacker->left;
+      if (unpacker->fd != -1 &&
+          !batch_write_all(unpacker->fd, data, length))
+        return batch_unpack_fail(unpacker);
+      unpacker->left -= length;
+      if (!unpacker->left && unpacker->fd != -1 &&
+          !batch_end_member(unpacker))
+        return batch_unpack_fail(unpacker);
+    } else if (unpacker->padding) {
+      if (length > unpacker->padding)
+        length = unpacker->padding;
+      unpacker->padding -= length;
+    } else {
+      if (length > BATCH_RECORD_SIZE - unpacker->header_size)
+        length = BATCH_RECORD_SIZE - unpacker->header_size;
+      memcpy((char *)&unpacker->header + unpacker->header_size, data,
+             length);
+      unpacker->header_size += length;
+      if (unpacker->header_size == BATCH_RECORD_SIZE) {
+        unpacker->header_size = 0;
+        if (!batch_unpack_header(unpacker))
+          return batch_unpack_fail(unpacker);
+      }
+    }
+    data += length;
+    size -= length;
+  }
+  return (ssize_t)total;
+}
+
+static int batch_unpack_close(void *cookie) {
+  batch_unpacker_t *unpacker = cookie;
+  int error = unpacker->error;
+  if (!error && !unpacker->ended)
+    error = EBADMSG;
+  if (unpacker->fd != -1) {
+    close(unpacker->fd);
+    unlinkat(unpacker->parent, unpacker->leaf, 0);
+    batch_close_parent(unpacker);
+  }
+  close(unpacker->directory);
+  free(unpacker);
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+FILE *batch_unpack(const char *directory) {
+  batch_unpacker_t *unpacker = calloc(1, sizeof(batch_unpacker_t));
+  if (!unpacker)
+    return NULL;
+  unpacker->fd = -1;
+  unpacker->directory =
+      open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (unpacker->directory == -1) {
+    free(unpacker);
+    return NULL;
+  }
+  unpacker->parent = unpacker->directory;
+
+  const cookie_io_functions_t functions = {
+      .write = &batch_unpack_write,
+      .close = &batch_unpack_close,
+  };
+  FILE *stream = fopencookie(unpacker, "w", functions);
+  if (!stream) {
+    const int error = errno;
+    close(unpacker->directory);
+    free(unpacker);
+    errno = error;
+  }
+  return stream;
+}
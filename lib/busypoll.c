@@ -0,0 +1,70 @@
+#include <drop/busypoll.h>
+#include <drop/pacer.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#define NS_PER_US 1000ull
+
+void busypoll_init(busypoll_t *busypoll, const busypoll_config_t *config) {
+  assert(busypoll);
+  *busypoll = (busypoll_t){
+      .config = *config,
+      .start_ns = pacer_now_ns(),
+  };
+}
+
+int busypoll_setup(int socket, const busypoll_config_t *config) {
+  const int usec = (int)config->spin_us;
+  if (-1 == setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)))
+    return -1;
+
+#ifdef SO_PREFER_BUSY_POLL
+  /* keeps the device's interrupts masked while we poll, since Linux 5.11 */
+  const int prefer = 1;
+  setsockopt(socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+             sizeof(prefer));
+#endif
+  return 0;
+}
+
+int busypoll_wait(busypoll_t *busypoll, int socket, uint64_t deadline_ns) {
+  if (!busypoll->config.spin_us)
+    return 0;
+
+  /* over budget, block until the blocked time brings the share down */
+  const uint64_t start = pacer_now_ns();
+  if (busypoll->spun_ns * 100 >
+      (start - busypoll->start_ns) * busypoll->config.budget)
+    return 0;
+
+  uint64_t end = start + busypoll->config.spin_us * NS_PER_US;
+  if (deadline_ns < end)
+    end = deadline_ns;
+
+  ++busypoll->waits;
+  int ready = 0;
+  uint64_t now = start;
+  do {
+    /* a non-blocking receive busy polls the device queue with SO_BUSY_POLL,
+     * the peek leaves the packet to tftp */
+    uint8_t byte = 0;
+    if (recv(socket, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT) != -1) {
+      ready = 1;
+      ++busypoll->hits;
+      break;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      ready = -1; /* the peek took the error, it is passed on here */
+      break;
+    }
+    /* a peer on the same CPU, loopback or the softirq, gets to answer */
+    sched_yield();
+    now = pacer_now_ns();
+  } while (now < end);
+
+  busypoll->spun_ns += now - start;
+  return ready;
+}
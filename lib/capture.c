@@ -0,0 +1,213 @@
+#include <drop/capture.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_MAGIC "DROPCAP1"
+#define CAPTURE_MAGIC_SIZE 8
+/* a session's records between writes, the largest datagram fits */
+#define CAPTURE_BUFFER_SIZE (256 * 1024)
+#define NS_PER_SEC 1000000000ull
+
+/* a record as stored, followed by size bytes of datagram */
+typedef struct {
+  uint64_t time_ns;
+  uint8_t address[16];
+  uint32_t scope_id;
+  uint32_t size;
+  uint16_t port; /* network byte order, like sin6_port */
+  uint8_t kind;
+  uint8_t reserved[5];
+} capture_header_t;
+
+static_assert(sizeof(capture_header_t) == 40, "no padding in a record");
+
+struct capture {
+  int fd;
+  size_t used;
+  uint8_t buffer[CAPTURE_BUFFER_SIZE];
+};
+
+static uint64_t capture_now_ns(void) {
+  struct timespec now = {0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+/* writes all of size, false with errno */
+static bool capture_write(int fd, const void *data, size_t size) {
+  const uint8_t *at = data;
+  while (size) {
+    const ssize_t written = write(fd, at, size);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1)
+      return false;
+    at += written;
+    size -= (size_t)written;
+  }
+  return true;
+}
+
+capture_t *capture_open(const char *path) {
+  const int fd =
+      open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return NULL;
+
+  struct stat status;
+  if (-1 == fstat(fd, &status) ||
+      (status.st_size == 0 &&
+       !capture_write(fd, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE))) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return NULL;
+  }
+
+  capture_t *capture = malloc(sizeof(capture_t));
+  if (!capture) {
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  capture->fd = fd;
+  capture->used = 0;
+  return capture;
+}
+
+void capture_close(capture_t *capture) {
+  if (!capture)
+    return;
+  capture_flush(capture);
+  close(capture->fd);
+  free(capture);
+}
+
+void capture_add(capture_t *capture, capture_kind_t kind,
+                 const struct sockaddr_in6 *peer, const void *data,
+                 size_t size) {
+  const size_t record = sizeof(capture_header_t) + size;
+  assert(record <= sizeof(capture->buffer));
+  if (capture->used + record > sizeof(capture->buffer))
+    capture_flush(capture);
+
+  capture_header_t header = {
+      .time_ns = capture_now_ns(),
+      .scope_id = peer->sin6_scope_id,
+      .size = (uint32_t)size,
+      .port = peer->sin6_port,
+      .kind = (uint8_t)kind,
+  };
+  memcpy(header.address, &peer->sin6_addr, sizeof(header.address));
+  memcpy(capture->buffer + capture->used, &header, sizeof(header));
+  memcpy(capture->buffer + capture->used + sizeof(header), data, size);
+  capture->used += record;
+}
+
+int capture_flush(capture_t *capture) {
+  /* dropped either way, a fork must not write them again */
+  const size_t used = capture->used;
+  capture->used = 0;
+  return capture_write(capture->fd, capture->buffer, used) ? 0 : -1;
+}
+
+/* by time, records of one process keep the order they were written in */
+static int capture_compare(const void *a, const void *b) {
+  const capture_record_t *left = a;
+  const capture_record_t *right = b;
+  if (left->time_ns != right->time_ns)
+    return left->time_ns < right->time_ns ? -1 : 1;
+  return left->data < right->data ? -1 : left->data > right->data;
+}
+
+bool capture_read(const char *path, capture_trace_t *trace) {
+  *trace = (capture_trace_t){0};
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  struct stat status;
+  if (-1 == fstat(fd, &status)) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return false;
+  }
+
+  const size_t size = (size_t)status.st_size;
+  trace->contents = malloc(size ? size : 1);
+  size_t have = 0;
+  while (trace->contents && have < size) {
+    const ssize_t got = read(fd, trace->contents + have, size - have);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      break;
+    have += (size_t)got;
+  }
+  const int error = !trace->contents ? ENOMEM : have < size ? errno : 0;
+  close(fd);
+  if (error || size < CAPTURE_MAGIC_SIZE ||
+      memcmp(trace->contents, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+    capture_trace_free(trace);
+    errno = error ? error : EINVAL;
+    return false;
+  }
+
+  /* a record cut short by a session killed while writing ends the capture */
+  size_t capacity = 0;
+  size_t offset = CAPTURE_MAGIC_SIZE;
+  while (offset + sizeof(capture_header_t) <= size) {
+    capture_header_t header;
+    memcpy(&header, trace->contents + offset, sizeof(header));
+    offset += sizeof(header);
+    if (header.size > size - offset)
+      break;
+
+    if (trace->count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      capture_record_t *records =
+          realloc(trace->records, capacity * sizeof(capture_record_t));
+      if (!records) {
+        capture_trace_free(trace);
+        errno = ENOMEM;
+        return false;
+      }
+      trace->records = records;
+    }
+
+    capture_record_t *record = trace->records + trace->count++;
+    *record = (capture_record_t){
+        .time_ns = header.time_ns,
+        .peer =
+            {
+                .sin6_family = AF_INET6,
+                .sin6_port = header.port,
+                .sin6_scope_id = header.scope_id,
+            },
+        .kind = header.kind,
+        .data = trace->contents + offset,
+        .size = header.size,
+    };
+    memcpy(&record->peer.sin6_addr, header.address, sizeof(header.address));
+    offset += header.size;
+  }
+
+  if (trace->count)
+    qsort(trace->records, trace->count, sizeof(capture_record_t),
+          &capture_compare);
+  return true;
+}
+
+void capture_trace_free(capture_trace_t *trace) {
+  free(trace->records);
+  free(trace->contents);
+  *trace = (capture_trace_t){0};
+}
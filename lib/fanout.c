@@ -0,0 +1,331 @@
+#include <drop/fanout.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* the most the reader thread asks for at once */
+#define FANOUT_READ_SIZE (1024 * 1024)
+/* what a pipe we read from is grown to, so the producer does not stall
+ * while a read is copied out */
+#define FANOUT_PIPE_SIZE (1024 * 1024)
+
+struct fanout_reader {
+  fanout_t *fanout;
+  uint64_t position; /* in the input */
+  bool closed;
+};
+
+struct fanout {
+  int fd;
+  /* a regular file, mapped whole, NULL when it is empty */
+  bool mapped;
+  uint8_t *mapping;
+  size_t mapping_size;
+  size_t start; /* where the input stood when we got it */
+  /* anything else, through the ring a thread of its own reads ahead into */
+  pthread_mutex_t lock;
+  pthread_cond_t changed; /* the ring got data or a reader moved on */
+  uint8_t *ring;
+  size_t ring_size;
+  uint64_t head;     /* bytes read from the input so far */
+  uint64_t reserved; /* up to where a read in progress writes, from head */
+  bool eof;
+  int error;
+  pthread_t filler;
+  int stop; /* an eventfd that ends the filler's wait for input */
+  bool stopping;
+  size_t reader_count;
+  struct fanout_reader readers[];
+};
+
+static void *fanout_filler(void *arg);
+
+fanout_t *fanout_new(FILE *input, size_t readers, size_t ring_size) {
+  const int fd = fileno(input);
+  struct stat status;
+  if (fd == -1 || -1 == fstat(fd, &status))
+    return NULL;
+
+  fanout_t *fanout = calloc(1, sizeof(fanout_t) +
+                                   readers * sizeof(struct fanout_reader));
+  if (!fanout)
+    return NULL;
+  fanout->fd = fd;
+  fanout->reader_count = readers;
+  for (size_t n = 0; n < readers; ++n)
+    fanout->readers[n].fanout = fanout;
+
+  const off_t start = lseek(fd, 0, SEEK_CUR);
+  if (S_ISREG(status.st_mode) && start != -1) {
+    fanout->mapped = true;
+    fanout->start = (size_t)start;
+    fanout->mapping_size = (size_t)status.st_size;
+    if (fanout->mapping_size > fanout->start) {
+      void *mapping =
+          mmap(NULL, fanout->mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapping == MAP_FAILED) {
+        free(fanout);
+        return NULL;
+      }
+      madvise(mapping, fanout->mapping_size, MADV_SEQUENTIAL);
+      fanout->mapping = mapping;
+    }
+    return fanout;
+  }
+
+  fanout->ring_size = ring_size ? ring_size : FANOUT_DEFAULT_BUFFER;
+  fanout->ring = malloc(fanout->ring_size);
+  fanout->stop = eventfd(0, EFD_CLOEXEC);
+  if (!fanout->ring || fanout->stop == -1) {
+    const int error = errno;
+    if (fanout->stop != -1)
+      close(fanout->stop);
+    free(fanout->ring);
+    free(fanout);
+    errno = error;
+    return NULL;
+  }
+  /* not a pipe, or one we may not grow, is read as it is */
+  if (S_ISFIFO(status.st_mode))
+    fcntl(fd, F_SETPIPE_SZ, FANOUT_PIPE_SIZE);
+
+  pthread_mutex_init(&fanout->lock, NULL);
+  pthread_cond_init(&fanout->changed, NULL);
+  const int error =
+      pthread_create(&fanout->filler, NULL, &fanout_filler, fanout);
+  if (error) {
+    pthread_cond_destroy(&fanout->changed);
+    pthread_mutex_destroy(&fanout->lock);
+    close(fanout->stop);
+    free(fanout->ring);
+    free(fanout);
+    errno = error;
+    return NULL;
+  }
+  return fanout;
+}
+
+void fanout_free(fanout_t *fanout) {
+  if (!fanout)
+    return;
+  if (fanout->mapped) {
+    if (fanout->mapping)
+      munmap(fanout->mapping, fanout->mapping_size);
+  } else {
+    /* the input may not end for a while, the filler stops waiting for it */
+    pthread_mutex_lock(&fanout->lock);
+    fanout->stopping = true;
+    pthread_cond_broadcast(&fanout->changed);
+    pthread_mutex_unlock(&fanout->lock);
+    const uint64_t one = 1;
+    while (write(fanout->stop, &one, sizeof(one)) == -1 && errno == EINTR)
+      ;
+    pthread_join(fanout->filler, NULL);
+    close(fanout->stop);
+    pthread_cond_destroy(&fanout->changed);
+    pthread_mutex_destroy(&fanout->lock);
+    free(fanout->ring);
+  }
+  free(fanout);
+}
+
+static ssize_t fanout_mapped_read(void *cookie, char *buffer, size_t size) {
+  struct fanout_reader *reader = cookie;
+  const fanout_t *fanout = reader->fanout;
+  const uint64_t offset = fanout->start + reader->position;
+  if (!fanout->mapping || offset >= fanout->mapping_size)
+    return 0;
+
+  if (size > fanout->mapping_size - offset)
+    size = fanout->mapping_size - offset;
+  memcpy(buffer, fanout->mapping + offset, size);
+  reader->position += size;
+  return (ssize_t)size;
+}
+
+static int fanout_mapped_seek(void *cookie, off64_t *offset, int whence) {
+  struct fanout_reader *reader = cookie;
+  const fanout_t *fanout = reader->fanout;
+  const int64_t size = (int64_t)(fanout->mapping_size - fanout->start);
+  int64_t target = *offset;
+  if (whence == SEEK_CUR)
+    target += (int64_t)reader->position;
+  else if (whence == SEEK_END)
+    target += size;
+  if (target < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  reader->position = (uint64_t)target;
+  *offset = target;
+  return 0;
+}
+
+/* the position the ring has to keep data from, locked */
+static uint64_t fanout_slowest(const fanout_t *fanout) {
+  uint64_t slowest = fanout->head;
+  for (size_t n = 0; n < fanout->reader_count; ++n) {
+    const struct fanout_reader *reader = fanout->readers + n;
+    if (!reader->closed && reader->position < slowest)
+      slowest = reader->position;
+  }
+  return slowest;
+}
+
+/* waits for input or fanout_free, ECANCELED for the latter */
+static ssize_t fanout_read_input(fanout_t *fanout, uint8_t *buffer,
+                                 size_t size) {
+  struct pollfd fds[2] = {
+      {.fd = fanout->fd, .events = POLLIN},
+      {.fd = fanout->stop, .events = POLLIN},
+  };
+  while (poll(fds, 2, -1) == -1)
+    if (errno != EINTR)
+      return -1;
+  if (fds[1].revents) {
+    errno = ECANCELED;
+    return -1;
+  }
+
+  ssize_t got;
+  while ((got = read(fanout->fd, buffer, size)) == -1 && errno == EINTR)
+    ;
+  return got;
+}
+
+/* reads the input ahead into the room the slowest reader left, so the
+ * producer and the uploads overlap. The lock is dropped while reading, the
+ * space written to is beyond what any reader may look at */
+static void *fanout_filler(void *arg) {
+  fanout_t *fanout = arg;
+  pthread_mutex_lock(&fanout->lock);
+  while (!fanout->eof && !fanout->error && !fanout->stopping) {
+    const uint64_t used = fanout->head - fanout_slowest(fanout);
+    if (used >= fanout->ring_size) {
+      pthread_cond_wait(&fanout->changed, &fanout->lock);
+      continue;
+    }
+    const size_t offset = (size_t)(fanout->head % fanout->ring_size);
+    size_t space = fanout->ring_size - (size_t)used;
+    if (space > fanout->ring_size - offset)
+      space = fanout->ring_size - offset;
+    if (space > FANOUT_READ_SIZE)
+      space = FANOUT_READ_SIZE;
+
+    fanout->reserved = fanout->head + space;
+    pthread_mutex_unlock(&fanout->lock);
+    const ssize_t got =
+        fanout_read_input(fanout, fanout->ring + offset, space);
+    const int error = errno;
+    pthread_mutex_lock(&fanout->lock);
+
+    if (got > 0)
+      fanout->head += (uint64_t)got;
+    else if (got == 0)
+      fanout->eof = true;
+    else if (error != ECANCELED)
+      fanout->error = error;
+    fanout->reserved = fanout->head;
+    pthread_cond_broadcast(&fanout->changed);
+  }
+  pthread_mutex_unlock(&fanout->lock);
+  return NULL;
+}
+
+static ssize_t fanout_ring_read(void *cookie, char *buffer, size_t size) {
+  struct fanout_reader *reader = cookie;
+  fanout_t *fanout = reader->fanout;
+
+  pthread_mutex_lock(&fanout->lock);
+  while (reader->position == fanout->head && !fanout->eof &&
+         !fanout->error)
+    pthread_cond_wait(&fanout->changed, &fanout->lock);
+
+  if (reader->position == fanout->head && fanout->error) {
+    errno = fanout->error;
+    pthread_mutex_unlock(&fanout->lock);
+    return -1;
+  }
+
+  const uint64_t available = fanout->head - reader->position;
+  if (size > available)
+    size = (size_t)available;
+  const size_t offset = (size_t)(reader->position % fanout->ring_size);
+  const size_t first =
+      size < fanout->ring_size - offset ? size : fanout->ring_size - offset;
+  memcpy(buffer, fanout->ring + offset, first);
+  memcpy(buffer + first, fanout->ring, size - first);
+  reader->position += size;
+
+  /* we may have been the slowest */
+  pthread_cond_broadcast(&fanout->changed);
+  pthread_mutex_unlock(&fanout->lock);
+  return (ssize_t)size;
+}
+
+static int fanout_ring_seek(void *cookie, off64_t *offset, int whence) {
+  struct fanout_reader *reader = cookie;
+  fanout_t *fanout = reader->fanout;
+
+  pthread_mutex_lock(&fanout->lock);
+
+  /* back as far as the ring still holds, not into what a read in progress
+   * overwrites and not beyond what was read */
+  int64_t target = *offset;
+  if (whence == SEEK_CUR)
+    target += (int64_t)reader->position;
+  const uint64_t oldest = fanout->reserved > fanout->ring_size
+                              ? fanout->reserved - fanout->ring_size
+                              : 0;
+  const int result =
+      whence == SEEK_END || target < (int64_t)oldest ||
+              target > (int64_t)fanout->head
+          ? -1
+          : 0;
+  if (result == 0) {
+    reader->position = (uint64_t)target;
+    *offset = target;
+  }
+  pthread_mutex_unlock(&fanout->lock);
+  if (result == -1)
+    errno = ESPIPE;
+  return result;
+}
+
+static int fanout_close(void *cookie) {
+  struct fanout_reader *reader = cookie;
+  fanout_t *fanout = reader->fanout;
+  if (fanout->mapped) {
+    reader->closed = true;
+    return 0;
+  }
+
+  pthread_mutex_lock(&fanout->lock);
+  reader->closed = true;
+  pthread_cond_broadcast(&fanout->changed);
+  pthread_mutex_unlock(&fanout->lock);
+  return 0;
+}
+
+FILE *fanout_open(fanout_t *fanout, size_t reader) {
+  const cookie_io_functions_t functions = {
+      .read = fanout->mapped ? &fanout_mapped_read : &fanout_ring_read,
+      .seek = fanout->mapped ? &fanout_mapped_seek : &fanout_ring_seek,
+      .close = &fanout_close,
+  };
+  FILE *stream = fopencookie(fanout->readers + reader, "r", functions);
+  /* blocks are copied out of the mapping or ring once, not through stdio */
+  if (stream)
+    setvbuf(stream, NULL, _IONBF, 0);
+  return stream;
+}
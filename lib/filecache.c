@@ -0,0 +1,489 @@
+#include <drop/filecache.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* what makes a snapshot stale: a write, a truncate, a chmod or touch, and
+ * the file being renamed away or deleted, as replacing it with a rename
+ * does */
+#define FILECACHE_EVENTS                                                       \
+  (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+/* files too large to cache that are not looked at again for a while */
+#define FILECACHE_REJECTED 64
+#define FILECACHE_REJECTED_NS 1000000000ull
+/* how often a waiting session checks its loader is still there */
+#define FILECACHE_WAIT_NS 100000000ull
+#define NS_PER_SEC 1000000000ull
+
+typedef enum {
+  FILECACHE_LOADING,
+  FILECACHE_READY,
+  FILECACHE_FAILED,
+} filecache_state_t;
+
+/* the first page of an entry's mapping, the file follows it */
+struct filecache_shared {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  atomic_int state; /* filecache_state_t, read without the lock too */
+  int error;        /* when FAILED */
+  pid_t loader;     /* the session loading it, set before others fork */
+  /* the file the accept loop found, the loader reads no other */
+  dev_t device;
+  ino_t inode;
+};
+
+typedef struct filecache_entry {
+  char *path;
+  int watch; /* shared with the entries of other paths to the same file */
+  filecache_shared_t *shared;
+  size_t mapped; /* the first page and the file */
+  size_t size;
+  /* most recently used first */
+  struct filecache_entry *prev;
+  struct filecache_entry *next;
+} filecache_entry_t;
+
+/* a file over the budget as it was when it was turned away */
+typedef struct {
+  char *path;
+  dev_t device;
+  ino_t inode;
+  off_t size;
+  struct timespec modified;
+  uint64_t checked_ns;
+} filecache_rejected_t;
+
+struct filecache {
+  int fd; /* inotify */
+  uint64_t budget;
+  uint64_t used;
+  size_t count;
+  filecache_entry_t *head;
+  filecache_entry_t *tail;
+  filecache_rejected_t rejected[FILECACHE_REJECTED];
+  size_t rejected_next; /* replaced next, the oldest */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t changed; /* entries dropped for a change */
+  uint64_t evicted;
+  uint64_t failed;  /* loads that did not complete */
+  uint64_t too_big; /* requests for a file over the budget */
+};
+
+static uint64_t filecache_now_ns(void) {
+  struct timespec now = {0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+/* the shared page, whole pages so the file after it can be made read-only */
+static size_t filecache_header_size(void) {
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (sizeof(filecache_shared_t) + page - 1) / page * page;
+}
+
+static void *filecache_data(const filecache_shared_t *shared) {
+  return (uint8_t *)shared + filecache_header_size();
+}
+
+filecache_t *filecache_new(uint64_t budget) {
+  filecache_t *cache = calloc(1, sizeof(filecache_t));
+  if (!cache)
+    return NULL;
+  cache->budget = budget;
+  cache->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cache->fd == -1) {
+    const int error = errno;
+    free(cache);
+    errno = error;
+    return NULL;
+  }
+  return cache;
+}
+
+static void filecache_unlink(filecache_t *cache, filecache_entry_t *entry) {
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    cache->head = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    cache->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+static void filecache_push(filecache_t *cache, filecache_entry_t *entry) {
+  entry->next = cache->head;
+  if (cache->head)
+    cache->head->prev = entry;
+  else
+    cache->tail = entry;
+  cache->head = entry;
+}
+
+static bool filecache_watched(const filecache_t *cache, int watch) {
+  for (const filecache_entry_t *entry = cache->head; entry;
+       entry = entry->next)
+    if (entry->watch == watch)
+      return true;
+  return false;
+}
+
+/* removes the entry, and its watch unless another entry has it too */
+static void filecache_drop(filecache_t *cache, filecache_entry_t *entry,
+                           bool unwatch) {
+  filecache_unlink(cache, entry);
+  if (unwatch && !filecache_watched(cache, entry->watch))
+    inotify_rm_watch(cache->fd, entry->watch);
+  munmap(entry->shared, entry->mapped);
+  cache->used -= entry->size;
+  --cache->count;
+  free(entry->path);
+  free(entry);
+}
+
+void filecache_free(filecache_t *cache) {
+  if (!cache)
+    return;
+  while (cache->head)
+    filecache_drop(cache, cache->head, false);
+  for (size_t n = 0; n < FILECACHE_REJECTED; ++n)
+    free(cache->rejected[n].path);
+  close(cache->fd);
+  free(cache);
+}
+
+static bool filecache_same_time(const struct timespec *a,
+                                const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* whether path was turned away for its size and is too large still. Within
+ * FILECACHE_REJECTED_NS of the last look nothing is asked of the kernel */
+static bool filecache_too_big(filecache_t *cache, const char *path,
+                              const struct stat *status, uint64_t now_ns) {
+  for (size_t n = 0; n < FILECACHE_REJECTED; ++n) {
+    filecache_rejected_t *rejected = cache->rejected + n;
+    if (!rejected->path || strcmp(rejected->path, path) != 0)
+      continue;
+    if (now_ns - rejected->checked_ns < FILECACHE_REJECTED_NS)
+      return true;
+    if (!status || status->st_dev != rejected->device ||
+        status->st_ino != rejected->inode ||
+        status->st_size != rejected->size ||
+        !filecache_same_time(&status->st_mtim, &rejected->modified))
+      return false;
+    rejected->checked_ns = now_ns;
+    return true;
+  }
+  return false;
+}
+
+static void filecache_reject(filecache_t *cache, const char *path,
+                             const struct stat *status, uint64_t now_ns) {
+  char *copy = strdup(path);
+  if (!copy)
+    return;
+  /* a path that changed is replaced where it is */
+  size_t slot = cache->rejected_next;
+  for (size_t n = 0; n < FILECACHE_REJECTED; ++n) {
+    if (cache->rejected[n].path &&
+        strcmp(cache->rejected[n].path, path) == 0)
+      slot = n;
+  }
+  if (slot == cache->rejected_next)
+    cache->rejected_next = (cache->rejected_next + 1) % FILECACHE_REJECTED;
+
+  filecache_rejected_t *rejected = cache->rejected + slot;
+  free(rejected->path);
+  *rejected = (filecache_rejected_t){
+      .path = copy,
+      .device = status->st_dev,
+      .inode = status->st_ino,
+      .size = status->st_size,
+      .modified = status->st_mtim,
+      .checked_ns = now_ns,
+  };
+}
+
+/* maps an entry for path, its loading is left to the first session. Only
+ * metadata is looked at here, in the accept loop */
+static filecache_entry_t *filecache_map(filecache_t *cache,
+                                        const char *path) {
+  const uint64_t now_ns = filecache_now_ns();
+  if (filecache_too_big(cache, path, NULL, now_ns)) {
+    ++cache->too_big;
+    errno = EFBIG;
+    return NULL;
+  }
+
+  struct stat status;
+  if (-1 == stat(path, &status))
+    return NULL;
+  if (!S_ISREG(status.st_mode) || status.st_size == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (filecache_too_big(cache, path, &status, now_ns) ||
+      (uint64_t)status.st_size > cache->budget) {
+    filecache_reject(cache, path, &status, now_ns);
+    ++cache->too_big;
+    errno = EFBIG;
+    return NULL;
+  }
+
+  filecache_entry_t *entry = calloc(1, sizeof(filecache_entry_t));
+  if (!entry)
+    return NULL;
+  entry->path = strdup(path);
+  if (!entry->path)
+    goto err;
+  /* watched before it is read, a change while loading drops it */
+  entry->watch = inotify_add_watch(cache->fd, path, FILECACHE_EVENTS);
+  if (entry->watch == -1)
+    goto err;
+
+  /* shared, so the sessions forked with it have the same pages */
+  entry->size = (size_t)status.st_size;
+  entry->mapped = filecache_header_size() + entry->size;
+  void *mapping = mmap(NULL, entry->mapped, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    goto err;
+  entry->shared = mapping;
+
+  filecache_shared_t *shared = entry->shared;
+  pthread_mutexattr_t lock_attr;
+  pthread_mutexattr_init(&lock_attr);
+  pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&shared->lock, &lock_attr);
+  pthread_mutexattr_destroy(&lock_attr);
+  pthread_condattr_t done_attr;
+  pthread_condattr_init(&done_attr);
+  pthread_condattr_setpshared(&done_attr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_setclock(&done_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&shared->done, &done_attr);
+  pthread_condattr_destroy(&done_attr);
+  atomic_init(&shared->state, FILECACHE_LOADING);
+  shared->device = status.st_dev;
+  shared->inode = status.st_ino;
+  return entry;
+
+err: {
+  const int error = errno;
+  if (entry->watch > 0 && !filecache_watched(cache, entry->watch))
+    inotify_rm_watch(cache->fd, entry->watch);
+  free(entry->path);
+  free(entry);
+  errno = error;
+  return NULL;
+}
+}
+
+static void filecache_finish(filecache_shared_t *shared,
+                             filecache_state_t state, int error) {
+  pthread_mutex_lock(&shared->lock);
+  shared->error = error;
+  atomic_store(&shared->state, state);
+  pthread_cond_broadcast(&shared->done);
+  pthread_mutex_unlock(&shared->lock);
+}
+
+/* a loader that is gone without finishing, the accept loop reaped it */
+static bool filecache_abandoned(filecache_shared_t *shared) {
+  return atomic_load(&shared->state) == FILECACHE_LOADING &&
+         shared->loader > 0 && kill(shared->loader, 0) == -1 &&
+         errno == ESRCH;
+}
+
+bool filecache_get(filecache_t *cache, const char *path,
+                   filecache_file_t *out) {
+  assert(cache);
+  assert(path);
+
+  filecache_entry_t *entry = cache->head;
+  while (entry && strcmp(entry->path, path) != 0)
+    entry = entry->next;
+
+  /* a load that failed is tried again by the next session */
+  if (entry && (atomic_load(&entry->shared->state) == FILECACHE_FAILED ||
+                filecache_abandoned(entry->shared))) {
+    filecache_drop(cache, entry, true);
+    ++cache->failed;
+    entry = NULL;
+  }
+
+  bool fill = false;
+  if (entry) {
+    ++cache->hits;
+    filecache_unlink(cache, entry);
+  } else {
+    ++cache->misses;
+    entry = filecache_map(cache, path);
+    if (!entry)
+      return false;
+    cache->used += entry->size;
+    ++cache->count;
+    fill = true;
+  }
+  /* listed before evicting, its watch may be an evicted entry's too */
+  filecache_push(cache, entry);
+  while (cache->used > cache->budget && cache->tail != entry) {
+    filecache_drop(cache, cache->tail, true);
+    ++cache->evicted;
+  }
+
+  *out = (filecache_file_t){
+      .data = filecache_data(entry->shared),
+      .size = entry->size,
+      .shared = entry->shared,
+      .fill = fill,
+  };
+  return true;
+}
+
+void filecache_loading(const filecache_file_t *file, pid_t pid) {
+  if (!file->shared || !file->fill)
+    return;
+  if (pid == -1)
+    filecache_finish(file->shared, FILECACHE_FAILED, ECHILD);
+  else
+    file->shared->loader = pid;
+}
+
+static bool filecache_read(int fd, uint8_t *data, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t got = pread(fd, data + done, size - done, (off_t)done);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got == 0) /* it shrank while we read it */
+      errno = EIO;
+    if (got <= 0)
+      return false;
+    done += (size_t)got;
+  }
+  return true;
+}
+
+static bool filecache_fill(const filecache_file_t *file, const char *path) {
+  filecache_shared_t *shared = file->shared;
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat status;
+  bool ok = fd != -1 && fstat(fd, &status) == 0;
+  /* replaced since the accept loop looked, its watch has dropped the
+   * entry already */
+  if (ok && (status.st_dev != shared->device ||
+             status.st_ino != shared->inode ||
+             (uint64_t)status.st_size != file->size)) {
+    errno = ESTALE;
+    ok = false;
+  }
+  ok = ok && filecache_read(fd, filecache_data(shared), file->size);
+  const int error = ok ? 0 : errno;
+  if (fd != -1)
+    close(fd);
+  filecache_finish(shared, ok ? FILECACHE_READY : FILECACHE_FAILED, error);
+  errno = error;
+  return ok;
+}
+
+static bool filecache_wait(const filecache_file_t *file) {
+  filecache_shared_t *shared = file->shared;
+  pthread_mutex_lock(&shared->lock);
+  while (atomic_load(&shared->state) == FILECACHE_LOADING &&
+         !filecache_abandoned(shared)) {
+    struct timespec deadline = {0};
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (long)FILECACHE_WAIT_NS;
+    if (deadline.tv_nsec >= (long)NS_PER_SEC) {
+      ++deadline.tv_sec;
+      deadline.tv_nsec -= (long)NS_PER_SEC;
+    }
+    pthread_cond_timedwait(&shared->done, &shared->lock, &deadline);
+  }
+  const int state = atomic_load(&shared->state);
+  const int error = state == FILECACHE_FAILED ? shared->error : ECHILD;
+  pthread_mutex_unlock(&shared->lock);
+
+  if (state != FILECACHE_READY) {
+    errno = error;
+    return false;
+  }
+  return true;
+}
+
+bool filecache_ready(const filecache_file_t *file, const char *path) {
+  assert(file->shared);
+  if (!(file->fill ? filecache_fill(file, path) : filecache_wait(file)))
+    return false;
+  /* no session writes to what the others send from */
+  mprotect(filecache_data(file->shared), file->size, PROT_READ);
+  return true;
+}
+
+int filecache_fd(const filecache_t *cache) { return cache->fd; }
+
+/* drops every entry of the file behind watch */
+static void filecache_changed(filecache_t *cache, int watch, bool removed) {
+  filecache_entry_t *entry = cache->head;
+  while (entry) {
+    filecache_entry_t *next = entry->next;
+    if (entry->watch == watch) {
+      /* the kernel removed a watch whose file is gone */
+      filecache_drop(cache, entry, !removed);
+      ++cache->changed;
+    }
+    entry = next;
+  }
+}
+
+void filecache_dispatch(filecache_t *cache) {
+  assert(cache);
+
+  /* as inotify(7) recommends, aligned for struct inotify_event */
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    const ssize_t got = read(cache->fd, buffer, sizeof(buffer));
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return;
+
+    for (const char *at = buffer; at < buffer + got;) {
+      const struct inotify_event *event = (const struct inotify_event *)at;
+      filecache_changed(cache, event->wd, event->mask & IN_IGNORED);
+      at += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+void filecache_dump(const filecache_t *cache, FILE *out) {
+  assert(out);
+  if (!cache)
+    return;
+
+  fprintf(out,
+          "filecache: files=%zu bytes=%" PRIu64 "/%" PRIu64 " hits=%" PRIu64
+          " misses=%" PRIu64 " changed=%" PRIu64 " evicted=%" PRIu64
+          " failed=%" PRIu64 " too_big=%" PRIu64 "\n",
+          cache->count, cache->used, cache->budget, cache->hits,
+          cache->misses, cache->changed, cache->evicted, cache->failed,
+          cache->too_big);
+  fflush(out);
+}
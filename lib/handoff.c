@@ -0,0 +1,167 @@
+#include <drop/handoff.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* the first descriptor systemd passes */
+#define SD_LISTEN_FDS_START 3
+
+static int handoff_address(const char *path, struct sockaddr_un *out) {
+  *out = (struct sockaddr_un){.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(out->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(out->sun_path, path);
+  return 0;
+}
+
+size_t handoff_activated(int *fds, size_t max) {
+  const char *pid = getenv("LISTEN_PID");
+  const char *listen_fds = getenv("LISTEN_FDS");
+  long passed = 0;
+  if (pid && listen_fds && strtol(pid, NULL, 10) == getpid())
+    passed = strtol(listen_fds, NULL, 10);
+
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  size_t count = 0;
+  for (long n = 0; n < passed; ++n) {
+    const int fd = SD_LISTEN_FDS_START + (int)n;
+    if (count < max)
+      fds[count++] = fd;
+    else
+      close(fd);
+  }
+  return count;
+}
+
+int handoff_listen(const char *path) {
+  struct sockaddr_un address;
+  if (-1 == handoff_address(path, &address))
+    return -1;
+
+  const int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s == -1)
+    return -1;
+
+  /* a predecessor leaves its path behind, and so does a crash */
+  unlink(path);
+  if (-1 == bind(s, (struct sockaddr *)&address, sizeof(address)) ||
+      -1 == listen(s, 1)) {
+    const int error = errno;
+    close(s);
+    errno = error;
+    return -1;
+  }
+  return s;
+}
+
+int handoff_send(int control, const int *fds, size_t count) {
+  if (count > HANDOFF_MAX_FDS) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  const int peer = accept4(control, NULL, NULL, SOCK_CLOEXEC);
+  if (peer == -1)
+    return -1;
+
+  char byte = 0;
+  struct iovec iov = {
+      .iov_base = &byte,
+      .iov_len = sizeof(byte),
+  };
+
+  union {
+    struct cmsghdr header;
+    uint8_t storage[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+  } control_message = {0};
+
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control_message.storage;
+  msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+  const ssize_t sent = sendmsg(peer, &msg, MSG_NOSIGNAL);
+  const int error = errno;
+  close(peer);
+  errno = error;
+  return sent == 1 ? 0 : -1;
+}
+
+int handoff_receive(const char *path, int *fds, size_t max) {
+  struct sockaddr_un address;
+  if (-1 == handoff_address(path, &address))
+    return -1;
+
+  const int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s == -1)
+    return -1;
+  if (-1 == connect(s, (struct sockaddr *)&address, sizeof(address))) {
+    const int error = errno;
+    close(s);
+    errno = error;
+    return -1;
+  }
+
+  char byte = 0;
+  struct iovec iov = {
+      .iov_base = &byte,
+      .iov_len = sizeof(byte),
+  };
+
+  union {
+    struct cmsghdr header;
+    uint8_t storage[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+  } control_message = {0};
+
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control_message.storage;
+  msg.msg_controllen = sizeof(control_message.storage);
+
+  ssize_t received;
+  while ((received = recvmsg(s, &msg, MSG_CMSG_CLOEXEC)) == -1 &&
+         errno == EINTR)
+    ;
+  const int error = errno;
+  close(s);
+
+  if (received != 1) {
+    errno = received == -1 ? error : EPROTO;
+    return -1;
+  }
+
+  const struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len <= CMSG_LEN(0)) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  int passed[HANDOFF_MAX_FDS];
+  memcpy(passed, CMSG_DATA(cmsg), count * sizeof(int));
+  for (size_t n = max; n < count; ++n)
+    close(passed[n]);
+
+  const size_t kept = count < max ? count : max;
+  memcpy(fds, passed, kept * sizeof(int));
+  return (int)kept;
+}
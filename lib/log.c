@@ -0,0 +1,454 @@
+#include <drop/log.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* messages a thread may have queued before it drops them */
+#define LOG_RING_SIZE 256
+#define LOG_MAX_FIELDS 8
+/* for the string values of a message */
+#define LOG_STRINGS_SIZE 256
+/* how long the drain sleeps once the rings are empty */
+#define LOG_DRAIN_INTERVAL_NS (10 * 1000 * 1000)
+/* lines are gathered before they are written */
+#define LOG_OUTPUT_SIZE (64 * 1024)
+#define LOG_LINE_SIZE 2048
+
+typedef struct {
+  uint64_t time_ns;
+  const char *event;
+  log_level_t level;
+  uint8_t count;
+  struct {
+    const char *key;
+    log_field_type_t type;
+    uint64_t value; /* for a string its offset in strings */
+  } fields[LOG_MAX_FIELDS];
+  char strings[LOG_STRINGS_SIZE];
+} log_record_t;
+
+/* written by its thread, read by the drain */
+typedef struct log_ring {
+  atomic_size_t head; /* the next record written */
+  atomic_size_t tail; /* the next record read */
+  atomic_uint_fast64_t dropped;
+  atomic_bool owned;     /* by a running thread */
+  struct log_ring *next; /* set before the ring is listed, never changed */
+  log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
+typedef struct {
+  char data[LOG_LINE_SIZE];
+  size_t size;
+} log_line_t;
+
+static struct {
+  int fd;
+  log_format_t format;
+  bool started;
+  pid_t pid;
+  pthread_mutex_t lock; /* the list of rings, stopping */
+  pthread_cond_t wake;  /* the drain, for a stop */
+  _Atomic(log_ring_t *) rings;
+  pthread_t drain;
+  atomic_bool running; /* the drain, in this process */
+  bool stopping;
+  pthread_key_t key; /* gives a thread's ring back when it exits */
+  /* the drain's, or the process's once it stopped */
+  struct {
+    char data[LOG_OUTPUT_SIZE];
+    size_t size;
+  } output;
+  log_line_t line;
+} log_state = {
+    .fd = STDERR_FILENO,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+log_level_t log_threshold = LOG_LEVEL_ERROR;
+
+static _Thread_local log_ring_t *log_ring;
+
+static const char *const log_level_names[] = {
+    [LOG_LEVEL_ERROR] = "error",
+    [LOG_LEVEL_INFO] = "info",
+    [LOG_LEVEL_DEBUG] = "debug",
+};
+
+static uint64_t log_now_ns(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/* copies the message, its strings as far as they fit */
+static void log_fill(log_record_t *record, log_level_t level,
+                     const char *event, const log_field_t *fields,
+                     size_t count) {
+  record->time_ns = log_now_ns(CLOCK_REALTIME);
+  record->event = event;
+  record->level = level;
+  record->count = (uint8_t)(count < LOG_MAX_FIELDS ? count : LOG_MAX_FIELDS);
+  /* the last byte is the empty string for those that do not fit */
+  record->strings[LOG_STRINGS_SIZE - 1] = '\0';
+  size_t used = 0;
+  for (size_t n = 0; n < record->count; ++n) {
+    record->fields[n].key = fields[n].key;
+    record->fields[n].type = fields[n].type;
+    if (fields[n].type != LOG_FIELD_STR) {
+      record->fields[n].value = fields[n].value.u64;
+      continue;
+    }
+    const char *string = fields[n].value.str ? fields[n].value.str : "";
+    const size_t room = LOG_STRINGS_SIZE - 1 - used;
+    if (!room) {
+      record->fields[n].value = LOG_STRINGS_SIZE - 1;
+      continue;
+    }
+    const size_t length = strnlen(string, room - 1);
+    memcpy(record->strings + used, string, length);
+    record->strings[used + length] = '\0';
+    record->fields[n].value = used;
+    used += length + 1;
+  }
+}
+
+static void log_put(log_line_t *line, const char *string, size_t length) {
+  /* room for the newline */
+  const size_t room = sizeof(line->data) - 1 - line->size;
+  if (length > room)
+    length = room;
+  memcpy(line->data + line->size, string, length);
+  line->size += length;
+}
+
+static void log_put_char(log_line_t *line, char c) { log_put(line, &c, 1); }
+
+static void log_put_string(log_line_t *line, const char *string, bool json) {
+  bool quote = json || !*string;
+  for (const char *c = string; *c && !quote; ++c)
+    quote = *c == ' ' || *c == '"' || *c == '=' || *c == '\\' ||
+            (unsigned char)*c < 0x20 || *c == 0x7f;
+  if (!quote) {
+    log_put(line, string, strlen(string));
+    return;
+  }
+
+  log_put_char(line, '"');
+  for (const unsigned char *c = (const unsigned char *)string; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      log_put_char(line, '\\');
+      log_put_char(line, (char)*c);
+    } else if (*c < 0x20 || *c == 0x7f) {
+      char escape[8];
+      const int length =
+          snprintf(escape, sizeof(escape), json ? "\\u%04x" : "\\x%02x", *c);
+      log_put(line, escape, (size_t)length);
+    } else {
+      log_put_char(line, (char)*c);
+    }
+  }
+  log_put_char(line, '"');
+}
+
+static void log_put_key(log_line_t *line, const char *key, bool json) {
+  const bool first = line->size == (json ? 1 : 0);
+  if (!first)
+    log_put_char(line, json ? ',' : ' ');
+  if (json)
+    log_put_char(line, '"');
+  log_put(line, key, strlen(key));
+  log_put(line, json ? "\":" : "=", json ? 2 : 1);
+}
+
+static void log_format(log_line_t *line, const log_record_t *record,
+                       pid_t pid) {
+  const bool json = log_state.format == LOG_FORMAT_JSON;
+  line->size = 0;
+  if (json)
+    log_put_char(line, '{');
+
+  const time_t seconds = (time_t)(record->time_ns / 1000000000u);
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  char stamp[40];
+  const size_t length =
+      strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(stamp + length, sizeof(stamp) - length, ".%06uZ",
+           (unsigned)(record->time_ns % 1000000000u / 1000u));
+
+  char number[24];
+  log_put_key(line, "time", json);
+  log_put_string(line, stamp, json);
+  log_put_key(line, "level", json);
+  log_put_string(line, log_level_names[record->level], json);
+  log_put_key(line, "pid", json);
+  log_put(line, number, (size_t)snprintf(number, sizeof(number), "%d", pid));
+  log_put_key(line, "event", json);
+  log_put_string(line, record->event, json);
+
+  for (size_t n = 0; n < record->count; ++n) {
+    log_put_key(line, record->fields[n].key, json);
+    const uint64_t value = record->fields[n].value;
+    switch (record->fields[n].type) {
+    case LOG_FIELD_U64:
+      log_put(line, number,
+              (size_t)snprintf(number, sizeof(number), "%" PRIu64, value));
+      break;
+    case LOG_FIELD_I64:
+      log_put(line, number,
+              (size_t)snprintf(number, sizeof(number), "%" PRId64,
+                               (int64_t)value));
+      break;
+    case LOG_FIELD_STR:
+      log_put_string(line, record->strings + value, json);
+      break;
+    }
+  }
+
+  if (json)
+    log_put_char(line, '}');
+  line->data[line->size++] = '\n';
+}
+
+static void log_write(const char *data, size_t size) {
+  while (size) {
+    const ssize_t written = write(log_state.fd, data, size);
+    if (written == -1 && errno == EINTR)
+      continue;
+    /* nowhere to report it */
+    if (written <= 0)
+      return;
+    data += written;
+    size -= (size_t)written;
+  }
+}
+
+static void log_output(const log_line_t *line) {
+  if (log_state.output.size + line->size > sizeof(log_state.output.data)) {
+    log_write(log_state.output.data, log_state.output.size);
+    log_state.output.size = 0;
+  }
+  memcpy(log_state.output.data + log_state.output.size, line->data,
+         line->size);
+  log_state.output.size += line->size;
+}
+
+/* writes what the rings hold, false when they were empty */
+static bool log_drain_rings(void) {
+  bool drained = false;
+  for (log_ring_t *ring = atomic_load(&log_state.rings); ring;
+       ring = ring->next) {
+    const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (; tail != head; ++tail) {
+      log_format(&log_state.line, ring->records + tail % LOG_RING_SIZE,
+                 log_state.pid);
+      log_output(&log_state.line);
+      drained = true;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    const uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0,
+                                                      memory_order_relaxed);
+    if (dropped) {
+      const log_field_t field = LOG_U64("messages", dropped);
+      log_record_t record;
+      log_fill(&record, LOG_LEVEL_ERROR, "log-dropped", &field, 1);
+      log_format(&log_state.line, &record, log_state.pid);
+      log_output(&log_state.line);
+      drained = true;
+    }
+  }
+  if (log_state.output.size) {
+    log_write(log_state.output.data, log_state.output.size);
+    log_state.output.size = 0;
+  }
+  return drained;
+}
+
+static void *log_drain(void *unused) {
+  (void)unused;
+  pthread_mutex_lock(&log_state.lock);
+  while (!log_state.stopping) {
+    pthread_mutex_unlock(&log_state.lock);
+    const bool drained = log_drain_rings();
+    pthread_mutex_lock(&log_state.lock);
+    if (drained || log_state.stopping)
+      continue;
+
+    const uint64_t until = log_now_ns(CLOCK_REALTIME) + LOG_DRAIN_INTERVAL_NS;
+    const struct timespec deadline = {
+        .tv_sec = (time_t)(until / 1000000000u),
+        .tv_nsec = (long)(until % 1000000000u),
+    };
+    pthread_cond_timedwait(&log_state.wake, &log_state.lock, &deadline);
+  }
+  pthread_mutex_unlock(&log_state.lock);
+  /* what was queued before the stop */
+  log_drain_rings();
+  return NULL;
+}
+
+static void log_spawn(void) {
+  pthread_mutex_lock(&log_state.lock);
+  if (!atomic_load(&log_state.running) && !log_state.stopping) {
+    /* the process's signals are for its other threads, a drain taking one
+     * would keep it from interrupting their poll */
+    sigset_t all;
+    sigset_t previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    const int error =
+        pthread_create(&log_state.drain, NULL, &log_drain, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (error)
+      errno = error;
+    else
+      atomic_store(&log_state.running, true);
+  }
+  pthread_mutex_unlock(&log_state.lock);
+}
+
+static void log_release(void *ring) {
+  atomic_store(&((log_ring_t *)ring)->owned, false);
+}
+
+/* a ring of a thread that exited, or a new one */
+static log_ring_t *log_claim(void) {
+  pthread_mutex_lock(&log_state.lock);
+  log_ring_t *ring = atomic_load(&log_state.rings);
+  while (ring && atomic_load(&ring->owned))
+    ring = ring->next;
+  if (!ring) {
+    ring = calloc(1, sizeof(log_ring_t));
+    if (ring) {
+      ring->next = atomic_load(&log_state.rings);
+      atomic_store(&log_state.rings, ring);
+    }
+  }
+  if (ring)
+    atomic_store(&ring->owned, true);
+  pthread_mutex_unlock(&log_state.lock);
+
+  if (ring)
+    pthread_setspecific(log_state.key, ring);
+  log_ring = ring;
+  return ring;
+}
+
+static void log_prepare_fork(void) { pthread_mutex_lock(&log_state.lock); }
+
+static void log_parent_forked(void) { pthread_mutex_unlock(&log_state.lock); }
+
+/* the drain did not come along, the parent writes what is queued */
+static void log_child_forked(void) {
+  log_state.pid = getpid();
+  atomic_store(&log_state.running, false);
+  log_state.output.size = 0;
+  for (log_ring_t *ring = atomic_load(&log_state.rings); ring;
+       ring = ring->next) {
+    atomic_store(&ring->tail, atomic_load(&ring->head));
+    atomic_store(&ring->dropped, 0);
+    if (ring != log_ring)
+      atomic_store(&ring->owned, false);
+  }
+  pthread_mutex_unlock(&log_state.lock);
+}
+
+bool log_start(int fd, log_level_t level, log_format_t format) {
+  log_state.fd = fd;
+  log_state.format = format;
+  log_state.pid = getpid();
+  const int error = pthread_key_create(&log_state.key, &log_release);
+  if (error) {
+    errno = error;
+    return false;
+  }
+  pthread_atfork(&log_prepare_fork, &log_parent_forked, &log_child_forked);
+  atexit(&log_stop);
+  log_state.started = true;
+  log_threshold = level;
+
+  log_spawn();
+  return atomic_load(&log_state.running);
+}
+
+void log_stop(void) {
+  if (!log_state.started)
+    return;
+
+  pthread_mutex_lock(&log_state.lock);
+  log_state.stopping = true;
+  pthread_cond_signal(&log_state.wake);
+  pthread_mutex_unlock(&log_state.lock);
+
+  if (atomic_load(&log_state.running))
+    pthread_join(log_state.drain, NULL);
+  else
+    log_drain_rings();
+  atomic_store(&log_state.running, false);
+  /* later messages are written as they come */
+  log_state.started = false;
+}
+
+void log_emit(log_level_t level, const char *event, const log_field_t *fields,
+              size_t count) {
+  if (!log_state.started) {
+    log_record_t record;
+    log_line_t line;
+    log_fill(&record, level, event, fields, count);
+    log_format(&line, &record, getpid());
+    log_write(line.data, line.size);
+    return;
+  }
+
+  log_ring_t *ring = log_ring ? log_ring : log_claim();
+  if (!ring)
+    return;
+  if (!atomic_load_explicit(&log_state.running, memory_order_relaxed))
+    log_spawn();
+
+  const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+      LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  log_fill(ring->records + head % LOG_RING_SIZE, level, event, fields, count);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void log_limit_init(log_limit_t *limit, uint32_t burst, uint64_t interval_ns) {
+  *limit = (log_limit_t){
+      .interval_ns = interval_ns,
+      .burst = burst,
+      .left = burst,
+      .start_ns = log_now_ns(CLOCK_MONOTONIC_COARSE),
+  };
+}
+
+bool log_limit_pass(log_limit_t *limit, uint64_t *suppressed) {
+  const uint64_t now = log_now_ns(CLOCK_MONOTONIC_COARSE);
+  if (now - limit->start_ns >= limit->interval_ns) {
+    limit->start_ns = now;
+    limit->left = limit->burst;
+  }
+  if (!limit->left) {
+    ++limit->suppressed;
+    return false;
+  }
+  --limit->left;
+  *suppressed = limit->suppressed;
+  limit->suppressed = 0;
+  return true;
+}
@@ -0,0 +1,885 @@
+#include <drop/multicast.h>
+#include <drop/pacer.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* announces during the join phase are this far apart */
+#define MULTICAST_ANNOUNCE_INTERVAL_MS 200
+/* how long receivers may take to join when no count is given */
+#define MULTICAST_JOIN_WINDOW_MS 1000
+/* the longest to wait for a given receiver count */
+#define MULTICAST_JOIN_TIMEOUT_MS 10000
+/* receivers repeat their JOIN until data arrives */
+#define MULTICAST_JOIN_INTERVAL_MS 200
+/* receivers NAK at most this often, plus up to as much again of jitter so
+ * that they do not all answer the same loss at once */
+#define MULTICAST_NAK_INTERVAL_MS 20
+#define MULTICAST_NAK_RANGES 64
+/* a block is not repaired again this soon after it was sent, NAKs that
+ * crossed the repair still ask for it */
+#define MULTICAST_REPAIR_HOLDOFF_MS 50
+#define MULTICAST_END_INTERVAL_MS 100
+/* either side gives up after hearing nothing from the other for this long */
+#define MULTICAST_TIMEOUT_MS 10000
+/* until the first DATA a receiver waits out the sender's join phase too */
+#define MULTICAST_FIRST_DATA_TIMEOUT_MS                                        \
+  (MULTICAST_JOIN_TIMEOUT_MS + MULTICAST_TIMEOUT_MS)
+/* a finished receiver answers late ENDs whose DONE got lost */
+#define MULTICAST_LINGER_MS 1000
+/* the group's scope keeps the packets in, not the hop limit */
+#define MULTICAST_HOPS 32
+#define MULTICAST_ANNOUNCE_SIZE 16 /* without the filename */
+#define MULTICAST_IPV6_HEADERS 48  /* IPv6 and UDP */
+#define NS_PER_MS 1000000ull
+
+typedef enum multicast_opcode : uint16_t {
+  MULTICAST_OPCODE_ANNOUNCE = 0x4d01,
+  MULTICAST_OPCODE_JOIN = 0x4d02,
+  MULTICAST_OPCODE_DATA = 0x4d03,
+  MULTICAST_OPCODE_NAK = 0x4d04,
+  MULTICAST_OPCODE_END = 0x4d05,
+  MULTICAST_OPCODE_DONE = 0x4d06,
+  MULTICAST_OPCODE_TFTP_ERROR = 5, /* what receivers refuse with */
+} multicast_opcode_t;
+
+static uint8_t *multicast_put(uint8_t *p, uint64_t value, size_t size) {
+  for (size_t n = size; n-- > 0; value >>= 8)
+    p[n] = (uint8_t)value;
+  return p + size;
+}
+
+static uint64_t multicast_get(const uint8_t *p, size_t size) {
+  uint64_t value = 0;
+  for (size_t n = 0; n < size; ++n)
+    value = value << 8 | p[n];
+  return value;
+}
+
+/* bitmaps of blocks, block 1 is bit 0 */
+static bool multicast_test(const uint64_t *map, uint32_t block) {
+  return map[(block - 1) / 64] >> ((block - 1) % 64) & 1;
+}
+
+static void multicast_set(uint64_t *map, uint32_t block) {
+  map[(block - 1) / 64] |= 1ull << ((block - 1) % 64);
+}
+
+static void multicast_clear(uint64_t *map, uint32_t block) {
+  map[(block - 1) / 64] &= ~(1ull << ((block - 1) % 64));
+}
+
+/* the size of a block's payload, the last one is short and may be empty */
+static size_t multicast_block_size(uint64_t size, uint16_t blksize,
+                                   uint32_t block) {
+  const uint64_t offset = (uint64_t)(block - 1) * blksize;
+  return size - offset < blksize ? (size_t)(size - offset) : blksize;
+}
+
+static uint32_t multicast_block_count(uint64_t size, uint16_t blksize) {
+  const uint64_t count = size / blksize + 1;
+  return count > UINT32_MAX ? 0 : (uint32_t)count;
+}
+
+/* waits for socket until the CLOCK_MONOTONIC deadline, 1 if readable */
+static int multicast_poll(int socket, uint64_t deadline_ns) {
+  const uint64_t now = pacer_now_ns();
+  const int timeout_ms =
+      deadline_ns > now ? (int)((deadline_ns - now + NS_PER_MS - 1) / NS_PER_MS)
+                        : 0;
+  struct pollfd pollfd = {.fd = socket, .events = POLLIN};
+  const int ready = poll(&pollfd, 1, timeout_ms);
+  return ready == -1 && errno == EINTR ? 0 : ready;
+}
+
+typedef enum {
+  MULTICAST_JOINED,
+  MULTICAST_DONE,
+  MULTICAST_FAILED,
+} multicast_state_t;
+
+typedef struct {
+  struct sockaddr_in6 address;
+  multicast_state_t state;
+} multicast_receiver_t;
+
+typedef struct {
+  int socket;
+  uint32_t session;
+  uint32_t blocks;
+  uint32_t next;     /* the next block sent for the first time */
+  uint32_t repair;   /* no block below is pending */
+  uint64_t *pending; /* NAKed and not repaired yet */
+  uint32_t *sent_ms; /* when each block was last sent, 0 for never */
+  uint64_t start_ns;
+  uint64_t heard_ns; /* the last sign of life from a receiver */
+  multicast_receiver_t *receivers;
+  size_t receiver_count;
+  multicast_result_t result;
+} multicast_sender_t;
+
+static uint32_t multicast_sender_ms(const multicast_sender_t *sender) {
+  return (uint32_t)((pacer_now_ns() - sender->start_ns) / NS_PER_MS) + 1;
+}
+
+static multicast_receiver_t *
+multicast_sender_find(multicast_sender_t *sender,
+                      const struct sockaddr_in6 *address) {
+  for (size_t n = 0; n < sender->receiver_count; ++n) {
+    const struct sockaddr_in6 *other = &sender->receivers[n].address;
+    if (other->sin6_port == address->sin6_port &&
+        IN6_ARE_ADDR_EQUAL(&other->sin6_addr, &address->sin6_addr))
+      return sender->receivers + n;
+  }
+  return NULL;
+}
+
+static multicast_receiver_t *
+multicast_sender_add(multicast_sender_t *sender,
+                     const struct sockaddr_in6 *address,
+                     multicast_state_t state) {
+  if (sender->receiver_count == MULTICAST_MAX_RECEIVERS)
+    return NULL;
+  multicast_receiver_t *receivers =
+      realloc(sender->receivers,
+              (sender->receiver_count + 1) * sizeof(multicast_receiver_t));
+  if (!receivers)
+    return NULL;
+  sender->receivers = receivers;
+
+  multicast_receiver_t *receiver = receivers + sender->receiver_count++;
+  *receiver = (multicast_receiver_t){
+      .address = *address,
+      .state = state,
+  };
+  if (state == MULTICAST_JOINED)
+    ++sender->result.joined;
+  else
+    ++sender->result.refused;
+  return receiver;
+}
+
+static void multicast_sender_nak(multicast_sender_t *sender,
+                                 const uint8_t *ranges, size_t size) {
+  ++sender->result.naks;
+  const uint32_t now = multicast_sender_ms(sender);
+  for (; size >= 8; ranges += 8, size -= 8) {
+    uint32_t first = (uint32_t)multicast_get(ranges, 4);
+    uint32_t last = (uint32_t)multicast_get(ranges + 4, 4);
+    /* blocks that were never sent are on their way anyway */
+    if (first < 1)
+      first = 1;
+    if (last >= sender->next)
+      last = sender->next - 1;
+
+    for (uint32_t block = first; block <= last && block >= first; ++block) {
+      const uint32_t sent = sender->sent_ms[block - 1];
+      if (multicast_test(sender->pending, block) ||
+          now - sent < MULTICAST_REPAIR_HOLDOFF_MS)
+        continue;
+      multicast_set(sender->pending, block);
+      if (block < sender->repair)
+        sender->repair = block;
+    }
+  }
+}
+
+/* handles whatever the receivers sent, without blocking */
+static void multicast_sender_receive(multicast_sender_t *sender) {
+  uint8_t packet[6 + 8 * MULTICAST_NAK_RANGES];
+  for (;;) {
+    struct sockaddr_in6 from;
+    socklen_t from_size = sizeof(from);
+    const ssize_t size = recvfrom(sender->socket, packet, sizeof(packet),
+                                  MSG_DONTWAIT, (struct sockaddr *)&from,
+                                  &from_size);
+    if (size == -1) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    if (size < 4 || from.sin6_family != AF_INET6)
+      continue;
+
+    multicast_receiver_t *receiver = multicast_sender_find(sender, &from);
+    const uint16_t opcode = (uint16_t)multicast_get(packet, 2);
+    if (opcode == MULTICAST_OPCODE_TFTP_ERROR) {
+      /* the refusal has no session id, only senders it answers get one */
+      if (!receiver)
+        receiver = multicast_sender_add(sender, &from, MULTICAST_FAILED);
+      else if (receiver->state == MULTICAST_JOINED)
+        receiver->state = MULTICAST_FAILED;
+      else
+        continue;
+      if (receiver && !sender->result.error)
+        sender->result.error = EPROTO;
+      continue;
+    }
+
+    if (size < 6 || multicast_get(packet + 2, 4) != sender->session)
+      continue;
+
+    switch (opcode) {
+    case MULTICAST_OPCODE_JOIN:
+      if (!receiver)
+        multicast_sender_add(sender, &from, MULTICAST_JOINED);
+      sender->heard_ns = pacer_now_ns();
+      break;
+    case MULTICAST_OPCODE_NAK:
+      if (!receiver || receiver->state != MULTICAST_JOINED)
+        break;
+      multicast_sender_nak(sender, packet + 6, (size_t)size - 6);
+      sender->heard_ns = pacer_now_ns();
+      break;
+    case MULTICAST_OPCODE_DONE:
+      if (!receiver || receiver->state != MULTICAST_JOINED)
+        break;
+      receiver->state = MULTICAST_DONE;
+      ++sender->result.completed;
+      sender->heard_ns = pacer_now_ns();
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static bool multicast_sender_finished(const multicast_sender_t *sender) {
+  for (size_t n = 0; n < sender->receiver_count; ++n) {
+    if (sender->receivers[n].state == MULTICAST_JOINED)
+      return false;
+  }
+  return true;
+}
+
+/* the largest block a packet to group on its interface fits */
+static uint16_t multicast_path_blksize(const struct sockaddr_in6 *group) {
+  uint16_t blksize = TFTP_BLOCK_SIZE;
+  const int s = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (s == -1)
+    return blksize;
+
+  int mtu = 0;
+  socklen_t size = sizeof(mtu);
+  if (0 == connect(s, (const struct sockaddr *)group, sizeof(*group)) &&
+      0 == getsockopt(s, IPPROTO_IPV6, IPV6_MTU, &mtu, &size) &&
+      mtu > MULTICAST_IPV6_HEADERS + MULTICAST_HEADER_SIZE + TFTP_BLOCK_SIZE) {
+    const int fits = mtu - MULTICAST_IPV6_HEADERS - MULTICAST_HEADER_SIZE;
+    blksize = fits > TFTP_MAX_BLOCK_SIZE - 6 ? TFTP_MAX_BLOCK_SIZE - 6
+                                              : (uint16_t)fits;
+  }
+  close(s);
+  return blksize;
+}
+
+static int multicast_sender_send(multicast_sender_t *sender,
+                                 const struct sockaddr_in6 *group,
+                                 FILE *file, uint16_t blksize, uint32_t block,
+                                 const tftp_hooks_t *hooks) {
+  uint8_t packet[MULTICAST_HEADER_SIZE + TFTP_MAX_BLOCK_SIZE];
+  const size_t payload =
+      multicast_block_size(sender->result.bytes, blksize, block);
+  if (-1 == fseeko(file, (off_t)(block - 1) * blksize, SEEK_SET))
+    return -1;
+  if (fread(packet + MULTICAST_HEADER_SIZE, 1, payload, file) != payload) {
+    errno = ferror(file) ? EIO : ENODATA; /* or the file shrank under us */
+    return -1;
+  }
+
+  uint8_t *p = multicast_put(packet, MULTICAST_OPCODE_DATA, 2);
+  p = multicast_put(p, sender->session, 4);
+  multicast_put(p, block, 4);
+
+  /* without SO_TXTIME on the socket a departure time is slept for */
+  if (hooks && hooks->on_send) {
+    const uint64_t departure = hooks->on_send(payload, hooks->userdata);
+    if (departure > pacer_now_ns())
+      pacer_sleep_until(departure);
+  }
+  const ssize_t sent =
+      sendto(sender->socket, packet, MULTICAST_HEADER_SIZE + payload, 0,
+             (const struct sockaddr *)group, sizeof(*group));
+  /* a full queue is a loss like any other, the receivers ask again */
+  if (sent == -1 && errno != ENOBUFS && errno != EAGAIN)
+    return -1;
+
+  sender->sent_ms[block - 1] = multicast_sender_ms(sender);
+  return 0;
+}
+
+/* sends the blocks and their repairs to group, on our own port, until every
+ * receiver is done */
+static void multicast_sender_run(multicast_sender_t *sender,
+                                 const struct sockaddr_in6 *group,
+                                 FILE *file, uint16_t blksize,
+                                 const tftp_hooks_t *hooks) {
+  uint8_t end[10];
+  uint8_t *p = multicast_put(end, MULTICAST_OPCODE_END, 2);
+  p = multicast_put(p, sender->session, 4);
+  multicast_put(p, sender->blocks, 4);
+  uint64_t end_due = 0;
+
+  sender->heard_ns = pacer_now_ns();
+  while (!multicast_sender_finished(sender)) {
+    multicast_sender_receive(sender);
+
+    uint32_t block = 0;
+    while (sender->repair < sender->next &&
+           !multicast_test(sender->pending, sender->repair))
+      ++sender->repair;
+    if (sender->repair < sender->next) {
+      block = sender->repair;
+      multicast_clear(sender->pending, block);
+      ++sender->result.repaired;
+    } else if (sender->next <= sender->blocks) {
+      block = sender->next++;
+      sender->heard_ns = pacer_now_ns();
+    }
+
+    if (block) {
+      if (-1 == multicast_sender_send(sender, group, file, blksize, block,
+                                      hooks)) {
+        sender->result.error = errno;
+        return;
+      }
+      continue;
+    }
+
+    const uint64_t now = pacer_now_ns();
+    if (now - sender->heard_ns > MULTICAST_TIMEOUT_MS * NS_PER_MS) {
+      sender->result.error = ETIMEDOUT;
+      return;
+    }
+    if (now >= end_due) {
+      sendto(sender->socket, end, sizeof(end), 0,
+             (const struct sockaddr *)group, sizeof(*group));
+      end_due = now + MULTICAST_END_INTERVAL_MS * NS_PER_MS;
+    }
+    multicast_poll(sender->socket, end_due);
+  }
+}
+
+/* announces until enough receivers joined, 0 or -1 with errno */
+static int multicast_sender_join(multicast_sender_t *sender,
+                                 const struct sockaddr_in6 *group,
+                                 const char *filename, uint16_t blksize,
+                                 size_t receivers) {
+  uint8_t announce[MULTICAST_ANNOUNCE_SIZE + TFTP_MAX_BLOCK_SIZE];
+  const size_t length = strlen(filename);
+  if (length + 1 > sizeof(announce) - MULTICAST_ANNOUNCE_SIZE) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  uint8_t *p = multicast_put(announce, MULTICAST_OPCODE_ANNOUNCE, 2);
+  p = multicast_put(p, sender->session, 4);
+  p = multicast_put(p, blksize, 2);
+  p = multicast_put(p, sender->result.bytes, 8);
+  memcpy(p, filename, length + 1);
+  const size_t size = MULTICAST_ANNOUNCE_SIZE + length + 1;
+
+  const uint64_t deadline =
+      sender->start_ns +
+      (receivers ? MULTICAST_JOIN_TIMEOUT_MS : MULTICAST_JOIN_WINDOW_MS) *
+          NS_PER_MS;
+  uint64_t announce_due = sender->start_ns;
+  for (;;) {
+    multicast_sender_receive(sender);
+    if (receivers && sender->receiver_count >= receivers)
+      break;
+
+    const uint64_t now = pacer_now_ns();
+    if (now >= deadline)
+      break;
+    if (now >= announce_due) {
+      if (-1 == sendto(sender->socket, announce, size, 0,
+                       (const struct sockaddr *)group, sizeof(*group)))
+        return -1;
+      announce_due = now + MULTICAST_ANNOUNCE_INTERVAL_MS * NS_PER_MS;
+    }
+    multicast_poll(sender->socket,
+                   announce_due < deadline ? announce_due : deadline);
+  }
+
+  if (sender->result.joined == 0 ||
+      (receivers && sender->receiver_count < receivers)) {
+    errno = sender->result.error ? sender->result.error : ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+multicast_result_t multicast_send(int socket, const struct sockaddr_in6 *group,
+                                  const char *filename, FILE *file,
+                                  const multicast_params_t *params,
+                                  const tftp_hooks_t *hooks) {
+  multicast_sender_t sender = {
+      .socket = socket,
+      .next = 1,
+      .repair = 1,
+      .start_ns = pacer_now_ns(),
+  };
+
+  /* repairs read blocks again wherever they are */
+  off_t size;
+  if (-1 == fseeko(file, 0, SEEK_END) || -1 == (size = ftello(file))) {
+    sender.result.error = ESPIPE;
+    return sender.result;
+  }
+  sender.result.bytes = (uint64_t)size;
+
+  uint16_t blksize = params->blksize ? params->blksize
+                                     : multicast_path_blksize(group);
+  if (blksize > TFTP_MAX_BLOCK_SIZE - 6)
+    blksize = TFTP_MAX_BLOCK_SIZE - 6;
+  sender.blocks = multicast_block_count(sender.result.bytes, blksize);
+  if (!sender.blocks) {
+    sender.result.error = EFBIG;
+    return sender.result;
+  }
+
+  /* receivers on this host bind the group to our port as well, and our
+   * own DATA coming back over the loop is nothing we want */
+  const int on = 1, off = 0;
+  const int interface = (int)group->sin6_scope_id;
+  const int hops = MULTICAST_HOPS;
+  const struct sockaddr_in6 any = {.sin6_family = AF_INET6};
+  if (-1 == setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+      -1 == setsockopt(socket, IPPROTO_IPV6, IPV6_MULTICAST_ALL, &off,
+                       sizeof(off)) ||
+      -1 == bind(socket, (const struct sockaddr *)&any, sizeof(any)) ||
+      (interface && -1 == setsockopt(socket, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+                                     &interface, sizeof(interface))) ||
+      -1 == setsockopt(socket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops,
+                       sizeof(hops))) {
+    sender.result.error = errno;
+    return sender.result;
+  }
+
+  /* the data goes to our own port, the daemons listen to theirs for
+   * announces only */
+  struct sockaddr_in6 data = *group;
+  struct sockaddr_in6 bound;
+  socklen_t bound_size = sizeof(bound);
+  if (-1 == getsockname(socket, (struct sockaddr *)&bound, &bound_size)) {
+    sender.result.error = errno;
+    return sender.result;
+  }
+  data.sin6_port = bound.sin6_port;
+
+  if (-1 == getrandom(&sender.session, sizeof(sender.session), 0))
+    sender.session = (uint32_t)(getpid() ^ sender.start_ns);
+
+  sender.pending = calloc((sender.blocks + 63) / 64, sizeof(uint64_t));
+  sender.sent_ms = calloc(sender.blocks, sizeof(uint32_t));
+  if (!sender.pending || !sender.sent_ms)
+    sender.result.error = ENOMEM;
+  else if (-1 == multicast_sender_join(&sender, group, filename, blksize,
+                                       params->receivers))
+    sender.result.error = errno;
+  else
+    multicast_sender_run(&sender, &data, file, blksize, hooks);
+
+  if (!sender.result.error && sender.result.completed < sender.result.joined)
+    sender.result.error = ETIMEDOUT;
+  free(sender.pending);
+  free(sender.sent_ms);
+  free(sender.receivers);
+  return sender.result;
+}
+
+typedef struct {
+  int socket; /* unicast, connected to the sender */
+  int data;   /* the group on the sender's port */
+  uint32_t session;
+  uint16_t blksize;
+  uint64_t size;
+  uint32_t blocks;
+  uint64_t *received;
+  uint32_t count;         /* blocks received */
+  uint32_t highest;       /* the highest block received */
+  uint32_t first_missing; /* no block below is missing */
+  bool end_seen;
+  uint32_t jitter; /* state of the NAK jitter */
+} multicast_receiver_session_t;
+
+static void multicast_refuse(int socket, tftp_error_code_t code,
+                             const char *message) {
+  tftp_buffer_t buffer;
+  const size_t size = tftp_format_error(&buffer, code, message);
+  send(socket, buffer.buffer, size, 0);
+}
+
+static void multicast_send_short(const multicast_receiver_session_t *session,
+                                 multicast_opcode_t opcode) {
+  uint8_t packet[6];
+  multicast_put(multicast_put(packet, opcode, 2), session->session, 4);
+  send(session->socket, packet, sizeof(packet), 0);
+}
+
+/* whether there is a gap to report */
+static bool multicast_missing(const multicast_receiver_session_t *session) {
+  return session->count < session->blocks &&
+         (session->end_seen || session->first_missing < session->highest);
+}
+
+static void multicast_send_nak(multicast_receiver_session_t *session) {
+  uint8_t packet[6 + 8 * MULTICAST_NAK_RANGES];
+  uint8_t *p = multicast_put(packet, MULTICAST_OPCODE_NAK, 2);
+  p = multicast_put(p, session->session, 4);
+
+  /* below the highest block everything missing is lost, beyond it only once
+   * the END told us nothing more is coming */
+  const uint32_t limit = session->end_seen ? session->blocks : session->highest;
+  size_t ranges = 0;
+  uint32_t block = session->first_missing;
+  while (block <= limit && ranges < MULTICAST_NAK_RANGES) {
+    if (multicast_test(session->received, block)) {
+      ++block;
+      continue;
+    }
+    const uint32_t first = block;
+    while (block <= limit && !multicast_test(session->received, block))
+      ++block;
+    p = multicast_put(p, first, 4);
+    p = multicast_put(p, block - 1, 4);
+    ++ranges;
+  }
+  if (ranges)
+    send(session->socket, packet, (size_t)(p - packet), 0);
+}
+
+static uint64_t multicast_nak_delay(multicast_receiver_session_t *session) {
+  /* xorshift, seeded per process so that receivers spread */
+  session->jitter ^= session->jitter << 13;
+  session->jitter ^= session->jitter >> 17;
+  session->jitter ^= session->jitter << 5;
+  const uint64_t interval = MULTICAST_NAK_INTERVAL_MS * NS_PER_MS;
+  return interval + session->jitter % interval;
+}
+
+/* stores a DATA packet, -1 with errno if the file could not take it */
+static int multicast_store(multicast_receiver_session_t *session, int fd,
+                           const uint8_t *packet, size_t size,
+                           const tftp_hooks_t *hooks) {
+  const uint32_t block = (uint32_t)multicast_get(packet + 6, 4);
+  if (block < 1 || block > session->blocks ||
+      multicast_test(session->received, block))
+    return 0;
+  const size_t payload = size - MULTICAST_HEADER_SIZE;
+  if (payload != multicast_block_size(session->size, session->blksize, block))
+    return 0;
+
+  if ((ssize_t)payload != pwrite(fd, packet + MULTICAST_HEADER_SIZE, payload,
+                                 (off_t)(block - 1) * session->blksize)) {
+    if (errno == 0)
+      errno = ENOSPC;
+    return -1;
+  }
+
+  multicast_set(session->received, block);
+  ++session->count;
+  if (block > session->highest)
+    session->highest = block;
+  while (session->first_missing <= session->blocks &&
+         multicast_test(session->received, session->first_missing))
+    ++session->first_missing;
+
+  if (hooks && hooks->on_data)
+    hooks->on_data(payload, hooks->userdata);
+  return 0;
+}
+
+/* reads what arrived on the data socket, 1 if it came from the sender */
+static int multicast_receive_data(multicast_receiver_session_t *session,
+                                  int fd, const tftp_hooks_t *hooks) {
+  uint8_t packet[MULTICAST_HEADER_SIZE + TFTP_MAX_BLOCK_SIZE];
+  int heard = 0;
+  for (;;) {
+    const ssize_t size =
+        recv(session->data, packet, sizeof(packet), MSG_DONTWAIT);
+    if (size == -1) {
+      if (errno == EINTR)
+        continue;
+      return heard;
+    }
+    if (size < 10 || multicast_get(packet + 2, 4) != session->session)
+      continue;
+
+    switch (multicast_get(packet, 2)) {
+    case MULTICAST_OPCODE_DATA:
+      heard = 1;
+      errno = 0;
+      if (-1 == multicast_store(session, fd, packet, (size_t)size, hooks))
+        return -1;
+      break;
+    case MULTICAST_OPCODE_END:
+      heard = 1;
+      session->end_seen = true;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/* the group's socket for the sender's data */
+static int multicast_data_socket(const struct sockaddr_in6 *group,
+                                 const struct sockaddr_in6 *sender) {
+  const int s = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (s == -1)
+    return -1;
+
+  /* other sessions may listen to the same port from other senders */
+  const int on = 1;
+  struct sockaddr_in6 address = *group;
+  address.sin6_port = sender->sin6_port;
+  const struct ipv6_mreq membership = {
+      .ipv6mr_multiaddr = group->sin6_addr,
+      .ipv6mr_interface = group->sin6_scope_id,
+  };
+  if (-1 == setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+      -1 == bind(s, (struct sockaddr *)&address, sizeof(address)) ||
+      -1 == setsockopt(s, IPPROTO_IPV6, IPV6_JOIN_GROUP, &membership,
+                       sizeof(membership)) ||
+      -1 == connect(s, (const struct sockaddr *)sender, sizeof(*sender))) {
+    const int error = errno;
+    close(s);
+    errno = error;
+    return -1;
+  }
+  return s;
+}
+
+/* answers the sender's ENDs until it stops sending them */
+static void multicast_linger(multicast_receiver_session_t *session) {
+  uint8_t packet[MULTICAST_HEADER_SIZE + TFTP_MAX_BLOCK_SIZE];
+  uint64_t done_sent = pacer_now_ns();
+  uint64_t heard = done_sent;
+  while (multicast_poll(session->data,
+                        heard + MULTICAST_LINGER_MS * NS_PER_MS) > 0) {
+    const ssize_t size = recv(session->data, packet, sizeof(packet), 0);
+    if (size < 6 || multicast_get(packet + 2, 4) != session->session)
+      continue;
+
+    const uint64_t now = pacer_now_ns();
+    heard = now;
+    if (now - done_sent >= MULTICAST_NAK_INTERVAL_MS * NS_PER_MS) {
+      multicast_send_short(session, MULTICAST_OPCODE_DONE);
+      done_sent = now;
+    }
+  }
+}
+
+static int multicast_receive_file(multicast_receiver_session_t *session,
+                                  int fd, const tftp_hooks_t *hooks) {
+  uint64_t heard = pacer_now_ns();
+  uint64_t join_due = heard;
+  uint64_t nak_due = 0;
+  bool data_seen = false;
+
+  while (session->count < session->blocks) {
+    const uint64_t now = pacer_now_ns();
+    const uint64_t timeout_ns =
+        (data_seen ? MULTICAST_TIMEOUT_MS : MULTICAST_FIRST_DATA_TIMEOUT_MS) *
+        NS_PER_MS;
+    if (now - heard > timeout_ns) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (!data_seen && now >= join_due) {
+      multicast_send_short(session, MULTICAST_OPCODE_JOIN);
+      join_due = now + MULTICAST_JOIN_INTERVAL_MS * NS_PER_MS;
+    }
+    if (multicast_missing(session) && now >= nak_due) {
+      multicast_send_nak(session);
+      nak_due = now + multicast_nak_delay(session);
+    }
+
+    uint64_t deadline = heard + timeout_ns;
+    if (!data_seen && join_due < deadline)
+      deadline = join_due;
+    if (multicast_missing(session) && nak_due < deadline)
+      deadline = nak_due;
+
+    struct pollfd pollfds[] = {
+        {.fd = session->data, .events = POLLIN},
+        {.fd = session->socket, .events = POLLIN},
+    };
+    const uint64_t wait_ns = deadline > now ? deadline - now : 0;
+    const int timeout_ms = (int)((wait_ns + NS_PER_MS - 1) / NS_PER_MS);
+    if (-1 == poll(pollfds, 2, timeout_ms)) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    if (pollfds[1].revents) {
+      /* the sender does not talk on the unicast socket, only its ICMP
+       * errors arrive there */
+      uint8_t byte;
+      if (-1 == recv(session->socket, &byte, sizeof(byte), MSG_DONTWAIT) &&
+          errno == ECONNREFUSED)
+        return -1;
+    }
+    if (pollfds[0].revents) {
+      const int result = multicast_receive_data(session, fd, hooks);
+      if (result == -1)
+        return -1;
+      if (result) {
+        heard = pacer_now_ns();
+        data_seen = true;
+      }
+    }
+  }
+  return 0;
+}
+
+/* opens the file an upload goes to through the hooks, as a unicast one is.
+ * Blocks arrive out of order, a stream that cannot seek, a sink's or a
+ * relay's, gets a spool that is copied to it once the upload is complete */
+static FILE *multicast_open(const char *filename, const tftp_hooks_t *hooks,
+                            FILE **spool) {
+  *spool = NULL;
+  FILE *file = hooks && hooks->on_open
+                   ? hooks->on_open(filename, hooks->userdata)
+                   : fopen(filename, "wb");
+  if (!file)
+    return NULL;
+
+  const int fd = fileno(file);
+  if (fd != -1 && lseek(fd, 0, SEEK_CUR) != -1)
+    return file;
+  *spool = tmpfile();
+  if (*spool)
+    return file;
+
+  const int error = errno;
+  if (hooks && hooks->on_close)
+    hooks->on_close(file, false, hooks->userdata);
+  else
+    fclose(file);
+  errno = error;
+  return NULL;
+}
+
+/* copies the spool to file if the upload is complete and closes both,
+ * -1 with errno if the file did not take it */
+static int multicast_close(FILE *file, FILE *spool, bool complete,
+                           const tftp_hooks_t *hooks) {
+  int error = 0;
+  if (spool) {
+    if (complete) {
+      char buffer[BUFSIZ];
+      rewind(spool);
+      size_t count;
+      while ((count = fread(buffer, 1, sizeof(buffer), spool)))
+        if (count != fwrite(buffer, 1, count, file))
+          break;
+      if (ferror(spool) || ferror(file)) {
+        error = errno ? errno : EIO;
+        complete = false;
+      }
+    }
+    fclose(spool);
+  }
+
+  const int closed = hooks && hooks->on_close
+                         ? hooks->on_close(file, complete, hooks->userdata)
+                         : fclose(file);
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return closed == 0 ? 0 : -1;
+}
+
+tftp_result_t multicast_receive(int socket, const struct sockaddr_in6 *group,
+                                const void *packet, size_t size,
+                                const tftp_limits_t *limits,
+                                const tftp_hooks_t *hooks) {
+  tftp_result_t result = {0};
+  const uint8_t *announce = packet;
+  if (size <= MULTICAST_ANNOUNCE_SIZE ||
+      multicast_get(announce, 2) != MULTICAST_OPCODE_ANNOUNCE ||
+      !memchr(announce + MULTICAST_ANNOUNCE_SIZE, '\0',
+              size - MULTICAST_ANNOUNCE_SIZE)) {
+    multicast_refuse(socket, TFTP_ERROR_ILLEGAL_OPERATION, "malformed");
+    result.error = EPROTO;
+    return result;
+  }
+
+  multicast_receiver_session_t session = {
+      .socket = socket,
+      .data = -1,
+      .session = (uint32_t)multicast_get(announce + 2, 4),
+      .blksize = (uint16_t)multicast_get(announce + 6, 2),
+      .size = multicast_get(announce + 8, 8),
+      .first_missing = 1,
+      .jitter = (uint32_t)(getpid() ^ pacer_now_ns()) | 1,
+  };
+  const char *filename = (const char *)announce + MULTICAST_ANNOUNCE_SIZE;
+
+  /* blocks beyond 512 bytes are what the blksize limit is about */
+  if (session.blksize < TFTP_MIN_BLOCK_SIZE ||
+      session.blksize > TFTP_MAX_BLOCK_SIZE - 6 ||
+      (session.blksize > TFTP_BLOCK_SIZE &&
+       (!limits || limits->max.blksize < session.blksize))) {
+    multicast_refuse(socket, TFTP_ERROR_OPTION_REFUSED, "blksize");
+    result.error = EPROTO;
+    return result;
+  }
+  session.blocks = multicast_block_count(session.size, session.blksize);
+  if (!session.blocks) {
+    multicast_refuse(socket, TFTP_ERROR_DISK_FULL, strerror(EFBIG));
+    result.error = EFBIG;
+    return result;
+  }
+
+  struct sockaddr_in6 sender;
+  socklen_t sender_size = sizeof(sender);
+  if (-1 == getpeername(socket, (struct sockaddr *)&sender, &sender_size) ||
+      -1 == (session.data = multicast_data_socket(group, &sender))) {
+    result.error = errno;
+    multicast_refuse(socket, TFTP_ERROR_NOT_DEFINED, strerror(errno));
+    return result;
+  }
+
+  FILE *spool = NULL;
+  FILE *file = multicast_open(filename, hooks, &spool);
+  session.received = calloc((session.blocks + 63) / 64, sizeof(uint64_t));
+  if (!file || !session.received) {
+    result.error = !file ? errno : ENOMEM;
+    multicast_refuse(socket, TFTP_ERROR_DISK_FULL, strerror(result.error));
+    if (file)
+      multicast_close(file, spool, false, hooks);
+  } else if (-1 == multicast_receive_file(&session,
+                                          fileno(spool ? spool : file),
+                                          hooks)) {
+    result.error = errno;
+    multicast_close(file, spool, false, hooks);
+    if (result.error != ETIMEDOUT && result.error != ECONNREFUSED)
+      multicast_refuse(socket, TFTP_ERROR_DISK_FULL, strerror(result.error));
+  } else if (-1 == multicast_close(file, spool, true, hooks)) {
+    result.error = errno;
+    if (result.error != ETIMEDOUT && result.error != ECONNREFUSED)
+      multicast_refuse(socket, TFTP_ERROR_DISK_FULL, strerror(result.error));
+  } else {
+    result.started = true;
+    result.bytes = session.size;
+    if (hooks && hooks->on_complete)
+      hooks->on_complete(hooks->userdata);
+    multicast_send_short(&session, MULTICAST_OPCODE_DONE);
+    multicast_linger(&session);
+  }
+
+  free(session.received);
+  close(session.data);
+  return result;
+}
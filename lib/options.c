@@ -1,6 +1,7 @@
 #include <drop/options.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <malloc.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -95,25 +96,38 @@ static void options_from_config_file(FILE *file,
                                      void (*parse)(int, char *const *,
                                                    options_t *),
                                      options_t *out) {
-  char **argv = malloc(3 * sizeof(char *));
-  argv[0] = "config";
-  argv[1] = NULL;
-  argv[2] = NULL;
+  size_t argv_size = 3 * sizeof(char *);
+  char **argv = safe_realloc(NULL, 0, argv_size);
+  char *key = NULL; /* getopt may permute argv, keep our own pointer */
 
   char *line = NULL;
   size_t capacity = 0;
-  while (getline(&line, &capacity, file) != 0) {
+  while (getline(&line, &capacity, file) != -1) {
     for (char *newline = strchr(line, '\n'); newline;
          newline = strchr(line, '\n'))
       *newline = ' ';
 
+    /* skip comments */
+    const char *first = line + strspn(line, " \t");
+    if (*first == '#')
+      continue;
+
     wordexp_t result = {0};
 
-    if (wordexp(line, &result, WRDE_NOCMD) == 0) {
-      argv[1] = str_realloc_fmt(argv[1], "--%s", result.we_wordv[0]);
-      if (result.we_wordc == 2) {
-        argv[2] = result.we_wordv[1];
+    if (wordexp(line, &result, WRDE_NOCMD) == 0 && result.we_wordc > 0) {
+      /* config, --key, values..., NULL */
+      const size_t size = (result.we_wordc + 2) * sizeof(char *);
+      if (size > argv_size) {
+        argv = safe_realloc(argv, argv_size, size);
+        argv_size = size;
       }
+      argv[0] = "config";
+      key = str_realloc_fmt(key, "--%s", result.we_wordv[0]);
+      argv[1] = key;
+      for (size_t n = 1; n < result.we_wordc; ++n)
+        argv[n + 1] = result.we_wordv[n];
+      argv[result.we_wordc + 1] = NULL;
+
       parse(result.we_wordc + 1, argv, out);
     }
 
@@ -122,7 +136,53 @@ static void options_from_config_file(FILE *file,
 
   if (line)
     free(line);
-  if (argv[1])
-    free(argv[1]);
+  if (key)
+    free(key);
   free(argv);
 }
+
+bool options_parse_size(const char *string, uint64_t *out) {
+  assert(string);
+  assert(out);
+
+  /* plain decimals, strtod alone takes signs, exponents, hex, inf and nan */
+  const size_t digits = strspn(string, "0123456789.");
+  char *end = NULL;
+  errno = 0;
+  const double value = strtod(string, &end);
+  if (errno || !digits || end != string + digits)
+    return false;
+
+  double multiplier = 1;
+  switch (*end) {
+  case '\0':
+    break;
+  case 'k':
+  case 'K':
+    multiplier = 1024.0;
+    ++end;
+    break;
+  case 'm':
+  case 'M':
+    multiplier = 1024.0 * 1024.0;
+    ++end;
+    break;
+  case 'g':
+  case 'G':
+    multiplier = 1024.0 * 1024.0 * 1024.0;
+    ++end;
+    break;
+  default:
+    return false;
+  }
+
+  if (*end != '\0')
+    return false;
+
+  /* 2^64, converting anything from there on is undefined */
+  const double bytes = value * multiplier;
+  if (bytes >= 18446744073709551616.0)
+    return false;
+  *out = (uint64_t)bytes;
+  return true;
+}
@@ -0,0 +1,47 @@
+#include <drop/pacer.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#define NS_PER_SEC 1000000000ull
+
+void pacer_init(pacer_t *pacer, uint64_t rate) {
+  assert(pacer);
+  pacer->rate = rate;
+  atomic_init(&pacer->tat_ns, 0);
+}
+
+uint64_t pacer_now_ns(void) {
+  struct timespec now = {0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+uint64_t pacer_reserve(pacer_t *pacer, size_t bytes) {
+  if (!pacer || pacer->rate == 0)
+    return 0;
+
+  const uint64_t cost = (uint64_t)bytes * NS_PER_SEC / pacer->rate;
+  const uint64_t now = pacer_now_ns();
+
+  /* an idle pacer restarts at now, it does not bank credit for a burst */
+  uint64_t tat = atomic_load_explicit(&pacer->tat_ns, memory_order_relaxed);
+  uint64_t departure;
+  do {
+    departure = tat > now ? tat : now;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &pacer->tat_ns, &tat, departure + cost, memory_order_relaxed,
+      memory_order_relaxed));
+
+  return departure;
+}
+
+void pacer_sleep_until(uint64_t departure_ns) {
+  const struct timespec until = {
+      .tv_sec = (time_t)(departure_ns / NS_PER_SEC),
+      .tv_nsec = (long)(departure_ns % NS_PER_SEC),
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+    ;
+}
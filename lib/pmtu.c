@@ -0,0 +1,170 @@
+#include <drop/pmtu.h>
+#include <drop/tftp.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#define IPV6_HEADER_SIZE 40
+#define IPV4_HEADER_SIZE 20
+#define UDP_HEADER_SIZE 8
+#define TFTP_HEADER_SIZE 4
+
+struct pmtu_entry {
+  bool used;
+  struct in6_addr address;
+  uint16_t blksize;
+};
+
+struct pmtu_cache {
+  pthread_mutex_t lock;
+  size_t mapping_size;
+  size_t entries;
+  size_t next; /* the entry to replace once all are used */
+  struct pmtu_entry entry[];
+};
+
+static void pmtu_lock(pmtu_cache_t *cache) {
+  if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&cache->lock);
+}
+
+static void pmtu_unlock(pmtu_cache_t *cache) {
+  pthread_mutex_unlock(&cache->lock);
+}
+
+pmtu_cache_t *pmtu_cache_new(size_t entries) {
+  assert(entries > 0);
+
+  const size_t size =
+      sizeof(pmtu_cache_t) + entries * sizeof(struct pmtu_entry);
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  pmtu_cache_t *cache = mapping;
+  cache->mapping_size = size;
+  cache->entries = entries;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&cache->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  return cache;
+}
+
+void pmtu_cache_free(pmtu_cache_t *cache) {
+  if (!cache)
+    return;
+  pthread_mutex_destroy(&cache->lock);
+  munmap(cache, cache->mapping_size);
+}
+
+int pmtu_setup(int socket) {
+  const int on = 1;
+  if (-1 == setsockopt(socket, IPPROTO_IPV6, IPV6_DONTFRAG, &on, sizeof(on)))
+    return -1;
+
+  /* DO rather than PROBE: sends above the learned path MTU fail with
+   * EMSGSIZE instead of vanishing */
+  const int v6 = IPV6_PMTUDISC_DO;
+  if (-1 == setsockopt(socket, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &v6,
+                       sizeof(v6)))
+    return -1;
+
+  /* v4-mapped destinations go by the IPv4 setting, a v6only socket
+   * refuses it */
+  const int v4 = IP_PMTUDISC_DO;
+  setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, &v4, sizeof(v4));
+  return 0;
+}
+
+static bool pmtu_peer(int socket, struct in6_addr *out) {
+  struct sockaddr_in6 peer = {0};
+  socklen_t size = sizeof(peer);
+  if (-1 == getpeername(socket, (struct sockaddr *)&peer, &size) ||
+      peer.sin6_family != AF_INET6)
+    return false;
+  *out = peer.sin6_addr;
+  return true;
+}
+
+static uint16_t pmtu_from_kernel(int socket, const struct in6_addr *peer) {
+  const bool v4 = IN6_IS_ADDR_V4MAPPED(peer);
+
+  int mtu = 0;
+  socklen_t size = sizeof(mtu);
+  if (-1 == getsockopt(socket, IPPROTO_IPV6, IPV6_MTU, &mtu, &size)) {
+    size = sizeof(mtu);
+    if (!v4 || -1 == getsockopt(socket, IPPROTO_IP, IP_MTU, &mtu, &size))
+      return TFTP_BLOCK_SIZE;
+  }
+
+  const int headers = (v4 ? IPV4_HEADER_SIZE : IPV6_HEADER_SIZE) +
+                      UDP_HEADER_SIZE + TFTP_HEADER_SIZE;
+  if (mtu - headers < TFTP_BLOCK_SIZE)
+    return TFTP_BLOCK_SIZE;
+  if (mtu - headers > TFTP_MAX_BLOCK_SIZE)
+    return TFTP_MAX_BLOCK_SIZE;
+  return (uint16_t)(mtu - headers);
+}
+
+static struct pmtu_entry *pmtu_find(pmtu_cache_t *cache,
+                                    const struct in6_addr *peer) {
+  for (size_t n = 0; n < cache->entries; ++n) {
+    struct pmtu_entry *entry = cache->entry + n;
+    if (entry->used && memcmp(&entry->address, peer, sizeof(*peer)) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+uint16_t pmtu_blksize(pmtu_cache_t *cache, int socket) {
+  struct in6_addr peer = {0};
+  if (!pmtu_peer(socket, &peer))
+    return TFTP_BLOCK_SIZE;
+
+  uint16_t blksize = pmtu_from_kernel(socket, &peer);
+  if (!cache)
+    return blksize;
+
+  pmtu_lock(cache);
+  const struct pmtu_entry *entry = pmtu_find(cache, &peer);
+  if (entry && entry->blksize < blksize)
+    blksize = entry->blksize;
+  pmtu_unlock(cache);
+
+  return blksize;
+}
+
+void pmtu_cache_lower(pmtu_cache_t *cache, int socket, uint16_t blksize) {
+  struct in6_addr peer = {0};
+  if (!cache || !pmtu_peer(socket, &peer))
+    return;
+
+  if (blksize < TFTP_BLOCK_SIZE)
+    blksize = TFTP_BLOCK_SIZE;
+
+  pmtu_lock(cache);
+  struct pmtu_entry *entry = pmtu_find(cache, &peer);
+  if (!entry) {
+    entry = cache->entry + cache->next;
+    cache->next = (cache->next + 1) % cache->entries;
+    *entry = (struct pmtu_entry){
+        .used = true,
+        .address = peer,
+        .blksize = blksize,
+    };
+  } else if (blksize < entry->blksize) {
+    entry->blksize = blksize;
+  }
+  pmtu_unlock(cache);
+}
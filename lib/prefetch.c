@@ -0,0 +1,397 @@
+#include <drop/prefetch.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* a FIFO in the list must not block its open, it is refused once stated */
+#define PREFETCH_OPEN_FLAGS (O_RDONLY | O_CLOEXEC | O_NONBLOCK)
+
+/* what a completion is for, in the low bits of its user_data */
+enum {
+  PREFETCH_OPEN,
+  PREFETCH_STATX,
+  PREFETCH_READ,
+  PREFETCH_OPS,
+};
+
+typedef struct {
+  int fd; /* -1 until opened, and once handed out */
+  struct statx statx;
+  uint8_t *buffer;
+  size_t got;       /* bytes read into buffer */
+  int error;        /* the first of its operations that failed */
+  unsigned pending; /* operations in flight */
+} prefetch_slot_t;
+
+/* the rings as io_uring_setup(2) describes them, without liburing */
+typedef struct {
+  int fd; /* -1 without io_uring */
+  unsigned entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring; /* sq_ring with IORING_FEAT_SINGLE_MMAP */
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned queued; /* entries filled in and not submitted */
+  bool fixed;      /* the buffers are registered */
+} prefetch_ring_t;
+
+struct prefetch {
+  char *const *paths;
+  size_t count;
+  size_t next;  /* the next file to read ahead */
+  size_t taken; /* files handed out */
+  size_t depth;
+  size_t buffer_size;
+  uint8_t *buffers;
+  prefetch_slot_t *slots; /* file n in slots[n % depth] */
+  prefetch_ring_t ring;
+};
+
+static void prefetch_ring_unmap(prefetch_ring_t *ring) {
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+static bool prefetch_ring_setup(prefetch_ring_t *ring, unsigned entries) {
+  struct io_uring_params params = {0};
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd == -1)
+    return false;
+  ring->entries = params.sq_entries;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries *
+                                                 sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries *
+                                                sizeof(struct io_uring_cqe);
+  const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ring->cq_ring_size > ring->sq_ring_size)
+    ring->sq_ring_size = ring->cq_ring_size;
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto err;
+  }
+  ring->cq_ring =
+      single ? ring->sq_ring
+             : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if (ring->cq_ring == MAP_FAILED) {
+    ring->cq_ring = NULL;
+    goto err;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto err;
+  }
+
+  uint8_t *sq = ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  uint8_t *cq = ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return true;
+
+err:
+  prefetch_ring_unmap(ring);
+  close(ring->fd);
+  ring->fd = -1;
+  return false;
+}
+
+/* hands the queued entries to the kernel, waiting for a completion */
+static bool prefetch_ring_submit(prefetch_ring_t *ring, bool wait) {
+  const unsigned tail = *ring->sq_tail + ring->queued;
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  ring->queued = 0;
+  /* with what an earlier failed call left in the ring */
+  const unsigned submit =
+      tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  while (syscall(__NR_io_uring_enter, ring->fd, submit, wait ? 1 : 0,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1) {
+    if (errno != EINTR)
+      return false;
+  }
+  return true;
+}
+
+static struct io_uring_sqe *prefetch_ring_sqe(prefetch_ring_t *ring) {
+  const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  const unsigned tail = *ring->sq_tail + ring->queued;
+  /* the ring holds every operation in flight, a full one is a bug */
+  assert(tail - head < ring->entries);
+  (void)head;
+  const unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = ring->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ++ring->queued;
+  return sqe;
+}
+
+static uint64_t prefetch_user_data(const prefetch_t *prefetch,
+                                   const prefetch_slot_t *slot, unsigned op) {
+  return (uint64_t)(slot - prefetch->slots) * PREFETCH_OPS + op;
+}
+
+/* the file's first operation, the rest follow once it is open */
+static void prefetch_start(prefetch_t *prefetch, size_t index) {
+  prefetch_slot_t *slot = prefetch->slots + index % prefetch->depth;
+  slot->fd = -1;
+  slot->got = 0;
+  slot->error = 0;
+  slot->pending = 1;
+
+  struct io_uring_sqe *sqe = prefetch_ring_sqe(&prefetch->ring);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)prefetch->paths[index];
+  sqe->open_flags = PREFETCH_OPEN_FLAGS;
+  sqe->user_data = prefetch_user_data(prefetch, slot, PREFETCH_OPEN);
+}
+
+static void prefetch_opened(prefetch_t *prefetch, prefetch_slot_t *slot) {
+  prefetch_ring_t *ring = &prefetch->ring;
+  struct io_uring_sqe *sqe = prefetch_ring_sqe(ring);
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = slot->fd;
+  sqe->addr = (uint64_t)(uintptr_t) "";
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = (uint64_t)(uintptr_t)&slot->statx;
+  sqe->statx_flags = AT_EMPTY_PATH;
+  sqe->user_data = prefetch_user_data(prefetch, slot, PREFETCH_STATX);
+
+  sqe = prefetch_ring_sqe(ring);
+  sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = slot->fd;
+  sqe->addr = (uint64_t)(uintptr_t)slot->buffer;
+  sqe->len = (unsigned)prefetch->buffer_size;
+  sqe->off = 0;
+  sqe->buf_index = (uint16_t)(slot - prefetch->slots);
+  sqe->user_data = prefetch_user_data(prefetch, slot, PREFETCH_READ);
+  slot->pending += 2;
+}
+
+static void prefetch_reap(prefetch_t *prefetch) {
+  prefetch_ring_t *ring = &prefetch->ring;
+  unsigned head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    const struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+    prefetch_slot_t *slot = prefetch->slots + cqe->user_data / PREFETCH_OPS;
+    const unsigned op = (unsigned)(cqe->user_data % PREFETCH_OPS);
+    const int res = cqe->res;
+    ++head;
+
+    --slot->pending;
+    /* no data in a FIFO yet, it is refused for its type */
+    if (res < 0 && !(op == PREFETCH_READ && res == -EAGAIN)) {
+      if (!slot->error)
+        slot->error = -res;
+      continue;
+    }
+    if (op == PREFETCH_OPEN) {
+      slot->fd = res;
+      prefetch_opened(prefetch, slot);
+    } else if (op == PREFETCH_READ && res > 0) {
+      slot->got = (size_t)res;
+    }
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* what the ring would have done, for the file asked for */
+static void prefetch_sync(prefetch_t *prefetch, prefetch_slot_t *slot,
+                          size_t index) {
+  slot->got = 0;
+  slot->error = 0;
+  slot->fd = open(prefetch->paths[index], PREFETCH_OPEN_FLAGS);
+  if (slot->fd == -1 ||
+      -1 == statx(slot->fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS,
+                  &slot->statx)) {
+    slot->error = errno;
+    return;
+  }
+  ssize_t got;
+  while ((got = pread(slot->fd, slot->buffer, prefetch->buffer_size, 0)) ==
+             -1 &&
+         errno == EINTR)
+    ;
+  if (got == -1 && errno != EAGAIN)
+    slot->error = errno;
+  slot->got = got > 0 ? (size_t)got : 0;
+}
+
+prefetch_t *prefetch_new(char *const *paths, size_t count, size_t depth,
+                         size_t buffer_size) {
+  assert(depth > 0 && depth <= UINT16_MAX);
+  prefetch_t *prefetch = calloc(1, sizeof(prefetch_t));
+  if (!prefetch)
+    return NULL;
+  prefetch->paths = paths;
+  prefetch->count = count;
+  prefetch->depth = depth;
+  prefetch->buffer_size = buffer_size;
+  prefetch->ring.fd = -1;
+  prefetch->slots = calloc(depth, sizeof(prefetch_slot_t));
+  prefetch->buffers = aligned_alloc(4096, depth * buffer_size);
+  if (!prefetch->slots || !prefetch->buffers) {
+    free(prefetch->slots);
+    free(prefetch->buffers);
+    free(prefetch);
+    errno = ENOMEM;
+    return NULL;
+  }
+  for (size_t n = 0; n < depth; ++n) {
+    prefetch->slots[n].fd = -1;
+    prefetch->slots[n].buffer = prefetch->buffers + n * buffer_size;
+  }
+
+  /* each file has at most its stat and read in flight */
+  if (!prefetch_ring_setup(&prefetch->ring, (unsigned)(4 * depth)))
+    return prefetch;
+
+  struct iovec *iov = calloc(depth, sizeof(struct iovec));
+  if (iov) {
+    for (size_t n = 0; n < depth; ++n)
+      iov[n] = (struct iovec){
+          .iov_base = prefetch->slots[n].buffer,
+          .iov_len = buffer_size,
+      };
+    /* pinned once rather than on every read, RLIMIT_MEMLOCK may refuse */
+    prefetch->ring.fixed =
+        syscall(__NR_io_uring_register, prefetch->ring.fd,
+                IORING_REGISTER_BUFFERS, iov, (unsigned)depth) == 0;
+    free(iov);
+  }
+
+  while (prefetch->next < count && prefetch->next < depth)
+    prefetch_start(prefetch, prefetch->next++);
+  if (!prefetch_ring_submit(&prefetch->ring, false)) {
+    const int error = errno;
+    prefetch_free(prefetch);
+    errno = error;
+    return NULL;
+  }
+  return prefetch;
+}
+
+void prefetch_free(prefetch_t *prefetch) {
+  if (!prefetch)
+    return;
+
+  prefetch_ring_t *ring = &prefetch->ring;
+  if (ring->fd != -1) {
+    /* the kernel may still write to the buffers */
+    for (size_t n = 0; n < prefetch->depth; ++n) {
+      while (prefetch->slots[n].pending) {
+        if (!prefetch_ring_submit(ring, true))
+          break;
+        prefetch_reap(prefetch);
+      }
+    }
+    prefetch_ring_unmap(ring);
+    close(ring->fd);
+  }
+  for (size_t n = 0; n < prefetch->depth; ++n)
+    if (prefetch->slots[n].fd != -1)
+      close(prefetch->slots[n].fd);
+  free(prefetch->slots);
+  free(prefetch->buffers);
+  free(prefetch);
+}
+
+bool prefetch_next(prefetch_t *prefetch, prefetch_file_t *out) {
+  assert(prefetch->taken < prefetch->count);
+  prefetch_ring_t *ring = &prefetch->ring;
+
+  /* the slot handed out last is free again for the next file ahead */
+  if (ring->fd != -1 && prefetch->taken && prefetch->next < prefetch->count)
+    prefetch_start(prefetch, prefetch->next++);
+
+  const size_t index = prefetch->taken++;
+  prefetch_slot_t *slot = prefetch->slots + index % prefetch->depth;
+  if (ring->fd == -1) {
+    prefetch_sync(prefetch, slot, index);
+  } else {
+    if (ring->queued && !prefetch_ring_submit(ring, false))
+      return false;
+    while (slot->pending) {
+      if (!prefetch_ring_submit(ring, true))
+        return false;
+      prefetch_reap(prefetch);
+    }
+    /* opens further ahead that completed meanwhile queued their statx and
+     * read, they go out now rather than once their file is asked for. The
+     * file asked for is ready, a failed submission is retried with the
+     * next one */
+    prefetch_reap(prefetch);
+    if (ring->queued)
+      prefetch_ring_submit(ring, false);
+  }
+
+  if (slot->error) {
+    if (slot->fd != -1)
+      close(slot->fd);
+    slot->fd = -1;
+    errno = slot->error;
+    return false;
+  }
+
+  const struct statx *statx = &slot->statx;
+  *out = (prefetch_file_t){
+      .fd = slot->fd,
+      .status =
+          {
+              .st_mode = statx->stx_mode,
+              .st_uid = statx->stx_uid,
+              .st_gid = statx->stx_gid,
+              .st_size = (off_t)statx->stx_size,
+              .st_mtime = (time_t)statx->stx_mtime.tv_sec,
+          },
+      .data = slot->buffer,
+      .data_size = slot->got,
+  };
+  slot->fd = -1;
+
+  /* the reads were at an offset, the caller reads on from after them */
+  if ((uint64_t)out->status.st_size > out->data_size &&
+      -1 == lseek(out->fd, (off_t)out->data_size, SEEK_SET)) {
+    const int error = errno;
+    close(out->fd);
+    errno = error;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,167 @@
+#include <drop/prefix.h>
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define V4_MAPPED_BITS 96
+#define PREFIX_TABLE_ROOT 0
+
+struct prefix_node {
+  int32_t child[2]; /* node indices, 0 for none as the root is no child */
+  int32_t value;    /* -1 unless a prefix ends here */
+};
+
+struct prefix_table {
+  struct prefix_node *nodes;
+  size_t count;
+  size_t capacity;
+};
+
+static bool is_v4_mapped_prefix(const prefix_t *prefix) {
+  return prefix->length >= V4_MAPPED_BITS &&
+         IN6_IS_ADDR_V4MAPPED(&prefix->address);
+}
+
+prefix_t prefix_of(const struct in6_addr *address, uint8_t length) {
+  prefix_t prefix = {
+      .address = *address,
+      .length = length > 128 ? 128 : length,
+  };
+
+  for (size_t n = 0; n < sizeof(prefix.address.s6_addr); ++n) {
+    const int bits = (int)prefix.length - (int)n * 8;
+    if (bits <= 0)
+      prefix.address.s6_addr[n] = 0;
+    else if (bits < 8)
+      prefix.address.s6_addr[n] &= (uint8_t)(0xff << (8 - bits));
+  }
+
+  return prefix;
+}
+
+bool prefix_contains(const prefix_t *prefix, const struct in6_addr *address) {
+  const prefix_t truncated = prefix_of(address, prefix->length);
+  return memcmp(&truncated.address, &prefix->address,
+                sizeof(struct in6_addr)) == 0;
+}
+
+bool prefix_parse(const char *string, prefix_t *out) {
+  char host[INET6_ADDRSTRLEN] = {0};
+  const char *slash = strchr(string, '/');
+  const size_t host_length = slash ? (size_t)(slash - string) : strlen(string);
+  if (host_length == 0 || host_length >= sizeof(host))
+    return false;
+  memcpy(host, string, host_length);
+
+  struct in6_addr address = {0};
+  unsigned max_length = 128;
+  unsigned offset = 0;
+
+  struct in_addr v4 = {0};
+  if (inet_pton(AF_INET, host, &v4) == 1) {
+    address.s6_addr[10] = 0xff;
+    address.s6_addr[11] = 0xff;
+    memcpy(address.s6_addr + 12, &v4, sizeof(v4));
+    max_length = 32;
+    offset = V4_MAPPED_BITS;
+  } else if (inet_pton(AF_INET6, host, &address) != 1) {
+    return false;
+  }
+
+  unsigned length = max_length;
+  if (slash) {
+    char *end = NULL;
+    const unsigned long value = strtoul(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' || value > max_length)
+      return false;
+    length = (unsigned)value;
+  }
+
+  *out = prefix_of(&address, (uint8_t)(length + offset));
+  return true;
+}
+
+static unsigned prefix_bit(const struct in6_addr *address, unsigned n) {
+  return (address->s6_addr[n / 8] >> (7 - n % 8)) & 1;
+}
+
+static int32_t prefix_table_add_node(prefix_table_t *table) {
+  if (table->count == table->capacity) {
+    const size_t capacity = table->capacity ? table->capacity * 2 : 64;
+    struct prefix_node *nodes =
+        realloc(table->nodes, capacity * sizeof(struct prefix_node));
+    if (!nodes)
+      return -1;
+    table->nodes = nodes;
+    table->capacity = capacity;
+  }
+
+  table->nodes[table->count] = (struct prefix_node){
+      .child = {0, 0},
+      .value = -1,
+  };
+  return (int32_t)table->count++;
+}
+
+prefix_table_t *prefix_table_new(void) {
+  prefix_table_t *table = calloc(1, sizeof(prefix_table_t));
+  if (!table)
+    return NULL;
+  if (prefix_table_add_node(table) != PREFIX_TABLE_ROOT) {
+    free(table);
+    return NULL;
+  }
+  return table;
+}
+
+void prefix_table_free(prefix_table_t *table) {
+  if (!table)
+    return;
+  free(table->nodes);
+  free(table);
+}
+
+bool prefix_table_insert(prefix_table_t *table, const prefix_t *prefix,
+                         int value) {
+  int32_t node = PREFIX_TABLE_ROOT;
+  for (unsigned n = 0; n < prefix->length; ++n) {
+    const unsigned bit = prefix_bit(&prefix->address, n);
+    if (!table->nodes[node].child[bit]) {
+      /* the node array may move */
+      const int32_t child = prefix_table_add_node(table);
+      if (child == -1)
+        return false;
+      table->nodes[node].child[bit] = child;
+    }
+    node = table->nodes[node].child[bit];
+  }
+  table->nodes[node].value = value;
+  return true;
+}
+
+int prefix_table_lookup(const prefix_table_t *table,
+                        const struct in6_addr *address) {
+  int32_t node = PREFIX_TABLE_ROOT;
+  int value = table->nodes[node].value;
+  for (unsigned n = 0; n < 128; ++n) {
+    node = table->nodes[node].child[prefix_bit(address, n)];
+    if (!node)
+      break;
+    if (table->nodes[node].value != -1)
+      value = table->nodes[node].value;
+  }
+  return value;
+}
+
+void prefix_format(const prefix_t *prefix, char *buffer, size_t size) {
+  char host[INET6_ADDRSTRLEN] = {0};
+  if (is_v4_mapped_prefix(prefix)) {
+    inet_ntop(AF_INET, prefix->address.s6_addr + 12, host, sizeof(host));
+    snprintf(buffer, size, "%s/%u", host, prefix->length - V4_MAPPED_BITS);
+  } else {
+    inet_ntop(AF_INET6, &prefix->address, host, sizeof(host));
+    snprintf(buffer, size, "%s/%u", host, prefix->length);
+  }
+}
@@ -0,0 +1,224 @@
+#include <drop/progress.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* weight of the latest interval in the throughput shown */
+#define PROGRESS_RATE_WEIGHT 0.3
+#define NS_PER_SEC 1000000000ull
+
+/* a cache line each, uploads in different processes do not contend */
+typedef struct {
+  _Atomic uint64_t size;
+  _Atomic uint64_t done;
+  atomic_bool expected; /* size was given */
+} __attribute__((aligned(64))) progress_slot_t;
+
+typedef enum {
+  PROGRESS_RUNNING,
+  PROGRESS_OK,
+  PROGRESS_FAILED,
+} progress_state_t;
+
+struct progress {
+  progress_slot_t *slots; /* shared */
+  size_t count;
+  /* the rest is the renderer's */
+  progress_state_t *states;
+  size_t ok;
+  size_t failed;
+  FILE *out;
+  bool terminal;
+  uint64_t interval_ns;
+  uint64_t rendered_ns; /* 0 before the first line */
+  uint64_t rendered_bytes;
+  double rate; /* bytes/s, smoothed */
+  int width;   /* of the line drawn in place, 0 for none */
+};
+
+progress_t *progress_new(size_t count, FILE *out, uint64_t interval_ns) {
+  assert(out);
+  progress_t *progress = calloc(1, sizeof(progress_t));
+  if (!progress)
+    return NULL;
+  progress->count = count;
+  progress->out = out;
+  progress->terminal = isatty(fileno(out));
+  progress->interval_ns = interval_ns;
+  progress->states = calloc(count ? count : 1, sizeof(progress_state_t));
+  progress->slots = mmap(NULL, (count ? count : 1) * sizeof(progress_slot_t),
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                         -1, 0);
+  if (!progress->states || progress->slots == MAP_FAILED) {
+    const int error = progress->states ? errno : ENOMEM;
+    if (progress->slots != MAP_FAILED)
+      munmap(progress->slots, (count ? count : 1) * sizeof(progress_slot_t));
+    free(progress->states);
+    free(progress);
+    errno = error;
+    return NULL;
+  }
+  return progress;
+}
+
+void progress_free(progress_t *progress) {
+  if (!progress)
+    return;
+  munmap(progress->slots,
+         (progress->count ? progress->count : 1) * sizeof(progress_slot_t));
+  free(progress->states);
+  free(progress);
+}
+
+void progress_expect(progress_t *progress, size_t index, uint64_t size) {
+  assert(index < progress->count);
+  progress_slot_t *slot = progress->slots + index;
+  atomic_fetch_add_explicit(&slot->size, size, memory_order_relaxed);
+  atomic_store_explicit(&slot->expected, true, memory_order_relaxed);
+}
+
+void progress_add(progress_t *progress, size_t index, int64_t bytes) {
+  assert(index < progress->count);
+  /* two's complement takes a negative one off */
+  atomic_fetch_add_explicit(&progress->slots[index].done, (uint64_t)bytes,
+                            memory_order_relaxed);
+}
+
+void progress_finish(progress_t *progress, size_t index, bool ok) {
+  assert(index < progress->count);
+  if (progress->states[index] != PROGRESS_RUNNING)
+    return;
+  progress->states[index] = ok ? PROGRESS_OK : PROGRESS_FAILED;
+  if (ok)
+    ++progress->ok;
+  else
+    ++progress->failed;
+
+  /* uploads without ACKs to count, multicast ones, are done once over */
+  progress_slot_t *slot = progress->slots + index;
+  if (ok && atomic_load(&slot->expected))
+    atomic_store(&slot->done, atomic_load(&slot->size));
+}
+
+/* 1023 bytes as "1023", larger counts in binary units with a decimal */
+static void progress_format_size(char *out, size_t size, double bytes) {
+  static const char units[] = "KMGTPE";
+  if (bytes < 1024) {
+    snprintf(out, size, "%.0f", bytes);
+    return;
+  }
+  size_t unit = 0;
+  bytes /= 1024;
+  while (bytes >= 1024 && unit + 1 < sizeof(units) - 1) {
+    bytes /= 1024;
+    ++unit;
+  }
+  snprintf(out, size, "%.1f%c", bytes, units[unit]);
+}
+
+static void progress_format_time(char *out, size_t size, uint64_t seconds) {
+  if (seconds >= 3600)
+    snprintf(out, size, "%u:%02u:%02u", (unsigned)(seconds / 3600),
+             (unsigned)(seconds / 60 % 60), (unsigned)(seconds % 60));
+  else
+    snprintf(out, size, "%u:%02u", (unsigned)(seconds / 60),
+             (unsigned)(seconds % 60));
+}
+
+static void progress_draw(progress_t *progress, uint64_t now_ns) {
+  uint64_t done = 0;
+  uint64_t total = 0;
+  bool unknown = false; /* an upload still running has no size */
+  for (size_t n = 0; n < progress->count; ++n) {
+    const progress_slot_t *slot = progress->slots + n;
+    const uint64_t bytes =
+        atomic_load_explicit(&slot->done, memory_order_relaxed);
+    const uint64_t size =
+        atomic_load_explicit(&slot->size, memory_order_relaxed);
+    const bool running = progress->states[n] == PROGRESS_RUNNING;
+    done += bytes;
+    /* a failed upload moves no more than it did */
+    if (atomic_load_explicit(&slot->expected, memory_order_relaxed) &&
+        progress->states[n] != PROGRESS_FAILED)
+      total += size > bytes ? size : bytes;
+    else
+      total += bytes;
+    unknown = unknown ||
+              (running && !atomic_load_explicit(&slot->expected,
+                                                memory_order_relaxed));
+  }
+
+  if (progress->rendered_ns && now_ns > progress->rendered_ns) {
+    const uint64_t moved =
+        done > progress->rendered_bytes ? done - progress->rendered_bytes : 0;
+    const double rate = (double)moved * NS_PER_SEC /
+                        (double)(now_ns - progress->rendered_ns);
+    progress->rate = progress->rate ? progress->rate +
+                                          PROGRESS_RATE_WEIGHT *
+                                              (rate - progress->rate)
+                                    : rate;
+  }
+  progress->rendered_ns = now_ns;
+  progress->rendered_bytes = done;
+
+  char done_text[16];
+  char total_text[16];
+  char rate_text[16];
+  char left_text[16] = "?";
+  progress_format_size(done_text, sizeof(done_text), (double)done);
+  progress_format_size(total_text, sizeof(total_text), (double)total);
+  progress_format_size(rate_text, sizeof(rate_text), progress->rate);
+  if (!unknown && progress->rate >= 1)
+    progress_format_time(left_text, sizeof(left_text),
+                         (uint64_t)((double)(total - done) / progress->rate));
+
+  char line[160];
+  int length = snprintf(line, sizeof(line),
+                        "%zu/%zu files, %s of %s, %s/s, %s left",
+                        progress->ok, progress->count, done_text, total_text,
+                        rate_text, left_text);
+  if (progress->failed)
+    length += snprintf(line + length, sizeof(line) - (size_t)length,
+                       ", %zu failed", progress->failed);
+
+  if (progress->terminal) {
+    /* spaces over what a longer line before left */
+    const int pad = progress->width > length ? progress->width - length : 0;
+    fprintf(progress->out, "\r%s%*s", line, pad, "");
+    progress->width = length;
+  } else {
+    fprintf(progress->out, "%s\n", line);
+  }
+  fflush(progress->out);
+}
+
+void progress_render(progress_t *progress, uint64_t now_ns) {
+  if (progress->rendered_ns &&
+      now_ns - progress->rendered_ns < progress->interval_ns)
+    return;
+  progress_draw(progress, now_ns);
+}
+
+uint64_t progress_next_ns(const progress_t *progress) {
+  return progress->rendered_ns + progress->interval_ns;
+}
+
+void progress_clear(progress_t *progress) {
+  if (!progress->width)
+    return;
+  fprintf(progress->out, "\r%*s\r", progress->width, "");
+  fflush(progress->out);
+  progress->width = 0;
+}
+
+void progress_done(progress_t *progress, uint64_t now_ns) {
+  progress_draw(progress, now_ns);
+  if (progress->terminal) {
+    fputc('\n', progress->out);
+    progress->width = 0;
+  }
+}
@@ -0,0 +1,280 @@
+#include <drop/pmtu.h>
+#include <drop/relay.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the upload to the next hop, as the client does it */
+#define RELAY_WINDOW 16
+#define RELAY_ACK_EVERY 8
+#define RELAY_TIMEOUT 1
+/* a busy next hop is asked again, until data was read for it */
+#define RELAY_ATTEMPTS 5
+#define RELAY_RETRY_MS 1000
+
+struct relay {
+  char *filename;
+  struct sockaddr_in6 next_hop;
+  relay_commit_t commit;
+  int local;  /* the file here */
+  int feed;   /* our end of the pair, -1 once closed */
+  int source; /* the thread's end */
+  FILE *stream;
+  FILE *input; /* source as the upload's file */
+  /* set before feed is closed, end of file then ends the upload instead of
+   * aborting it */
+  atomic_bool complete;
+  pthread_t thread;
+  bool joined;
+  tftp_result_t result; /* once joined */
+  int failed; /* the next hop's error, downstream commit fails writes with it */
+};
+
+static bool write_all(int fd, const char *data, size_t size) {
+  while (size) {
+    const ssize_t written = write(fd, data, size);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1)
+      return false;
+    data += written;
+    size -= (size_t)written;
+  }
+  return true;
+}
+
+/* as write_all, a next hop that is gone fails with EPIPE, not SIGPIPE */
+static bool send_all(int fd, const char *data, size_t size) {
+  while (size) {
+    const ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent == -1 && errno == EINTR)
+      continue;
+    if (sent == -1)
+      return false;
+    data += sent;
+    size -= (size_t)sent;
+  }
+  return true;
+}
+
+static void relay_join(relay_t *relay) {
+  if (relay->joined)
+    return;
+  pthread_join(relay->thread, NULL);
+  relay->joined = true;
+}
+
+/* the next hop first, stdio writes a failed buffer again on close */
+static ssize_t relay_write(void *cookie, const char *data, size_t size) {
+  relay_t *relay = cookie;
+  if (relay->failed) {
+    errno = relay->failed;
+    return -1;
+  }
+
+  if (relay->feed != -1 && !send_all(relay->feed, data, size)) {
+    /* the upload to the next hop ended early, its thread closed the pair */
+    const int error = errno;
+    close(relay->feed);
+    relay->feed = -1;
+    if (relay->commit == RELAY_COMMIT_DOWNSTREAM) {
+      relay_join(relay);
+      relay->failed = relay->result.error ? relay->result.error : error;
+      errno = relay->failed;
+      return -1;
+    }
+  }
+
+  if (!write_all(relay->local, data, size))
+    return -1;
+  return (ssize_t)size;
+}
+
+static int relay_stream_close(void *cookie) {
+  relay_t *relay = cookie;
+  const int result = close(relay->local);
+  relay->local = -1;
+  return result;
+}
+
+static ssize_t relay_read(void *cookie, char *buffer, size_t size) {
+  relay_t *relay = cookie;
+  ssize_t got;
+  while ((got = read(relay->source, buffer, size)) == -1 && errno == EINTR)
+    ;
+  if (got == 0 && !atomic_load(&relay->complete)) {
+    errno = ECONNABORTED;
+    return -1;
+  }
+  return got;
+}
+
+static int relay_input_close(void *cookie) {
+  relay_t *relay = cookie;
+  const int result = close(relay->source);
+  relay->source = -1;
+  return result;
+}
+
+static void relay_backoff(unsigned retry_after_ms) {
+  const unsigned delay_ms = retry_after_ms ? retry_after_ms : RELAY_RETRY_MS;
+  const struct timespec delay = {
+      .tv_sec = (time_t)(delay_ms / 1000),
+      .tv_nsec = (long)(delay_ms % 1000) * 1000000,
+  };
+  nanosleep(&delay, NULL);
+}
+
+static tftp_result_t relay_upload(relay_t *relay) {
+  tftp_result_t result = {0};
+  for (unsigned attempt = 0; attempt < RELAY_ATTEMPTS; ++attempt) {
+    const int s = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (s == -1)
+      return (tftp_result_t){.error = errno};
+    if (-1 == pmtu_setup(s) ||
+        -1 == connect(s, (const struct sockaddr *)&relay->next_hop,
+                      sizeof(relay->next_hop))) {
+      const int error = errno;
+      close(s);
+      return (tftp_result_t){.error = error};
+    }
+
+    const tftp_params_t request = {
+        .blksize = pmtu_blksize(NULL, s),
+        .windowsize = RELAY_WINDOW,
+        .ackevery = RELAY_ACK_EVERY,
+        .timeout = RELAY_TIMEOUT,
+    };
+    result = tftp_send_wrq(s, relay->filename, relay->input, &request, NULL);
+    close(s);
+
+    /* the pair cannot be read again, only an upload that did not start is
+     * retried */
+    if (result.started ||
+        (result.error != EBUSY && result.error != ETIMEDOUT))
+      break;
+    if (attempt + 1 < RELAY_ATTEMPTS)
+      relay_backoff(result.retry_after_ms);
+  }
+  return result;
+}
+
+static void *relay_thread(void *arg) {
+  relay_t *relay = arg;
+  relay->result = relay_upload(relay);
+  /* the session's writes fail from here on rather than block */
+  fclose(relay->input);
+  relay->input = NULL;
+  return NULL;
+}
+
+relay_t *relay_open(const char *filename, const struct sockaddr_in6 *next_hop,
+                    relay_commit_t commit) {
+  relay_t *relay = calloc(1, sizeof(relay_t));
+  if (!relay)
+    return NULL;
+  relay->next_hop = *next_hop;
+  relay->commit = commit;
+  relay->local = relay->feed = relay->source = -1;
+  atomic_init(&relay->complete, false);
+
+  int pair[2] = {-1, -1};
+  relay->filename = strdup(filename);
+  if (!relay->filename)
+    goto err;
+  relay->local = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0666);
+  if (relay->local == -1)
+    goto err;
+  if (-1 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair))
+    goto err;
+  relay->feed = pair[0];
+  relay->source = pair[1];
+  /* how far the upstream may get ahead, capped by net.core.wmem_max */
+  const int size = RELAY_BUFFER;
+  setsockopt(relay->feed, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+  const cookie_io_functions_t input_functions = {
+      .read = &relay_read,
+      .close = &relay_input_close,
+  };
+  relay->input = fopencookie(relay, "r", input_functions);
+  if (!relay->input)
+    goto err;
+
+  /* the session's stdio buffer is the only one in front of the tee */
+  const cookie_io_functions_t stream_functions = {
+      .write = &relay_write,
+      .close = &relay_stream_close,
+  };
+  relay->stream = fopencookie(relay, "w", stream_functions);
+  if (!relay->stream)
+    goto err;
+
+  const int created =
+      pthread_create(&relay->thread, NULL, &relay_thread, relay);
+  if (created != 0) {
+    errno = created;
+    goto err;
+  }
+  return relay;
+
+err: {
+  const int error = errno;
+  if (relay->stream)
+    fclose(relay->stream);
+  else if (relay->local != -1)
+    close(relay->local);
+  if (relay->input)
+    fclose(relay->input);
+  else if (relay->source != -1)
+    close(relay->source);
+  if (relay->feed != -1)
+    close(relay->feed);
+  free(relay->filename);
+  free(relay);
+  errno = error;
+  return NULL;
+}
+}
+
+FILE *relay_stream(relay_t *relay) { return relay->stream; }
+
+int relay_close(relay_t *relay, bool complete) {
+  /* what stdio still holds goes through the tee first */
+  int error = fclose(relay->stream) == 0 ? 0 : errno;
+  relay->stream = NULL;
+
+  if (relay->feed != -1) {
+    atomic_store(&relay->complete, complete && !error);
+    close(relay->feed);
+    relay->feed = -1;
+  }
+
+  if (!error && complete && relay->commit == RELAY_COMMIT_DOWNSTREAM) {
+    relay_join(relay);
+    error = relay->result.error;
+  }
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+tftp_result_t relay_finish(relay_t *relay) {
+  relay_join(relay);
+  const tftp_result_t result = relay->result;
+  free(relay->filename);
+  free(relay);
+  return result;
+}
@@ -0,0 +1,498 @@
+#include <drop/sched.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/* bytes a class may get ahead of its clock before ACKs are delayed */
+#define SCHED_BURST (64 * 1024)
+#define SCHED_HISTOGRAM_BUCKETS 32
+#define NS_PER_SEC 1000000000ull
+
+struct sched_class {
+  bool used;
+  bool capped;
+  prefix_t subnet;
+  uint32_t weight;
+  uint32_t sessions;
+  uint64_t rate;   /* allocated share in bytes/s, 0 when unlimited */
+  uint64_t tat_ns; /* theoretical arrival time of the next byte */
+  uint64_t bytes;
+  uint64_t wait_ns;
+  uint64_t active_ns;
+  uint64_t active_since_ns;
+};
+
+struct sched_session {
+  bool used;
+  bool completed; /* transfer over, the process has yet to exit */
+  pid_t pid;
+  size_t class;
+  uint64_t start_ns;
+  uint64_t bytes;
+};
+
+struct sched {
+  pthread_mutex_t lock;
+  size_t mapping_size;
+
+  uint64_t rate;
+  uint64_t client_rate;
+  uint8_t subnet_v4;
+  uint8_t subnet_v6;
+
+  /* only read by the accept loop, lives in its heap */
+  sched_weight_t *weights;
+  size_t weight_count;
+
+  size_t max_sessions;
+  uint32_t active_sessions;
+  uint64_t sessions_total;
+
+  uint64_t small_uploads;
+  uint64_t small_latency[SCHED_HISTOGRAM_BUCKETS]; /* log2 of microseconds */
+
+  struct sched_class *classes;
+  struct sched_session *sessions;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec now = {0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+static void sched_lock(sched_t *sched) {
+  if (pthread_mutex_lock(&sched->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&sched->lock);
+}
+
+static void sched_unlock(sched_t *sched) { pthread_mutex_unlock(&sched->lock); }
+
+sched_t *sched_new(const sched_config_t *config, size_t max_sessions) {
+  assert(config);
+  assert(max_sessions > 0);
+
+  const size_t size = sizeof(sched_t) +
+                      max_sessions * sizeof(struct sched_class) +
+                      max_sessions * sizeof(struct sched_session);
+
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  sched_t *sched = mapping;
+  sched->mapping_size = size;
+  sched->rate = config->rate;
+  sched->client_rate = config->client_rate;
+  sched->subnet_v4 = config->subnet_v4;
+  sched->subnet_v6 = config->subnet_v6;
+  sched->max_sessions = max_sessions;
+  sched->classes = (struct sched_class *)(sched + 1);
+  sched->sessions = (struct sched_session *)(sched->classes + max_sessions);
+
+  if (config->weight_count) {
+    sched->weights = calloc(config->weight_count, sizeof(sched_weight_t));
+    assert(sched->weights);
+    memcpy(sched->weights, config->weights,
+           config->weight_count * sizeof(sched_weight_t));
+    sched->weight_count = config->weight_count;
+  }
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&sched->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  return sched;
+}
+
+void sched_free(sched_t *sched) {
+  if (!sched)
+    return;
+  free(sched->weights);
+  pthread_mutex_destroy(&sched->lock);
+  munmap(sched, sched->mapping_size);
+}
+
+static uint32_t sched_weight(const sched_t *sched,
+                             const struct in6_addr *client) {
+  uint32_t weight = 1;
+  int best = -1;
+  for (size_t n = 0; n < sched->weight_count; ++n) {
+    const sched_weight_t *rule = sched->weights + n;
+    if (rule->prefix.length > best &&
+        prefix_contains(&rule->prefix, client)) {
+      best = rule->prefix.length;
+      weight = rule->weight;
+    }
+  }
+  return weight ? weight : 1;
+}
+
+/* splits the global rate over active classes by weight (water-filling) */
+static void sched_rebalance(sched_t *sched) {
+  double remaining = (double)sched->rate;
+  double weights = 0;
+
+  for (size_t n = 0; n < sched->max_sessions; ++n) {
+    struct sched_class *class = sched->classes + n;
+    class->capped = false;
+    class->rate = sched->client_rate;
+    if (class->sessions)
+      weights += class->weight;
+  }
+
+  if (sched->rate == 0)
+    return;
+
+  for (bool changed = true; changed && weights > 0;) {
+    changed = false;
+    for (size_t n = 0; n < sched->max_sessions; ++n) {
+      struct sched_class *class = sched->classes + n;
+      if (!class->sessions || class->capped)
+        continue;
+
+      const double share = remaining * class->weight / weights;
+      if (sched->client_rate && (double)sched->client_rate < share) {
+        class->capped = true;
+        remaining -= (double)sched->client_rate;
+        weights -= class->weight;
+        changed = true;
+      }
+    }
+  }
+
+  for (size_t n = 0; n < sched->max_sessions; ++n) {
+    struct sched_class *class = sched->classes + n;
+    if (class->sessions && !class->capped) {
+      const double share = remaining * class->weight / weights;
+      class->rate = share < 1 ? 1 : (uint64_t)share;
+    }
+  }
+}
+
+static struct sched_class *sched_class_for(sched_t *sched,
+                                           const struct in6_addr *client) {
+  const uint8_t length = IN6_IS_ADDR_V4MAPPED(client)
+                             ? (uint8_t)(96 + sched->subnet_v4)
+                             : sched->subnet_v6;
+  const prefix_t subnet = prefix_of(client, length);
+
+  struct sched_class *free_class = NULL;
+  for (size_t n = 0; n < sched->max_sessions; ++n) {
+    struct sched_class *class = sched->classes + n;
+    if (class->used && class->subnet.length == subnet.length &&
+        memcmp(&class->subnet.address, &subnet.address,
+               sizeof(subnet.address)) == 0)
+      return class;
+
+    /* prefer never used slots, keeping idle classes' counters around */
+    if (!class->used && (!free_class || free_class->used))
+      free_class = class;
+    else if (class->used && !class->sessions && !free_class)
+      free_class = class;
+  }
+
+  if (!free_class)
+    return NULL;
+
+  *free_class = (struct sched_class){
+      .used = true,
+      .subnet = subnet,
+  };
+  return free_class;
+}
+
+void sched_reconfigure(sched_t *sched, const sched_config_t *config) {
+  assert(sched);
+  assert(config);
+
+  /* the weights live in the accept loop's heap, no lock needed for them */
+  free(sched->weights);
+  sched->weights = NULL;
+  sched->weight_count = 0;
+  if (config->weight_count) {
+    sched->weights = calloc(config->weight_count, sizeof(sched_weight_t));
+    assert(sched->weights);
+    memcpy(sched->weights, config->weights,
+           config->weight_count * sizeof(sched_weight_t));
+    sched->weight_count = config->weight_count;
+  }
+
+  sched_lock(sched);
+  sched->rate = config->rate;
+  sched->client_rate = config->client_rate;
+  for (size_t n = 0; n < sched->max_sessions; ++n) {
+    struct sched_class *class = sched->classes + n;
+    if (class->used)
+      class->weight = sched_weight(sched, &class->subnet.address);
+  }
+  sched_rebalance(sched);
+  sched_unlock(sched);
+}
+
+int sched_session_begin(sched_t *sched, const struct in6_addr *client) {
+  assert(sched);
+  assert(client);
+
+  const uint32_t weight = sched_weight(sched, client);
+
+  sched_lock(sched);
+
+  struct sched_session *session = NULL;
+  for (size_t n = 0; n < sched->max_sessions && !session; ++n) {
+    if (!sched->sessions[n].used)
+      session = sched->sessions + n;
+  }
+
+  struct sched_class *class = session ? sched_class_for(sched, client) : NULL;
+  if (!class) {
+    sched_unlock(sched);
+    return -1;
+  }
+
+  const uint64_t now = now_ns();
+
+  *session = (struct sched_session){
+      .used = true,
+      .class = (size_t)(class - sched->classes),
+      .start_ns = now,
+  };
+
+  class->weight = weight;
+  if (class->sessions++ == 0) {
+    class->active_since_ns = now;
+    class->tat_ns = now;
+    sched_rebalance(sched);
+  }
+
+  ++sched->active_sessions;
+  ++sched->sessions_total;
+
+  sched_unlock(sched);
+  return (int)(session - sched->sessions);
+}
+
+void sched_session_attach(sched_t *sched, int slot, pid_t pid) {
+  assert(sched);
+  assert(slot >= 0 && (size_t)slot < sched->max_sessions);
+
+  sched_lock(sched);
+  sched->sessions[slot].pid = pid;
+  sched_unlock(sched);
+}
+
+static unsigned log2_bucket(uint64_t value) {
+  unsigned bucket = 0;
+  while (value > 1 && bucket + 1 < SCHED_HISTOGRAM_BUCKETS) {
+    value >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+static void sched_session_complete_locked(sched_t *sched, size_t slot) {
+  struct sched_session *session = sched->sessions + slot;
+  if (!session->used || session->completed)
+    return;
+
+  const uint64_t now = now_ns();
+
+  if (session->bytes <= SCHED_SMALL_UPLOAD) {
+    const uint64_t elapsed_us = (now - session->start_ns) / 1000;
+    ++sched->small_latency[log2_bucket(elapsed_us)];
+    ++sched->small_uploads;
+  }
+
+  struct sched_class *class = sched->classes + session->class;
+  if (--class->sessions == 0) {
+    class->active_ns += now - class->active_since_ns;
+    sched_rebalance(sched);
+  }
+
+  --sched->active_sessions;
+  session->completed = true;
+}
+
+static void sched_session_end_locked(sched_t *sched, size_t slot) {
+  struct sched_session *session = sched->sessions + slot;
+  if (!session->used)
+    return;
+
+  sched_session_complete_locked(sched, slot);
+  *session = (struct sched_session){0};
+}
+
+void sched_session_complete(sched_t *sched, int slot) {
+  if (!sched || slot < 0)
+    return;
+
+  assert((size_t)slot < sched->max_sessions);
+
+  sched_lock(sched);
+  sched_session_complete_locked(sched, (size_t)slot);
+  sched_unlock(sched);
+}
+
+void sched_session_end(sched_t *sched, int slot) {
+  assert(sched);
+  assert(slot >= 0 && (size_t)slot < sched->max_sessions);
+
+  sched_lock(sched);
+  sched_session_end_locked(sched, (size_t)slot);
+  sched_unlock(sched);
+}
+
+bool sched_session_reap(sched_t *sched, pid_t pid) {
+  assert(sched);
+
+  bool found = false;
+  sched_lock(sched);
+  for (size_t n = 0; n < sched->max_sessions && !found; ++n) {
+    if (sched->sessions[n].used && sched->sessions[n].pid == pid) {
+      sched_session_end_locked(sched, n);
+      found = true;
+    }
+  }
+  sched_unlock(sched);
+  return found;
+}
+
+void sched_acquire(sched_t *sched, int slot, size_t bytes) {
+  if (!sched || slot < 0)
+    return;
+
+  assert((size_t)slot < sched->max_sessions);
+
+  sched_lock(sched);
+
+  struct sched_session *session = sched->sessions + slot;
+  struct sched_class *class = sched->classes + session->class;
+  session->bytes += bytes;
+  class->bytes += bytes;
+
+  if (class->rate == 0) {
+    sched_unlock(sched);
+    return;
+  }
+
+  /* GCRA: a class may run SCHED_BURST bytes ahead of its virtual clock */
+  const uint64_t now = now_ns();
+  const uint64_t tolerance = SCHED_BURST * NS_PER_SEC / class->rate;
+  const uint64_t tat = class->tat_ns > now ? class->tat_ns : now;
+  const uint64_t release = tat > now + tolerance ? tat - tolerance : now;
+  class->tat_ns = tat + bytes * NS_PER_SEC / class->rate;
+  class->wait_ns += release - now;
+
+  sched_unlock(sched);
+
+  if (release > now) {
+    const struct timespec until = {
+        .tv_sec = (time_t)(release / NS_PER_SEC),
+        .tv_nsec = (long)(release % NS_PER_SEC),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+           EINTR)
+      ;
+  }
+}
+
+static void format_rate(uint64_t rate, char *buffer, size_t size) {
+  if (rate == 0)
+    snprintf(buffer, size, "unlimited");
+  else if (rate >= 1024 * 1024)
+    snprintf(buffer, size, "%.1fM/s", rate / (1024.0 * 1024.0));
+  else
+    snprintf(buffer, size, "%.1fk/s", rate / 1024.0);
+}
+
+static uint64_t histogram_percentile(const uint64_t *buckets, uint64_t count,
+                                     double percentile) {
+  const uint64_t rank = (uint64_t)(percentile * (double)count + 0.5);
+  uint64_t seen = 0;
+  for (unsigned n = 0; n < SCHED_HISTOGRAM_BUCKETS; ++n) {
+    seen += buckets[n];
+    if (seen >= rank && seen > 0)
+      return 2ull << n; /* upper bound of the bucket */
+  }
+  return 0;
+}
+
+void sched_dump(sched_t *sched, FILE *out) {
+  assert(sched);
+  assert(out);
+
+  sched_lock(sched);
+
+  const uint64_t now = now_ns();
+  char rate[32], client_rate[32];
+  format_rate(sched->rate, rate, sizeof(rate));
+  format_rate(sched->client_rate, client_rate, sizeof(client_rate));
+
+  fprintf(out, "sched: rate=%s client-rate=%s sessions=%u/%zu total=%" PRIu64
+          "\n",
+          rate, client_rate, sched->active_sessions, sched->max_sessions,
+          sched->sessions_total);
+
+  double sum = 0, sum_squares = 0;
+  unsigned classes = 0;
+  for (size_t n = 0; n < sched->max_sessions; ++n) {
+    const struct sched_class *class = sched->classes + n;
+    if (!class->used)
+      continue;
+
+    const uint64_t active_ns =
+        class->active_ns +
+        (class->sessions ? now - class->active_since_ns : 0);
+    const double throughput =
+        active_ns ? class->bytes * (double)NS_PER_SEC / active_ns : 0;
+
+    char subnet[INET6_ADDRSTRLEN + 8], share[32], achieved[32];
+    prefix_format(&class->subnet, subnet, sizeof(subnet));
+    format_rate(class->sessions ? class->rate : 0, share, sizeof(share));
+    format_rate((uint64_t)throughput, achieved, sizeof(achieved));
+
+    fprintf(out,
+            "  class %s weight=%u sessions=%u share=%s bytes=%" PRIu64
+            " throughput=%s wait=%" PRIu64 "ms\n",
+            subnet, class->weight, class->sessions,
+            class->sessions ? share : "-", class->bytes, achieved,
+            class->wait_ns / 1000000);
+
+    if (active_ns) {
+      const double normalized = throughput / class->weight;
+      sum += normalized;
+      sum_squares += normalized * normalized;
+      ++classes;
+    }
+  }
+
+  if (classes)
+    fprintf(out, "  fairness (jain, weight normalized): %.3f over %u classes\n",
+            sum_squares > 0 ? sum * sum / (classes * sum_squares) : 1.0,
+            classes);
+
+  if (sched->small_uploads)
+    fprintf(out,
+            "  small uploads (<=%d bytes): count=%" PRIu64 " p50<=%" PRIu64
+            "us p90<=%" PRIu64 "us p99<=%" PRIu64 "us\n",
+            SCHED_SMALL_UPLOAD, sched->small_uploads,
+            histogram_percentile(sched->small_latency, sched->small_uploads,
+                                 0.50),
+            histogram_percentile(sched->small_latency, sched->small_uploads,
+                                 0.90),
+            histogram_percentile(sched->small_latency, sched->small_uploads,
+                                 0.99));
+
+  sched_unlock(sched);
+  fflush(out);
+}
@@ -0,0 +1,218 @@
+#include <drop/sink.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct sink {
+  int fd;
+  bool framed; /* a socket, chunks with their length in front */
+  int lock;    /* the FIFO's directory, held while we write to it */
+  FILE *stream;
+};
+
+/* writes all of iov, advancing it. Sockets do not raise SIGPIPE */
+static bool sink_write_all(const sink_t *sink, struct iovec *iov,
+                           int count) {
+  while (count) {
+    const struct msghdr message = {
+        .msg_iov = iov,
+        .msg_iovlen = (size_t)count,
+    };
+    const ssize_t written = sink->framed
+                                ? sendmsg(sink->fd, &message, MSG_NOSIGNAL)
+                                : writev(sink->fd, iov, count);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written == -1)
+      return false;
+
+    size_t left = (size_t)written;
+    while (count && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count) {
+      iov->iov_base = (uint8_t *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return true;
+}
+
+static bool sink_send_chunk(const sink_t *sink, const void *data,
+                            size_t size) {
+  uint32_t length = htonl((uint32_t)size);
+  struct iovec iov[2] = {
+      {.iov_base = &length, .iov_len = sizeof(length)},
+      {.iov_base = (void *)data, .iov_len = size},
+  };
+  return sink_write_all(sink, iov, size ? 2 : 1);
+}
+
+static ssize_t sink_write(void *cookie, const char *data, size_t size) {
+  const sink_t *sink = cookie;
+  if (sink->framed) {
+    if (!sink_send_chunk(sink, data, size))
+      return -1;
+  } else {
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = size};
+    if (!sink_write_all(sink, &iov, 1))
+      return -1;
+  }
+  return (ssize_t)size;
+}
+
+static int sink_connect(const char *path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (-1 == connect(fd, (const struct sockaddr *)&address, sizeof(address))) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+/* the directory of path, locked for our turn */
+static int sink_lock_directory(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *directory = slash ? strndup(path, slash == path ? 1 : slash - path)
+                          : strdup(".");
+  if (!directory)
+    return -1;
+  const int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  free(directory);
+  if (fd == -1)
+    return -1;
+
+  int result;
+  while ((result = flock(fd, LOCK_EX)) == -1 && errno == EINTR)
+    ;
+  if (result == -1) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+/* opens the FIFO for writing without waiting for a reader that is not
+ * there, the writes then block as usual */
+static int sink_open_fifo(const char *path) {
+  const int fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || -1 == fcntl(fd, F_SETFL, flags & ~O_NONBLOCK)) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+sink_t *sink_open(const char *path, const char *filename) {
+  struct stat status;
+  if (-1 == stat(path, &status))
+    return NULL;
+
+  sink_t *sink = calloc(1, sizeof(sink_t));
+  if (!sink)
+    return NULL;
+  sink->fd = sink->lock = -1;
+
+  if (S_ISSOCK(status.st_mode)) {
+    sink->framed = true;
+    sink->fd = sink_connect(path);
+    if (sink->fd == -1 ||
+        !sink_send_chunk(sink, filename, strlen(filename)))
+      goto err;
+  } else if (S_ISFIFO(status.st_mode)) {
+    sink->lock = sink_lock_directory(path);
+    if (sink->lock == -1)
+      goto err;
+    sink->fd = sink_open_fifo(path);
+    if (sink->fd == -1)
+      goto err;
+  } else {
+    errno = ENOTSOCK;
+    goto err;
+  }
+
+  const cookie_io_functions_t functions = {
+      .write = &sink_write,
+  };
+  sink->stream = fopencookie(sink, "w", functions);
+  if (!sink->stream)
+    goto err;
+  return sink;
+
+err: {
+  const int error = errno;
+  if (sink->fd != -1)
+    close(sink->fd);
+  if (sink->lock != -1)
+    close(sink->lock);
+  free(sink);
+  errno = error;
+  return NULL;
+}
+}
+
+FILE *sink_stream(sink_t *sink) { return sink->stream; }
+
+/* the consumer closes its end once it has the file */
+static bool sink_wait_taken(const sink_t *sink) {
+  if (-1 == shutdown(sink->fd, SHUT_WR))
+    return false;
+  for (;;) {
+    char discard[64];
+    const ssize_t got = recv(sink->fd, discard, sizeof(discard), 0);
+    if (got == 0)
+      return true;
+    if (got == -1 && errno != EINTR)
+      return false;
+  }
+}
+
+int sink_close(sink_t *sink, bool complete) {
+  /* what stdio still holds goes out first */
+  int error = fclose(sink->stream) == 0 ? 0 : errno;
+
+  if (!error && complete && sink->framed &&
+      (!sink_send_chunk(sink, NULL, 0) || !sink_wait_taken(sink)))
+    error = errno;
+
+  close(sink->fd);
+  if (sink->lock != -1)
+    close(sink->lock);
+  free(sink);
+
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
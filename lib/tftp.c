@@ -1,3 +1,4 @@
+#include <drop/batch.h>
 #include <drop/tftp.h>
 
 #include <arpa/inet.h>
@@ -6,11 +7,28 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #define TFTP_TIMEOUT 5
+#define TFTP_MAX_RETRIES 5
+/* retries before giving up on big blocks that never got through, the path
+ * may drop them without an ICMP error */
+#define TFTP_PROBE_RETRIES 2
+/* the longest a windowed receiver holds back an ACK unless negotiated */
+#define TFTP_ACK_DELAY_MS 50
+/* repeats of the ACK in front of a gap, ackdelay apart */
+#define TFTP_GAP_REPEATS 3
+#define TFTP_MAX_OPTIONS 8
+/* an unsigned in decimal and its terminator */
+#define TFTP_OPTION_VALUE_SIZE 11
+#define TFTP_BUSY_MESSAGE "busy, retry after %u ms"
+#define NS_PER_SEC 1000000000ull
+#define NS_PER_MS 1000000ull
 
 typedef enum tftp_opcode : uint16_t {
   TFTP_OPCODE_RRQ = 1,
@@ -18,18 +36,33 @@ typedef enum tftp_opcode : uint16_t {
   TFTP_OPCODE_DATA = 3,
   TFTP_OPCODE_ACK = 4,
   TFTP_OPCODE_ERROR = 5,
+  TFTP_OPCODE_OACK = 6,
 } tftp_opcode_t;
 
+typedef struct {
+  const char *name;
+  const char *value;
+} tftp_option_t;
+
 typedef struct {
   const char *filename;
   const char *mode;
+  tftp_option_t options[TFTP_MAX_OPTIONS];
+  size_t option_count;
 } tftp_rrq_t;
 
 typedef struct {
   const char *filename;
   const char *mode;
+  tftp_option_t options[TFTP_MAX_OPTIONS];
+  size_t option_count;
 } tftp_wrq_t;
 
+typedef struct {
+  tftp_option_t options[TFTP_MAX_OPTIONS];
+  size_t option_count;
+} tftp_oack_t;
+
 typedef struct {
   tftp_block_t block;
   const uint8_t *data;
@@ -40,17 +73,6 @@ typedef struct {
   tftp_block_t block;
 } tftp_ack_t;
 
-typedef enum tftp_error_code : uint16_t {
-  TFTP_ERROR_NOT_DEFINED = 0,
-  TFTP_ERROR_NOT_FOUND = 1,
-  TFTP_ERROR_ACCESS_VIOLATION = 2,
-  TFTP_ERROR_DISK_FULL = 3,
-  TFTP_ERROR_ILLEGAL_OPERATION = 4,
-  TFTP_ERROR_UNKNOWN_TID = 5,
-  TFTP_ERROR_ALREADY_EXISTS = 6,
-  TFTP_ERROR_NO_SUCH_USER = 7
-} tftp_error_code_t;
-
 typedef struct {
   tftp_error_code_t code;
   const char *message;
@@ -64,6 +86,7 @@ typedef struct {
     tftp_data_t data;
     tftp_ack_t ack;
     tftp_error_t error;
+    tftp_oack_t oack;
   };
 } tftp_packet_t;
 
@@ -179,6 +202,29 @@ static expected_size_t tftp_buffer_write_string(tftp_buffer_view_t *writer,
                                         strlen(value) + 1);
 }
 
+/* reads RFC 2347 name/value pairs up to the end of the packet, options past
+ * TFTP_MAX_OPTIONS are dropped */
+static int tftp_buffer_read_options(tftp_buffer_view_t *reader,
+                                    tftp_option_t *options, size_t *count) {
+  *count = 0;
+  while (tftp_buffer_view_capacity(reader) > 0) {
+    expected_string_t name = tftp_buffer_read_string(reader);
+    if (!name.has_value)
+      return name.error;
+
+    expected_string_t value = tftp_buffer_read_string(reader);
+    if (!value.has_value)
+      return value.error;
+
+    if (*count < TFTP_MAX_OPTIONS)
+      options[(*count)++] = (tftp_option_t){
+          .name = name.value,
+          .value = value.value,
+      };
+  }
+  return 0;
+}
+
 typedef struct {
   bool has_value;
   union {
@@ -202,7 +248,7 @@ static expected_tftp_rrq_t tftp_buffer_read_rrq(tftp_buffer_view_t *reader) {
         .error = mode.error,
     };
 
-  return (expected_tftp_rrq_t){
+  expected_tftp_rrq_t rrq = {
       .has_value = true,
       .value =
           {
@@ -210,6 +256,16 @@ static expected_tftp_rrq_t tftp_buffer_read_rrq(tftp_buffer_view_t *reader) {
               .mode = mode.value,
           },
   };
+
+  const int error = tftp_buffer_read_options(reader, rrq.value.options,
+                                             &rrq.value.option_count);
+  if (error)
+    return (expected_tftp_rrq_t){
+        .has_value = false,
+        .error = error,
+    };
+
+  return rrq;
 }
 
 typedef struct {
@@ -235,7 +291,7 @@ static expected_tftp_wrq_t tftp_buffer_read_wrq(tftp_buffer_view_t *reader) {
         .error = mode.error,
     };
 
-  return (expected_tftp_wrq_t){
+  expected_tftp_wrq_t wrq = {
       .has_value = true,
       .value =
           {
@@ -243,6 +299,38 @@ static expected_tftp_wrq_t tftp_buffer_read_wrq(tftp_buffer_view_t *reader) {
               .mode = mode.value,
           },
   };
+
+  const int error = tftp_buffer_read_options(reader, wrq.value.options,
+                                             &wrq.value.option_count);
+  if (error)
+    return (expected_tftp_wrq_t){
+        .has_value = false,
+        .error = error,
+    };
+
+  return wrq;
+}
+
+typedef struct {
+  bool has_value;
+  union {
+    tftp_oack_t value;
+    int error;
+  };
+} expected_tftp_oack_t;
+
+static expected_tftp_oack_t tftp_buffer_read_oack(tftp_buffer_view_t *reader) {
+  expected_tftp_oack_t oack = {.has_value = true};
+
+  const int error = tftp_buffer_read_options(reader, oack.value.options,
+                                             &oack.value.option_count);
+  if (error)
+    return (expected_tftp_oack_t){
+        .has_value = false,
+        .error = error,
+    };
+
+  return oack;
 }
 
 typedef struct {
@@ -434,8 +522,28 @@ static expected_tftp_packet_t tftp_buffer_read_packet(tftp_buffer_t *buffer,
             },
     };
   }
+  case TFTP_OPCODE_OACK: {
+    expected_tftp_oack_t oack = tftp_buffer_read_oack(&reader);
+    if (!oack.has_value)
+      return (expected_tftp_packet_t){
+          .has_value = false,
+          .error = oack.error,
+      };
+
+    return (expected_tftp_packet_t){
+        .has_value = true,
+        .value =
+            {
+                .opcode = opcode.value,
+                .oack = oack.value,
+            },
+    };
+  }
   default:
-    __builtin_unreachable();
+    return (expected_tftp_packet_t){
+        .has_value = false,
+        .error = EBADMSG,
+    };
   }
 }
 
@@ -473,9 +581,35 @@ static expected_size_t tftp_buffer_write_rrq(tftp_buffer_t *buffer,
   };
 }
 
+static expected_size_t
+tftp_buffer_write_options(tftp_buffer_view_t *writer,
+                          const tftp_option_t *options, size_t count) {
+  size_t size = 0;
+  for (size_t n = 0; n < count; ++n) {
+    const expected_size_t name =
+        tftp_buffer_write_string(writer, options[n].name);
+    if (!name.has_value)
+      return name;
+
+    const expected_size_t value =
+        tftp_buffer_write_string(writer, options[n].value);
+    if (!value.has_value)
+      return value;
+
+    size += name.value + value.value;
+  }
+
+  return (expected_size_t){
+      .has_value = true,
+      .value = size,
+  };
+}
+
 static expected_size_t tftp_buffer_write_wrq(tftp_buffer_t *buffer,
                                              const char *in_filename,
-                                             const char *in_mode) {
+                                             const char *in_mode,
+                                             const tftp_option_t *in_options,
+                                             size_t in_option_count) {
   tftp_buffer_view_t writer = tftp_writer(buffer);
 
   const expected_size_t opcode =
@@ -501,9 +635,35 @@ static expected_size_t tftp_buffer_write_wrq(tftp_buffer_t *buffer,
         .error = mode.error,
     };
 
+  const expected_size_t options =
+      tftp_buffer_write_options(&writer, in_options, in_option_count);
+  if (!options.has_value)
+    return options;
+
   return (expected_size_t){
       .has_value = true,
-      .value = opcode.value + filename.value + mode.value,
+      .value = opcode.value + filename.value + mode.value + options.value,
+  };
+}
+
+static expected_size_t tftp_buffer_write_oack(tftp_buffer_t *buffer,
+                                              const tftp_option_t *in_options,
+                                              size_t in_option_count) {
+  tftp_buffer_view_t writer = tftp_writer(buffer);
+
+  const expected_size_t opcode =
+      tftp_buffer_write_uint16_t(&writer, TFTP_OPCODE_OACK);
+  if (!opcode.has_value)
+    return opcode;
+
+  const expected_size_t options =
+      tftp_buffer_write_options(&writer, in_options, in_option_count);
+  if (!options.has_value)
+    return options;
+
+  return (expected_size_t){
+      .has_value = true,
+      .value = opcode.value + options.value,
   };
 }
 
@@ -598,14 +758,57 @@ static expected_size_t tftp_buffer_write_error(tftp_buffer_t *buffer,
   };
 }
 
+static struct timeval tftp_timeval_from_ns(uint64_t ns) {
+  return (struct timeval){
+      .tv_sec = (time_t)(ns / NS_PER_SEC),
+      .tv_usec = (suseconds_t)(ns % NS_PER_SEC / 1000),
+  };
+}
+
+static uint64_t tftp_now_ns(void) {
+  struct timespec now = {0};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NS_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+/* error is ETIMEDOUT when nothing arrived in time, EBADMSG or EMSGSIZE for
+ * garbage and whatever recv reports, e.g. ECONNREFUSED, otherwise */
 static expected_tftp_packet_t tftp_recv(int socket, tftp_buffer_t *buffer,
-                                        struct timeval *timeout) {
+                                        struct timeval *timeout,
+                                        const tftp_hooks_t *hooks) {
+  int ready = 0;
+  if (hooks->on_wait) {
+    const uint64_t deadline = tftp_now_ns() +
+                              (uint64_t)timeout->tv_sec * NS_PER_SEC +
+                              (uint64_t)timeout->tv_usec * 1000;
+    ready = hooks->on_wait(socket, deadline, hooks->userdata);
+    if (ready == -1)
+      return (expected_tftp_packet_t){
+          .has_value = false,
+          .error = errno,
+      };
+    if (ready == 0) {
+      const uint64_t now = tftp_now_ns();
+      *timeout = tftp_timeval_from_ns(deadline > now ? deadline - now : 0);
+    }
+  }
+
   fd_set readfds = {0};
-  FD_ZERO(&readfds);
-  FD_SET(socket, &readfds);
+  if (!ready) {
+    do {
+      /* Linux updates timeout to the time left, so retrying keeps the
+       * deadline */
+      FD_ZERO(&readfds);
+      FD_SET(socket, &readfds);
+      ready = select(socket + 1, &readfds, NULL, NULL, timeout);
+    } while (ready == -1 && errno == EINTR);
+  }
 
-  const int ready = select(socket + 1, &readfds, NULL, NULL, timeout);
-  assert(ready != -1);
+  if (ready == -1)
+    return (expected_tftp_packet_t){
+        .has_value = false,
+        .error = errno,
+    };
 
   if (ready == 0)
     return (expected_tftp_packet_t){
@@ -615,123 +818,833 @@ static expected_tftp_packet_t tftp_recv(int socket, tftp_buffer_t *buffer,
 
   const ssize_t bytes =
       recv(socket, &buffer->buffer, sizeof(buffer->buffer), 0);
-  assert(bytes != -1);
+  if (bytes == -1)
+    return (expected_tftp_packet_t){
+        .has_value = false,
+        .error = errno,
+    };
 
+  if (hooks->on_receive)
+    hooks->on_receive(&buffer->buffer, (size_t)bytes, hooks->userdata);
   return tftp_buffer_read_packet(buffer, bytes);
 }
 
-void tftp_send_data(int socket, tftp_buffer_t *buffer, tftp_block_t block,
-                    const uint8_t *in_data, size_t in_data_size) {
+/* returns the errno of a failed send. Apart from EMSGSIZE and ECONNREFUSED a
+ * datagram that could not be sent is treated like one lost on the way, the
+ * retransmission timers recover from both */
+int tftp_send_data(int socket, tftp_buffer_t *buffer, tftp_block_t block,
+                   const uint8_t *in_data, size_t in_data_size,
+                   uint64_t txtime) {
   const expected_size_t data =
       tftp_buffer_write_data(buffer, block, in_data, in_data_size);
   assert(data.has_value);
-  assert(send(socket, &buffer->buffer, data.value, 0) != -1);
+
+  if (!txtime)
+    return send(socket, &buffer->buffer, data.value, 0) == -1 ? errno : 0;
+
+  struct iovec iov = {
+      .iov_base = &buffer->buffer,
+      .iov_len = data.value,
+  };
+
+  uint8_t cmsg_storage[CMSG_SPACE(sizeof(uint64_t))] = {0};
+
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_storage;
+  msg.msg_controllen = sizeof(cmsg_storage);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+  memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+
+  return sendmsg(socket, &msg, 0) == -1 ? errno : 0;
 }
 
 void tftp_send_ack(int socket, tftp_buffer_t *buffer, tftp_block_t block) {
   const expected_size_t ack = tftp_buffer_write_ack(buffer, block);
   assert(ack.has_value);
-  assert(send(socket, &buffer->buffer, ack.value, 0) != -1);
+  send(socket, &buffer->buffer, ack.value, 0);
 }
 
 void tftp_send_error(int socket, tftp_buffer_t *buffer, tftp_error_code_t code,
                      const char *message) {
   const expected_size_t error = tftp_buffer_write_error(buffer, code, message);
   assert(error.has_value);
-  assert(send(socket, &buffer->buffer, error.value, 0) != -1);
+  send(socket, &buffer->buffer, error.value, 0);
+}
+
+size_t tftp_format_error(tftp_buffer_t *buffer, tftp_error_code_t code,
+                         const char *message) {
+  const expected_size_t error = tftp_buffer_write_error(buffer, code, message);
+  assert(error.has_value);
+  return error.value;
+}
+
+size_t tftp_format_busy(tftp_buffer_t *buffer, unsigned retry_after_ms) {
+  char message[64] = {0};
+  snprintf(message, sizeof(message), TFTP_BUSY_MESSAGE, retry_after_ms);
+  return tftp_format_error(buffer, TFTP_ERROR_NOT_DEFINED, message);
+}
+
+static tftp_result_t tftp_result_from_error(const tftp_error_t *error) {
+  unsigned retry_after_ms = 0;
+  if (error->code == TFTP_ERROR_NOT_DEFINED &&
+      sscanf(error->message, TFTP_BUSY_MESSAGE, &retry_after_ms) == 1)
+    return (tftp_result_t){
+        .error = EBUSY,
+        .code = error->code,
+        .retry_after_ms = retry_after_ms,
+    };
+
+  return (tftp_result_t){
+      .error = EPROTO,
+      .code = error->code,
+  };
+}
+
+static bool tftp_parse_option(const char *value, unsigned long max,
+                              unsigned long *out) {
+  char *end = NULL;
+  errno = 0;
+  const unsigned long parsed = strtoul(value, &end, 10);
+  if (errno || end == value || *end != '\0' || parsed == 0 || parsed > max)
+    return false;
+  *out = parsed;
+  return true;
+}
+
+/* unknown options and values out of range are left at 0, not negotiated */
+static void tftp_params_from_options(const tftp_option_t *options,
+                                     size_t count, tftp_params_t *out) {
+  *out = (tftp_params_t){0};
+  for (size_t n = 0; n < count; ++n) {
+    unsigned long value = 0;
+    if (strcasecmp(options[n].name, "blksize") == 0 &&
+        tftp_parse_option(options[n].value, TFTP_MAX_BLOCK_SIZE, &value) &&
+        value >= TFTP_MIN_BLOCK_SIZE)
+      out->blksize = (uint16_t)value;
+    else if (strcasecmp(options[n].name, "windowsize") == 0 &&
+        tftp_parse_option(options[n].value, UINT16_MAX, &value))
+      out->windowsize = (uint16_t)value;
+    else if (strcasecmp(options[n].name, "ackevery") == 0 &&
+             tftp_parse_option(options[n].value, UINT16_MAX, &value))
+      out->ackevery = (uint16_t)value;
+    else if (strcasecmp(options[n].name, "ackdelay") == 0 &&
+             tftp_parse_option(options[n].value, UINT16_MAX, &value))
+      out->ackdelay_ms = (uint16_t)value;
+    else if (strcasecmp(options[n].name, "timeout") == 0 &&
+             tftp_parse_option(options[n].value, UINT8_MAX, &value))
+      out->timeout = (uint8_t)value;
+    else if (strcasecmp(options[n].name, "probe") == 0 &&
+             tftp_parse_option(options[n].value, 1, &value))
+      out->probe = 1;
+    else if (strcasecmp(options[n].name, "batch") == 0 &&
+             tftp_parse_option(options[n].value, 1, &value))
+      out->batch = 1;
+  }
+}
+
+static size_t tftp_params_to_options(const tftp_params_t *params,
+                                     char values[][TFTP_OPTION_VALUE_SIZE],
+                                     tftp_option_t *options) {
+  const struct {
+    const char *name;
+    unsigned value;
+  } fields[] = {
+      {"blksize", params->blksize},
+      {"windowsize", params->windowsize},
+      {"ackevery", params->ackevery},
+      {"ackdelay", params->ackdelay_ms},
+      {"timeout", params->timeout},
+      {"probe", params->probe},
+      {"batch", params->batch},
+  };
+
+  size_t count = 0;
+  for (size_t n = 0; n < sizeof(fields) / sizeof(fields[0]); ++n) {
+    if (!fields[n].value)
+      continue;
+    snprintf(values[count], TFTP_OPTION_VALUE_SIZE, "%u", fields[n].value);
+    options[count] = (tftp_option_t){
+        .name = fields[n].name,
+        .value = values[count],
+    };
+    ++count;
+  }
+  return count;
 }
 
-void tftp_send_wrq(int socket, const char *filename, FILE *file,
-                   tftp_block_cb_t on_block, void *userdata) {
+static uint16_t tftp_min_u16(uint16_t a, uint16_t b) { return a < b ? a : b; }
+
+/* what the receiver agrees to of the sender's request, a limit of 0 refuses
+ * the option. rcvbuf is the receive buffer a window has to fit in, as
+ * SO_RCVBUF reports it */
+static tftp_params_t tftp_negotiate(const tftp_params_t *request,
+                                    const tftp_limits_t *limits,
+                                    size_t rcvbuf) {
+  tftp_params_t accepted = {0};
+
+  if (request->blksize && limits->max.blksize >= TFTP_MIN_BLOCK_SIZE)
+    accepted.blksize = tftp_min_u16(request->blksize, limits->max.blksize);
+
+  if (request->windowsize && limits->max.windowsize) {
+    /* half of SO_RCVBUF goes to the kernel's bookkeeping */
+    const size_t packet =
+        (accepted.blksize ? accepted.blksize : TFTP_BLOCK_SIZE) + 4;
+    const size_t fits = rcvbuf / 2 / packet;
+    const uint16_t window =
+        fits < 1 ? 1 : fits > UINT16_MAX ? UINT16_MAX : (uint16_t)fits;
+    accepted.windowsize = tftp_min_u16(
+        tftp_min_u16(request->windowsize, limits->max.windowsize), window);
+  }
+
+  /* ACKing less often than once a window stalls the sender */
+  if (request->ackevery && accepted.windowsize)
+    accepted.ackevery = tftp_min_u16(request->ackevery, accepted.windowsize);
+
+  if (request->ackdelay_ms && limits->max.ackdelay_ms)
+    accepted.ackdelay_ms =
+        tftp_min_u16(request->ackdelay_ms, limits->max.ackdelay_ms);
+
+  /* RFC 2349 has the receiver take the timeout as is or not at all */
+  if (request->timeout && request->timeout >= limits->min_timeout &&
+      request->timeout <= limits->max.timeout)
+    accepted.timeout = request->timeout;
+
+  if (request->probe && limits->max.probe)
+    accepted.probe = 1;
+
+  /* a probe has no files to unpack */
+  if (request->batch && limits->max.batch && !accepted.probe)
+    accepted.batch = 1;
+
+  return accepted;
+}
+
+static bool tftp_params_within(const tftp_params_t *accepted,
+                               const tftp_params_t *request) {
+  return accepted->blksize <= request->blksize &&
+         accepted->windowsize <= request->windowsize &&
+         accepted->ackevery <= request->ackevery &&
+         accepted->ackdelay_ms <= request->ackdelay_ms &&
+         (!accepted->timeout || accepted->timeout == request->timeout) &&
+         accepted->probe <= request->probe &&
+         accepted->batch <= request->batch;
+}
+
+static tftp_result_t tftp_send_blocks(int socket, tftp_buffer_t *buffer,
+                                      FILE *file, const tftp_params_t *params,
+                                      const tftp_hooks_t *hooks) {
+  const size_t blksize = params->blksize ? params->blksize : TFTP_BLOCK_SIZE;
+  const unsigned probe_retries =
+      blksize > TFTP_BLOCK_SIZE ? TFTP_PROBE_RETRIES : TFTP_MAX_RETRIES;
+  const uint64_t window = params->windowsize ? params->windowsize : 1;
+  const uint64_t timeout_ns =
+      (params->timeout ? params->timeout : TFTP_TIMEOUT) * NS_PER_SEC;
+  const uint64_t ack_delay_ns =
+      (params->ackdelay_ms ? params->ackdelay_ms : TFTP_ACK_DELAY_MS) *
+      NS_PER_MS;
+
+  /* the window's blocks, kept until acknowledged for retransmission */
+  uint8_t *blocks = calloc(window, blksize);
+  size_t *sizes = calloc(window, sizeof(size_t));
+  /* when the blocks first went out, 0 once resent as their ACK is
+   * ambiguous then */
+  uint64_t *sent_ns = calloc(window, sizeof(uint64_t));
+  if (!blocks || !sizes || !sent_ns) {
+    free(blocks);
+    free(sizes);
+    free(sent_ns);
+    return (tftp_result_t){.error = ENOMEM};
+  }
+
+  /* blocks are counted from 1 without wrapping, the wire carries the low 16
+   * bits */
+  uint64_t acked = 0;           /* acknowledged up to this block */
+  uint64_t next = 1;            /* the block to send next */
+  uint64_t sent = 0;            /* the highest block sent so far */
+  uint64_t read = 0;            /* the highest block read from file */
+  uint64_t last = 0;            /* the final, short block once read */
+  uint64_t resent = UINT64_MAX; /* the last repeated ACK acted on */
+  uint64_t resent_ns = 0;       /* and when */
+  unsigned retries = 0;
+  /* the retransmission timeout runs from the last ACK or go-back */
+  uint64_t progress_ns = tftp_now_ns();
+  tftp_result_t result = {
+      .error = 0,
+      .started = true,
+  };
+
+  for (;;) {
+    while (next <= acked + window && (!last || next <= last)) {
+      const size_t slot = next % window;
+      uint8_t *data = blocks + slot * blksize;
+      if (next > read) {
+        sizes[slot] = fread(data, 1, blksize, file);
+        /* a short block would end the file early */
+        if (sizes[slot] < blksize && ferror(file)) {
+          result.error = errno ? errno : EIO;
+          tftp_send_error(socket, buffer, TFTP_ERROR_NOT_DEFINED,
+                          strerror(result.error));
+          goto out;
+        }
+        read = next;
+        if (sizes[slot] < blksize)
+          last = next;
+      }
+
+      const uint64_t txtime =
+          hooks->on_send ? hooks->on_send(sizes[slot], hooks->userdata) : 0;
+      const uint64_t send_ns = tftp_now_ns();
+      const int error = tftp_send_data(socket, buffer, (tftp_block_t)next,
+                                       data, sizes[slot], txtime);
+      /* the block does not fit the path MTU, or the peer is gone */
+      if (error == EMSGSIZE || error == ECONNREFUSED) {
+        if (error == EMSGSIZE)
+          tftp_send_error(socket, buffer, TFTP_ERROR_NOT_DEFINED,
+                          "block size exceeds the path MTU");
+        result.error = error;
+        goto out;
+      }
+
+      if (next > sent) {
+        sent = next;
+        sent_ns[slot] = txtime > send_ns ? txtime : send_ns;
+      } else {
+        sent_ns[slot] = 0;
+        ++result.resent;
+      }
+      ++next;
+    }
+
+    /* the timeout runs from the last progress, not the last packet, or
+     * repeated ACKs we do not act on would hold it off forever */
+    uint64_t now = tftp_now_ns();
+    const uint64_t due = progress_ns + timeout_ns;
+    struct timeval timeout = tftp_timeval_from_ns(due > now ? due - now : 0);
+    const expected_tftp_packet_t packet =
+        tftp_recv(socket, buffer, &timeout, hooks);
+    now = tftp_now_ns();
+    if (!packet.has_value) {
+      if (packet.error == EBADMSG || packet.error == EMSGSIZE)
+        continue;
+
+      if (packet.error != ETIMEDOUT ||
+          ++retries > (acked ? TFTP_MAX_RETRIES : probe_retries)) {
+        result.error = packet.error;
+        break;
+      }
+
+      /* go back to the first block not acknowledged */
+      next = acked + 1;
+      progress_ns = now;
+      continue;
+    }
+
+    if (packet.value.opcode == TFTP_OPCODE_ERROR) {
+      const uint64_t bytes = result.bytes;
+      result = tftp_result_from_error(&packet.value.error);
+      result.started = true;
+      result.bytes = bytes;
+      break;
+    }
+
+    if (packet.value.opcode != TFTP_OPCODE_ACK)
+      continue;
+
+    const uint64_t block =
+        acked + (tftp_block_t)(packet.value.ack.block - (tftp_block_t)acked);
+    if (block > sent)
+      continue; /* from before the last wrap */
+
+    if (block > acked) {
+      const uint64_t first_ns = sent_ns[block % window];
+      if (first_ns && (!result.rtt_ns || now - first_ns < result.rtt_ns))
+        result.rtt_ns = now - first_ns;
+
+      for (uint64_t n = acked + 1; n <= block; ++n) {
+        result.bytes += sizes[n % window];
+        if (hooks->on_block)
+          hooks->on_block((tftp_block_t)n, hooks->userdata);
+      }
+      if (hooks->on_progress)
+        hooks->on_progress(result.bytes, hooks->userdata);
+
+      acked = block;
+      retries = 0;
+      progress_ns = now;
+      if (next <= acked)
+        next = acked + 1;
+      if (last && acked == last)
+        break;
+    } else if (block == acked &&
+               (resent != acked || now - resent_ns >= ack_delay_ns)) {
+      /* the receiver repeats an ACK when it sees a gap, resend from there
+       * instead of waiting for the timeout. Repeats within ackdelay are
+       * for blocks that were in flight when we went back */
+      next = acked + 1;
+      resent = acked;
+      resent_ns = now;
+    }
+  }
+
+out:
+  free(blocks);
+  free(sizes);
+  free(sent_ns);
+  return result;
+}
+
+tftp_result_t tftp_send_wrq(int socket, const char *filename, FILE *file,
+                            const tftp_params_t *request,
+                            const tftp_hooks_t *hooks) {
+  const tftp_hooks_t no_hooks = {0};
+  if (!hooks)
+    hooks = &no_hooks;
+
   tftp_buffer_t buffer = {0};
 
-  const expected_size_t wrq =
-      tftp_buffer_write_wrq(&buffer, filename, "netascii");
+  char values[TFTP_MAX_OPTIONS][TFTP_OPTION_VALUE_SIZE] = {0};
+  tftp_option_t options[TFTP_MAX_OPTIONS] = {0};
+  const size_t option_count =
+      request ? tftp_params_to_options(request, values, options) : 0;
+
+  const expected_size_t wrq = tftp_buffer_write_wrq(
+      &buffer, filename, "netascii", options, option_count);
   assert(wrq.has_value);
-  assert(send(socket, &buffer.buffer, wrq.value, 0) == wrq.value);
+  if (send(socket, &buffer.buffer, wrq.value, 0) != (ssize_t)wrq.value)
+    return (tftp_result_t){.error = errno};
+  if (hooks->on_request)
+    hooks->on_request(hooks->userdata);
 
   struct timeval timeout = {
       .tv_sec = TFTP_TIMEOUT,
       .tv_usec = 0,
   };
-  expected_tftp_packet_t packet = tftp_recv(socket, &buffer, &timeout);
-  assert(packet.has_value);
-  assert(packet.value.opcode == TFTP_OPCODE_ACK);
-  assert(packet.value.ack.block == 0);
+  expected_tftp_packet_t packet = tftp_recv(socket, &buffer, &timeout, hooks);
+  if (!packet.has_value)
+    return (tftp_result_t){.error = packet.error};
+
+  tftp_params_t params = {0};
+  switch (packet.value.opcode) {
+  case TFTP_OPCODE_ERROR:
+    return tftp_result_from_error(&packet.value.error);
+  case TFTP_OPCODE_OACK:
+    tftp_params_from_options(packet.value.oack.options,
+                             packet.value.oack.option_count, &params);
+    if (!request || !tftp_params_within(&params, request)) {
+      tftp_send_error(socket, &buffer, TFTP_ERROR_OPTION_REFUSED,
+                      "options beyond the request");
+      return (tftp_result_t){
+          .error = EPROTO,
+          .code = TFTP_ERROR_OPTION_REFUSED,
+      };
+    }
+    break;
+  case TFTP_OPCODE_ACK:
+    /* a server without option support, lock-step it is */
+    if (packet.value.ack.block == 0)
+      break;
+    /* fall through */
+  default:
+    return (tftp_result_t){.error = EPROTO};
+  }
 
-  if (on_block)
-    on_block(packet.value.ack.block, userdata);
+  /* a server that does not know probes would keep the data */
+  if (request && request->probe && !params.probe) {
+    tftp_send_error(socket, &buffer, TFTP_ERROR_OPTION_REFUSED,
+                    "probe not accepted");
+    return (tftp_result_t){.error = EPROTONOSUPPORT};
+  }
+  /* nor would one that does not know batches unpack them */
+  if (request && request->batch && !params.batch) {
+    tftp_send_error(socket, &buffer, TFTP_ERROR_OPTION_REFUSED,
+                    "batch not accepted");
+    return (tftp_result_t){.error = EPROTONOSUPPORT};
+  }
 
-  for (;;) {
-    uint8_t file_data[TFTP_BLOCK_SIZE] = {0};
-    const size_t file_bytes = fread(file_data, 1, sizeof(file_data), file);
+  if (hooks->on_block)
+    hooks->on_block(0, hooks->userdata);
 
-    const tftp_block_t block = packet.value.ack.block + 1;
-    tftp_send_data(socket, &buffer, block, file_data, file_bytes);
+  return tftp_send_blocks(socket, &buffer, file, &params, hooks);
+}
 
-    packet = tftp_recv(socket, &buffer, NULL);
-    assert(packet.has_value);
-    assert(packet.value.opcode == TFTP_OPCODE_ACK);
-    /* todo: handle out-of-order ack */
-    assert(packet.value.ack.block == block);
+static void tftp_send_oack(int socket, tftp_buffer_t *buffer,
+                           const tftp_params_t *accepted) {
+  char values[TFTP_MAX_OPTIONS][TFTP_OPTION_VALUE_SIZE] = {0};
+  tftp_option_t options[TFTP_MAX_OPTIONS] = {0};
+  const size_t option_count = tftp_params_to_options(accepted, values, options);
 
-    if (on_block)
-      on_block(block, userdata);
+  const expected_size_t oack =
+      tftp_buffer_write_oack(buffer, options, option_count);
+  assert(oack.has_value);
+  send(socket, &buffer->buffer, oack.value, 0);
+}
 
-    if (file_bytes < TFTP_BLOCK_SIZE) {
-      assert(feof(file));
-      break;
+/* the final ACK may get lost, answer the retransmissions it would cause.
+ * Those are rare, the wait for them does not spin */
+static void tftp_dally(int socket, tftp_buffer_t *buffer, tftp_block_t last,
+                       time_t timeout_s) {
+  const tftp_hooks_t no_hooks = {0};
+  struct timeval timeout = {
+      .tv_sec = timeout_s,
+      .tv_usec = 0,
+  };
+  for (;;) {
+    const expected_tftp_packet_t packet =
+        tftp_recv(socket, buffer, &timeout, &no_hooks);
+    if (!packet.has_value) {
+      if (packet.error == EBADMSG || packet.error == EMSGSIZE)
+        continue;
+      return;
     }
+    if (packet.value.opcode == TFTP_OPCODE_DATA)
+      tftp_send_ack(socket, buffer, last);
   }
 }
 
-void tftp_handle_wrq(int socket, tftp_buffer_t *buffer, size_t buffer_size,
-                     tftp_block_cb_t on_block, void *userdata) {
+static int tftp_close_file(FILE *file, bool complete,
+                           const tftp_hooks_t *hooks) {
+  return hooks->on_close ? hooks->on_close(file, complete, hooks->userdata)
+                         : fclose(file);
+}
+
+tftp_result_t tftp_handle_wrq(int socket, tftp_buffer_t *buffer,
+                              size_t buffer_size, const tftp_limits_t *limits,
+                              const tftp_hooks_t *hooks) {
   assert(socket != -1);
   assert(buffer);
 
-  expected_tftp_packet_t packet = tftp_buffer_read_packet(buffer, buffer_size);
-  assert(packet.has_value);
-  assert(packet.value.opcode == TFTP_OPCODE_WRQ);
+  const tftp_hooks_t no_hooks = {0};
+  if (!hooks)
+    hooks = &no_hooks;
 
-  FILE *file = fopen(packet.value.wrq.filename, "wb");
-  if (!file) {
-    tftp_send_error(socket, buffer, TFTP_ERROR_DISK_FULL, strerror(errno));
-    return;
+  expected_tftp_packet_t packet = tftp_buffer_read_packet(buffer, buffer_size);
+  if (!packet.has_value || packet.value.opcode != TFTP_OPCODE_WRQ) {
+    tftp_send_error(socket, buffer, TFTP_ERROR_ILLEGAL_OPERATION,
+                    "expected a write request");
+    return (tftp_result_t){
+        .error = EPROTO,
+        .code = TFTP_ERROR_ILLEGAL_OPERATION,
+    };
   }
 
-  tftp_block_t block = 0;
-  tftp_send_ack(socket, buffer, block);
+  tftp_params_t requested = {0};
+  tftp_params_from_options(packet.value.wrq.options,
+                           packet.value.wrq.option_count, &requested);
+  int rcvbuf = 0;
+  socklen_t rcvbuf_size = sizeof(rcvbuf);
+  if (-1 == getsockopt(socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &rcvbuf_size))
+    rcvbuf = 0;
+
+  const tftp_params_t accepted =
+      limits ? tftp_negotiate(&requested, limits, (size_t)rcvbuf)
+             : (tftp_params_t){0};
+  const bool oack = accepted.blksize || accepted.windowsize ||
+                    accepted.ackevery || accepted.ackdelay_ms ||
+                    accepted.timeout || accepted.probe || accepted.batch;
+
+  /* a probe goes through the motions without a file, a batch is unpacked
+   * here rather than handed to the hooks */
+  const tftp_hooks_t *file_hooks = accepted.batch ? &no_hooks : hooks;
+  FILE *file = NULL;
+  if (!accepted.probe) {
+    file = accepted.batch ? batch_unpack(packet.value.wrq.filename)
+           : hooks->on_open
+               ? hooks->on_open(packet.value.wrq.filename, hooks->userdata)
+               : fopen(packet.value.wrq.filename, "wb");
+    if (!file) {
+      const int error = errno;
+      tftp_send_error(socket, buffer, TFTP_ERROR_DISK_FULL, strerror(error));
+      return (tftp_result_t){.error = error};
+    }
+    setvbuf(file, NULL, _IOFBF, TFTP_WRITE_BUFFER_SIZE);
+  }
 
-  if (on_block)
-    on_block(block, userdata);
+  /* ACK policy: without options every block is acknowledged, as RFC 1350
+   * has it. Otherwise an ACK goes out every ackevery blocks, at the end of
+   * each window, for the final block and once ackdelay passed since the
+   * first block it covers. A gap is reported right away by repeating the ACK
+   * for the last block received in order, and again every ackdelay while the
+   * gap is still there, the sender resends from those repeats. */
+  const size_t blksize =
+      accepted.blksize ? accepted.blksize : TFTP_BLOCK_SIZE;
+  const uint64_t window = accepted.windowsize ? accepted.windowsize : 1;
+  const uint64_t ack_every = accepted.ackevery ? accepted.ackevery : window;
+  const uint64_t ack_delay_ns =
+      (accepted.ackdelay_ms ? accepted.ackdelay_ms : TFTP_ACK_DELAY_MS) *
+      NS_PER_MS;
+  const time_t timeout_s = accepted.timeout ? accepted.timeout : TFTP_TIMEOUT;
+
+  if (oack)
+    tftp_send_oack(socket, buffer, &accepted);
+  else
+    tftp_send_ack(socket, buffer, 0);
+
+  if (hooks->on_block)
+    hooks->on_block(0, hooks->userdata);
+
+  uint64_t expected = 1; /* the next block in order */
+  uint64_t acked = 0;    /* the last block acknowledged */
+  uint64_t acked_ns = 0; /* when the ACK for acked last went out */
+  unsigned gap = 0;      /* repeats left for the gap before expected */
+  uint64_t pending = 0;  /* blocks received but not acknowledged */
+  uint64_t pending_since = 0;
+  unsigned retries = 0;
+  tftp_result_t result = {.error = 0};
 
   for (;;) {
     struct timeval timeout = {
-        .tv_sec = TFTP_TIMEOUT,
+        .tv_sec = timeout_s,
         .tv_usec = 0,
     };
-    const expected_tftp_packet_t packet = tftp_recv(socket, buffer, &timeout);
+    if (pending || gap) {
+      const uint64_t now = tftp_now_ns();
+      const uint64_t due = (pending ? pending_since : acked_ns) + ack_delay_ns;
+      timeout = tftp_timeval_from_ns(due > now ? due - now : 0);
+    }
 
-    /* handle timeout */
+    packet = tftp_recv(socket, buffer, &timeout, hooks);
     if (!packet.has_value) {
-      assert(packet.error == ETIMEDOUT);
-      tftp_send_ack(socket, buffer, block);
+      if (packet.error == EBADMSG || packet.error == EMSGSIZE)
+        continue;
+
+      if (packet.error == ETIMEDOUT && (pending || gap)) {
+        /* the delayed ACK is due, or the gap is still there. Blocks after a
+         * delayed ACK may have been lost as well, with nothing behind them
+         * to show the gap, so it is repeated too unless more arrive */
+        acked = expected - 1;
+        acked_ns = tftp_now_ns();
+        gap = pending ? TFTP_GAP_REPEATS : gap - 1;
+        pending = 0;
+        tftp_send_ack(socket, buffer, (tftp_block_t)acked);
+        continue;
+      }
+
+      if (packet.error != ETIMEDOUT || ++retries > TFTP_MAX_RETRIES) {
+        result.error = packet.error;
+        break;
+      }
+
+      if (expected == 1 && oack)
+        tftp_send_oack(socket, buffer, &accepted);
+      else
+        tftp_send_ack(socket, buffer, (tftp_block_t)acked);
+      acked_ns = tftp_now_ns();
+      continue;
+    }
+
+    /* the client retransmitted its request before our reply arrived */
+    if (packet.value.opcode == TFTP_OPCODE_WRQ && expected == 1) {
+      if (oack)
+        tftp_send_oack(socket, buffer, &accepted);
+      else
+        tftp_send_ack(socket, buffer, 0);
+      continue;
+    }
+
+    if (packet.value.opcode == TFTP_OPCODE_ERROR) {
+      result = (tftp_result_t){
+          .error = EPROTO,
+          .code = packet.value.error.code,
+      };
+      break;
+    }
+
+    if (packet.value.opcode != TFTP_OPCODE_DATA)
       continue;
+
+    if (packet.value.data.block != (tftp_block_t)expected) {
+      /* a gap or a retransmission, either way the sender has to go back to
+       * the block after acked. It does so on a repeated ACK, so a new one
+       * goes out twice. The rest of the window is likely still on its way,
+       * those blocks are not answered within ackdelay */
+      const uint64_t now = tftp_now_ns();
+      if (acked != expected - 1) {
+        acked = expected - 1;
+        pending = 0;
+        tftp_send_ack(socket, buffer, (tftp_block_t)acked);
+        tftp_send_ack(socket, buffer, (tftp_block_t)acked);
+        acked_ns = now;
+      } else if (now - acked_ns >= ack_delay_ns) {
+        tftp_send_ack(socket, buffer, (tftp_block_t)acked);
+        acked_ns = now;
+      }
+      if (!gap)
+        gap = TFTP_GAP_REPEATS;
+      continue;
+    }
+
+    const size_t size = packet.value.data.size;
+    if (file && fwrite(packet.value.data.data, 1, size, file) != size) {
+      result.error = errno;
+      tftp_send_error(socket, buffer, TFTP_ERROR_DISK_FULL,
+                      strerror(result.error));
+      break;
+    }
+
+    if (hooks->on_data)
+      hooks->on_data(size, hooks->userdata);
+
+    if (hooks->on_block)
+      hooks->on_block((tftp_block_t)expected, hooks->userdata);
+
+    retries = 0;
+    gap = 0;
+    if (pending++ == 0)
+      pending_since = tftp_now_ns();
+
+    /* the final ACK promises the data reached the file */
+    const bool final = size < blksize;
+    if (final && file) {
+      const int closed = tftp_close_file(file, true, file_hooks);
+      file = NULL;
+      if (closed != 0) {
+        result.error = errno;
+        tftp_send_error(socket, buffer, TFTP_ERROR_DISK_FULL,
+                        strerror(result.error));
+        break;
+      }
     }
 
-    assert(packet.value.opcode == TFTP_OPCODE_DATA);
-    block = packet.value.data.block;
+    if (final || pending >= ack_every || expected % window == 0) {
+      acked = expected;
+      acked_ns = tftp_now_ns();
+      pending = 0;
+      tftp_send_ack(socket, buffer, (tftp_block_t)acked);
+    }
+
+    ++expected;
+
+    if (final) {
+      if (hooks->on_complete)
+        hooks->on_complete(hooks->userdata);
+      tftp_dally(socket, buffer, (tftp_block_t)acked, timeout_s);
+      break;
+    }
+  }
 
-    assert(fwrite(packet.value.data.data, 1, packet.value.data.size, file) ==
-           packet.value.data.size);
+  if (file)
+    tftp_close_file(file, false, file_hooks);
+  return result;
+}
 
-    tftp_send_ack(socket, buffer, block);
+const char *tftp_read_request_filename(tftp_buffer_t *buffer,
+                                       size_t buffer_size) {
+  const expected_tftp_packet_t packet =
+      tftp_buffer_read_packet(buffer, buffer_size);
+  return packet.has_value && packet.value.opcode == TFTP_OPCODE_RRQ
+             ? packet.value.rrq.filename
+             : NULL;
+}
 
-    if (on_block)
-      on_block(block, userdata);
+/* an OACK to a read request is answered with ACK 0, or with an ERROR by a
+ * client that does not take the options */
+static tftp_result_t tftp_await_oack_ack(int socket, tftp_buffer_t *buffer,
+                                         const tftp_params_t *accepted,
+                                         const tftp_hooks_t *hooks) {
+  const time_t timeout_s = accepted->timeout ? accepted->timeout : TFTP_TIMEOUT;
+  unsigned retries = 0;
+  for (;;) {
+    struct timeval timeout = {
+        .tv_sec = timeout_s,
+        .tv_usec = 0,
+    };
+    const expected_tftp_packet_t packet =
+        tftp_recv(socket, buffer, &timeout, hooks);
+    if (!packet.has_value) {
+      if (packet.error == EBADMSG || packet.error == EMSGSIZE)
+        continue;
+      if (packet.error != ETIMEDOUT || ++retries > TFTP_MAX_RETRIES)
+        return (tftp_result_t){.error = packet.error};
+      tftp_send_oack(socket, buffer, accepted);
+      continue;
+    }
 
-    if (packet.value.data.size < TFTP_BLOCK_SIZE)
+    switch (packet.value.opcode) {
+    case TFTP_OPCODE_ERROR:
+      return tftp_result_from_error(&packet.value.error);
+    case TFTP_OPCODE_ACK:
+      if (packet.value.ack.block == 0)
+        return (tftp_result_t){.error = 0};
       break;
+    case TFTP_OPCODE_RRQ: /* our OACK crossed a retransmitted request */
+      tftp_send_oack(socket, buffer, accepted);
+      break;
+    default:
+      break;
+    }
   }
 }
+
+tftp_result_t tftp_handle_rrq(int socket, tftp_buffer_t *buffer,
+                              size_t buffer_size, const tftp_limits_t *limits,
+                              const tftp_hooks_t *hooks) {
+  assert(socket != -1);
+  assert(buffer);
+
+  const tftp_hooks_t no_hooks = {0};
+  if (!hooks)
+    hooks = &no_hooks;
+
+  const expected_tftp_packet_t packet =
+      tftp_buffer_read_packet(buffer, buffer_size);
+  if (!packet.has_value || packet.value.opcode != TFTP_OPCODE_RRQ) {
+    tftp_send_error(socket, buffer, TFTP_ERROR_ILLEGAL_OPERATION,
+                    "expected a read request");
+    return (tftp_result_t){
+        .error = EPROTO,
+        .code = TFTP_ERROR_ILLEGAL_OPERATION,
+    };
+  }
+
+  tftp_params_t requested = {0};
+  tftp_params_from_options(packet.value.rrq.options,
+                           packet.value.rrq.option_count, &requested);
+  /* there is nothing to discard or unpack in a download */
+  requested.probe = requested.batch = 0;
+  /* the window waits in our send buffer rather than the client's receive
+   * buffer we do not know */
+  int sndbuf = 0;
+  socklen_t sndbuf_size = sizeof(sndbuf);
+  if (-1 == getsockopt(socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndbuf_size))
+    sndbuf = 0;
+
+  const tftp_params_t accepted =
+      limits ? tftp_negotiate(&requested, limits, (size_t)sndbuf)
+             : (tftp_params_t){0};
+  const bool oack = accepted.blksize || accepted.windowsize ||
+                    accepted.ackevery || accepted.ackdelay_ms ||
+                    accepted.timeout;
+
+  /* opened before the OACK overwrites the request's filename */
+  FILE *file = hooks->on_open
+                   ? hooks->on_open(packet.value.rrq.filename, hooks->userdata)
+                   : fopen(packet.value.rrq.filename, "rb");
+  if (!file) {
+    const int error = errno;
+    tftp_send_error(socket, buffer,
+                    error == ENOENT ? TFTP_ERROR_NOT_FOUND
+                                    : TFTP_ERROR_ACCESS_VIOLATION,
+                    strerror(error));
+    return (tftp_result_t){.error = error};
+  }
+
+  tftp_result_t result = {.error = 0};
+  if (oack) {
+    tftp_send_oack(socket, buffer, &accepted);
+    result = tftp_await_oack_ack(socket, buffer, &accepted, hooks);
+  }
+  if (!result.error) {
+    if (hooks->on_block)
+      hooks->on_block(0, hooks->userdata);
+    result = tftp_send_blocks(socket, buffer, file, &accepted, hooks);
+  }
+
+  tftp_close_file(file, !result.error, hooks);
+  return result;
+}
@@ -0,0 +1,200 @@
+#include <drop/tuning.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TUNING_DIR "drop"
+#define TUNING_FILE "tuning"
+#define TUNING_MIN_WINDOW 4
+#define TUNING_MAX_WINDOW 1024
+/* retransmitted share of the probe above which uploads are paced, the
+ * go-back-N sender pays for every loss with a window of resends */
+#define TUNING_LOSSY_PERMILLE 20
+/* round trips before a retransmission */
+#define TUNING_TIMEOUT_RTTS 4
+#define NS_PER_SEC 1000000000ull
+
+tuning_t tuning_derive(const tuning_measurement_t *measurement) {
+  const uint16_t blksize =
+      measurement->blksize ? measurement->blksize : TFTP_BLOCK_SIZE;
+  const bool lossy = measurement->packets &&
+                     measurement->resent * 1000 / measurement->packets >
+                         TUNING_LOSSY_PERMILLE;
+
+  /* two bandwidth-delay products in flight keep the path busy while the
+   * ACKs are on their way back, less on a lossy path */
+  const double bdp = (double)measurement->rate *
+                     (double)measurement->rtt_ns / (double)NS_PER_SEC;
+  double window = 2 * bdp / blksize + 1;
+  if (lossy)
+    window /= 2;
+  if (window < TUNING_MIN_WINDOW)
+    window = TUNING_MIN_WINDOW;
+  if (window > TUNING_MAX_WINDOW)
+    window = TUNING_MAX_WINDOW;
+
+  uint64_t timeout =
+      (TUNING_TIMEOUT_RTTS * measurement->rtt_ns + NS_PER_SEC - 1) /
+      NS_PER_SEC;
+  if (timeout < 1)
+    timeout = 1;
+  if (timeout > UINT8_MAX)
+    timeout = UINT8_MAX;
+
+  return (tuning_t){
+      .probed_at = time(NULL),
+      .params =
+          {
+              .blksize = blksize,
+              .windowsize = (uint16_t)window,
+              .ackevery = (uint16_t)window / 2,
+              .timeout = (uint8_t)timeout,
+          },
+      .rate = lossy ? measurement->rate : 0,
+  };
+}
+
+static bool tuning_path(char *path, size_t size, const char *name) {
+  const char *config_dir = getenv("XDG_CONFIG_HOME");
+  if (!config_dir)
+    return false;
+  const int written =
+      name ? snprintf(path, size, "%s/" TUNING_DIR "/%s", config_dir, name)
+           : snprintf(path, size, "%s/" TUNING_DIR, config_dir);
+  return written > 0 && (size_t)written < size;
+}
+
+/* an empty port is the client's default, it is kept as "-" */
+static const char *tuning_port(const char *port) {
+  return port && *port ? port : "-";
+}
+
+/* parses a cache line, returns false for lines that are not an entry */
+static bool tuning_parse(const char *line, char *host, char *port,
+                         tuning_t *out) {
+  long long probed_at = 0;
+  unsigned blksize = 0, window = 0, ack_every = 0, timeout = 0;
+  uint64_t rate = 0;
+  if (sscanf(line, "%1024s %31s %lld %u %u %u %u %" SCNu64, host, port,
+             &probed_at, &blksize, &window, &ack_every, &timeout,
+             &rate) != 8 ||
+      blksize > TFTP_MAX_BLOCK_SIZE || window > UINT16_MAX ||
+      ack_every > UINT16_MAX || timeout > UINT8_MAX)
+    return false;
+
+  *out = (tuning_t){
+      .probed_at = (time_t)probed_at,
+      .params =
+          {
+              .blksize = (uint16_t)blksize,
+              .windowsize = (uint16_t)window,
+              .ackevery = (uint16_t)ack_every,
+              .timeout = (uint8_t)timeout,
+          },
+      .rate = rate,
+  };
+  return true;
+}
+
+bool tuning_load(const char *host, const char *port, time_t max_age,
+                 tuning_t *out) {
+  char path[PATH_MAX] = {0};
+  if (!tuning_path(path, sizeof(path), TUNING_FILE))
+    return false;
+
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return false;
+
+  port = tuning_port(port);
+  const time_t now = time(NULL);
+
+  bool found = false;
+  char *line = NULL;
+  size_t capacity = 0;
+  while (getline(&line, &capacity, file) != -1) {
+    char entry_host[NI_MAXHOST] = {0};
+    char entry_port[32] = {0};
+    tuning_t tuning = {0};
+    if (!tuning_parse(line, entry_host, entry_port, &tuning) ||
+        strcmp(entry_host, host) != 0 || strcmp(entry_port, port) != 0)
+      continue;
+
+    found = now - tuning.probed_at <= max_age;
+    if (found)
+      *out = tuning;
+    break;
+  }
+
+  free(line);
+  fclose(file);
+  return found;
+}
+
+int tuning_store(const char *host, const char *port, const tuning_t *tuning) {
+  char dir[PATH_MAX] = {0};
+  char path[PATH_MAX] = {0};
+  char temp[PATH_MAX] = {0};
+  if (!tuning_path(dir, sizeof(dir), NULL) ||
+      !tuning_path(path, sizeof(path), TUNING_FILE) ||
+      !tuning_path(temp, sizeof(temp), "." TUNING_FILE ".XXXXXX")) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if (-1 == mkdir(dir, 0777) && errno != EEXIST)
+    return -1;
+
+  /* the other entries are copied to a new file that replaces the old one,
+   * concurrent runs never see half a cache */
+  const int fd = mkstemp(temp);
+  if (fd == -1)
+    return -1;
+  FILE *out = fdopen(fd, "w");
+  if (!out) {
+    const int error = errno;
+    close(fd);
+    unlink(temp);
+    errno = error;
+    return -1;
+  }
+
+  port = tuning_port(port);
+
+  FILE *in = fopen(path, "r");
+  if (in) {
+    char *line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, in) != -1) {
+      char entry_host[NI_MAXHOST] = {0};
+      char entry_port[32] = {0};
+      tuning_t entry = {0};
+      if (!tuning_parse(line, entry_host, entry_port, &entry) ||
+          (strcmp(entry_host, host) == 0 && strcmp(entry_port, port) == 0))
+        continue;
+      fputs(line, out);
+    }
+    free(line);
+    fclose(in);
+  }
+
+  fprintf(out, "%s %s %lld %u %u %u %u %" PRIu64 "\n", host, port,
+          (long long)tuning->probed_at, tuning->params.blksize,
+          tuning->params.windowsize, tuning->params.ackevery,
+          tuning->params.timeout, tuning->rate);
+
+  if (fclose(out) != 0 || -1 == rename(temp, path)) {
+    const int error = errno;
+    unlink(temp);
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,140 @@
+#!/bin/sh
+# Times drop against dropd over loopback: one large file, many small files
+# one by one and the same files as a batch, which runs the tftp codec, the
+# window and the archive packing and unpacking the way a deployment does.
+#
+#   scripts/bench-loopback.sh BUILD [BUILD...]
+#
+# Each BUILD is a build directory with src/drop and src/dropd. With more
+# than one, the others are compared to the first. The PGO training run of
+# `cmake --build . --target pgo-train` is one round of it.
+#
+# ROUNDS (3), LARGE_MB (64), SMALL_FILES (200) and PORT (17069) can be set
+# in the environment.
+
+set -eu
+
+ROUNDS=${ROUNDS:-3}
+LARGE_MB=${LARGE_MB:-64}
+SMALL_FILES=${SMALL_FILES:-200}
+PORT=${PORT:-17069}
+
+if [ $# -eq 0 ]; then
+  echo "usage: $0 BUILD [BUILD...]" >&2
+  exit 2
+fi
+
+work=$(mktemp -d)
+daemon=
+cleanup() {
+  [ -z "$daemon" ] || kill "$daemon" 2>/dev/null || true
+  rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+# the tuning cache stays out of the user's
+XDG_CONFIG_HOME=$work/config
+export XDG_CONFIG_HOME
+
+mkdir -p "$work/files/small"
+head -c $((LARGE_MB * 1024 * 1024)) /dev/urandom >"$work/files/large.bin"
+n=0
+while [ $n -lt "$SMALL_FILES" ]; do
+  head -c $((512 + n * 37 % 8192)) /dev/urandom >"$work/files/small/$n.bin"
+  n=$((n + 1))
+done
+
+now_ms() {
+  echo $(($(date +%s%N) / 1000000))
+}
+
+# runs a workload with the build in $1 and checks what the daemon received,
+# prints its milliseconds
+run() {
+  build=$1
+  shift
+  prefix=
+  case $1 in
+  --batch=*) prefix=${1#--batch=}/ ;;
+  esac
+
+  # a file left by the previous round must not pass for this one's
+  for file in "$@"; do
+    [ "$file" = "$1" ] && [ -n "$prefix" ] && continue
+    rm -f "$work/root/$prefix$file"
+  done
+
+  start=$(now_ms)
+  (cd "$work/files" && "$build/src/drop" --tune off -p "$PORT" ::1 "$@" \
+    >/dev/null 2>"$work/drop.log") || {
+    cat "$work/drop.log" >&2
+    exit 1
+  }
+  ms=$(($(now_ms) - start))
+
+  for file in "$@"; do
+    [ "$file" = "$1" ] && [ -n "$prefix" ] && continue
+    cmp -s "$work/files/$file" "$work/root/$prefix$file" || {
+      echo "$0: $prefix$file was not received intact" >&2
+      exit 1
+    }
+  done
+  echo "$ms"
+}
+
+# the best of ROUNDS, what the build can do rather than the noise around it
+bench() {
+  build=$1
+  shift
+  best=
+  round=0
+  while [ $round -lt "$ROUNDS" ]; do
+    ms=$(run "$build" "$@")
+    if [ -z "$best" ] || [ "$ms" -lt "$best" ]; then
+      best=$ms
+    fi
+    round=$((round + 1))
+  done
+  echo "$best"
+}
+
+results=
+for build in "$@"; do
+  build=$(cd "$build" && pwd)
+  rm -rf "$work/root"
+  mkdir -p "$work/root/small" "$work/root/batch/small"
+  (cd "$work/root" && exec "$build/src/dropd" -p "$PORT" \
+    >"$work/dropd.log" 2>&1) &
+  daemon=$!
+  sleep 0.5
+
+  large=$(bench "$build" large.bin)
+  small=$(cd "$work/files" && bench "$build" small/*)
+  batch=$(cd "$work/files" && bench "$build" --batch=batch small/*)
+
+  # SIGTERM lets dropd finish its sessions and exit, which is when a
+  # profiling build writes its counts
+  kill "$daemon"
+  wait "$daemon" || {
+    cat "$work/dropd.log" >&2
+    exit 1
+  }
+  daemon=
+
+  echo "$build: large ${large}ms, small ${small}ms, batch ${batch}ms"
+  results="$results $large $small $batch"
+done
+
+# gains of each build over the first, positive for faster
+[ $# -gt 1 ] || exit 0
+set -- $results
+base_large=$1 base_small=$2 base_batch=$3
+shift 3
+while [ $# -ge 3 ]; do
+  echo "$1 $2 $3" | awk -v l="$base_large" -v s="$base_small" \
+    -v b="$base_batch" '{
+      printf "gain: large %+.1f%%, small %+.1f%%, batch %+.1f%%\n",
+        100 * (l - $1) / l, 100 * (s - $2) / s, 100 * (b - $3) / b
+    }'
+  shift 3
+done
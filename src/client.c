@@ -1,18 +1,35 @@
+#include <drop/batch.h>
+#include <drop/busypoll.h>
+#include <drop/fanout.h>
+#include <drop/multicast.h>
 #include <drop/options.h>
+#include <drop/pacer.h>
+#include <drop/pmtu.h>
+#include <drop/progress.h>
 #include <drop/tftp.h>
+#include <drop/tuning.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/net_tstamp.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef int socket_t;
@@ -21,20 +38,108 @@ typedef struct sockaddr_in6 address_t;
 typedef struct {
   pid_t pid;
   const char *filename;
-  int pipefd;
-  struct {
-    uint16_t block;
-    uint16_t block_count;
-  } status;
+  int pipefd;   /* closed by the child when it is done */
+  size_t index; /* its progress slot */
+  /* one per destination, taken from the parent's pools, -1 where the child
+   * makes its own */
+  const socket_t *sockets;
 } child_t;
 
+typedef enum {
+  PACING_AUTO,
+  PACING_USER,   /* sleep until each packet's departure time */
+  PACING_KERNEL, /* SO_MAX_PACING_RATE, enforced by the fq qdisc */
+  PACING_TXTIME, /* SO_TXTIME departure times, needs fq or etf */
+} pacing_t;
+
+typedef enum {
+  TUNE_CACHED, /* use what an earlier probe found */
+  TUNE_AUTO,   /* probe destinations without a recent entry first */
+  TUNE_OFF,
+} tune_t;
+
+/* what --stats reports of the startup. The parent fills in its own times,
+ * the children the time of their first WRQ in memory shared with it */
+typedef struct {
+  uint64_t started_ns; /* when drop started */
+  uint64_t resolve_ns; /* resolving every destination, once */
+  uint64_t prepare_ns; /* filling the socket pools */
+  size_t prepared;     /* sockets the pools were filled with */
+  uint64_t spawn_ns;   /* forking the children, without the above */
+  _Atomic uint64_t *first_wrq_ns; /* per file since started_ns, 0 if none */
+  size_t count;
+} startup_stats_t;
+
+/* settings given as options, tuning leaves them alone */
+enum {
+  SET_WINDOW = 1 << 0,
+  SET_ACK_EVERY = 1 << 1,
+  SET_TIMEOUT = 1 << 2,
+  SET_LIMIT_RATE = 1 << 3,
+};
+
 typedef struct {
   options_t base;
+  address_t resolved; /* base.address, looked up once by the parent */
   char *const *filenames;
   size_t file_count;
+  uint64_t limit_rate;      /* all files together, bytes/s */
+  uint64_t limit_file_rate; /* each file, bytes/s */
+  pacing_t pacing;
+  pacer_t *run_pacer; /* shared by all children */
+  progress_t *progress; /* shared by all children, NULL when not shown */
+  tftp_params_t request; /* windowsize 0 for a lock-step transfer */
+  pmtu_cache_t *pmtu;    /* block sizes learned by the children */
+  tune_t tune;
+  bool probe;   /* probe the destination even if it is cached */
+  unsigned set; /* SET_* */
+  busypoll_config_t busy_poll;
+  bool multicast;   /* host is a group, files go to every daemon in it */
+  size_t receivers; /* daemons to wait for, 0 for whoever answers */
+  uint64_t fanout_buffer; /* how far a host may get ahead of the slowest */
+  /* the directory the files are unpacked in as one batch, NULL to upload
+   * them one by one */
+  const char *batch;
+  bool stats; /* report the startup */
+  startup_stats_t *startup; /* shared by all children, NULL without stats */
 } client_options_t;
 
+typedef struct {
+  pacer_t *run;
+  pacer_t file;
+  bool txtime;
+  busypoll_t busypoll; /* not pacing, but the same hooks' state */
+  progress_t *progress; /* and neither is reporting progress */
+  startup_stats_t *startup; /* nor timing the first WRQ */
+  size_t index;             /* the upload's, for both */
+  uint64_t acked; /* reported to progress so far */
+} child_pacing_t;
+
 #define PROGRAM_NAME "drop"
+#define MAX_ATTEMPTS 8
+/* lookups a resolver answers with EAI_AGAIN, backing off in between */
+#define RESOLVE_ATTEMPTS 4
+/* sockets a destination's pool is filled with at once */
+#define SOCKET_POOL_SIZE 16
+#define BACKOFF_BASE_MS 100
+#define BACKOFF_MAX_MS 30000
+#define DEFAULT_WINDOW 16
+#define DEFAULT_ACK_EVERY 8
+#define DEFAULT_TIMEOUT 1
+/* progress is redrawn on a terminal, logged with -v elsewhere */
+#define PROGRESS_TERMINAL_INTERVAL_NS 250000000ull
+#define PROGRESS_LOG_INTERVAL_NS 5000000000ull
+#define PMTU_CACHE_ENTRIES 64
+#define PROBE_FILENAME "drop-probe"
+#define PROBE_SIZE (512 * 1024)
+#define PROBE_WINDOW 64
+#define BATCH_NAME "batch"
+#define BATCH_DIRECTORY "."
+#define TUNING_MAX_AGE_S (24 * 60 * 60)
+#define NS_PER_SEC 1000000000ull
+/* no ACKs slow a multicast upload down, it is paced to this without a rate
+ * given */
+#define DEFAULT_MULTICAST_RATE (100 * 1000 * 1000)
 
 static void swap(void *a, void *b, size_t size) {
   uint8_t buffer[size];
@@ -45,19 +150,129 @@ static void swap(void *a, void *b, size_t size) {
 
 //clang-format off
 const char *usage =
-    "Usage: " PROGRAM_NAME " [options] <host> <filename> [filename...]\n"
+    "Usage: " PROGRAM_NAME " [options] <host>[,host...] <filename> "
+    "[filename...]\n"
+    "       " PROGRAM_NAME " --probe [options] <host>[,host...]\n"
     "\n"
     "Options:\n"
     "  --port,    -p <port> the port <host> is listening on\n"
     "  --verbose, -v        verbose output\n"
     "  --help,    -h        print this message\n"
+    "  --limit-rate <rate>  cap on all uploads together, e.g. 10M (bytes/s)\n"
+    "  --limit-file-rate <rate>\n"
+    "                       cap on each file\n"
+    "  --pacing <mode>      how rates are enforced: auto, user, kernel\n"
+    "                       (SO_MAX_PACING_RATE) or txtime (SO_TXTIME),\n"
+    "                       the latter two need the fq qdisc\n"
+    "  --window <n>         blocks in flight, default 16, 0 for lock-step\n"
+    "  --ack-every <n>      ask for an ACK every n blocks, default 8\n"
+    "  --ack-delay <ms>     longest the server may hold back an ACK\n"
+    "  --timeout <s>        retransmission timeout, default 1\n"
+    "  --blksize <n>        block size, by default the largest that fits\n"
+    "                       the path MTU\n"
+    "  --probe              measure the path to <host> and cache the\n"
+    "                       settings derived from it\n"
+    "  --tune <mode>        cached (default) starts uploads with the\n"
+    "                       settings of an earlier probe, auto probes\n"
+    "                       first when there is none, off ignores them\n"
+    "  --busy-poll <us>     spin up to us microseconds for each reply\n"
+    "                       before sleeping, for lock-step latency\n"
+    "  --busy-poll-budget <percent>\n"
+    "                       share of the time that may go to spinning,\n"
+    "                       default 50\n"
+    "  --receivers <n>      with a multicast <host>, wait for n daemons to\n"
+    "                       join, by default whoever joins within 1 s\n"
+    "  --fanout-buffer <size>\n"
+    "                       how far a pipe is read ahead, and with several\n"
+    "                       hosts how far the fastest may get ahead of the\n"
+    "                       slowest, default 8M\n"
+    "  --batch[=<dir>]      upload the files as one archive the daemon\n"
+    "                       unpacks into <dir>, by default its root, for\n"
+    "                       many small files\n"
+    "  --stats              print where the time before the uploads went:\n"
+    "                       resolving, preparing sockets, forking and\n"
+    "                       the time to each file's first WRQ\n"
     "\n"
     "Arguments:\n"
-    "  <host>      hostname of server\n"
+    "  <host>      hostname of server, or an IPv6 multicast group the\n"
+    "              daemons joined with --multicast, e.g. ff02::d%eth0.\n"
+    "              Files go to several hosts at once, read only once\n"
     "  <filename>  file to upload, - for stdin\n";
 // clang-fomat on
 
+enum {
+  OPTION_LIMIT_RATE = 256,
+  OPTION_LIMIT_FILE_RATE,
+  OPTION_PACING,
+  OPTION_WINDOW,
+  OPTION_ACK_EVERY,
+  OPTION_ACK_DELAY,
+  OPTION_TIMEOUT,
+  OPTION_BLKSIZE,
+  OPTION_PROBE,
+  OPTION_TUNE,
+  OPTION_BUSY_POLL,
+  OPTION_BUSY_POLL_BUDGET,
+  OPTION_RECEIVERS,
+  OPTION_FANOUT_BUFFER,
+  OPTION_BATCH,
+  OPTION_STATS,
+};
+
+static uint64_t parse_rate_or_exit(const char *name, const char *value) {
+  uint64_t rate = 0;
+  if (!options_parse_size(value, &rate)) {
+    fprintf(stderr, PROGRAM_NAME ": invalid %s '%s'\n", name, value);
+    exit(EXIT_FAILURE);
+  }
+  return rate;
+}
+
+static unsigned long parse_number_or_exit(const char *name, const char *value,
+                                          unsigned long max) {
+  char *end = NULL;
+  const unsigned long number = strtoul(value, &end, 10);
+  if (end == value || *end != '\0' || number > max) {
+    fprintf(stderr, PROGRAM_NAME ": invalid %s '%s'\n", name, value);
+    exit(EXIT_FAILURE);
+  }
+  return number;
+}
+
+static pacing_t parse_pacing_or_exit(const char *value) {
+  const char *const modes[] = {
+      [PACING_AUTO] = "auto",
+      [PACING_USER] = "user",
+      [PACING_KERNEL] = "kernel",
+      [PACING_TXTIME] = "txtime",
+  };
+  for (size_t n = 0; n < sizeof(modes) / sizeof(modes[0]); ++n) {
+    if (strcmp(value, modes[n]) == 0)
+      return (pacing_t)n;
+  }
+
+  fprintf(stderr, PROGRAM_NAME ": invalid pacing '%s'\n", value);
+  exit(EXIT_FAILURE);
+}
+
+static tune_t parse_tune_or_exit(const char *value) {
+  const char *const modes[] = {
+      [TUNE_CACHED] = "cached",
+      [TUNE_AUTO] = "auto",
+      [TUNE_OFF] = "off",
+  };
+  for (size_t n = 0; n < sizeof(modes) / sizeof(modes[0]); ++n) {
+    if (strcmp(value, modes[n]) == 0)
+      return (tune_t)n;
+  }
+
+  fprintf(stderr, PROGRAM_NAME ": invalid tune '%s'\n", value);
+  exit(EXIT_FAILURE);
+}
+
 static void options_from_argv(int argc, char *const *argv, options_t *out) {
+  client_options_t *options = (client_options_t *)out;
+
   struct option const long_options[] = {
       {
           .name = "port",
@@ -77,6 +292,102 @@ static void options_from_argv(int argc, char *const *argv, options_t *out) {
           .flag = NULL,
           .val = 'h',
       },
+      {
+          .name = "limit-rate",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_LIMIT_RATE,
+      },
+      {
+          .name = "limit-file-rate",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_LIMIT_FILE_RATE,
+      },
+      {
+          .name = "pacing",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_PACING,
+      },
+      {
+          .name = "window",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_WINDOW,
+      },
+      {
+          .name = "ack-every",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_ACK_EVERY,
+      },
+      {
+          .name = "ack-delay",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_ACK_DELAY,
+      },
+      {
+          .name = "timeout",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_TIMEOUT,
+      },
+      {
+          .name = "blksize",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_BLKSIZE,
+      },
+      {
+          .name = "probe",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = OPTION_PROBE,
+      },
+      {
+          .name = "tune",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_TUNE,
+      },
+      {
+          .name = "busy-poll",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_BUSY_POLL,
+      },
+      {
+          .name = "busy-poll-budget",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_BUSY_POLL_BUDGET,
+      },
+      {
+          .name = "receivers",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_RECEIVERS,
+      },
+      {
+          .name = "fanout-buffer",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_FANOUT_BUFFER,
+      },
+      {
+          .name = "batch",
+          .has_arg = optional_argument,
+          .flag = NULL,
+          .val = OPTION_BATCH,
+      },
+      {
+          .name = "stats",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = OPTION_STATS,
+      },
       {.name = 0, .has_arg = 0, .flag = 0, .val = 0},
   };
 
@@ -87,7 +398,11 @@ static void options_from_argv(int argc, char *const *argv, options_t *out) {
     case -1:
       return;
     case 'p':
-      strncpy(out->address.port, optarg, sizeof(out->address.port));
+      if (strlen(optarg) >= sizeof(out->address.port)) {
+        fprintf(stderr, PROGRAM_NAME ": invalid port '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      memcpy(out->address.port, optarg, strlen(optarg) + 1);
       break;
     case 'v':
       out->verbose = true;
@@ -95,16 +410,176 @@ static void options_from_argv(int argc, char *const *argv, options_t *out) {
     case 'h':
       puts(usage);
       exit(EXIT_SUCCESS);
+    case OPTION_LIMIT_RATE:
+      options->limit_rate = parse_rate_or_exit("limit-rate", optarg);
+      options->set |= SET_LIMIT_RATE;
+      break;
+    case OPTION_LIMIT_FILE_RATE:
+      options->limit_file_rate = parse_rate_or_exit("limit-file-rate", optarg);
+      break;
+    case OPTION_PACING:
+      options->pacing = parse_pacing_or_exit(optarg);
+      break;
+    case OPTION_WINDOW:
+      options->request.windowsize =
+          (uint16_t)parse_number_or_exit("window", optarg, UINT16_MAX);
+      options->set |= SET_WINDOW;
+      break;
+    case OPTION_ACK_EVERY:
+      options->request.ackevery =
+          (uint16_t)parse_number_or_exit("ack-every", optarg, UINT16_MAX);
+      options->set |= SET_ACK_EVERY;
+      break;
+    case OPTION_ACK_DELAY:
+      options->request.ackdelay_ms =
+          (uint16_t)parse_number_or_exit("ack-delay", optarg, UINT16_MAX);
+      break;
+    case OPTION_TIMEOUT:
+      options->request.timeout =
+          (uint8_t)parse_number_or_exit("timeout", optarg, UINT8_MAX);
+      options->set |= SET_TIMEOUT;
+      break;
+    case OPTION_BLKSIZE:
+      options->request.blksize = (uint16_t)parse_number_or_exit(
+          "blksize", optarg, TFTP_MAX_BLOCK_SIZE);
+      break;
+    case OPTION_PROBE:
+      options->probe = true;
+      break;
+    case OPTION_TUNE:
+      options->tune = parse_tune_or_exit(optarg);
+      break;
+    case OPTION_BUSY_POLL:
+      options->busy_poll.spin_us =
+          (uint32_t)parse_number_or_exit("busy-poll", optarg, UINT32_MAX);
+      break;
+    case OPTION_BUSY_POLL_BUDGET:
+      options->busy_poll.budget =
+          (uint8_t)parse_number_or_exit("busy-poll-budget", optarg, 100);
+      break;
+    case OPTION_RECEIVERS:
+      options->receivers = (size_t)parse_number_or_exit(
+          "receivers", optarg, MULTICAST_MAX_RECEIVERS);
+      break;
+    case OPTION_FANOUT_BUFFER:
+      options->fanout_buffer = parse_rate_or_exit("fanout-buffer", optarg);
+      break;
+    case OPTION_BATCH:
+      options->batch = optarg ? optarg : BATCH_DIRECTORY;
+      options->request.batch = 1;
+      break;
+    case OPTION_STATS:
+      options->stats = true;
+      break;
     }
   }
 }
 
 static void parent_spawn_children(child_t *children,
-                                  const client_options_t *options);
-static void parent_monitor_children(child_t *children, size_t count);
+                                  const client_options_t *destinations,
+                                  size_t destination_count);
+static bool parent_monitor_children(child_t *children, size_t count,
+                                    progress_t *progress);
+static bool tune(client_options_t *options);
+static void backoff(unsigned attempt, unsigned retry_after_ms);
+address_t address(const options_t *options);
+
+/* resolves the destination, the only lookup of it in the run, and settles
+ * what depends on it, false if its probe failed */
+static bool destination_setup(client_options_t *destination) {
+  const uint64_t started_ns = pacer_now_ns();
+  destination->resolved = address(&destination->base);
+  if (destination->startup)
+    destination->startup->resolve_ns += pacer_now_ns() - started_ns;
+
+  const address_t *resolved = &destination->resolved;
+  destination->multicast = IN6_IS_ADDR_MULTICAST(&resolved->sin6_addr);
+  if (!destination->multicast)
+    return destination->probe || destination->tune != TUNE_OFF
+               ? tune(destination)
+               : true;
+
+  if (destination->probe) {
+    fprintf(stderr, PROGRAM_NAME ": --probe needs a unicast host\n");
+    exit(EXIT_FAILURE);
+  }
+  if (destination->batch) {
+    fprintf(stderr, PROGRAM_NAME ": --batch needs a unicast host\n");
+    exit(EXIT_FAILURE);
+  }
+  /* the tuning of one path says nothing about a group's */
+  if (!destination->limit_rate && !destination->limit_file_rate)
+    destination->limit_file_rate = DEFAULT_MULTICAST_RATE;
+  destination->pmtu = NULL;
+  return true;
+}
+
+/* a pacer shared with every child */
+static pacer_t *shared_pacer_new(uint64_t rate) {
+  pacer_t *pacer = mmap(NULL, sizeof(pacer_t), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert(pacer != MAP_FAILED);
+  pacer_init(pacer, rate);
+  return pacer;
+}
+
+/* times the children write and the parent reads, 0 until written */
+static _Atomic uint64_t *shared_times_new(size_t count) {
+  _Atomic uint64_t *times =
+      mmap(NULL, count * sizeof(*times), PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert(times != MAP_FAILED);
+  return times;
+}
+
+/* the first WRQ of the file wins, with several destinations too */
+static void startup_first_wrq(startup_stats_t *stats, size_t index,
+                              uint64_t now_ns) {
+  uint64_t none = 0;
+  atomic_compare_exchange_strong(stats->first_wrq_ns + index, &none,
+                                 now_ns - stats->started_ns);
+}
+
+static int compare_u64(const void *a, const void *b) {
+  const uint64_t left = *(const uint64_t *)a;
+  const uint64_t right = *(const uint64_t *)b;
+  return left < right ? -1 : left > right;
+}
+
+static void startup_stats_print(const startup_stats_t *stats) {
+  uint64_t *times = malloc(stats->count * sizeof(uint64_t));
+  assert(times);
+  size_t sent = 0;
+  for (size_t n = 0; n < stats->count; ++n) {
+    const uint64_t time_ns = atomic_load(stats->first_wrq_ns + n);
+    if (time_ns)
+      times[sent++] = time_ns;
+  }
+  qsort(times, sent, sizeof(uint64_t), &compare_u64);
+
+  printf("startup: resolved in %.3f ms, %zu sockets prepared in %.3f ms, "
+         "forked in %.3f ms\n",
+         (double)stats->resolve_ns / 1e6, stats->prepared,
+         (double)stats->prepare_ns / 1e6, (double)stats->spawn_ns / 1e6);
+  if (sent)
+    printf("first WRQ of %zu files: first after %.3f ms, p50 %.3f ms, "
+           "p99 %.3f ms, last %.3f ms\n",
+           sent, (double)times[0] / 1e6,
+           (double)times[(sent - 1) * 50 / 100] / 1e6,
+           (double)times[(sent - 1) * 99 / 100] / 1e6,
+           (double)times[sent - 1] / 1e6);
+  else
+    printf("first WRQ: none sent\n");
+  free(times);
+}
 
 int main(int argc, char *const *argv) {
+  startup_stats_t startup = {.started_ns = pacer_now_ns()};
   client_options_t options = {0};
+  options.request.windowsize = DEFAULT_WINDOW;
+  options.request.ackevery = DEFAULT_ACK_EVERY;
+  options.request.timeout = DEFAULT_TIMEOUT;
+  options.busy_poll.budget = BUSYPOLL_DEFAULT_BUDGET;
 
   /* parse common options first, command-line can override config*/
   options_from_config("drop/" PROGRAM_NAME ".conf", &options_from_argv,
@@ -118,26 +593,97 @@ int main(int argc, char *const *argv) {
     exit(EXIT_FAILURE);
   }
 
-  if (optind + 1 == argc) {
+  if (optind + 1 == argc && !options.probe) {
     fprintf(stderr, PROGRAM_NAME ": expected <filename> argument\n");
     puts(usage);
     exit(EXIT_FAILURE);
   }
 
   /* read positional arguments */
-  strncpy(options.base.address.host, argv[optind++],
-          sizeof(options.base.address.host));
+  char *hosts = strdup(argv[optind++]);
+  assert(hosts);
 
   options.filenames = argv + optind;
   options.file_count = argc - optind;
 
-  child_t children[options.file_count];
-  memset(children, 0, sizeof(child_t) * options.file_count);
+  if (!options.request.blksize)
+    options.pmtu = pmtu_cache_new(PMTU_CACHE_ENTRIES);
+
+  /* a batch is a single upload */
+  const size_t child_count = options.batch ? 1 : options.file_count;
+  if (options.stats && child_count) {
+    startup.count = child_count;
+    startup.first_wrq_ns = shared_times_new(child_count);
+    options.startup = &startup;
+  }
+
+  /* each host gets the options, tuned for it */
+  client_options_t *destinations = NULL;
+  size_t destination_count = 0;
+  bool tuned = true;
+  char *save = NULL;
+  for (char *host = strtok_r(hosts, ",", &save); host;
+       host = strtok_r(NULL, ",", &save)) {
+    destinations = realloc(destinations, (destination_count + 1) *
+                                             sizeof(client_options_t));
+    assert(destinations);
+    client_options_t *destination = destinations + destination_count++;
+    *destination = options;
+    if (strlen(host) >= sizeof(destination->base.address.host)) {
+      fprintf(stderr, PROGRAM_NAME ": invalid host '%s'\n", host);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(destination->base.address.host, host, strlen(host) + 1);
+    tuned = destination_setup(destination) && tuned;
+  }
+  free(hosts);
+
+  if (destination_count == 0) {
+    fprintf(stderr, PROGRAM_NAME ": expected <host> argument\n");
+    exit(EXIT_FAILURE);
+  }
+  if (options.file_count == 0) /* nothing to upload after --probe */
+    return tuned ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  /* --limit-rate caps the whole run, a rate tuned for a host only the
+   * uploads to it */
+  pacer_t *run_pacer = NULL;
+  for (size_t n = 0; n < destination_count; ++n) {
+    client_options_t *destination = destinations + n;
+    if (!destination->limit_rate)
+      continue;
+    if (!(destination->set & SET_LIMIT_RATE)) {
+      destination->run_pacer = shared_pacer_new(destination->limit_rate);
+      continue;
+    }
+    if (!run_pacer)
+      run_pacer = shared_pacer_new(destination->limit_rate);
+    destination->run_pacer = run_pacer;
+  }
+
+  child_t children[child_count];
+  memset(children, 0, sizeof(child_t) * child_count);
 
-  parent_spawn_children(children, &options);
-  parent_monitor_children(children, options.file_count);
+  progress_t *progress = NULL;
+  const bool terminal = isatty(STDERR_FILENO);
+  if (terminal || options.base.verbose) {
+    progress = progress_new(child_count, stderr,
+                            terminal ? PROGRESS_TERMINAL_INTERVAL_NS
+                                     : PROGRESS_LOG_INTERVAL_NS);
+    if (!progress)
+      fprintf(stderr, "progress_new: %s\n", strerror(errno));
+  }
+  for (size_t n = 0; n < destination_count; ++n)
+    destinations[n].progress = progress;
 
-  return EXIT_SUCCESS;
+  parent_spawn_children(children, destinations, destination_count);
+  const bool completed =
+      parent_monitor_children(children, child_count, progress);
+  progress_free(progress);
+  if (options.startup)
+    startup_stats_print(&startup);
+
+  return completed ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 address_t address(const options_t *options) {
@@ -155,14 +701,21 @@ address_t address(const options_t *options) {
       strlen(options->address.host) == 0 ? NULL : options->address.host;
   const char *port = options->address.port;
 
+  /* a resolver that cannot answer yet is asked again a few times, one that
+   * never can fails the run rather than hanging it */
   struct addrinfo *results = NULL;
-  int ret = getaddrinfo(host, port, &hints, &results);
+  int ret = 0;
+  for (unsigned attempt = 0; attempt < RESOLVE_ATTEMPTS; ++attempt) {
+    ret = getaddrinfo(host, port, &hints, &results);
+    if (ret != EAI_AGAIN)
+      break;
+    if (attempt + 1 < RESOLVE_ATTEMPTS)
+      backoff(attempt, 0);
+  }
 
   switch (ret) {
   case 0:
     break;
-  case EAI_AGAIN:
-    return address(options);
   case EAI_SYSTEM:
     fprintf(stderr, "getaddrinfo failed: '%s'\n", strerror(errno));
     goto err;
@@ -185,128 +738,748 @@ err:
   exit(EXIT_FAILURE);
 }
 
-static socket_t child_connect(const options_t *options) {
+/* a window of blocks fits the send buffer, so it goes out without waiting
+ * for the kernel to make room */
+static void child_setup_sndbuf(socket_t s, const client_options_t *options) {
+  const uint64_t blksize = options->request.blksize
+                               ? options->request.blksize
+                               : pmtu_blksize(options->pmtu, s);
+  const uint64_t window =
+      options->request.windowsize ? options->request.windowsize : 1;
+  const uint64_t wanted = window * (blksize + 4);
+
+  /* the kernel doubles what it is given for its bookkeeping and reports
+   * the doubled size */
+  int sndbuf = 0;
+  socklen_t sndbuf_size = sizeof(sndbuf);
+  if (-1 == getsockopt(s, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndbuf_size) ||
+      (uint64_t)sndbuf >= 2 * wanted)
+    return;
+
+  const int size = wanted > INT_MAX / 2 ? INT_MAX / 2 : (int)wanted;
+  if (-1 == setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)))
+    fprintf(stderr, "setsockopt for 'SO_SNDBUF': %s\n", strerror(errno));
+}
+
+/* a socket connected to the destination's address as resolved by the
+ * parent and set up for uploads to it, -1 if there is none */
+static socket_t child_connect(const client_options_t *options) {
   const socket_t s = socket(AF_INET6, SOCK_DGRAM, 0);
   if (s == -1) {
     fprintf(stderr, "socket: %s\n", strerror(errno));
     return -1;
   }
 
-  if (-1 == setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &options->v6only,
-                       sizeof(options->v6only))) {
+  if (-1 == setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &options->base.v6only,
+                       sizeof(options->base.v6only))) {
     fprintf(stderr, "setsockopt: %s\n", strerror(errno));
+    close(s);
     return -1;
   }
 
-  const address_t destination = address(options);
-  if (-1 ==
-      connect(s, (const struct sockaddr *)&destination, sizeof(address_t))) {
+  /* never fragment, blocks are sized to the path MTU instead */
+  if (-1 == pmtu_setup(s))
+    fprintf(stderr, "setsockopt for 'IPV6_DONTFRAG': %s\n", strerror(errno));
+
+  if (-1 == connect(s, (const struct sockaddr *)&options->resolved,
+                    sizeof(address_t))) {
     fprintf(stderr, "connect: %s\n", strerror(errno));
+    close(s);
     return -1;
   }
 
+  child_setup_sndbuf(s, options);
   return s;
 }
 
 static void upload_file(socket_t s, const char *filename) {}
 
-noreturn static void child(const options_t *options, child_t *child) {
-  const socket_t client = child_connect(options);
-  assert(client != -1);
+static bool default_qdisc_is_fq(void) {
+  FILE *file = fopen("/proc/sys/net/core/default_qdisc", "r");
+  if (!file)
+    return false;
 
-  FILE *file = stdin;
-  if (strcmp(child->filename, "-") != 0) {
-    file = fopen(child->filename, "rb");
-    if (!file) {
-      fprintf(stderr, "fopen: %s\n", strerror(errno));
-      exit(EXIT_FAILURE);
+  char qdisc[32] = {0};
+  const bool read = fgets(qdisc, sizeof(qdisc), file) != NULL;
+  fclose(file);
+
+  return read && strcmp(qdisc, "fq\n") == 0;
+}
+
+static void child_setup_pacing(socket_t s, const client_options_t *options,
+                               child_pacing_t *out) {
+  out->run = options->run_pacer;
+  pacer_init(&out->file, options->limit_file_rate);
+
+  pacing_t pacing = options->pacing;
+  if (pacing == PACING_AUTO)
+    pacing = default_qdisc_is_fq() ? PACING_KERNEL : PACING_USER;
+
+  switch (pacing) {
+  case PACING_AUTO:
+  case PACING_USER:
+    break;
+  case PACING_KERNEL: {
+    /* fq paces this socket, the run-wide cap stays with the shared pacer */
+    const uint64_t rate = options->limit_file_rate;
+    if (rate == 0)
+      break;
+    if (-1 ==
+        setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate))) {
+      fprintf(stderr, "setsockopt for 'SO_MAX_PACING_RATE': %s\n",
+              strerror(errno));
+      break;
     }
-  } else {
+    pacer_init(&out->file, 0);
+    break;
+  }
+  case PACING_TXTIME: {
+    const struct sock_txtime txtime = {
+        .clockid = CLOCK_MONOTONIC,
+        .flags = 0,
+    };
+    if (-1 == setsockopt(s, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime))) {
+      fprintf(stderr, "setsockopt for 'SO_TXTIME': %s\n", strerror(errno));
+      break;
+    }
+    out->txtime = true;
+    break;
+  }
+  }
+}
+
+static void child_setup_busy_poll(socket_t s, const client_options_t *options,
+                                  child_pacing_t *out) {
+  busypoll_init(&out->busypoll, &options->busy_poll);
+  if (options->busy_poll.spin_us &&
+      -1 == busypoll_setup(s, &options->busy_poll))
+    fprintf(stderr, "setsockopt for 'SO_BUSY_POLL': %s\n", strerror(errno));
+}
+
+static int child_on_wait(int socket, uint64_t deadline_ns, void *userdata) {
+  child_pacing_t *pacing = userdata;
+  return busypoll_wait(&pacing->busypoll, socket, deadline_ns);
+}
+
+/* ACKs only add up, the parent reads them at its own pace */
+static void child_on_progress(uint64_t bytes, void *userdata) {
+  child_pacing_t *pacing = userdata;
+  progress_add(pacing->progress, pacing->index,
+               (int64_t)(bytes - pacing->acked));
+  pacing->acked = bytes;
+}
+
+static void child_on_request(void *userdata) {
+  child_pacing_t *pacing = userdata;
+  startup_first_wrq(pacing->startup, pacing->index, pacer_now_ns());
+}
+
+static uint64_t child_on_send(size_t bytes, void *userdata) {
+  child_pacing_t *pacing = userdata;
+
+  uint64_t departure = pacer_reserve(pacing->run, bytes);
+  const uint64_t file_departure = pacer_reserve(&pacing->file, bytes);
+  if (file_departure > departure)
+    departure = file_departure;
+
+  if (pacing->txtime)
+    return departure;
+
+  if (departure > pacer_now_ns())
+    pacer_sleep_until(departure);
+  return 0;
+}
+
+/* sleeps before retrying a request the server shed or did not answer */
+static void backoff(unsigned attempt, unsigned retry_after_ms) {
+  uint64_t delay_ms = (uint64_t)BACKOFF_BASE_MS << attempt;
+  if (delay_ms > BACKOFF_MAX_MS)
+    delay_ms = BACKOFF_MAX_MS;
+  if (delay_ms < retry_after_ms)
+    delay_ms = retry_after_ms;
+
+  /* jitter in [delay / 2, delay * 3 / 2] so shed clients do not come back in
+   * lock-step */
+  delay_ms = delay_ms / 2 + (uint64_t)random() % (delay_ms + 1);
+
+  const struct timespec delay = {
+      .tv_sec = (time_t)(delay_ms / 1000),
+      .tv_nsec = (long)(delay_ms % 1000) * 1000000,
+  };
+  nanosleep(&delay, NULL);
+}
+
+/* uploads file over *client, retrying while that may help. An upload that
+ * has to start over gets a new socket, set up for pacing unless pacing is
+ * NULL. request ends up with the block size that got through */
+static tftp_result_t send_file(const client_options_t *options,
+                               socket_t *client, child_pacing_t *pacing,
+                               const char *filename, FILE *file,
+                               tftp_params_t *request,
+                               const tftp_hooks_t *hooks) {
+  tftp_result_t result = {0};
+  for (unsigned attempt = 0; attempt < MAX_ATTEMPTS; ++attempt) {
+    result = tftp_send_wrq(*client, filename, file, request, hooks);
+    if (!result.error)
+      break;
+
+    /* an upload that got under way starts over, not possible from a pipe.
+     * The old session may still be waiting for blocks, so it starts from a
+     * new port the server sees as a new transfer */
+    if (result.started) {
+      if (fseek(file, 0, SEEK_SET) != 0)
+        break;
+      close(*client);
+      *client = child_connect(options);
+      assert(*client != -1);
+      if (pacing) {
+        child_setup_pacing(*client, options, pacing);
+        child_setup_busy_poll(*client, options, pacing);
+      }
+    }
+
+    if (result.error == EMSGSIZE && options->pmtu) {
+      /* ICMP "packet too big" taught the kernel a smaller path MTU */
+      request->blksize = pmtu_blksize(options->pmtu, *client);
+      pmtu_cache_lower(options->pmtu, *client, request->blksize);
+      continue;
+    }
+
+    if (result.error == ETIMEDOUT && result.started && result.bytes == 0 &&
+        options->pmtu && request->blksize > TFTP_BLOCK_SIZE) {
+      /* not a single block made it, a path that drops big packets without
+       * telling */
+      request->blksize = request->blksize / 2 > TFTP_BLOCK_SIZE
+                             ? request->blksize / 2
+                             : TFTP_BLOCK_SIZE;
+      pmtu_cache_lower(options->pmtu, *client, request->blksize);
+      continue;
+    }
+
+    if (result.error != EBUSY && result.error != ETIMEDOUT)
+      break;
+
+    if (attempt + 1 < MAX_ATTEMPTS)
+      backoff(attempt, result.retry_after_ms);
+  }
+  return result;
+}
+
+/* opens the child's file, exits if it cannot */
+static FILE *child_open(child_t *child) {
+  if (strcmp(child->filename, "-") == 0) {
     child->filename = "stdin";
+    return stdin;
+  }
+
+  FILE *file = fopen(child->filename, "rb");
+  if (!file) {
+    fprintf(stderr, "fopen: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  return file;
+}
+
+/* one file's upload to one destination, a thread of the file's process
+ * when there are several */
+typedef struct {
+  const client_options_t *options;
+  const char *filename; /* as requested */
+  char name[NI_MAXHOST + 256]; /* in messages, with the host if several */
+  FILE *file;
+  batch_t *batch; /* file's archive, with --batch */
+  size_t index;   /* the file's progress slot */
+  socket_t socket; /* from the parent's pool, -1 to connect one */
+  bool ok;
+  pthread_t thread;
+} upload_t;
+
+/* pushes the file to every daemon in the group */
+static bool upload_multicast(upload_t *upload) {
+  const client_options_t *options = upload->options;
+  const socket_t s = socket(AF_INET6, SOCK_DGRAM, 0);
+  if (s == -1) {
+    fprintf(stderr, "socket: %s\n", strerror(errno));
+    return false;
   }
 
-  tftp_send_wrq(client, child->filename, file, NULL, NULL);
+  child_pacing_t pacing = {0};
+  child_setup_pacing(s, options, &pacing);
+
+  const tftp_hooks_t hooks = {
+      .on_send = &child_on_send,
+      .userdata = &pacing,
+  };
+  const multicast_params_t params = {
+      .blksize = options->request.blksize,
+      .receivers = options->receivers,
+  };
+  const multicast_result_t result = multicast_send(
+      s, &options->resolved, upload->filename, upload->file, &params, &hooks);
+  if (result.error)
+    fprintf(stderr, "%s: %s\n", upload->name, strerror(result.error));
+
+  /*verbose*/
+  printf("%s: %zu of %zu receivers done, %zu refused, %" PRIu64
+         " NAKs, %" PRIu64 " blocks repaired\n",
+         upload->name, result.completed, result.joined, result.refused,
+         result.naks, result.repaired);
+
+  close(s);
+  return !result.error;
+}
+
+static bool upload_unicast(upload_t *upload) {
+  const client_options_t *options = upload->options;
+  socket_t client =
+      upload->socket != -1 ? upload->socket : child_connect(options);
+  if (client == -1)
+    return false;
+
+  child_pacing_t pacing = {0};
+  child_setup_pacing(client, options, &pacing);
+  child_setup_busy_poll(client, options, &pacing);
+  pacing.progress = options->progress;
+  pacing.startup = options->startup;
+  pacing.index = upload->index;
+  const bool paced = options->limit_rate || options->limit_file_rate;
+
+  const tftp_hooks_t hooks = {
+      .on_send = paced ? &child_on_send : NULL,
+      .on_wait = options->busy_poll.spin_us ? &child_on_wait : NULL,
+      .on_progress = options->progress ? &child_on_progress : NULL,
+      .on_request = options->startup ? &child_on_request : NULL,
+      .userdata = &pacing,
+  };
+
+  /* a tuned block size is still held to what the path takes now */
+  tftp_params_t request = options->request;
+  if (options->pmtu) {
+    const uint16_t fits = pmtu_blksize(options->pmtu, client);
+    if (!request.blksize || fits < request.blksize)
+      request.blksize = fits;
+  }
+
+  const uint64_t started_ns = pacer_now_ns();
+  const tftp_result_t result =
+      send_file(options, &client, &pacing, upload->filename, upload->file,
+                &request, &hooks);
+  if (result.error)
+    fprintf(stderr, "%s: %s\n", upload->name, strerror(result.error));
+
+  if (!result.error && (options->base.verbose || options->busy_poll.spin_us)) {
+    /* in lock-step the time per block is its round trip, what spinning is
+     * meant to cut */
+    const busypoll_t *busypoll = &pacing.busypoll;
+    const uint64_t elapsed_ns = pacer_now_ns() - started_ns;
+    const uint64_t blocks =
+        result.bytes / (request.blksize ? request.blksize : TFTP_BLOCK_SIZE) +
+        1;
+    /*verbose*/
+    printf("%s: %.1f us per block, rtt %.1f us", upload->name,
+           (double)elapsed_ns / 1e3 / (double)blocks,
+           (double)result.rtt_ns / 1e3);
+    if (busypoll->waits)
+      printf(", %" PRIu64 " of %" PRIu64 " waits answered while spinning, "
+             "%.1f%% of the time spinning",
+             busypoll->hits, busypoll->waits,
+             100.0 * (double)busypoll->spun_ns / (double)elapsed_ns);
+    printf("\n");
+  }
 
   close(client);
+  return !result.error;
+}
+
+static void *upload_thread(void *userdata) {
+  upload_t *upload = userdata;
+  upload->ok = upload->options->multicast ? upload_multicast(upload)
+                                          : upload_unicast(upload);
+  if (upload->batch) {
+    int error = 0;
+    const char *failed = batch_failed(upload->batch, &error);
+    if (failed && !upload->ok)
+      fprintf(stderr, "%s: %s\n", failed, strerror(error));
+    batch_free(upload->batch);
+    return NULL;
+  }
+  /* a finished or failed upload holds the others back no longer */
+  fclose(upload->file);
+  return NULL;
+}
+
+/* each destination builds the archive on a thread of its own, small files
+ * are cheaper to read again than to keep for the slowest */
+static bool child_batch(upload_t *uploads, size_t count) {
+  const client_options_t *options = uploads->options;
+  for (size_t n = 0; n < count; ++n) {
+    uploads[n].batch = batch_pack(options->filenames, options->file_count);
+    if (!uploads[n].batch) {
+      fprintf(stderr, "batch_pack: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    uploads[n].file = batch_stream(uploads[n].batch);
+    const int error = pthread_create(&uploads[n].thread, NULL,
+                                     &upload_thread, uploads + n);
+    if (error) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(error));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  bool ok = true;
+  for (size_t n = 0; n < count; ++n) {
+    pthread_join(uploads[n].thread, NULL);
+    ok = ok && uploads[n].ok;
+  }
+  return ok;
+}
+
+static bool is_regular(FILE *file) {
+  struct stat status;
+  return fstat(fileno(file), &status) == 0 && S_ISREG(status.st_mode);
+}
+
+/* a regular file's size to every destination is what progress expects of
+ * it, a pipe's and the archive's are not known ahead */
+static void child_expect(const client_options_t *destinations, size_t count,
+                         const child_t *child, FILE *file) {
+  struct stat status;
+  if (destinations->progress && file && fstat(fileno(file), &status) == 0 &&
+      S_ISREG(status.st_mode))
+    progress_expect(destinations->progress, child->index,
+                    (uint64_t)status.st_size * count);
+}
+
+/* uploads the child's file to every destination. With several, the file is
+ * read once and each destination gets a thread with a session of its own.
+ * A pipe is read ahead on a thread even for one. With --batch the child's
+ * file is the archive of all of them */
+noreturn static void child(const client_options_t *destinations,
+                           size_t count, child_t *child) {
+  FILE *file = destinations->batch ? NULL : child_open(child);
+  srandom((unsigned)getpid() ^ (unsigned)time(NULL));
+  child_expect(destinations, count, child, file);
+
+  upload_t uploads[count];
+  memset(uploads, 0, sizeof(uploads));
+  for (size_t n = 0; n < count; ++n) {
+    upload_t *upload = uploads + n;
+    upload->options = destinations + n;
+    upload->filename =
+        destinations->batch ? destinations->batch : child->filename;
+    upload->index = child->index;
+    upload->socket = child->sockets ? child->sockets[n] : -1;
+    if (count == 1)
+      snprintf(upload->name, sizeof(upload->name), "%s", child->filename);
+    else
+      snprintf(upload->name, sizeof(upload->name), "%s to %s",
+               child->filename, destinations[n].base.address.host);
+  }
+
+  bool ok = true;
+  if (destinations->batch) {
+    ok = child_batch(uploads, count);
+  } else if (count == 1 && is_regular(file)) {
+    uploads[0].file = file;
+    ok = uploads[0].options->multicast ? upload_multicast(uploads)
+                                       : upload_unicast(uploads);
+  } else {
+    fanout_t *fanout =
+        fanout_new(file, count, destinations->fanout_buffer);
+    if (!fanout) {
+      fprintf(stderr, "%s: %s\n", child->filename, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    for (size_t n = 0; n < count; ++n) {
+      uploads[n].file = fanout_open(fanout, n);
+      assert(uploads[n].file);
+      const int error = pthread_create(&uploads[n].thread, NULL,
+                                       &upload_thread, uploads + n);
+      if (error) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(error));
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (size_t n = 0; n < count; ++n) {
+      pthread_join(uploads[n].thread, NULL);
+      ok = ok && uploads[n].ok;
+    }
+    fanout_free(fanout);
+  }
+
   close(child->pipefd);
+  exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void probe_on_block(tftp_block_t block, void *userdata) {
+  uint64_t *started_ns = userdata;
+  if (block == 0) /* the request was answered, again after a retry */
+    *started_ns = pacer_now_ns();
+}
+
+/* uploads PROBE_SIZE bytes the server discards and derives settings from
+ * how that went */
+static bool probe(const client_options_t *options, tuning_t *out) {
+  socket_t client = child_connect(options);
+  if (client == -1)
+    return false;
 
-  exit(EXIT_SUCCESS);
+  uint8_t *data = calloc(PROBE_SIZE, 1);
+  FILE *file = data ? fmemopen(data, PROBE_SIZE, "rb") : NULL;
+  if (!file) {
+    fprintf(stderr, "fmemopen: %s\n", strerror(errno));
+    free(data);
+    close(client);
+    return false;
+  }
+
+  tftp_params_t request = {
+      .blksize = options->request.blksize
+                     ? options->request.blksize
+                     : pmtu_blksize(options->pmtu, client),
+      .windowsize = PROBE_WINDOW,
+      .ackevery = PROBE_WINDOW / 4,
+      .timeout = DEFAULT_TIMEOUT,
+      .probe = 1,
+  };
+  uint64_t started_ns = 0;
+  const tftp_hooks_t hooks = {
+      .on_block = &probe_on_block,
+      .userdata = &started_ns,
+  };
+  const tftp_result_t result = send_file(options, &client, NULL,
+                                         PROBE_FILENAME, file, &request,
+                                         &hooks);
+  const uint64_t elapsed_ns = pacer_now_ns() - started_ns;
+
+  fclose(file);
+  free(data);
+  close(client);
+
+  if (result.error) {
+    fprintf(stderr, "probe: %s\n", strerror(result.error));
+    return false;
+  }
+
+  const tuning_measurement_t measurement = {
+      .blksize = request.blksize,
+      .rtt_ns = result.rtt_ns,
+      .rate = elapsed_ns ? result.bytes * NS_PER_SEC / elapsed_ns : 0,
+      .packets = result.bytes / request.blksize + 1 + result.resent,
+      .resent = result.resent,
+  };
+  *out = tuning_derive(&measurement);
+
+  /*verbose*/
+  printf("probed %s: rtt %.3f ms, %" PRIu64 " bytes/s, %" PRIu64
+         " of %" PRIu64 " packets resent\n"
+         "tuned: blksize %u, window %u, ack-every %u, timeout %u s, "
+         "rate %" PRIu64 " bytes/s\n",
+         options->base.address.host, (double)measurement.rtt_ns / 1e6,
+         measurement.rate, measurement.resent, measurement.packets,
+         out->params.blksize, out->params.windowsize, out->params.ackevery,
+         out->params.timeout, out->rate);
+  fflush(stdout); /* before the children inherit the buffer */
+  return true;
+}
+
+/* fills in the settings the options left open from the destination's cache
+ * entry, probing first for --probe and with --tune auto. Returns false if
+ * the probe failed */
+static bool tune(client_options_t *options) {
+  const char *host = options->base.address.host;
+  const char *port = options->base.address.port;
+
+  tuning_t tuning = {0};
+  if (options->probe ||
+      !tuning_load(host, port, TUNING_MAX_AGE_S, &tuning)) {
+    if (!options->probe && options->tune != TUNE_AUTO)
+      return true;
+    if (!probe(options, &tuning))
+      return false;
+    if (-1 == tuning_store(host, port, &tuning))
+      fprintf(stderr, "tuning_store: %s\n", strerror(errno));
+  }
+
+  if (!options->request.blksize)
+    options->request.blksize = tuning.params.blksize;
+  if (!(options->set & SET_WINDOW)) {
+    options->request.windowsize = tuning.params.windowsize;
+    if (!(options->set & SET_ACK_EVERY))
+      options->request.ackevery = tuning.params.ackevery;
+  }
+  if (!(options->set & SET_TIMEOUT))
+    options->request.timeout = tuning.params.timeout;
+  if (!(options->set & SET_LIMIT_RATE) && tuning.rate)
+    options->limit_rate = tuning.rate;
+  return true;
+}
+
+/* sockets connected and set up for one destination before the children
+ * that take them are forked, so a child sends its WRQ right away. A child
+ * closes the rest of the pool it inherits and the parent the one the child
+ * was given */
+typedef struct {
+  socket_t sockets[SOCKET_POOL_SIZE];
+  size_t count;
+} socket_pool_t;
+
+/* a socket for the destination, -1 if none could be made. An empty pool is
+ * filled with as many of the wanted sockets as fit */
+static socket_t socket_pool_take(socket_pool_t *pool,
+                                 const client_options_t *options,
+                                 size_t wanted) {
+  if (!pool->count) {
+    const uint64_t started_ns = pacer_now_ns();
+    while (pool->count < SOCKET_POOL_SIZE && pool->count < wanted) {
+      const socket_t s = child_connect(options);
+      if (s == -1)
+        break;
+      pool->sockets[pool->count++] = s;
+    }
+    if (options->startup) {
+      options->startup->prepare_ns += pacer_now_ns() - started_ns;
+      options->startup->prepared += pool->count;
+    }
+  }
+  return pool->count ? pool->sockets[--pool->count] : -1;
 }
 
 static void parent_spawn_children(child_t *children,
-                                  const client_options_t *options) {
-  for (size_t n = 0; n < options->file_count; ++n) {
+                                  const client_options_t *destinations,
+                                  size_t destination_count) {
+  const uint64_t started_ns = pacer_now_ns();
+  const client_options_t *options = destinations;
+  const size_t count = options->batch ? 1 : options->file_count;
+  socket_pool_t pools[destination_count];
+  memset(pools, 0, sizeof(pools));
+  for (size_t n = 0; n < count; ++n) {
     int fds[2] = {0};
-    assert(pipe(fds) == 0);
+    if (-1 == pipe(fds)) {
+      fprintf(stderr, "pipe: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    /* a group's upload has a socket of its own kind */
+    socket_t sockets[destination_count];
+    for (size_t d = 0; d < destination_count; ++d)
+      sockets[d] = destinations[d].multicast
+                       ? -1
+                       : socket_pool_take(pools + d, destinations + d,
+                                          count - n);
 
+    children[n].index = n;
+    children[n].sockets = sockets;
+    /* or the child writes what is buffered again */
+    fflush(stdout);
     children[n].pid = fork();
     assert(children[n].pid != -1);
 
-    children[n].filename = options->filenames[n];
+    children[n].filename = options->batch ? BATCH_NAME : options->filenames[n];
 
     if (0 == children[n].pid) { /* we're the child */
       children[n].pipefd = fds[1];
       close(fds[0]);
-      child(&options->base, children + n);
+      for (size_t d = 0; d < destination_count; ++d)
+        for (size_t s = 0; s < pools[d].count; ++s)
+          close(pools[d].sockets[s]);
+      child(destinations, destination_count, children + n);
     }
 
     children[n].pipefd = fds[0];
+    children[n].sockets = NULL;
     close(fds[1]);
+    for (size_t d = 0; d < destination_count; ++d) {
+      if (sockets[d] != -1)
+        close(sockets[d]);
+    }
     printf("spawned %d for %s\n", children[n].pid, children[n].filename);
   }
+
+  if (options->startup)
+    options->startup->spawn_ns =
+        pacer_now_ns() - started_ns - options->startup->prepare_ns;
 }
 
-static void parent_cleanup_child(const child_t *child) {
+/* reaps the child, true if its upload succeeded */
+static bool parent_cleanup_child(const child_t *child) {
   close(child->pipefd);
 
   int wstatus = 0;
   waitpid(child->pid, &wstatus, 0);
   if (WIFEXITED(wstatus)) {
     const int exit_code = WEXITSTATUS(wstatus);
-    if (exit_code == EXIT_SUCCESS)
+    if (exit_code == EXIT_SUCCESS) {
       printf("[%d] transer complete: %s\n", child->pid, child->filename);
-    else
-      fprintf(stderr, "[%d] transfer failed: %s, error: %d", child->pid,
-              child->filename, exit_code);
+      return true;
+    }
+    fprintf(stderr, "[%d] transfer failed: %s, error: %d\n", child->pid,
+            child->filename, exit_code);
   } else {
     fprintf(stderr, "%d finished abnormally\n", child->pid);
   }
+  return false;
 }
 
-static void parent_monitor_children(child_t *children, size_t count) {
+/* waits for every child to close its pipe, rendering progress meanwhile,
+ * false if any of them failed. poll rather than select, a run may have more
+ * files than FD_SETSIZE */
+static bool parent_monitor_children(child_t *children, size_t count,
+                                    progress_t *progress) {
+  struct pollfd *fds = calloc(count ? count : 1, sizeof(struct pollfd));
+  assert(fds);
+  bool completed = true;
   while (count) {
-    fd_set readfds = {0};
-    int max = 0;
-    for (size_t n = 0; n < count; ++n) {
-      max = (max < children[n].pipefd) ? children[n].pipefd : max;
-      FD_SET(children[n].pipefd, &readfds);
+    for (size_t n = 0; n < count; ++n)
+      fds[n] = (struct pollfd){.fd = children[n].pipefd, .events = POLLIN};
+
+    int timeout_ms = -1;
+    if (progress) {
+      const uint64_t now_ns = pacer_now_ns();
+      const uint64_t next_ns = progress_next_ns(progress);
+      timeout_ms = 0;
+      if (next_ns > now_ns)
+        timeout_ms = (int)((next_ns - now_ns + 999999) / 1000000);
     }
 
-    if (-1 == select(max + 1, &readfds, NULL, NULL, NULL)) {
+    const int ready = poll(fds, count, timeout_ms);
+    if (ready == -1) {
       assert(errno == EINTR);
       continue;
     }
 
-    for (size_t n = 0; n < count; ++n) {
-      if (FD_ISSET(children[n].pipefd, &readfds)) {
-        const int read_result = read(children[n].pipefd, &children[n].status,
-                                     sizeof(children[n].status));
-        if (read_result == -1) {
-          assert(errno == EINTR);
-          break;
-        }
-
-        if (read_result == 0) { /* child closed pipe */
-          const size_t back = --count;
-          swap(children + n, children + back, sizeof(child_t));
-          parent_cleanup_child(children + back);
-        } else {
-          assert(read_result == sizeof(children[n].status));
-          printf("[%d] uploaded %d blocks of %d in %s\n", children[n].pid,
-                 children[n].status.block, children[n].status.block_count,
-                 children[n].filename);
-        }
+    /* back to front, a finished child is swapped with the last one */
+    for (size_t n = count; ready && n-- > 0;) {
+      if (!fds[n].revents)
+        continue;
+
+      char discard[64];
+      const ssize_t read_result =
+          read(children[n].pipefd, discard, sizeof(discard));
+      if (read_result == -1) {
+        assert(errno == EINTR);
+        continue;
+      }
+
+      if (read_result == 0) { /* child closed pipe */
+        const size_t back = --count;
+        swap(children + n, children + back, sizeof(child_t));
+        if (progress)
+          progress_clear(progress);
+        const bool ok = parent_cleanup_child(children + back);
+        completed = completed && ok;
+        if (progress)
+          progress_finish(progress, children[back].index, ok);
       }
     }
+
+    if (progress)
+      progress_render(progress, pacer_now_ns());
   }
+  if (progress)
+    progress_done(progress, pacer_now_ns());
+  free(fds);
+  return completed;
 }
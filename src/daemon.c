@@ -1,10 +1,25 @@
+#include <drop/admission.h>
+#include <drop/affinity.h>
+#include <drop/busypoll.h>
+#include <drop/capture.h>
+#include <drop/filecache.h>
+#include <drop/handoff.h>
+#include <drop/log.h>
+#include <drop/multicast.h>
 #include <drop/options.h>
+#include <drop/pacer.h>
+#include <drop/prefix.h>
+#include <drop/relay.h>
+#include <drop/sched.h>
+#include <drop/sink.h>
 #include <drop/tftp.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,21 +27,145 @@
 #include <stdnoreturn.h>
 #include <string.h>
 
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 typedef int socket_t;
 typedef struct sockaddr_in6 address_t;
 
+/* session settings for the clients in some prefixes */
+typedef struct {
+  const char *name;
+  tftp_limits_t limits;  /* on what clients may negotiate */
+  uint64_t session_rate; /* bytes/s for each session, 0 for none */
+  char *root;            /* where uploads go, NULL for the working directory */
+  busypoll_config_t busy_poll;
+} profile_t;
+
 typedef struct {
   options_t base;
   const char *id;
+  sched_config_t sched;
+  sched_weight_t *weights;
+  size_t weight_count;
+  admission_config_t admission;
+  profile_t defaults; /* for clients no profile matches */
+  /* as given, they are parsed once the defaults they start from are known */
+  char **profiles;        /* <name>:<setting>=<value>,... */
+  size_t profile_count;
+  char **profile_matches; /* <prefix>=<name> */
+  size_t profile_match_count;
+  char *control;  /* where a successor can take the port over */
+  char *takeover; /* the control path of the dropd to take over from */
+  char *cpus;     /* CPU list to steer sessions to */
+  char *multicast; /* group to take multicast uploads from */
+  char **relays;   /* <path-prefix>=<host>[:<port>] */
+  size_t relay_count;
+  relay_commit_t relay_commit;
+  char **sinks; /* <pattern>=<path> */
+  size_t sink_count;
+  bool downloads;          /* serve read requests */
+  uint64_t download_cache; /* bytes of files shared by downloads */
+  log_level_t log_level;   /* -v raises it to info */
+  log_format_t log_format;
+  char *capture; /* file the datagrams received are appended to */
 } server_options_t;
 
+/* uploads whose name starts with prefix go on to next_hop */
+typedef struct {
+  char *prefix;
+  address_t next_hop;
+} relay_route_t;
+
+/* uploads whose name matches pattern go to the consumer at path */
+typedef struct {
+  char *pattern;
+  const char *path; /* within pattern's allocation */
+} sink_route_t;
+
+/* a --profile-prefix as parsed */
+typedef struct {
+  prefix_t prefix;
+  int profile; /* index into profiles */
+} profile_match_t;
+
+/* what a reload replaces. Sessions keep the copy they were forked with, so
+ * the accept loop is the only reader and the old one is freed right after
+ * the swap */
+typedef struct {
+  profile_t *profiles; /* the defaults first */
+  size_t profile_count;
+  prefix_table_t *profile_prefixes; /* client prefix to profile index */
+  /* what profile_prefixes was built from, passed on by a reload's check */
+  profile_match_t *matches;
+  size_t match_count;
+  relay_route_t *relays;
+  size_t relay_count;
+  relay_commit_t relay_commit;
+  sink_route_t *sinks;
+  size_t sink_count;
+} server_config_t;
+
+/* a multicast upload we answered, the sender repeats its announce */
+typedef struct {
+  address_t sender;
+  pid_t pid; /* 0 while the request waits for capacity */
+} multicast_session_t;
+
+typedef struct {
+  socket_t *sockets; /* listening, one per CPU of the affinity map */
+  size_t socket_count;
+  socket_t control; /* -1 without --control */
+  /* joined to the group on the listening port, -1 without --multicast.
+   * Requests from it have the index after the listening sockets */
+  socket_t multicast;
+  address_t group;
+  multicast_session_t *multicast_sessions;
+  size_t multicast_session_count;
+  affinity_t *affinity; /* NULL without --cpus */
+  sched_t *sched;
+  admission_t *admission;
+  server_config_t *config;
+  bool downloads;
+  filecache_t *cache; /* NULL without downloads or a cache for them */
+  capture_t *capture; /* NULL without --capture */
+  /* the command line, it overrides the config file again on reload */
+  int argc;
+  char **argv;
+  pid_t reload_pid; /* checking a new config, 0 for none */
+  int reload_fd;    /* where the check leaves the config it built */
+  /* on what fails once per request, like sockets under fd exhaustion */
+  log_limit_t accept_log_limit;
+} server_t;
+
 #define PROGRAM_NAME "dropd"
+#define DEFAULT_MAX_SESSIONS 1024
+#define DEFAULT_ACCEPT_QUEUE 64
+#define DEFAULT_ACCEPT_TIMEOUT_MS 2000
+#define DEFAULT_MAX_WINDOW 64
+#define DEFAULT_MAX_ACK_DELAY_MS 200
+#define SESSION_RCVBUF (128 * 1024)
+#define DEFAULT_DOWNLOAD_CACHE (256 * 1024 * 1024)
+/* a session's messages for each of its blocks, per second */
+#define SESSION_LOG_BURST 10
+#define SESSION_LOG_INTERVAL_NS 1000000000u
+/* the accept loop's messages for each request, per second */
+#define ACCEPT_LOG_BURST 10
+/* lookups a resolver answers with EAI_AGAIN, the wait doubles in between */
+#define RESOLVE_ATTEMPTS 4
+#define RESOLVE_RETRY_NS 100000000ull
+/* the kernel doubles SO_RCVBUF for its bookkeeping */
+#define SESSION_MEMORY                                                         \
+  (2 * SESSION_RCVBUF + TFTP_WRITE_BUFFER_SIZE + sizeof(tftp_buffer_t))
 
 // clang-format off
 const char *usage =
@@ -36,10 +175,97 @@ const char *usage =
   "  bind: the address to to listen on. Default is the 'any' address\n"
   "  port: the port to listen on. Default is '0'\n"
   "Options:\n"
-  "  -v, --verbose verbose output\n"
-  "  -h, --help    print this message\n";
+  "  -p, --port <port>           the port to listen on, multicast pushes\n"
+  "                              need the same on every daemon\n"
+  "  -v, --verbose               verbose output\n"
+  "  -h, --help                  print this message\n"
+  "      --rate-limit <rate>     cap on total ingest bandwidth, e.g. 100M\n"
+  "      --client-rate <rate>    cap on ingest bandwidth per client subnet\n"
+  "      --weight <prefix>=<n>   bandwidth share weight of clients in prefix\n"
+  "      --client-subnet-v4 <n>  prefix length grouping IPv4 clients\n"
+  "      --client-subnet-v6 <n>  prefix length grouping IPv6 clients\n"
+  "      --max-sessions <n>      concurrent sessions, default 1024\n"
+  "      --memory-budget <size>  cap on all sessions' buffers, e.g. 512M\n"
+  "      --accept-queue <n>      requests waiting for capacity, default 64\n"
+  "      --accept-timeout <ms>   longest wait before a request is shed\n"
+  "      --max-blksize <n>       largest block size a client may ask for\n"
+  "      --max-window <n>        blocks a client may keep in flight,\n"
+  "                              default 64, 0 for lock-step only\n"
+  "      --max-ack-delay <ms>    longest a client may have ACKs held back,\n"
+  "                              default 200\n"
+  "      --min-timeout <s>       shortest retransmission timeout accepted\n"
+  "      --max-timeout <s>       longest retransmission timeout accepted\n"
+  "      --session-rate <rate>   cap on each session's ingest bandwidth\n"
+  "      --root <dir>            where uploads are stored\n"
+  "      --busy-poll <us>        spin up to us microseconds for each\n"
+  "                              packet before sleeping\n"
+  "      --busy-poll-budget <percent>\n"
+  "                              share of a session's time that may go to\n"
+  "                              spinning, default 50\n"
+  "      --profile <name>:<setting>=<value>[,...]\n"
+  "                              settings above for some clients, the rest\n"
+  "                              is taken from the options\n"
+  "      --profile-prefix <prefix>=<name>\n"
+  "                              clients in prefix get profile name\n"
+  "      --control <path>        unix socket a new dropd takes the port\n"
+  "                              over from\n"
+  "      --takeover <path>       take the port over from the dropd whose\n"
+  "                              --control is path, it finishes its\n"
+  "                              sessions and exits\n"
+  "      --cpus <list>           CPUs to run sessions on, e.g. 0-3,8, each\n"
+  "                              on the one that received its packets\n"
+  "      --multicast <group>[%iface]\n"
+  "                              also take uploads pushed to the IPv6\n"
+  "                              group on the listening port\n"
+  "      --relay <path>=<host>[:<port>]\n"
+  "                              pass uploads whose name starts with path\n"
+  "                              on to host while receiving them, IPv6\n"
+  "                              hosts with a port in brackets. The port\n"
+  "                              defaults to the listening one\n"
+  "      --relay-commit <local|downstream>\n"
+  "                              acknowledge a relayed upload once it is\n"
+  "                              stored here, the default, or once the\n"
+  "                              next hop acknowledged it\n"
+  "      --sink <pattern>=<path> hand uploads whose name matches the glob\n"
+  "                              to the consumer at path, a unix socket or\n"
+  "                              a FIFO, instead of storing them\n"
+  "      --downloads             serve read requests for files in the root\n"
+  "      --download-cache <size> memory for files shared by the downloads\n"
+  "                              of them, default 256M, 0 for none\n"
+  "      --log-level <error|info|debug>\n"
+  "                              what goes to stderr, -v is info. debug\n"
+  "                              adds each session's blocks, at most 10\n"
+  "                              messages a second\n"
+  "      --log-format <text|json>\n"
+  "                              key=value lines, the default, or JSON\n"
+  "                              objects\n"
+  "      --capture <file>        append the datagrams of requests and\n"
+  "                              sessions to file, for drop-replay\n"
+  "\n"
+  "Requests beyond capacity are answered with 'busy, retry after N ms'.\n"
+  "SIGUSR1 prints bandwidth shares, fairness, latencies, admissions,\n"
+  "the CPU map and the download cache.\n"
+  "SIGHUP reloads the configuration, running sessions keep theirs except\n"
+  "for rate-limit, client-rate and weights.\n"
+  "With socket activation (LISTEN_FDS) the passed sockets are used as is.\n";
 // clang-format on
 
+/* getaddrinfo, asked again a few times while the resolver cannot answer
+ * yet. One that never can fails the lookup rather than hanging startup or
+ * a reload */
+static int resolve(const char *host, const char *port,
+                   const struct addrinfo *hints, struct addrinfo **results) {
+  int ret = 0;
+  for (unsigned attempt = 0; attempt < RESOLVE_ATTEMPTS; ++attempt) {
+    ret = getaddrinfo(host, port, hints, results);
+    if (ret != EAI_AGAIN)
+      break;
+    if (attempt + 1 < RESOLVE_ATTEMPTS)
+      pacer_sleep_until(pacer_now_ns() + (RESOLVE_RETRY_NS << attempt));
+  }
+  return ret;
+}
+
 /* creates address_t from options */
 static address_t address(const options_t *options) {
   struct addrinfo hints = {0};
@@ -53,13 +279,11 @@ static address_t address(const options_t *options) {
   const char *port = options->address.port;
 
   struct addrinfo *results = NULL;
-  const int ret = getaddrinfo(host, port, &hints, &results);
+  const int ret = resolve(host, port, &hints, &results);
 
   switch (ret) {
   case 0:
     break;
-  case EAI_AGAIN:
-    return address(options);
   case EAI_SYSTEM:
     /*error*/ fprintf(stderr, "getaddrinfo failed: '%s'\n", strerror(errno));
     goto err;
@@ -95,13 +319,42 @@ static bool sockname(const address_t *addr, sockname_t *out) {
   return true;
 }
 
-static int udp_accept(socket_t listen_socket, uint16_t listen_port,
-                      void *buffer, size_t *buffer_size);
-static int loop(socket_t socket, const address_t *bind_address);
+/* the client's address for the log, without the lookup sockname does */
+static const char *peer_name(const address_t *addr,
+                             char name[static INET6_ADDRSTRLEN]) {
+  return inet_ntop(AF_INET6, &addr->sin6_addr, name, INET6_ADDRSTRLEN);
+}
+
+static int loop(server_t *server, const address_t *bind_address);
 static void options_from_argv(int argc, char *const *argv, options_t *out);
+static server_config_t *server_config_new(const server_options_t *options);
+static void server_config_free(server_config_t *config);
+static bool reload_write(FILE *out, const server_options_t *options,
+                         const server_config_t *config);
+static bool reload_read(FILE *in, sched_config_t *sched,
+                        admission_config_t *admission,
+                        server_config_t **config);
 
-int main(int argc, char **argv) {
+/* reads dropd.conf and the command line, exits on invalid options */
+static void server_options_load(int argc, char **argv,
+                                server_options_t *out) {
   server_options_t options = {0};
+  options.sched.subnet_v4 = SCHED_DEFAULT_SUBNET_V4;
+  options.sched.subnet_v6 = SCHED_DEFAULT_SUBNET_V6;
+  options.admission.max_sessions = DEFAULT_MAX_SESSIONS;
+  options.admission.session_memory = SESSION_MEMORY;
+  options.admission.queue_length = DEFAULT_ACCEPT_QUEUE;
+  options.admission.queue_timeout_ms = DEFAULT_ACCEPT_TIMEOUT_MS;
+  options.defaults.name = "default";
+  options.defaults.limits.max.blksize = TFTP_MAX_BLOCK_SIZE;
+  options.defaults.limits.max.windowsize = DEFAULT_MAX_WINDOW;
+  options.defaults.limits.max.ackdelay_ms = DEFAULT_MAX_ACK_DELAY_MS;
+  options.defaults.limits.max.timeout = UINT8_MAX;
+  /* clients measuring the path, nothing is kept */
+  options.defaults.limits.max.probe = 1;
+  options.defaults.limits.max.batch = 1;
+  options.defaults.busy_poll.budget = BUSYPOLL_DEFAULT_BUDGET;
+  options.download_cache = DEFAULT_DOWNLOAD_CACHE;
 
   /* disable getopt printing error */
   opterr = 0;
@@ -111,6 +364,37 @@ int main(int argc, char **argv) {
                       (options_t *)&options);
   options_from_argv(argc, argv, (options_t *)&options);
 
+  options.sched.weights = options.weights;
+  options.sched.weight_count = options.weight_count;
+  *out = options;
+}
+
+/* frees what parsing allocated, the profiles went to a server_config_t */
+static void server_options_free(server_options_t *options) {
+  free(options->weights);
+  for (size_t n = 0; n < options->profile_count; ++n)
+    free(options->profiles[n]);
+  free(options->profiles);
+  for (size_t n = 0; n < options->profile_match_count; ++n)
+    free(options->profile_matches[n]);
+  free(options->profile_matches);
+  for (size_t n = 0; n < options->relay_count; ++n)
+    free(options->relays[n]);
+  free(options->relays);
+  for (size_t n = 0; n < options->sink_count; ++n)
+    free(options->sinks[n]);
+  free(options->sinks);
+  free(options->control);
+  free(options->takeover);
+  free(options->cpus);
+  free(options->multicast);
+  free(options->capture);
+}
+
+/* creates and binds a listening socket, a member of a reuseport group when
+ * there is one per CPU */
+static socket_t listen_socket(const address_t *server, int v6only,
+                              bool reuseport) {
   socket_t s = socket(AF_INET6, SOCK_DGRAM, 0);
   if (s == -1) {
     /*error*/ fprintf(stderr, "socket() failed: '%s'\n", strerror(errno));
@@ -125,33 +409,253 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
-  if (-1 == setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &options.base.v6only,
-                       sizeof(options.base.v6only))) {
+  const int on = 1;
+  if (reuseport &&
+      -1 == setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+    /*error*/ fprintf(stderr, "setsockopt for 'SO_REUSEPORT': %s\n",
+                      strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (-1 ==
+      setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only))) {
     /*error*/ fprintf(stderr, "setsockopt for 'IPV6_V6ONLY': '%s'\n",
                       strerror(errno));
     exit(EXIT_FAILURE);
   }
 
-  int pktinfo = 1;
-  if (-1 == setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &pktinfo,
-                       sizeof(pktinfo))) {
+  if (-1 == bind(s, (const struct sockaddr *)server, sizeof(*server))) {
+    /*error*/ fprintf(stderr, "bind failed: '%s'\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  return s;
+}
+
+/* binds one listening socket per CPU of the map, the first picks the port
+ * for the others */
+static size_t listen_sockets(const options_t *options,
+                             const affinity_t *affinity, socket_t *out) {
+  const size_t count = affinity ? affinity_size(affinity) : 1;
+  address_t server = address(options);
+  for (size_t n = 0; n < count; ++n) {
+    out[n] = listen_socket(&server, options->v6only, affinity != NULL);
+    socklen_t size = sizeof(server);
+    if (n == 0 && -1 == getsockname(out[n], (struct sockaddr *)&server,
+                                    &size)) {
+      /*error*/ fprintf(stderr, "getsockname: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  return count;
+}
+
+/* joins the group given as <group>[%iface] on the listening port, exits if
+ * that fails */
+static socket_t multicast_socket(const char *spec, in_port_t port,
+                                 address_t *group) {
+  struct addrinfo hints = {0};
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_family = AF_INET6;
+  hints.ai_flags = AI_NUMERICHOST;
+
+  struct addrinfo *results = NULL;
+  const int ret = getaddrinfo(spec, NULL, &hints, &results);
+  if (ret != 0 || !IN6_IS_ADDR_MULTICAST(
+                      &((address_t *)results->ai_addr)->sin6_addr)) {
+    /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid multicast group '%s'\n",
+                      spec);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(group, results->ai_addr, sizeof(*group));
+  freeaddrinfo(results);
+  group->sin6_port = port;
+
+  const socket_t s = socket(AF_INET6, SOCK_DGRAM, 0);
+  if (s == -1) {
+    /*error*/ fprintf(stderr, "socket() failed: '%s'\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  /* next to the listening socket on the same port */
+  const int on = 1;
+  if (-1 == setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on))) {
+    /*error*/ fprintf(stderr, "setsockopt for 'SO_REUSEADDR': %s\n",
+                      strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (-1 == bind(s, (const struct sockaddr *)group, sizeof(*group))) {
+    /*error*/ fprintf(stderr, "bind to '%s' failed: '%s'\n", spec,
+                      strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  const struct ipv6_mreq membership = {
+      .ipv6mr_multiaddr = group->sin6_addr,
+      .ipv6mr_interface = group->sin6_scope_id,
+  };
+  if (-1 == setsockopt(s, IPPROTO_IPV6, IPV6_JOIN_GROUP, &membership,
+                       sizeof(membership))) {
+    /*error*/ fprintf(stderr, "setsockopt for 'IPV6_JOIN_GROUP': %s\n",
+                      strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (-1 == setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on))) {
     /*error*/ fprintf(stderr, "setsockopt for 'IPV6_RECVPKTINFO': %s\n",
                       strerror(errno));
     exit(EXIT_FAILURE);
   }
+  return s;
+}
 
-  address_t server = address(&options.base);
-  if (-1 == bind(s, (struct sockaddr *)&server, sizeof(server))) {
-    /*error*/ fprintf(stderr, "bind failed: '%s'\n", strerror(errno));
+int main(int argc, char **argv) {
+  server_options_t options = {0};
+  server_options_load(argc, argv, &options);
+
+  const log_level_t log_level =
+      options.base.verbose && options.log_level < LOG_LEVEL_INFO
+          ? LOG_LEVEL_INFO
+          : options.log_level;
+  if (!log_start(STDERR_FILENO, log_level, options.log_format))
+    /*error*/ fprintf(stderr, "log: %s\n", strerror(errno));
+
+  affinity_t *affinity = NULL;
+  if (options.cpus) {
+    affinity = affinity_new(options.cpus);
+    if (!affinity) {
+      /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid cpus '%s': %s\n",
+                        options.cpus, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* already bound sockets, from systemd or the dropd we replace */
+  socket_t *sockets = calloc(HANDOFF_MAX_FDS, sizeof(socket_t));
+  assert(sockets);
+  size_t count = handoff_activated(sockets, HANDOFF_MAX_FDS);
+  if (options.takeover) {
+    for (size_t n = 0; n < count; ++n)
+      close(sockets[n]);
+    const int received =
+        handoff_receive(options.takeover, sockets, HANDOFF_MAX_FDS);
+    if (received == -1) {
+      /*error*/ fprintf(stderr, "takeover from '%s': %s\n", options.takeover,
+                        strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    count = (size_t)received;
+  }
+
+  if (count == 0) {
+    count = listen_sockets(&options.base, affinity, sockets);
+  } else if (affinity && count != affinity_size(affinity)) {
+    /* the reuseport group is fixed while the port stays open */
+    /*error*/ fprintf(stderr,
+                      PROGRAM_NAME ": got %zu listening sockets, --cpus "
+                                   "needs %zu\n",
+                      count, affinity_size(affinity));
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t n = 0; n < count; ++n) {
+    /* the session sockets bind next to it, which a socket bound elsewhere
+     * need not allow */
+    int reuseaddr = 1;
+    if (-1 == setsockopt(sockets[n], SOL_SOCKET, SO_REUSEADDR, &reuseaddr,
+                         sizeof(reuseaddr))) {
+      /*error*/ fprintf(stderr, "setsockopt for 'SO_REUSEADDR': %s\n",
+                        strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    int pktinfo = 1;
+    if (-1 == setsockopt(sockets[n], IPPROTO_IPV6, IPV6_RECVPKTINFO, &pktinfo,
+                         sizeof(pktinfo))) {
+      /*error*/ fprintf(stderr, "setsockopt for 'IPV6_RECVPKTINFO': %s\n",
+                        strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    /* the group's packets are for the group's socket alone, a wildcard
+     * socket gets every group someone on the host joined otherwise */
+    const int all = 0;
+    if (options.multicast &&
+        -1 == setsockopt(sockets[n], IPPROTO_IPV6, IPV6_MULTICAST_ALL, &all,
+                         sizeof(all))) {
+      /*error*/ fprintf(stderr, "setsockopt for 'IPV6_MULTICAST_ALL': %s\n",
+                        strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* attached again after a takeover, the map may have other CPUs */
+  if (affinity && -1 == affinity_steer(sockets[0], affinity)) {
+    /*error*/ fprintf(stderr, "setsockopt for 'SO_ATTACH_REUSEPORT_CBPF': %s\n",
+                      strerror(errno));
     exit(EXIT_FAILURE);
   }
 
+  socket_t control = -1;
+  if (options.control) {
+    control = handoff_listen(options.control);
+    if (control == -1) {
+      /*error*/ fprintf(stderr, "control socket '%s': %s\n", options.control,
+                        strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  address_t server = {0};
   socklen_t serverlen = sizeof(server);
-  if (-1 == getsockname(s, (struct sockaddr *)&server, &serverlen)) {
+  if (-1 == getsockname(sockets[0], (struct sockaddr *)&server, &serverlen)) {
     /*error*/ fprintf(stderr, "getsockname: %s\n", strerror(errno));
   }
 
-  return loop(s, &server);
+  /* not handed over, a successor joins the group itself */
+  address_t group = {0};
+  socket_t multicast = -1;
+  if (options.multicast)
+    multicast = multicast_socket(options.multicast, server.sin6_port, &group);
+
+  server_t context = {
+      .sockets = sockets,
+      .socket_count = count,
+      .control = control,
+      .multicast = multicast,
+      .group = group,
+      .affinity = affinity,
+      .sched = sched_new(&options.sched, options.admission.max_sessions),
+      .admission = admission_new(&options.admission),
+      .config = server_config_new(&options),
+      .downloads = options.downloads,
+      .argc = argc,
+      .argv = argv,
+      .reload_fd = -1,
+  };
+  log_limit_init(&context.accept_log_limit, ACCEPT_LOG_BURST,
+                 SESSION_LOG_INTERVAL_NS);
+  if (!context.sched || !context.admission) {
+    /*error*/ fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  if (options.downloads && options.download_cache) {
+    context.cache = filecache_new(options.download_cache);
+    if (!context.cache)
+      /*error*/ fprintf(stderr, "download cache: %s\n", strerror(errno));
+  }
+  if (options.capture) {
+    context.capture = capture_open(options.capture);
+    if (!context.capture) {
+      /*error*/ fprintf(stderr, "capture '%s': %s\n", options.capture,
+                        strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  server_options_free(&options);
+
+  return loop(&context, &server);
 }
 
 static ssize_t recvmessage(socket_t s, void *buffer, size_t buffer_size,
@@ -194,50 +698,101 @@ static ssize_t recvmessage(socket_t s, void *buffer, size_t buffer_size,
   return received;
 }
 
-static int udp_accept(socket_t listen_socket, uint16_t listen_port,
-                      void *buffer, size_t *buffer_size) {
-  assert(listen_socket != -1);
-  assert(listen_port != 0);
+static ssize_t sendmessage(socket_t s, const void *buffer, size_t buffer_size,
+                           const address_t *dst, const address_t *src) {
   assert(buffer);
-  assert(buffer_size);
+  assert(dst);
 
-  address_t source = {0};
-  address_t destination = {0};
+  struct iovec iov = {
+      .iov_base = (void *)buffer,
+      .iov_len = buffer_size,
+  };
 
-  const ssize_t bytes = recvmessage(listen_socket, buffer, *buffer_size, 0,
-                                    &source, &destination);
-  if (bytes == -1) {
-    /*error*/ fprintf(stderr, "recvmessage: %s\n", strerror(errno));
-    return -1;
+  uint8_t cmsg_storage[CMSG_SPACE(sizeof(struct in6_pktinfo))] = {0};
+
+  struct msghdr msg = {0};
+  msg.msg_name = (void *)dst;
+  msg.msg_namelen = sizeof(address_t);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  /* answer from the address the request was sent to, v4-mapped sources are
+   * left to the routing table */
+  if (src && !IN6_IS_ADDR_V4MAPPED(&src->sin6_addr)) {
+    msg.msg_control = cmsg_storage;
+    msg.msg_controllen = sizeof(cmsg_storage);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = IPPROTO_IPV6;
+    cmsg->cmsg_type = IPV6_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+
+    struct in6_pktinfo *pktinfo = (struct in6_pktinfo *)CMSG_DATA(cmsg);
+    pktinfo->ipi6_addr = src->sin6_addr;
+    pktinfo->ipi6_ifindex = src->sin6_scope_id;
   }
 
-  destination.sin6_port = htons(listen_port);
+  return sendmsg(s, &msg, 0);
+}
+
+/* creates the session socket for a request received on the listening port
+ * and picks the client's profile */
+static int udp_accept(server_t *server, const address_t *source,
+                      const address_t *destination,
+                      const profile_t **profile) {
+  assert(source);
+  assert(destination);
+  assert(destination->sin6_port != 0);
+
+  const server_config_t *config = server->config;
+  const int match =
+      prefix_table_lookup(config->profile_prefixes, &source->sin6_addr);
+  *profile = config->profiles + (match == -1 ? 0 : match);
 
+  log_limit_t *limit = &server->accept_log_limit;
   const socket_t s = socket(AF_INET6, SOCK_DGRAM, 0);
   if (s == -1) {
-    /*error*/ fprintf(stderr, "socket: %s\n", strerror(errno));
+    LOG_LIMITED(limit, LOG_LEVEL_ERROR, "socket",
+                LOG_STR("error", strerror(errno)));
     return -1;
   }
 
   int reuseaddr = 1;
   if (-1 ==
       setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr))) {
-    /*error*/ fprintf(stderr, "setsockopt for 'SO_REUSEADDR': %s\n",
-                      strerror(errno));
+    LOG_LIMITED(limit, LOG_LEVEL_ERROR, "setsockopt",
+                LOG_STR("option", "SO_REUSEADDR"),
+                LOG_STR("error", strerror(errno)));
     goto err;
   }
 
-  if (-1 == bind(s, (struct sockaddr *)&destination, sizeof(address_t))) {
-    /*error*/ fprintf(stderr, "bind: %s\n", strerror(errno));
+  /* bounded so the memory budget holds */
+  int rcvbuf = SESSION_RCVBUF;
+  if (-1 == setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf))) {
+    LOG_LIMITED(limit, LOG_LEVEL_ERROR, "setsockopt",
+                LOG_STR("option", "SO_RCVBUF"),
+                LOG_STR("error", strerror(errno)));
+    goto err;
+  }
+
+  /* a multicast request is answered from an address of our own, whichever
+   * the route to the sender picks */
+  const address_t any = {.sin6_family = AF_INET6};
+  if (IN6_IS_ADDR_MULTICAST(&destination->sin6_addr))
+    destination = &any;
+
+  if (-1 == bind(s, (struct sockaddr *)destination, sizeof(address_t))) {
+    LOG_LIMITED(limit, LOG_LEVEL_ERROR, "bind",
+                LOG_STR("error", strerror(errno)));
     goto err;
   }
 
-  if (-1 == connect(s, (struct sockaddr *)&source, sizeof(address_t))) {
-    /*error*/ fprintf(stderr, "connect: %s\n", strerror(errno));
+  if (-1 == connect(s, (struct sockaddr *)source, sizeof(address_t))) {
+    LOG_LIMITED(limit, LOG_LEVEL_ERROR, "connect",
+                LOG_STR("error", strerror(errno)));
     goto err;
   }
 
-  *buffer_size = (size_t)bytes;
   return s;
 
 err:
@@ -245,71 +800,1600 @@ err:
   return -1;
 }
 
-int loop(socket_t socket, const address_t *bind_address) {
-  sockname_t servername = {0};
-  assert(sockname(bind_address, &servername));
+static volatile sig_atomic_t children_exited = 0;
+static volatile sig_atomic_t stats_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
 
-  /*verbose*/
-  printf("listening on %s:%s\n", servername.host, servername.port);
+static void on_signal(int signal) {
+  switch (signal) {
+  case SIGCHLD:
+    children_exited = 1;
+    break;
+  case SIGUSR1:
+    stats_requested = 1;
+    break;
+  case SIGHUP:
+    reload_requested = 1;
+    break;
+  case SIGTERM:
+  case SIGINT:
+    stop_requested = 1;
+    break;
+  }
+}
 
-  for (;;) {
-    tftp_buffer_t buffer = {0};
+static void install_signal_handlers(void) {
+  /* no SA_RESTART, a blocked poll has to return to reap and report */
+  struct sigaction action = {0};
+  action.sa_handler = &on_signal;
+  sigemptyset(&action.sa_mask);
+  const bool installed = sigaction(SIGCHLD, &action, NULL) == 0 &&
+                         sigaction(SIGUSR1, &action, NULL) == 0 &&
+                         sigaction(SIGHUP, &action, NULL) == 0 &&
+                         sigaction(SIGTERM, &action, NULL) == 0 &&
+                         sigaction(SIGINT, &action, NULL) == 0;
+  assert(installed);
+  (void)installed;
+}
+
+/* parses the configuration in a child process, invalid options make the
+ * parser exit and would take the daemon with them, and relay hosts are
+ * resolved there rather than in the accept loop. The child leaves what it
+ * built in a memfd for reload_commit */
+static void reload_begin(server_t *server) {
+  const int fd = memfd_create("dropd-reload", MFD_CLOEXEC);
+  if (fd == -1) {
+    LOG(LOG_LEVEL_ERROR, "reload", LOG_STR("call", "memfd_create"),
+        LOG_STR("error", strerror(errno)));
+    return;
+  }
+
+  fflush(NULL); /* or the child's exit writes our buffers again */
+  const pid_t pid = fork();
+  switch (pid) {
+  case -1:
+    LOG(LOG_LEVEL_ERROR, "reload", LOG_STR("call", "fork"),
+        LOG_STR("error", strerror(errno)));
+    close(fd);
+    return;
+  case 0: {
+    server_options_t options = {0};
+    server_options_load(server->argc, server->argv, &options);
+    const server_config_t *config = server_config_new(&options);
+    FILE *out = fdopen(fd, "w");
+    const bool written =
+        out && reload_write(out, &options, config) && fclose(out) == 0;
+    _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  default:
+    server->reload_pid = pid;
+    server->reload_fd = fd;
+  }
+}
+
+/* swaps the checked configuration in for new sessions. Running sessions see
+ * the scheduler's rates and weights change as they live in shared memory.
+ * Nothing is parsed or resolved here, a config that cannot be read back
+ * leaves the current one in place */
+static void reload_commit(server_t *server) {
+  FILE *in = NULL;
+  const int fd = dup(server->reload_fd);
+  if (fd != -1 && lseek(fd, 0, SEEK_SET) == 0)
+    in = fdopen(fd, "r");
+  else if (fd != -1)
+    close(fd);
+
+  sched_config_t sched = {0};
+  admission_config_t admission = {0};
+  server_config_t *config = NULL;
+  const bool read = in && reload_read(in, &sched, &admission, &config);
+  if (in)
+    fclose(in);
+  if (!read) {
+    LOG(LOG_LEVEL_ERROR, "reload",
+        LOG_STR("error", "checked configuration unreadable, keeping the "
+                         "current one"));
+    free((sched_weight_t *)sched.weights);
+    server_config_free(config);
+    return;
+  }
+
+  server_config_free(server->config);
+  server->config = config;
+  sched_reconfigure(server->sched, &sched);
+  admission_reconfigure(server->admission, &admission);
+  free((sched_weight_t *)sched.weights);
+
+  LOG(LOG_LEVEL_INFO, "reload", LOG_STR("result", "reloaded"));
+}
+
+static multicast_session_t *multicast_session_find(server_t *server,
+                                                   const address_t *sender) {
+  for (size_t n = 0; n < server->multicast_session_count; ++n) {
+    multicast_session_t *session = server->multicast_sessions + n;
+    if (session->sender.sin6_port == sender->sin6_port &&
+        IN6_ARE_ADDR_EQUAL(&session->sender.sin6_addr, &sender->sin6_addr))
+      return session;
+  }
+  return NULL;
+}
+
+static bool multicast_session_add(server_t *server, const address_t *sender) {
+  multicast_session_t *sessions =
+      realloc(server->multicast_sessions,
+              (server->multicast_session_count + 1) *
+                  sizeof(multicast_session_t));
+  if (!sessions)
+    return false;
+  server->multicast_sessions = sessions;
+  sessions[server->multicast_session_count++] = (multicast_session_t){
+      .sender = *sender,
+  };
+  return true;
+}
+
+static void multicast_session_remove(server_t *server,
+                                     multicast_session_t *session) {
+  *session = server->multicast_sessions[--server->multicast_session_count];
+}
 
-    size_t received = sizeof(buffer.buffer);
-    const socket_t client = udp_accept(socket, ntohs(bind_address->sin6_port),
-                                       &buffer.buffer, &received);
+static void multicast_session_reap(server_t *server, pid_t pid) {
+  for (size_t n = 0; n < server->multicast_session_count; ++n) {
+    if (server->multicast_sessions[n].pid == pid) {
+      multicast_session_remove(server, server->multicast_sessions + n);
+      return;
+    }
+  }
+}
 
-    if (client == -1) {
+static void reap_children(server_t *server) {
+  pid_t pid;
+  int status = 0;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (pid == server->reload_pid) {
+      server->reload_pid = 0;
+      if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+        reload_commit(server);
+      else
+        LOG(LOG_LEVEL_ERROR, "reload",
+            LOG_STR("error", "invalid configuration, keeping the current "
+                             "one"));
+      close(server->reload_fd);
+      server->reload_fd = -1;
       continue;
     }
 
-    const pid_t pid = fork();
-    switch (pid) {
-    case -1:
-      fprintf(stderr, "fork: %s\n", strerror(errno));
-      close(client);
-      break;
-    case 0: /* we're the child */
-      close(socket);
-      tftp_handle_wrq(client, &buffer, received, NULL, NULL);
+    sched_session_reap(server->sched, pid);
+    admission_session_end(server->admission);
+    multicast_session_reap(server, pid);
+  }
+}
+
+typedef struct {
+  sched_t *sched;
+  int slot;
+  pacer_t pacer; /* the profile's session rate */
+  busypoll_t busypoll;
+  const server_config_t *config;
+  const relay_route_t *route; /* the upload's, NULL when it stays here */
+  relay_t *relay;
+  sink_t *sink; /* NULL when the upload goes to a file */
+  filecache_file_t cached; /* the download's file, size 0 if not cached */
+  uint64_t bytes;          /* received */
+  log_limit_t log_limit;   /* on its messages for each block */
+  capture_t *capture;      /* NULL without --capture */
+  address_t peer;
+} session_t;
+
+static void session_on_receive(const void *packet, size_t size,
+                               void *userdata) {
+  session_t *session = userdata;
+  capture_add(session->capture, CAPTURE_SESSION, &session->peer, packet,
+              size);
+}
+
+static void session_on_data(size_t bytes, void *userdata) {
+  session_t *session = userdata;
+  sched_acquire(session->sched, session->slot, bytes);
+  session->bytes += bytes;
+
+  const uint64_t departure = pacer_reserve(&session->pacer, bytes);
+  const uint64_t now = pacer_now_ns();
+  LOG_LIMITED(&session->log_limit, LOG_LEVEL_DEBUG, "data",
+              LOG_U64("bytes", bytes), LOG_U64("total", session->bytes),
+              LOG_U64("paced_us", departure > now ? (departure - now) / 1000
+                                                  : 0));
+  if (departure > now)
+    pacer_sleep_until(departure);
+}
+
+static int session_on_wait(int socket, uint64_t deadline_ns, void *userdata) {
+  session_t *session = userdata;
+  return busypoll_wait(&session->busypoll, socket, deadline_ns);
+}
+
+static void session_on_complete(void *userdata) {
+  const session_t *session = userdata;
+  sched_session_complete(session->sched, session->slot);
+  /* the upload is in the capture without waiting for the session to end */
+  if (session->capture && -1 == capture_flush(session->capture))
+    LOG(LOG_LEVEL_ERROR, "capture", LOG_STR("error", strerror(errno)));
+}
+
+/* the longest --relay path prefix filename starts with, NULL for none */
+static const relay_route_t *relay_route_find(const server_config_t *config,
+                                             const char *filename) {
+  const relay_route_t *found = NULL;
+  for (size_t n = 0; n < config->relay_count; ++n) {
+    const relay_route_t *route = config->relays + n;
+    const size_t length = strlen(route->prefix);
+    if (strncmp(filename, route->prefix, length) == 0 &&
+        (!found || length > strlen(found->prefix)))
+      found = route;
+  }
+  return found;
+}
+
+/* the first --sink whose pattern filename matches, NULL for none */
+static const sink_route_t *sink_route_find(const server_config_t *config,
+                                           const char *filename) {
+  for (size_t n = 0; n < config->sink_count; ++n)
+    if (fnmatch(config->sinks[n].pattern, filename, 0) == 0)
+      return config->sinks + n;
+  return NULL;
+}
+
+/* a sink takes the upload before it could be stored or relayed */
+static FILE *session_on_open(const char *filename, void *userdata) {
+  session_t *session = userdata;
+  const sink_route_t *sink = sink_route_find(session->config, filename);
+  if (sink) {
+    session->sink = sink_open(sink->path, filename);
+    return session->sink ? sink_stream(session->sink) : NULL;
+  }
+
+  session->route = relay_route_find(session->config, filename);
+  if (!session->route)
+    return fopen(filename, "wb");
+
+  session->relay = relay_open(filename, &session->route->next_hop,
+                              session->config->relay_commit);
+  return session->relay ? relay_stream(session->relay) : NULL;
+}
+
+static int session_on_close(FILE *file, bool complete, void *userdata) {
+  session_t *session = userdata;
+  if (session->sink) {
+    sink_t *sink = session->sink;
+    session->sink = NULL;
+    return sink_close(sink, complete);
+  }
+  return session->relay ? relay_close(session->relay, complete)
+                        : fclose(file);
+}
+
+/* relative and not going up, downloads stay below the root */
+static bool download_name_safe(const char *filename) {
+  if (!*filename || *filename == '/')
+    return false;
+  for (const char *part = filename; part;) {
+    const char *slash = strchr(part, '/');
+    const size_t length = slash ? (size_t)(slash - part) : strlen(part);
+    if (length == 2 && part[0] == '.' && part[1] == '.')
+      return false;
+    part = slash ? slash + 1 : NULL;
+  }
+  return true;
+}
+
+static FILE *session_on_read(const char *filename, void *userdata) {
+  const session_t *session = userdata;
+  if (!download_name_safe(filename)) {
+    errno = EACCES;
+    return NULL;
+  }
+  /* the first session for a file loads it into the cache, the others wait
+   * for it. Without the cache's copy the session reads the file itself */
+  if (session->cached.size && filecache_ready(&session->cached, filename))
+    return fmemopen((void *)session->cached.data, session->cached.size, "rb");
+  return fopen(filename, "rb");
+}
+
+/* the cache's entry for a download's file, mapped in the accept loop so the
+ * session is forked with it and loaded by the first session for it. Left
+ * empty when the file is not cached, the session then reads it itself */
+static void download_lookup(server_t *server, const profile_t *profile,
+                            const char *filename, filecache_file_t *out) {
+  char path[PATH_MAX];
+  const int length =
+      profile->root
+          ? snprintf(path, sizeof(path), "%s/%s", profile->root, filename)
+          : snprintf(path, sizeof(path), "%s", filename);
+  if (!server->cache || !download_name_safe(filename) || length < 0 ||
+      (size_t)length >= sizeof(path))
+    return;
+  if (!filecache_get(server->cache, path, out))
+    *out = (filecache_file_t){0};
+}
+
+static bool is_multicast(const server_t *server,
+                         const admission_request_t *request) {
+  return request->socket == server->socket_count;
+}
+
+/* answers a request we have no capacity for */
+static void shed(server_t *server, const admission_request_t *request) {
+  tftp_buffer_t buffer = {0};
+  const unsigned retry_after_ms = admission_reject(server->admission);
+  const size_t size = tftp_format_busy(&buffer, retry_after_ms);
+  char peer[INET6_ADDRSTRLEN];
+  LOG(LOG_LEVEL_INFO, "shed",
+      LOG_STR("peer", peer_name(&request->source, peer)),
+      LOG_U64("retry_after_ms", retry_after_ms));
+
+  /* the multicast sender counts us out, it hears it from our address */
+  socket_t s = server->sockets[0];
+  const address_t *source = NULL;
+  if (is_multicast(server, request)) {
+    multicast_session_t *session =
+        multicast_session_find(server, &request->source);
+    if (session)
+      multicast_session_remove(server, session);
+  } else {
+    s = server->sockets[request->socket];
+    source = &request->destination;
+  }
+
+  if (-1 == sendmessage(s, &buffer.buffer, size, &request->source, source))
+    LOG(LOG_LEVEL_ERROR, "sendmessage", LOG_STR("error", strerror(errno)));
+}
+
+/* returns 0 in the session process once the session is over */
+static int spawn(server_t *server, const admission_request_t *request) {
+  tftp_buffer_t buffer = {0};
+  assert(request->size <= sizeof(buffer.buffer));
+  memcpy(&buffer.buffer, request->packet, request->size);
+
+  multicast_session_t *multicast =
+      is_multicast(server, request)
+          ? multicast_session_find(server, &request->source)
+          : NULL;
+
+  const profile_t *profile = NULL;
+  const socket_t client = udp_accept(server, &request->source,
+                                     &request->destination, &profile);
+  if (client == -1) {
+    if (multicast)
+      multicast_session_remove(server, multicast);
+    return -1;
+  }
+
+  /* without --downloads a read request is refused as it always was */
+  const char *download =
+      server->downloads && !multicast
+          ? tftp_read_request_filename(&buffer, request->size)
+          : NULL;
+  filecache_file_t cached = {0};
+  if (download)
+    download_lookup(server, profile, download, &cached);
+
+  /* a full session table leaves the session unscheduled */
+  const int slot =
+      sched_session_begin(server->sched, &request->source.sin6_addr);
+  admission_session_begin(server->admission);
+
+  const pid_t pid = fork();
+  switch (pid) {
+  case -1:
+    LOG(LOG_LEVEL_ERROR, "fork", LOG_STR("error", strerror(errno)));
+    filecache_loading(&cached, -1);
+    if (slot != -1)
+      sched_session_end(server->sched, slot);
+    admission_session_end(server->admission);
+    if (multicast)
+      multicast_session_remove(server, multicast);
+    close(client);
+    return -1;
+  case 0: { /* we're the child */
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    /* a sink's consumer going away fails its writes */
+    signal(SIGPIPE, SIG_IGN);
+    for (size_t n = 0; n < server->socket_count; ++n)
+      close(server->sockets[n]);
+    if (server->control != -1)
+      close(server->control);
+    if (server->multicast != -1)
+      close(server->multicast);
+    if (server->cache)
+      close(filecache_fd(server->cache));
+
+    /* before the session allocates, its memory comes from the CPU's node */
+    if (server->affinity && !is_multicast(server, request) &&
+        -1 == affinity_pin(server->affinity, request->socket))
+      LOG(LOG_LEVEL_ERROR, "sched_setaffinity",
+          LOG_STR("error", strerror(errno)));
+
+    if (profile->root && -1 == chdir(profile->root)) {
+      LOG(LOG_LEVEL_ERROR, "chdir", LOG_STR("path", profile->root),
+          LOG_STR("error", strerror(errno)));
+      const size_t size = tftp_format_error(
+          &buffer, TFTP_ERROR_ACCESS_VIOLATION, "storage unavailable");
+      send(client, &buffer.buffer, size, 0);
       close(client);
       return 0;
-    default: /* we're the parent */
-      close(client);
-      break;
     }
+
+    session_t session = {
+        .sched = server->sched,
+        .slot = slot,
+        .config = server->config,
+        .cached = cached,
+        .capture = server->capture,
+        .peer = request->source,
+    };
+    log_limit_init(&session.log_limit, SESSION_LOG_BURST,
+                   SESSION_LOG_INTERVAL_NS);
+    pacer_init(&session.pacer, profile->session_rate);
+    busypoll_init(&session.busypoll, &profile->busy_poll);
+    if (profile->busy_poll.spin_us &&
+        -1 == busypoll_setup(client, &profile->busy_poll))
+      LOG(LOG_LEVEL_ERROR, "setsockopt", LOG_STR("option", "SO_BUSY_POLL"),
+          LOG_STR("error", strerror(errno)));
+
+    const bool routed =
+        server->config->relay_count || server->config->sink_count;
+    const tftp_hooks_t hooks = {
+        .on_data = &session_on_data,
+        .on_complete = &session_on_complete,
+        .on_wait = profile->busy_poll.spin_us ? &session_on_wait : NULL,
+        .on_open = routed ? &session_on_open : NULL,
+        .on_close = routed ? &session_on_close : NULL,
+        .on_receive = server->capture ? &session_on_receive : NULL,
+        .userdata = &session,
+    };
+    /* a download is sent as fast as the client takes it, the rates are
+     * for uploads */
+    const tftp_hooks_t download_hooks = {
+        .on_wait = hooks.on_wait,
+        .on_open = &session_on_read,
+        .on_receive = hooks.on_receive,
+        .userdata = &session,
+    };
+    const char *kind = download                        ? "download"
+                       : is_multicast(server, request) ? "multicast"
+                                                       : "upload";
+    char peer[INET6_ADDRSTRLEN];
+    peer_name(&request->source, peer);
+    LOG(LOG_LEVEL_DEBUG, "session-start", LOG_STR("peer", peer),
+        LOG_STR("kind", kind), LOG_STR("profile", profile->name));
+    const uint64_t start_ns = pacer_now_ns();
+
+    tftp_result_t result;
+    if (download)
+      result = tftp_handle_rrq(client, &buffer, request->size,
+                               &profile->limits, &download_hooks);
+    else if (is_multicast(server, request))
+      result = multicast_receive(client, &server->group, &buffer,
+                                 request->size, &profile->limits, &hooks);
+    else
+      result = tftp_handle_wrq(client, &buffer, request->size,
+                               &profile->limits, &hooks);
+
+    /* a download's bytes are counted by the sender, an upload's here */
+    const uint64_t bytes = download ? result.bytes : session.bytes;
+    const uint64_t duration_ms = (pacer_now_ns() - start_ns) / 1000000u;
+    if (result.error)
+      LOG(LOG_LEVEL_INFO, "session-end", LOG_STR("peer", peer),
+          LOG_STR("kind", kind), LOG_U64("bytes", bytes),
+          LOG_U64("resent", result.resent), LOG_U64("ms", duration_ms),
+          LOG_STR("error", strerror(result.error)));
+    else
+      LOG(LOG_LEVEL_INFO, "session-end", LOG_STR("peer", peer),
+          LOG_STR("kind", kind), LOG_U64("bytes", bytes),
+          LOG_U64("resent", result.resent), LOG_U64("ms", duration_ms));
+
+    /* with local commit the next hop may still be receiving */
+    if (session.relay) {
+      const tftp_result_t relayed = relay_finish(session.relay);
+      sockname_t next_hop = {0};
+      if (relayed.error && sockname(&session.route->next_hop, &next_hop))
+        LOG(LOG_LEVEL_ERROR, "relay", LOG_STR("host", next_hop.host),
+            LOG_STR("port", next_hop.port),
+            LOG_STR("error", strerror(relayed.error)));
+    }
+    if (server->affinity && !is_multicast(server, request))
+      affinity_session_end(server->affinity, request->socket, client);
+    if (server->capture && -1 == capture_flush(server->capture))
+      LOG(LOG_LEVEL_ERROR, "capture", LOG_STR("error", strerror(errno)));
+    close(client);
+    return 0;
+  }
+  default: /* we're the parent */
+    /* before another session is forked with the entry */
+    filecache_loading(&cached, pid);
+    if (slot != -1)
+      sched_session_attach(server->sched, slot, pid);
+    if (multicast)
+      multicast->pid = pid;
+    close(client);
+    return pid;
   }
 }
 
-static void options_from_argv(int argc, char *const *argv, options_t *out) {
-  struct option const long_options[] = {
-      {
-          .name = "verbose",
-          .has_arg = no_argument,
-          .flag = NULL,
-          .val = 'v',
-      },
-      {
-          .name = "help",
-          .has_arg = no_argument,
-          .flag = NULL,
-          .val = 'h',
-      },
-      {.name = 0, .has_arg = 0, .flag = 0, .val = 0},
-  };
+/* after handing the port over or being asked to stop: sheds the queued
+ * requests so their retries reach the successor, then waits for the running
+ * sessions */
+static int drain(server_t *server) {
+  admission_request_t request = {0};
+  while (admission_dequeue(server->admission, &request)) {
+    shed(server, &request);
+    free(request.packet);
+  }
+  for (size_t n = 0; n < server->socket_count; ++n)
+    close(server->sockets[n]);
+  close(server->control);
+  if (server->multicast != -1)
+    close(server->multicast);
 
-  optind = 1;
+  while (wait(NULL) > 0 || errno == EINTR)
+    ;
+  return EXIT_SUCCESS;
+}
+
+/* reads a request from the listening socket at index and admits, queues or
+ * sheds it, returns 0 in the session process once the session is over */
+static int receive(server_t *server, size_t index, in_port_t port) {
+  admission_request_t request = {
+      .socket = index,
+  };
+  tftp_buffer_t buffer = {0};
+  const bool multicast = is_multicast(server, &request);
+  const ssize_t bytes =
+      recvmessage(multicast ? server->multicast : server->sockets[index],
+                  &buffer.buffer, sizeof(buffer.buffer), 0, &request.source,
+                  &request.destination);
+  if (bytes == -1) {
+    if (errno != EINTR)
+      LOG(LOG_LEVEL_ERROR, "recvmessage", LOG_STR("error", strerror(errno)));
+    return -1;
+  }
+
+  /* the sender announces until it hears from us */
+  if (multicast && (multicast_session_find(server, &request.source) ||
+                    !multicast_session_add(server, &request.source)))
+    return -1;
+
+  if (server->affinity && !multicast)
+    affinity_request(server->affinity, index);
+
+  request.packet = &buffer.buffer;
+  request.size = (size_t)bytes;
+  request.destination.sin6_port = port;
+
+  /* written right away, a session forked next would inherit it */
+  if (server->capture && !multicast) {
+    capture_add(server->capture, CAPTURE_REQUEST, &request.source,
+                request.packet, request.size);
+    if (-1 == capture_flush(server->capture))
+      LOG(LOG_LEVEL_ERROR, "capture", LOG_STR("error", strerror(errno)));
+  }
+
+  if (admission_can_admit(server->admission))
+    return spawn(server, &request);
+
+  if (admission_enqueue(server->admission, &request) == ADMISSION_FULL)
+    shed(server, &request);
+  return -1;
+}
+
+int loop(server_t *server, const address_t *bind_address) {
+  sockname_t servername = {0};
+  const bool named = sockname(bind_address, &servername);
+  assert(named);
+  (void)named;
+
+  LOG(LOG_LEVEL_INFO, "listening", LOG_STR("host", servername.host),
+      LOG_STR("port", servername.port));
+
+  install_signal_handlers();
+
+  if (server->multicast != -1) {
+    sockname_t groupname = {0};
+    const bool named = sockname(&server->group, &groupname);
+    assert(named);
+    (void)named;
+    LOG(LOG_LEVEL_INFO, "multicast", LOG_STR("group", groupname.host));
+  }
+
+  /* the listening sockets, the multicast, the control socket and then the
+   * download cache's changes */
+  const size_t multicast = server->socket_count;
+  const size_t control = server->socket_count + 1;
+  const size_t cache = server->socket_count + 2;
+  struct pollfd *pollfds =
+      calloc(server->socket_count + 3, sizeof(struct pollfd));
+  assert(pollfds);
 
   for (;;) {
-    switch (getopt_long(argc, argv, "vh", long_options, NULL)) {
+    if (children_exited) {
+      children_exited = 0;
+      reap_children(server);
+    }
+
+    /* a SIGHUP during a check waits for it, the file may have changed */
+    if (reload_requested && !server->reload_pid) {
+      reload_requested = 0;
+      reload_begin(server);
+    }
+
+    /* stopping finishes the sessions and returns through main, which writes
+     * what atexit handlers such as a profile's have to */
+    if (stop_requested) {
+      LOG(LOG_LEVEL_INFO, "draining", LOG_STR("reason", "stop"));
+      free(pollfds);
+      return drain(server);
+    }
+
+    if (stats_requested) {
+      stats_requested = 0;
+      sched_dump(server->sched, stderr);
+      admission_dump(server->admission, stderr);
+      affinity_dump(server->affinity, stderr);
+      filecache_dump(server->cache, stderr);
+    }
+
+    admission_request_t request = {0};
+    while (admission_can_admit(server->admission) &&
+           admission_dequeue(server->admission, &request)) {
+      const int spawned = spawn(server, &request);
+      free(request.packet);
+      if (spawned == 0)
+        return 0;
+    }
+
+    while (admission_expire(server->admission, &request)) {
+      shed(server, &request);
+      free(request.packet);
+    }
+
+    for (size_t n = 0; n < server->socket_count; ++n)
+      pollfds[n] = (struct pollfd){
+          .fd = server->sockets[n],
+          .events = POLLIN,
+      };
+    /* poll skips them when -1 */
+    pollfds[multicast] = (struct pollfd){
+        .fd = server->multicast,
+        .events = POLLIN,
+    };
+    pollfds[control] = (struct pollfd){
+        .fd = server->control,
+        .events = POLLIN,
+    };
+    pollfds[cache] = (struct pollfd){
+        .fd = server->cache ? filecache_fd(server->cache) : -1,
+        .events = POLLIN,
+    };
+    const int ready = poll(pollfds, server->socket_count + 3,
+                           admission_next_timeout_ms(server->admission));
+    if (ready == -1 && errno != EINTR)
+      LOG(LOG_LEVEL_ERROR, "poll", LOG_STR("error", strerror(errno)));
+    if (ready <= 0)
+      continue;
+
+    if (pollfds[cache].revents & POLLIN)
+      filecache_dispatch(server->cache);
+
+    if (pollfds[control].revents & POLLIN) {
+      if (-1 == handoff_send(server->control, server->sockets,
+                             server->socket_count))
+        LOG(LOG_LEVEL_ERROR, "handoff", LOG_STR("error", strerror(errno)));
+      else {
+        LOG(LOG_LEVEL_INFO, "draining", LOG_STR("reason", "handoff"));
+        free(pollfds);
+        return drain(server);
+      }
+    }
+
+    for (size_t n = 0; n <= multicast; ++n) {
+      if ((pollfds[n].revents & POLLIN) &&
+          receive(server, n, bind_address->sin6_port) == 0)
+        return 0;
+    }
+  }
+}
+
+enum {
+  OPTION_RATE_LIMIT = 256,
+  OPTION_CLIENT_RATE,
+  OPTION_WEIGHT,
+  OPTION_CLIENT_SUBNET_V4,
+  OPTION_CLIENT_SUBNET_V6,
+  OPTION_MAX_SESSIONS,
+  OPTION_MEMORY_BUDGET,
+  OPTION_ACCEPT_QUEUE,
+  OPTION_ACCEPT_TIMEOUT,
+  OPTION_MAX_BLKSIZE,
+  OPTION_MAX_WINDOW,
+  OPTION_MAX_ACK_DELAY,
+  OPTION_MIN_TIMEOUT,
+  OPTION_MAX_TIMEOUT,
+  OPTION_SESSION_RATE,
+  OPTION_ROOT,
+  OPTION_PROFILE,
+  OPTION_PROFILE_PREFIX,
+  OPTION_CONTROL,
+  OPTION_TAKEOVER,
+  OPTION_CPUS,
+  OPTION_BUSY_POLL,
+  OPTION_BUSY_POLL_BUDGET,
+  OPTION_MULTICAST,
+  OPTION_RELAY,
+  OPTION_RELAY_COMMIT,
+  OPTION_SINK,
+  OPTION_DOWNLOADS,
+  OPTION_DOWNLOAD_CACHE,
+  OPTION_LOG_LEVEL,
+  OPTION_LOG_FORMAT,
+  OPTION_CAPTURE,
+};
+
+static uint64_t parse_size_or_exit(const char *name, const char *value) {
+  uint64_t size = 0;
+  if (!options_parse_size(value, &size)) {
+    /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid %s '%s'\n", name, value);
+    exit(EXIT_FAILURE);
+  }
+  return size;
+}
+
+static uint64_t parse_count_or_exit(const char *name, const char *value,
+                                    uint64_t min, uint64_t max) {
+  char *end = NULL;
+  const unsigned long long count = strtoull(value, &end, 10);
+  if (end == value || *end != '\0' || count < min || count > max) {
+    /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid %s '%s'\n", name, value);
+    exit(EXIT_FAILURE);
+  }
+  return count;
+}
+
+static uint8_t parse_prefix_length_or_exit(const char *name, const char *value,
+                                           unsigned max) {
+  char *end = NULL;
+  const unsigned long length = strtoul(value, &end, 10);
+  if (end == value || *end != '\0' || length > max) {
+    /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid %s '%s'\n", name, value);
+    exit(EXIT_FAILURE);
+  }
+  return (uint8_t)length;
+}
+
+/* parses <prefix>=<weight> */
+static void add_weight(server_options_t *options, const char *value) {
+  const char *equals = strrchr(value, '=');
+  char prefix[INET6_ADDRSTRLEN + 8] = {0};
+  sched_weight_t weight = {0};
+  char *end = NULL;
+
+  if (!equals || (size_t)(equals - value) >= sizeof(prefix))
+    goto err;
+
+  memcpy(prefix, value, equals - value);
+  if (!prefix_parse(prefix, &weight.prefix))
+    goto err;
+
+  const unsigned long parsed = strtoul(equals + 1, &end, 10);
+  if (end == equals + 1 || *end != '\0' || parsed == 0 || parsed > UINT32_MAX)
+    goto err;
+  weight.weight = (uint32_t)parsed;
+
+  options->weights = realloc(options->weights, (options->weight_count + 1) *
+                                                   sizeof(sched_weight_t));
+  assert(options->weights);
+  options->weights[options->weight_count++] = weight;
+  return;
+
+err:
+  /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid weight '%s'\n", value);
+  exit(EXIT_FAILURE);
+}
+
+/* sets a profile setting by its option name, false for names that are not
+ * one */
+static bool profile_set(profile_t *profile, const char *name,
+                        const char *value) {
+  if (strcmp(name, "max-blksize") == 0)
+    profile->limits.max.blksize = (uint16_t)parse_count_or_exit(
+        name, value, 0, TFTP_MAX_BLOCK_SIZE);
+  else if (strcmp(name, "max-window") == 0)
+    profile->limits.max.windowsize =
+        (uint16_t)parse_count_or_exit(name, value, 0, UINT16_MAX);
+  else if (strcmp(name, "max-ack-delay") == 0)
+    profile->limits.max.ackdelay_ms =
+        (uint16_t)parse_count_or_exit(name, value, 0, UINT16_MAX);
+  else if (strcmp(name, "min-timeout") == 0)
+    profile->limits.min_timeout =
+        (uint8_t)parse_count_or_exit(name, value, 0, UINT8_MAX);
+  else if (strcmp(name, "max-timeout") == 0)
+    profile->limits.max.timeout =
+        (uint8_t)parse_count_or_exit(name, value, 0, UINT8_MAX);
+  else if (strcmp(name, "session-rate") == 0)
+    profile->session_rate = parse_size_or_exit(name, value);
+  else if (strcmp(name, "busy-poll") == 0)
+    profile->busy_poll.spin_us =
+        (uint32_t)parse_count_or_exit(name, value, 0, UINT32_MAX);
+  else if (strcmp(name, "busy-poll-budget") == 0)
+    profile->busy_poll.budget =
+        (uint8_t)parse_count_or_exit(name, value, 0, 100);
+  else if (strcmp(name, "root") == 0) {
+    free(profile->root);
+    profile->root = strdup(value); /* config lines do not outlive parsing */
+  } else
+    return false;
+  return true;
+}
+
+static void add_string(char ***strings, size_t *count, const char *value) {
+  *strings = realloc(*strings, (*count + 1) * sizeof(char *));
+  assert(*strings);
+  (*strings)[*count] = strdup(value);
+  assert((*strings)[*count]);
+  ++*count;
+}
+
+/* parses <name>:<setting>=<value>,... on top of base */
+static void parse_profile_or_exit(const char *value, const profile_t *base,
+                                  profile_t *out) {
+  char *spec = strdup(value);
+  assert(spec);
+
+  char *colon = strchr(spec, ':');
+  if (!colon || colon == spec)
+    goto err;
+  *colon = '\0';
+
+  *out = *base;
+  out->name = spec;
+  out->root = base->root ? strdup(base->root) : NULL;
+
+  char *save = NULL;
+  for (char *setting = strtok_r(colon + 1, ",", &save); setting;
+       setting = strtok_r(NULL, ",", &save)) {
+    char *equals = strchr(setting, '=');
+    if (!equals)
+      goto err;
+    *equals = '\0';
+    if (!profile_set(out, setting, equals + 1))
+      goto err;
+  }
+  return;
+
+err:
+  /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid profile '%s'\n", value);
+  exit(EXIT_FAILURE);
+}
+
+static void check_root_or_exit(const profile_t *profile) {
+  struct stat st = {0};
+  if (profile->root &&
+      (-1 == stat(profile->root, &st) || !S_ISDIR(st.st_mode))) {
+    /*error*/ fprintf(stderr, PROGRAM_NAME ": profile %s: no directory '%s'\n",
+                      profile->name, profile->root);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* parses <path-prefix>=<host>[:<port>], an IPv6 host with a port in
+ * brackets. The port defaults to ours */
+static void parse_relay_or_exit(const char *value, const char *our_port,
+                                relay_route_t *out) {
+  char *spec = strdup(value);
+  assert(spec);
+  char *equals = strchr(spec, '=');
+  if (!equals || equals == spec)
+    goto err;
+  *equals = '\0';
+
+  char *host = equals + 1;
+  const char *port = our_port;
+  char *colon = strrchr(host, ':');
+  if (*host == '[') {
+    char *bracket = strchr(++host, ']');
+    if (!bracket || (bracket[1] && bracket[1] != ':'))
+      goto err;
+    *bracket = '\0';
+    if (bracket[1])
+      port = bracket + 2;
+  } else if (colon && colon == strchr(host, ':')) {
+    *colon = '\0';
+    port = colon + 1;
+  }
+  if (!*host || !*port || strcmp(port, "0") == 0)
+    goto err;
+
+  struct addrinfo hints = {0};
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_family = AF_INET6;
+  hints.ai_flags = AI_V4MAPPED | AI_NUMERICSERV;
+  struct addrinfo *results = NULL;
+  const int ret = resolve(host, port, &hints, &results);
+  if (ret != 0) {
+    /*error*/ fprintf(stderr, PROGRAM_NAME ": relay '%s': %s\n", value,
+                      gai_strerror(ret));
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&out->next_hop, results->ai_addr, sizeof(out->next_hop));
+  freeaddrinfo(results);
+  out->prefix = spec; /* cut at the '=' */
+  return;
+
+err:
+  /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid relay '%s'\n", value);
+  exit(EXIT_FAILURE);
+}
+
+/* resolves --profile and --profile-prefix into a lookup table, profiles
+ * start from the settings given as options */
+static server_config_t *server_config_new(const server_options_t *options) {
+  server_config_t *out = calloc(1, sizeof(server_config_t));
+  if (out) {
+    out->profile_count = options->profile_count + 1;
+    out->profiles = calloc(out->profile_count, sizeof(profile_t));
+    out->profile_prefixes = prefix_table_new();
+  }
+  if (!out || !out->profiles || !out->profile_prefixes) {
+    /*error*/ fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  out->profiles[0] = options->defaults;
+  check_root_or_exit(out->profiles);
+  for (size_t n = 0; n < options->profile_count; ++n) {
+    profile_t *profile = out->profiles + n + 1;
+    parse_profile_or_exit(options->profiles[n], &options->defaults, profile);
+    for (size_t other = 0; other < n + 1; ++other) {
+      if (strcmp(out->profiles[other].name, profile->name) == 0) {
+        /*error*/ fprintf(stderr, PROGRAM_NAME ": duplicate profile '%s'\n",
+                          profile->name);
+        exit(EXIT_FAILURE);
+      }
+    }
+    check_root_or_exit(profile);
+  }
+
+  for (size_t n = 0; n < options->profile_match_count; ++n) {
+    const char *value = options->profile_matches[n];
+    const char *equals = strrchr(value, '=');
+    char text[INET6_ADDRSTRLEN + 8] = {0};
+    prefix_t prefix = {0};
+    if (!equals || (size_t)(equals - value) >= sizeof(text))
+      goto err;
+    memcpy(text, value, equals - value);
+    if (!prefix_parse(text, &prefix))
+      goto err;
+
+    size_t index = 0;
+    while (index < out->profile_count &&
+           strcmp(out->profiles[index].name, equals + 1) != 0)
+      ++index;
+    if (index == out->profile_count)
+      goto err;
+
+    profile_match_t *matches =
+        realloc(out->matches, (out->match_count + 1) * sizeof(*matches));
+    if (!matches ||
+        !prefix_table_insert(out->profile_prefixes, &prefix, (int)index)) {
+      /*error*/ fprintf(stderr, "out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+    out->matches = matches;
+    out->matches[out->match_count++] = (profile_match_t){
+        .prefix = prefix,
+        .profile = (int)index,
+    };
+    continue;
+
+  err:
+    /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid profile-prefix '%s'\n",
+                      value);
+    exit(EXIT_FAILURE);
+  }
+
+  if (options->relay_count) {
+    out->relays = calloc(options->relay_count, sizeof(relay_route_t));
+    if (!out->relays) {
+      /*error*/ fprintf(stderr, "out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  out->relay_count = options->relay_count;
+  out->relay_commit = options->relay_commit;
+  for (size_t n = 0; n < options->relay_count; ++n)
+    parse_relay_or_exit(options->relays[n], options->base.address.port,
+                        out->relays + n);
+
+  if (options->sink_count) {
+    out->sinks = calloc(options->sink_count, sizeof(sink_route_t));
+    if (!out->sinks) {
+      /*error*/ fprintf(stderr, "out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  out->sink_count = options->sink_count;
+  for (size_t n = 0; n < options->sink_count; ++n) {
+    char *pattern = strdup(options->sinks[n]);
+    assert(pattern);
+    char *equals = strchr(pattern, '=');
+    if (!equals || equals == pattern || !equals[1]) {
+      /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid sink '%s'\n",
+                        options->sinks[n]);
+      exit(EXIT_FAILURE);
+    }
+    *equals = '\0';
+    out->sinks[n] = (sink_route_t){
+        .pattern = pattern,
+        .path = equals + 1,
+    };
+  }
+  return out;
+}
+
+static void server_config_free(server_config_t *config) {
+  if (!config)
+    return;
+  for (size_t n = 0; n < config->profile_count; ++n) {
+    if (n > 0) /* the defaults' name is a literal */
+      free((char *)config->profiles[n].name);
+    free(config->profiles[n].root);
+  }
+  free(config->profiles);
+  prefix_table_free(config->profile_prefixes);
+  free(config->matches);
+  for (size_t n = 0; n < config->relay_count; ++n)
+    free(config->relays[n].prefix);
+  free(config->relays);
+  for (size_t n = 0; n < config->sink_count; ++n)
+    free(config->sinks[n].pattern);
+  free(config->sinks);
+  free(config);
+}
+
+/* a reload's configuration as its check built it, read back by the accept
+ * loop. Parent and child are the same binary, so structs go as they are
+ * and strings after them, their pointers are replaced on reading */
+static bool reload_put(FILE *out, const void *data, size_t size) {
+  return fwrite(data, 1, size, out) == size;
+}
+
+static bool reload_put_string(FILE *out, const char *string) {
+  const uint32_t size = string ? (uint32_t)strlen(string) : UINT32_MAX;
+  return reload_put(out, &size, sizeof(size)) &&
+         (!string || reload_put(out, string, size));
+}
+
+static bool reload_write(FILE *out, const server_options_t *options,
+                         const server_config_t *config) {
+  bool ok = reload_put(out, &options->sched, sizeof(options->sched)) &&
+            reload_put(out, options->sched.weights,
+                       options->sched.weight_count * sizeof(sched_weight_t)) &&
+            reload_put(out, &options->admission, sizeof(options->admission)) &&
+            reload_put(out, config, sizeof(*config));
+  for (size_t n = 0; ok && n < config->profile_count; ++n)
+    ok = reload_put(out, config->profiles + n, sizeof(profile_t)) &&
+         reload_put_string(out, config->profiles[n].name) &&
+         reload_put_string(out, config->profiles[n].root);
+  ok = ok && reload_put(out, config->matches,
+                        config->match_count * sizeof(profile_match_t));
+  for (size_t n = 0; ok && n < config->relay_count; ++n)
+    ok = reload_put(out, &config->relays[n].next_hop, sizeof(address_t)) &&
+         reload_put_string(out, config->relays[n].prefix);
+  for (size_t n = 0; ok && n < config->sink_count; ++n)
+    ok = reload_put_string(out, config->sinks[n].pattern) &&
+         reload_put_string(out, config->sinks[n].path);
+  return ok;
+}
+
+static bool reload_get(FILE *in, void *data, size_t size) {
+  return fread(data, 1, size, in) == size;
+}
+
+/* a NULL string reads as NULL, false when out of memory or cut short */
+static bool reload_get_string(FILE *in, char **out) {
+  uint32_t size = 0;
+  *out = NULL;
+  if (!reload_get(in, &size, sizeof(size)))
+    return false;
+  if (size == UINT32_MAX)
+    return true;
+  *out = malloc((size_t)size + 1);
+  if (!*out)
+    return false;
+  (*out)[size] = '\0';
+  return reload_get(in, *out, size);
+}
+
+/* sched->weights and *config are the caller's to free, on failure too */
+static bool reload_read(FILE *in, sched_config_t *sched,
+                        admission_config_t *admission,
+                        server_config_t **config) {
+  if (!reload_get(in, sched, sizeof(*sched)))
+    return false;
+  sched_weight_t *weights = calloc(sched->weight_count + 1, sizeof(*weights));
+  sched->weights = weights;
+  if (!weights ||
+      !reload_get(in, weights, sched->weight_count * sizeof(*weights)) ||
+      !reload_get(in, admission, sizeof(*admission)))
+    return false;
+
+  server_config_t *out = calloc(1, sizeof(server_config_t));
+  *config = out;
+  if (!out)
+    return false;
+  server_config_t counts = {0};
+  if (!reload_get(in, &counts, sizeof(counts)))
+    return false;
+
+  out->profiles = calloc(counts.profile_count, sizeof(profile_t));
+  out->profile_prefixes = prefix_table_new();
+  out->matches = calloc(counts.match_count + 1, sizeof(profile_match_t));
+  out->relays = calloc(counts.relay_count + 1, sizeof(relay_route_t));
+  out->sinks = calloc(counts.sink_count + 1, sizeof(sink_route_t));
+  out->relay_commit = counts.relay_commit;
+  if (!out->profiles || !out->profile_prefixes || !out->matches ||
+      !out->relays || !out->sinks)
+    return false;
+
+  for (; out->profile_count < counts.profile_count; ++out->profile_count) {
+    profile_t *profile = out->profiles + out->profile_count;
+    char *name = NULL;
+    if (!reload_get(in, profile, sizeof(*profile)))
+      return false;
+    profile->root = NULL;
+    profile->name = NULL;
+    const bool got_name = reload_get_string(in, &name);
+    /* the defaults' name is a literal, server_config_free leaves it */
+    profile->name = out->profile_count ? name : "default";
+    if (!out->profile_count)
+      free(name);
+    if (!got_name || !profile->name ||
+        !reload_get_string(in, &profile->root)) {
+      ++out->profile_count; /* what it holds is freed with the others */
+      return false;
+    }
+  }
+
+  if (!reload_get(in, out->matches,
+                  counts.match_count * sizeof(profile_match_t)))
+    return false;
+  for (; out->match_count < counts.match_count; ++out->match_count) {
+    const profile_match_t *match = out->matches + out->match_count;
+    if (match->profile < 0 || (size_t)match->profile >= out->profile_count ||
+        !prefix_table_insert(out->profile_prefixes, &match->prefix,
+                             match->profile))
+      return false;
+  }
+
+  for (; out->relay_count < counts.relay_count; ++out->relay_count) {
+    relay_route_t *route = out->relays + out->relay_count;
+    if (!reload_get(in, &route->next_hop, sizeof(route->next_hop)) ||
+        !reload_get_string(in, &route->prefix) || !route->prefix) {
+      ++out->relay_count;
+      return false;
+    }
+  }
+
+  for (; out->sink_count < counts.sink_count; ++out->sink_count) {
+    sink_route_t *route = out->sinks + out->sink_count;
+    char *path = NULL;
+    if (!reload_get_string(in, &route->pattern) || !route->pattern ||
+        !reload_get_string(in, &path) || !path) {
+      free(path);
+      ++out->sink_count;
+      return false;
+    }
+    /* the path lives in the pattern's allocation, as parsed */
+    const size_t pattern_size = strlen(route->pattern) + 1;
+    char *both = realloc(route->pattern, pattern_size + strlen(path) + 1);
+    if (both) {
+      strcpy(both + pattern_size, path);
+      route->pattern = both;
+      route->path = both + pattern_size;
+    }
+    free(path);
+    if (!both) {
+      ++out->sink_count;
+      return false;
+    }
+  }
+  return true;
+}
+
+static void options_from_argv(int argc, char *const *argv, options_t *out) {
+  server_options_t *options = (server_options_t *)out;
+
+  struct option const long_options[] = {
+      {
+          .name = "port",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'p',
+      },
+      {
+          .name = "verbose",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'v',
+      },
+      {
+          .name = "help",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'h',
+      },
+      {
+          .name = "rate-limit",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_RATE_LIMIT,
+      },
+      {
+          .name = "client-rate",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_CLIENT_RATE,
+      },
+      {
+          .name = "weight",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_WEIGHT,
+      },
+      {
+          .name = "client-subnet-v4",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_CLIENT_SUBNET_V4,
+      },
+      {
+          .name = "client-subnet-v6",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_CLIENT_SUBNET_V6,
+      },
+      {
+          .name = "max-sessions",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_MAX_SESSIONS,
+      },
+      {
+          .name = "memory-budget",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_MEMORY_BUDGET,
+      },
+      {
+          .name = "accept-queue",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_ACCEPT_QUEUE,
+      },
+      {
+          .name = "accept-timeout",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_ACCEPT_TIMEOUT,
+      },
+      {
+          .name = "max-blksize",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_MAX_BLKSIZE,
+      },
+      {
+          .name = "max-window",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_MAX_WINDOW,
+      },
+      {
+          .name = "max-ack-delay",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_MAX_ACK_DELAY,
+      },
+      {
+          .name = "min-timeout",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_MIN_TIMEOUT,
+      },
+      {
+          .name = "max-timeout",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_MAX_TIMEOUT,
+      },
+      {
+          .name = "session-rate",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_SESSION_RATE,
+      },
+      {
+          .name = "root",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_ROOT,
+      },
+      {
+          .name = "profile",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_PROFILE,
+      },
+      {
+          .name = "profile-prefix",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_PROFILE_PREFIX,
+      },
+      {
+          .name = "control",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_CONTROL,
+      },
+      {
+          .name = "takeover",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_TAKEOVER,
+      },
+      {
+          .name = "cpus",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_CPUS,
+      },
+      {
+          .name = "busy-poll",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_BUSY_POLL,
+      },
+      {
+          .name = "busy-poll-budget",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_BUSY_POLL_BUDGET,
+      },
+      {
+          .name = "multicast",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_MULTICAST,
+      },
+      {
+          .name = "relay",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_RELAY,
+      },
+      {
+          .name = "relay-commit",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_RELAY_COMMIT,
+      },
+      {
+          .name = "sink",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_SINK,
+      },
+      {
+          .name = "downloads",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = OPTION_DOWNLOADS,
+      },
+      {
+          .name = "download-cache",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_DOWNLOAD_CACHE,
+      },
+      {
+          .name = "log-level",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_LOG_LEVEL,
+      },
+      {
+          .name = "log-format",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_LOG_FORMAT,
+      },
+      {
+          .name = "capture",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_CAPTURE,
+      },
+      {.name = 0, .has_arg = 0, .flag = 0, .val = 0},
+  };
+
+  optind = 1;
+
+  for (;;) {
+    switch (getopt_long(argc, argv, "p:vh", long_options, NULL)) {
     case -1:
       return;
+    case 'p':
+      if (strlen(optarg) >= sizeof(out->address.port)) {
+        /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid port '%s'\n",
+                          optarg);
+        exit(EXIT_FAILURE);
+      }
+      memcpy(out->address.port, optarg, strlen(optarg) + 1);
+      break;
     case 'v':
       out->verbose = true;
       break;
     case 'h':
       puts(usage);
       exit(EXIT_SUCCESS);
+    case OPTION_RATE_LIMIT:
+      options->sched.rate = parse_size_or_exit("rate-limit", optarg);
+      break;
+    case OPTION_CLIENT_RATE:
+      options->sched.client_rate = parse_size_or_exit("client-rate", optarg);
+      break;
+    case OPTION_WEIGHT:
+      add_weight(options, optarg);
+      break;
+    case OPTION_CLIENT_SUBNET_V4:
+      options->sched.subnet_v4 =
+          parse_prefix_length_or_exit("client-subnet-v4", optarg, 32);
+      break;
+    case OPTION_CLIENT_SUBNET_V6:
+      options->sched.subnet_v6 =
+          parse_prefix_length_or_exit("client-subnet-v6", optarg, 128);
+      break;
+    case OPTION_MAX_SESSIONS:
+      options->admission.max_sessions =
+          parse_count_or_exit("max-sessions", optarg, 1, SIZE_MAX);
+      break;
+    case OPTION_MEMORY_BUDGET:
+      options->admission.memory_budget =
+          parse_size_or_exit("memory-budget", optarg);
+      /* one that no session fits would shed every request */
+      if (options->admission.memory_budget &&
+          options->admission.memory_budget < SESSION_MEMORY) {
+        /*error*/ fprintf(stderr,
+                          PROGRAM_NAME ": memory-budget '%s' is below the "
+                          "%zu bytes of a session\n",
+                          optarg, (size_t)SESSION_MEMORY);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPTION_ACCEPT_QUEUE:
+      options->admission.queue_length =
+          parse_count_or_exit("accept-queue", optarg, 0, SIZE_MAX);
+      break;
+    case OPTION_ACCEPT_TIMEOUT:
+      options->admission.queue_timeout_ms =
+          parse_count_or_exit("accept-timeout", optarg, 0, UINT32_MAX);
+      break;
+    case OPTION_MAX_BLKSIZE:
+      profile_set(&options->defaults, "max-blksize", optarg);
+      break;
+    case OPTION_MAX_WINDOW:
+      profile_set(&options->defaults, "max-window", optarg);
+      break;
+    case OPTION_MAX_ACK_DELAY:
+      profile_set(&options->defaults, "max-ack-delay", optarg);
+      break;
+    case OPTION_MIN_TIMEOUT:
+      profile_set(&options->defaults, "min-timeout", optarg);
+      break;
+    case OPTION_MAX_TIMEOUT:
+      profile_set(&options->defaults, "max-timeout", optarg);
+      break;
+    case OPTION_SESSION_RATE:
+      profile_set(&options->defaults, "session-rate", optarg);
+      break;
+    case OPTION_ROOT:
+      profile_set(&options->defaults, "root", optarg);
+      break;
+    case OPTION_PROFILE:
+      add_string(&options->profiles, &options->profile_count, optarg);
+      break;
+    case OPTION_PROFILE_PREFIX:
+      add_string(&options->profile_matches, &options->profile_match_count,
+                 optarg);
+      break;
+    case OPTION_CONTROL:
+      free(options->control);
+      options->control = strdup(optarg);
+      break;
+    case OPTION_TAKEOVER:
+      free(options->takeover);
+      options->takeover = strdup(optarg);
+      break;
+    case OPTION_BUSY_POLL:
+      profile_set(&options->defaults, "busy-poll", optarg);
+      break;
+    case OPTION_BUSY_POLL_BUDGET:
+      profile_set(&options->defaults, "busy-poll-budget", optarg);
+      break;
+    case OPTION_CPUS:
+      free(options->cpus);
+      options->cpus = strdup(optarg);
+      break;
+    case OPTION_CAPTURE:
+      free(options->capture);
+      options->capture = strdup(optarg);
+      break;
+    case OPTION_MULTICAST:
+      free(options->multicast);
+      options->multicast = strdup(optarg);
+      break;
+    case OPTION_RELAY:
+      add_string(&options->relays, &options->relay_count, optarg);
+      break;
+    case OPTION_SINK:
+      add_string(&options->sinks, &options->sink_count, optarg);
+      break;
+    case OPTION_DOWNLOADS:
+      options->downloads = true;
+      break;
+    case OPTION_DOWNLOAD_CACHE:
+      options->download_cache = parse_size_or_exit("download-cache", optarg);
+      break;
+    case OPTION_LOG_LEVEL:
+      if (strcmp(optarg, "error") == 0)
+        options->log_level = LOG_LEVEL_ERROR;
+      else if (strcmp(optarg, "info") == 0)
+        options->log_level = LOG_LEVEL_INFO;
+      else if (strcmp(optarg, "debug") == 0)
+        options->log_level = LOG_LEVEL_DEBUG;
+      else {
+        /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid log-level '%s'\n",
+                          optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPTION_LOG_FORMAT:
+      if (strcmp(optarg, "text") == 0)
+        options->log_format = LOG_FORMAT_TEXT;
+      else if (strcmp(optarg, "json") == 0)
+        options->log_format = LOG_FORMAT_JSON;
+      else {
+        /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid log-format '%s'\n",
+                          optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPTION_RELAY_COMMIT:
+      if (strcmp(optarg, "local") == 0)
+        options->relay_commit = RELAY_COMMIT_LOCAL;
+      else if (strcmp(optarg, "downstream") == 0)
+        options->relay_commit = RELAY_COMMIT_DOWNSTREAM;
+      else {
+        /*error*/ fprintf(stderr, PROGRAM_NAME ": invalid relay-commit '%s'\n",
+                          optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
     default:
       exit(EXIT_FAILURE);
     }
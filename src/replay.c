@@ -0,0 +1,633 @@
+#include <drop/capture.h>
+#include <drop/pacer.h>
+#include <drop/tftp.h>
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Sends the datagrams a capture of dropd's recorded to a daemon again and
+ * reports how it answered.
+ *
+ * Every client address in the capture becomes a socket of its own, its
+ * requests go to the daemon's address and what followed them to wherever
+ * the daemon answered from, as a client's would. An error in answer to a
+ * request refuses it, anything else accepts it. The replay is open loop: the
+ * datagrams go out as recorded, retransmissions included, not in answer to
+ * the daemon. A session's datagrams after its request wait for the
+ * daemon's first answer though, they need its address, and keep their
+ * spacing from when it came.
+ *
+ * By default the whole capture keeps its timing, --speed scales it and
+ * --fast starts every session right away, keeping only the timing within
+ * sessions, to see how fast the daemon takes sessions on.
+ */
+
+typedef struct sockaddr_in6 address_t;
+
+#define PROGRAM_NAME "drop-replay"
+#define DEFAULT_PORT "69"
+/* a session whose request goes unanswered this long is given up */
+#define REPLAY_TIMEOUT_NS (5 * NS_PER_SEC)
+/* a session's socket stays open this long after its last datagram for the
+ * answers to it */
+#define REPLAY_LINGER_NS (1 * NS_PER_SEC)
+/* longest wait in one go, for the timeouts */
+#define REPLAY_TICK_MS 100
+#define REPLAY_EVENTS 64
+#define TFTP_OPCODE_ERROR 5
+#define NS_PER_SEC 1000000000ull
+
+// clang-format off
+static const char *usage =
+  "Usage: " PROGRAM_NAME " [options] <capture> [host]\n"
+  "\n"
+  "Sends what dropd --capture recorded to the daemon on host, by default\n"
+  "::1, again and reports how fast it took the sessions on.\n"
+  "\n"
+  "Options:\n"
+  "  --port,    -p <port> the port the daemon listens on, default 69\n"
+  "  --verbose, -v        a line per session\n"
+  "  --help,    -h        print this message\n"
+  "  --speed <factor>     replay factor times as fast as recorded\n"
+  "  --fast               start every session right away, keeping the\n"
+  "                       timing within sessions\n";
+// clang-format on
+
+typedef struct {
+  const char *capture;
+  char host[NI_MAXHOST];
+  char port[NI_MAXSERV];
+  double speed;
+  bool fast;
+  bool verbose;
+} replay_options_t;
+
+typedef enum {
+  FLOW_RUNNING, /* in the schedule */
+  FLOW_WAITING, /* for the answer that tells where the session is */
+  FLOW_LINGERING,
+  FLOW_DONE,
+} flow_state_t;
+
+/* the datagrams of one client address */
+typedef struct {
+  const capture_record_t **records;
+  size_t count;
+  size_t next;
+  flow_state_t state;
+  int socket;
+  address_t session; /* where the daemon answered from */
+  bool has_session;
+  bool refused;  /* an error answered a request */
+  bool answered; /* by a session */
+  uint64_t base_ns; /* the schedule's start, with --fast the flow's */
+  uint64_t reference_ns; /* the capture's time at base_ns */
+  uint64_t due_ns;
+  uint64_t requested_ns; /* first request sent */
+  uint64_t accepted_ns;  /* first answer of a session */
+  uint64_t last_ns;      /* last datagram sent or answer received */
+  uint64_t sent_ns;      /* last datagram sent */
+  uint64_t waiting_ns;   /* since when it waits for an answer */
+} flow_t;
+
+/* flows by due time, a binary heap */
+typedef struct {
+  flow_t **flows;
+  size_t count;
+} schedule_t;
+
+typedef struct {
+  uint64_t *values;
+  size_t count;
+} samples_t;
+
+static void schedule_push(schedule_t *schedule, flow_t *flow) {
+  size_t at = schedule->count++;
+  while (at) {
+    const size_t parent = (at - 1) / 2;
+    if (schedule->flows[parent]->due_ns <= flow->due_ns)
+      break;
+    schedule->flows[at] = schedule->flows[parent];
+    at = parent;
+  }
+  schedule->flows[at] = flow;
+}
+
+static flow_t *schedule_pop(schedule_t *schedule) {
+  flow_t *top = schedule->flows[0];
+  flow_t *last = schedule->flows[--schedule->count];
+  size_t at = 0;
+  for (;;) {
+    size_t child = 2 * at + 1;
+    if (child >= schedule->count)
+      break;
+    if (child + 1 < schedule->count &&
+        schedule->flows[child + 1]->due_ns < schedule->flows[child]->due_ns)
+      ++child;
+    if (last->due_ns <= schedule->flows[child]->due_ns)
+      break;
+    schedule->flows[at] = schedule->flows[child];
+    at = child;
+  }
+  if (schedule->count)
+    schedule->flows[at] = last;
+  return top;
+}
+
+static bool same_peer(const address_t *a, const address_t *b) {
+  return a->sin6_port == b->sin6_port &&
+         memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+}
+
+/* by peer, then as captured */
+static int compare_by_peer(const void *a, const void *b) {
+  const capture_record_t *left = *(const capture_record_t *const *)a;
+  const capture_record_t *right = *(const capture_record_t *const *)b;
+  const int address = memcmp(&left->peer.sin6_addr, &right->peer.sin6_addr,
+                              sizeof(left->peer.sin6_addr));
+  if (address)
+    return address;
+  if (left->peer.sin6_port != right->peer.sin6_port)
+    return left->peer.sin6_port < right->peer.sin6_port ? -1 : 1;
+  return left < right ? -1 : left > right;
+}
+
+/* a flow per client address, its datagrams from its first request on.
+ * The flows point into order, which is freed with them */
+static flow_t *flows_new(const capture_trace_t *trace,
+                         const capture_record_t ***order_out, size_t *count,
+                         size_t *skipped) {
+  const capture_record_t **order =
+      calloc(trace->count ? trace->count : 1, sizeof(*order));
+  flow_t *flows = calloc(trace->count ? trace->count : 1, sizeof(flow_t));
+  assert(order && flows);
+  for (size_t n = 0; n < trace->count; ++n)
+    order[n] = trace->records + n;
+  /* the records are in time order, which breaks the ties */
+  qsort(order, trace->count, sizeof(*order), &compare_by_peer);
+
+  *count = 0;
+  *skipped = 0;
+  for (size_t n = 0; n < trace->count;) {
+    size_t end = n + 1;
+    while (end < trace->count &&
+           same_peer(&order[n]->peer, &order[end]->peer))
+      ++end;
+    /* a session the capture started in the middle of has no request */
+    size_t first = n;
+    while (first < end && order[first]->kind != CAPTURE_REQUEST)
+      ++first;
+    *skipped += first - n;
+    if (first < end)
+      flows[(*count)++] = (flow_t){
+          .records = order + first,
+          .count = end - first,
+          .socket = -1,
+      };
+    n = end;
+  }
+  *order_out = order;
+  return flows;
+}
+
+static uint64_t flow_due(const flow_t *flow, const replay_options_t *options) {
+  const uint64_t offset =
+      flow->records[flow->next]->time_ns - flow->reference_ns;
+  return flow->base_ns + (uint64_t)((double)offset / options->speed);
+}
+
+static void samples_add(samples_t *samples, uint64_t value) {
+  samples->values[samples->count++] = value;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  const uint64_t left = *(const uint64_t *)a;
+  const uint64_t right = *(const uint64_t *)b;
+  return left < right ? -1 : left > right;
+}
+
+static void format_ns(char *out, size_t size, uint64_t ns) {
+  if (ns < 1000000)
+    snprintf(out, size, "%.0f us", (double)ns / 1e3);
+  else if (ns < NS_PER_SEC)
+    snprintf(out, size, "%.1f ms", (double)ns / 1e6);
+  else
+    snprintf(out, size, "%.2f s", (double)ns / 1e9);
+}
+
+/* p50, p99 and the largest, nothing without samples */
+static void samples_print(const char *name, samples_t *samples) {
+  if (!samples->count)
+    return;
+  qsort(samples->values, samples->count, sizeof(uint64_t), &compare_u64);
+  char p50[32];
+  char p99[32];
+  char max[32];
+  format_ns(p50, sizeof(p50), samples->values[samples->count / 2]);
+  format_ns(p99, sizeof(p99),
+            samples->values[(samples->count - 1) * 99 / 100]);
+  format_ns(max, sizeof(max), samples->values[samples->count - 1]);
+  printf("%s: p50 %s, p99 %s, max %s\n", name, p50, p99, max);
+}
+
+static address_t resolve(const replay_options_t *options) {
+  const struct addrinfo hints = {
+      .ai_family = AF_INET6,
+      .ai_socktype = SOCK_DGRAM,
+      .ai_flags = AI_NUMERICSERV | AI_V4MAPPED | AI_ADDRCONFIG,
+  };
+  struct addrinfo *results = NULL;
+  const int error =
+      getaddrinfo(options->host, options->port, &hints, &results);
+  if (error) {
+    fprintf(stderr, PROGRAM_NAME ": %s: %s\n", options->host,
+            error == EAI_SYSTEM ? strerror(errno) : gai_strerror(error));
+    exit(EXIT_FAILURE);
+  }
+  address_t address = {0};
+  memcpy(&address, results->ai_addr, sizeof(address));
+  freeaddrinfo(results);
+  return address;
+}
+
+/* every session a socket, more than the default limit for a burst */
+static void raise_file_limit(void) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+static void flow_close(int epoll, flow_t *flow) {
+  if (flow->socket != -1) {
+    epoll_ctl(epoll, EPOLL_CTL_DEL, flow->socket, NULL);
+    close(flow->socket);
+    flow->socket = -1;
+  }
+  flow->state = FLOW_DONE;
+}
+
+/* sends the flow's next datagram, false when it could not be */
+static bool flow_send(int epoll, flow_t *flow, const address_t *daemon,
+                      uint64_t now) {
+  if (flow->socket == -1) {
+    flow->socket = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (flow->socket == -1) {
+      fprintf(stderr, "socket: %s\n", strerror(errno));
+      return false;
+    }
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = flow,
+    };
+    if (-1 == epoll_ctl(epoll, EPOLL_CTL_ADD, flow->socket, &event)) {
+      fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+      return false;
+    }
+  }
+
+  const capture_record_t *record = flow->records[flow->next++];
+  const bool request = record->kind == CAPTURE_REQUEST;
+  /* a request opens a new session */
+  if (request) {
+    flow->has_session = false;
+    if (!flow->requested_ns)
+      flow->requested_ns = now;
+  }
+  /* blocks while the socket buffer is full rather than dropping what the
+   * capture has, receiving does not */
+  const address_t *to = request ? daemon : &flow->session;
+  if (-1 == sendto(flow->socket, record->data, record->size, 0,
+                   (const struct sockaddr *)to, sizeof(*to)))
+    fprintf(stderr, "sendto: %s\n", strerror(errno));
+  flow->sent_ns = now;
+  flow->last_ns = now;
+  return true;
+}
+
+/* schedules what the flow sends next, or lets it linger */
+static void flow_advance(schedule_t *schedule, flow_t *flow,
+                         const replay_options_t *options, uint64_t now) {
+  if (flow->next == flow->count) {
+    flow->state = FLOW_LINGERING;
+    return;
+  }
+  if (flow->records[flow->next]->kind == CAPTURE_SESSION &&
+      !flow->has_session) {
+    flow->state = FLOW_WAITING;
+    flow->waiting_ns = now;
+    return;
+  }
+  flow->state = FLOW_RUNNING;
+  flow->due_ns = flow_due(flow, options);
+  schedule_push(schedule, flow);
+}
+
+static void flow_receive(schedule_t *schedule, flow_t *flow,
+                         const replay_options_t *options, uint64_t now) {
+  for (;;) {
+    tftp_buffer_t buffer;
+    const uint8_t *packet = buffer.buffer;
+    address_t from = {0};
+    socklen_t length = sizeof(from);
+    const ssize_t size =
+        recvfrom(flow->socket, &buffer.buffer, sizeof(buffer.buffer),
+                 MSG_DONTWAIT, (struct sockaddr *)&from, &length);
+    if (size == -1)
+      return;
+    flow->last_ns = now;
+
+    if (!flow->answered && size >= 2 && packet[0] == 0 &&
+        packet[1] == TFTP_OPCODE_ERROR) {
+      flow->refused = true;
+      continue;
+    }
+    if (!flow->answered) {
+      flow->answered = true;
+      flow->accepted_ns = now;
+    }
+    if (!flow->has_session) {
+      flow->session = from;
+      flow->has_session = true;
+      if (flow->state == FLOW_WAITING) {
+        /* what follows keeps its spacing from now on, a daemon slower to
+         * answer than the recorded one would get it in a burst and drop
+         * what its window has no room for */
+        flow->base_ns = now;
+        flow->reference_ns = flow->records[flow->next]->time_ns;
+        flow_advance(schedule, flow, options, now);
+      }
+    }
+  }
+}
+
+static void options_load(int argc, char **argv, replay_options_t *options) {
+  enum {
+    OPTION_SPEED = 256,
+    OPTION_FAST,
+  };
+  static const struct option long_options[] = {
+      {
+          .name = "port",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = 'p',
+      },
+      {
+          .name = "verbose",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'v',
+      },
+      {
+          .name = "help",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = 'h',
+      },
+      {
+          .name = "speed",
+          .has_arg = required_argument,
+          .flag = NULL,
+          .val = OPTION_SPEED,
+      },
+      {
+          .name = "fast",
+          .has_arg = no_argument,
+          .flag = NULL,
+          .val = OPTION_FAST,
+      },
+      {.name = 0, .has_arg = 0, .flag = 0, .val = 0},
+  };
+
+  *options = (replay_options_t){
+      .host = "::1",
+      .port = DEFAULT_PORT,
+      .speed = 1,
+  };
+  for (;;) {
+    char *end = NULL;
+    switch (getopt_long(argc, argv, "p:vh", long_options, NULL)) {
+    case -1:
+      if (optind == argc || argc - optind > 2) {
+        fprintf(stderr, "%s", usage);
+        exit(EXIT_FAILURE);
+      }
+      options->capture = argv[optind];
+      if (argc - optind == 2)
+        snprintf(options->host, sizeof(options->host), "%s",
+                 argv[optind + 1]);
+      return;
+    case 'p':
+      snprintf(options->port, sizeof(options->port), "%s", optarg);
+      break;
+    case 'v':
+      options->verbose = true;
+      break;
+    case 'h':
+      printf("%s", usage);
+      exit(EXIT_SUCCESS);
+    case OPTION_SPEED:
+      options->speed = strtod(optarg, &end);
+      if (*end || !(options->speed > 0)) {
+        fprintf(stderr, PROGRAM_NAME ": invalid speed '%s'\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case OPTION_FAST:
+      options->fast = true;
+      break;
+    default:
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  replay_options_t options;
+  options_load(argc, argv, &options);
+
+  capture_trace_t trace;
+  if (!capture_read(options.capture, &trace)) {
+    fprintf(stderr, PROGRAM_NAME ": %s: %s\n", options.capture,
+            errno == EINVAL ? "not a capture" : strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  const capture_record_t **order = NULL;
+  size_t flow_count = 0;
+  size_t skipped = 0;
+  flow_t *flows = flows_new(&trace, &order, &flow_count, &skipped);
+  const address_t daemon = resolve(&options);
+  raise_file_limit();
+
+  const int epoll = epoll_create1(EPOLL_CLOEXEC);
+  assert(epoll != -1);
+  schedule_t schedule = {
+      .flows = calloc(flow_count ? flow_count : 1, sizeof(flow_t *)),
+  };
+  samples_t lag = {
+      .values = calloc(trace.count ? trace.count : 1, sizeof(uint64_t)),
+  };
+  assert(schedule.flows && lag.values);
+
+  /* the first request goes out now, the rest relative to it */
+  const uint64_t start_ns = pacer_now_ns();
+  const uint64_t first_ns = trace.count ? trace.records[0].time_ns : 0;
+  for (size_t n = 0; n < flow_count; ++n) {
+    flow_t *flow = flows + n;
+    flow->base_ns = start_ns;
+    flow->reference_ns =
+        options.fast ? flow->records[0]->time_ns : first_ns;
+    flow->state = FLOW_RUNNING;
+    flow->due_ns = flow_due(flow, &options);
+    schedule_push(&schedule, flow);
+  }
+
+  size_t done = 0;
+  uint64_t checked_ns = start_ns;
+  while (done < flow_count) {
+    uint64_t now = pacer_now_ns();
+    while (schedule.count && schedule.flows[0]->due_ns <= now) {
+      flow_t *flow = schedule_pop(&schedule);
+      samples_add(&lag, now - flow->due_ns);
+      if (!flow_send(epoll, flow, &daemon, now)) {
+        flow_close(epoll, flow);
+        ++done;
+        continue;
+      }
+      /* with --fast a session's timing starts with its request */
+      if (options.fast && flow->next == 1)
+        flow->base_ns = now;
+      flow_advance(&schedule, flow, &options, now);
+    }
+
+    /* spins for what is due within the millisecond epoll waits in */
+    int timeout_ms = REPLAY_TICK_MS;
+    if (schedule.count) {
+      const uint64_t wait_ns =
+          schedule.flows[0]->due_ns > now ? schedule.flows[0]->due_ns - now
+                                          : 0;
+      if (wait_ns / 1000000 < REPLAY_TICK_MS)
+        timeout_ms = (int)(wait_ns / 1000000);
+    }
+
+    struct epoll_event events[REPLAY_EVENTS];
+    const int ready = epoll_wait(epoll, events, REPLAY_EVENTS, timeout_ms);
+    if (ready == -1 && errno != EINTR) {
+      fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    now = pacer_now_ns();
+    for (int n = 0; n < ready; ++n)
+      flow_receive(&schedule, events[n].data.ptr, &options, now);
+
+    if (now - checked_ns < (uint64_t)REPLAY_TICK_MS * 1000000)
+      continue;
+    checked_ns = now;
+    for (size_t n = 0; n < flow_count; ++n) {
+      flow_t *flow = flows + n;
+      if ((flow->state == FLOW_WAITING &&
+           now - flow->waiting_ns >= REPLAY_TIMEOUT_NS) ||
+          (flow->state == FLOW_LINGERING &&
+           now - flow->last_ns >= REPLAY_LINGER_NS)) {
+        flow_close(epoll, flow);
+        ++done;
+      }
+    }
+  }
+  const uint64_t end_ns = pacer_now_ns();
+
+  /* the replay ends with the last linger, the capture with its last
+   * datagram */
+  uint64_t last_sent_ns = start_ns;
+  size_t accepted = 0;
+  size_t refused = 0;
+  samples_t latency = {.values = calloc(flow_count + 1, sizeof(uint64_t))};
+  samples_t replayed = {.values = calloc(flow_count + 1, sizeof(uint64_t))};
+  samples_t recorded = {.values = calloc(flow_count + 1, sizeof(uint64_t))};
+  assert(latency.values && replayed.values && recorded.values);
+  for (size_t n = 0; n < flow_count; ++n) {
+    const flow_t *flow = flows + n;
+    const uint64_t recorded_ns = flow->records[flow->count - 1]->time_ns -
+                                 flow->records[0]->time_ns;
+    if (flow->sent_ns > last_sent_ns)
+      last_sent_ns = flow->sent_ns;
+    if (flow->answered) {
+      ++accepted;
+      samples_add(&latency, flow->accepted_ns - flow->requested_ns);
+      samples_add(&replayed, flow->sent_ns - flow->requested_ns);
+      samples_add(&recorded, recorded_ns);
+    } else if (flow->refused) {
+      ++refused;
+    }
+
+    if (options.verbose) {
+      char peer[INET6_ADDRSTRLEN] = "";
+      inet_ntop(AF_INET6, &flow->records[0]->peer.sin6_addr, peer,
+                sizeof(peer));
+      char took[32];
+      char was[32];
+      format_ns(took, sizeof(took), flow->sent_ns - flow->requested_ns);
+      format_ns(was, sizeof(was), recorded_ns);
+      printf("[%s]:%u: %zu of %zu datagrams, %s", peer,
+             ntohs(flow->records[0]->peer.sin6_port), flow->next,
+             flow->count,
+             flow->answered  ? "accepted"
+             : flow->refused ? "refused"
+                             : "unanswered");
+      if (flow->answered) {
+        char latency_text[32];
+        format_ns(latency_text, sizeof(latency_text),
+                  flow->accepted_ns - flow->requested_ns);
+        printf(" in %s", latency_text);
+      }
+      printf(", %s (recorded %s)\n", took, was);
+    }
+  }
+
+  const double span_s =
+      trace.count ? (double)(trace.records[trace.count - 1].time_ns -
+                             first_ns) / 1e9
+                  : 0;
+  const double replay_s = (double)(last_sent_ns - start_ns) / 1e9;
+  printf("%zu sessions, %zu datagrams recorded over %.3f s, %zu without "
+         "their request skipped\n",
+         flow_count, trace.count - skipped, span_s, skipped);
+  printf("replayed over %.3f s (%.3f s with the last answers): %zu "
+         "accepted, %zu refused, %zu unanswered, %.1f accepted/s\n",
+         replay_s, (double)(end_ns - start_ns) / 1e9, accepted, refused,
+         flow_count - accepted - refused,
+         replay_s > 0 ? (double)accepted / replay_s : 0);
+  samples_print("accept latency", &latency);
+  samples_print("session, replayed", &replayed);
+  samples_print("session, recorded", &recorded);
+  samples_print("behind schedule", &lag);
+
+  free(latency.values);
+  free(replayed.values);
+  free(recorded.values);
+  free(lag.values);
+  free(schedule.flows);
+  close(epoll);
+  free(flows);
+  free(order);
+  capture_trace_free(&trace);
+  return EXIT_SUCCESS;
+}